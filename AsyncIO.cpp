@@ -0,0 +1,512 @@
+/******************************************************************************
+
+	File: AsyncIO.cpp
+
+	Description:
+
+	Implementation of the Interpreter class' asynchronous I/O primitives.
+
+	Rather than dedicating a thread to each outstanding blocking operation (as
+	an overlapped external call does), the image can submit reads, writes,
+	accepts and connects on file and socket handles associated with a single
+	I/O completion port. A small number of threads (registry value
+	AsyncIO\Threads, default 1) wait on the port, and when an operation
+	completes they record the result and signal the Semaphore that was
+	supplied with the request through the asynchronous signal queue. The image
+	then collects the result with primitiveAsyncIoRequest.
+
+	Buffers may be byte objects, which the request keeps alive, or external
+	memory (an ExternalAddress). The bodies of byte objects do not move in
+	Dolphin's object memory, but they must not be resized while an operation
+	on them is outstanding. Byte object buffers that are still to be demand
+	loaded are loaded before the operation is started (see LazyLoad.cpp).
+
+	Each request is identified to the image by a SmallInteger handle that
+	encodes its index and generation, so that a stale handle is not mistaken
+	for a reused request. Requests are freed only once their results have been
+	collected, so an OVERLAPPED is never freed while the system may write to
+	it. Lock ordering is the async protect lock, then the I/O lock.
+
+******************************************************************************/
+#include "Ist.h"
+
+#include <winsock2.h>
+#include <mswsock.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#pragma code_seg(PRIM_SEG)
+
+#include <vector>
+#include "ObjMem.h"
+#include "Interprt.h"
+#include "InterprtPrim.inl"
+#include "RegKey.h"
+
+// Smalltalk classes
+#include "STBehavior.h"
+#include "STExternal.h"
+#include "STProcess.h"
+
+enum AsyncIoOperation { AsyncIoAssociate, AsyncIoRead, AsyncIoWrite, AsyncIoAccept, AsyncIoConnect };
+
+// Handles encode the index of the request and its generation
+enum { AsyncIoIndexBits = 20, AsyncIoIndexMask = (1 << AsyncIoIndexBits) - 1, AsyncIoGenerationMask = 0x1FF };
+
+// Completion key posted to stop the completion port threads
+static const ULONG_PTR AsyncIoShutdownKey = 1;
+
+// Space AcceptEx requires for each of the local and remote addresses
+static const DWORD AcceptAddressLength = sizeof(SOCKADDR_STORAGE) + 16;
+
+struct AsyncIoRequest
+{
+	OVERLAPPED		m_overlapped;
+	SemaphoreOTE*	m_oteSemaphore;		// NULL if the request is free
+	OTE*			m_oteBuffer;		// Byte object buffer, or NULL if external memory
+	HANDLE			m_hFile;
+	DWORD			m_dwBytes;
+	DWORD			m_dwError;
+	bool			m_bCompleted;
+	unsigned		m_generation;
+};
+
+static std::vector<AsyncIoRequest*> s_requests;
+static std::vector<unsigned> s_freeRequests;
+
+static CRITICAL_SECTION s_csAsyncIo;
+static HANDLE s_hCompletionPort;
+static std::vector<HANDLE> s_completionThreads;
+static LPFN_ACCEPTEX s_pfnAcceptEx;
+static LPFN_CONNECTEX s_pfnConnectEx;
+
+///////////////////////////////////////////////////////////////////////////////
+// Completion port threads
+
+static DWORD WINAPI AsyncIoThreadProc(LPVOID)
+{
+	for (;;)
+	{
+		DWORD dwBytes = 0;
+		ULONG_PTR key = 0;
+		LPOVERLAPPED pOverlapped = NULL;
+		BOOL bSucceeded = ::GetQueuedCompletionStatus(s_hCompletionPort, &dwBytes, &key, &pOverlapped, INFINITE);
+		DWORD dwError = bSucceeded ? 0 : ::GetLastError();
+		if (pOverlapped == NULL)
+		{
+			if (key == AsyncIoShutdownKey || dwError == ERROR_ABANDONED_WAIT_0 || dwError == ERROR_INVALID_HANDLE)
+				break;
+			continue;
+		}
+
+		AsyncIoRequest* pRequest = CONTAINING_RECORD(pOverlapped, AsyncIoRequest, m_overlapped);
+
+		// The async protect lock must be held to access the Semaphore, since a compaction could be in progress
+		Interpreter::GrabAsyncProtect();
+		::EnterCriticalSection(&s_csAsyncIo);
+		pRequest->m_dwBytes = dwBytes;
+		pRequest->m_dwError = dwError;
+		pRequest->m_bCompleted = true;
+		Interpreter::asynchronousSignalNoProtect(pRequest->m_oteSemaphore);
+		::LeaveCriticalSection(&s_csAsyncIo);
+		Interpreter::RelinquishAsyncProtect();
+
+		// In case the idle process has put the VM to sleep
+		Interpreter::SetWakeupEvent();
+	}
+	return 0;
+}
+
+// Create the completion port, and the threads to service it, on first use
+static bool StartAsyncIo()
+{
+	if (s_hCompletionPort != NULL)
+		return true;
+
+	DWORD dwThreads = 1;
+	CRegKey rkAsyncIo;
+	if (OpenDolphinKey(rkAsyncIo, "AsyncIO", KEY_READ) == ERROR_SUCCESS)
+		rkAsyncIo.QueryDWORDValue("Threads", dwThreads);
+	if (dwThreads == 0)
+		dwThreads = 1;
+
+	s_hCompletionPort = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, dwThreads);
+	if (s_hCompletionPort == NULL)
+		return false;
+
+	for (DWORD i=0;i<dwThreads;i++)
+	{
+		DWORD dwThreadId;
+		HANDLE hThread = ::CreateThread(NULL, 0, AsyncIoThreadProc, NULL, 0, &dwThreadId);
+		if (hThread != NULL)
+			s_completionThreads.push_back(hThread);
+	}
+
+	if (s_completionThreads.empty())
+	{
+		::CloseHandle(s_hCompletionPort);
+		s_hCompletionPort = NULL;
+		return false;
+	}
+	return true;
+}
+
+// Look up a Winsock extension function through the socket on which it is to be used
+static void* WinsockExtension(SOCKET s, GUID guid)
+{
+	void* pfn = NULL;
+	DWORD dwBytes;
+	if (::WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid), &pfn, sizeof(pfn), &dwBytes, NULL, NULL) != 0)
+		return NULL;
+	return pfn;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Request management, which must be performed inside the I/O lock
+
+// Answer the index of a free request, or -1 if the table is full
+static int AllocateRequest()
+{
+	if (s_freeRequests.empty())
+	{
+		if (s_requests.size() > AsyncIoIndexMask)
+			return -1;
+		AsyncIoRequest* pRequest = new AsyncIoRequest;
+		pRequest->m_oteSemaphore = NULL;
+		pRequest->m_generation = 0;
+		s_requests.push_back(pRequest);
+		return s_requests.size() - 1;
+	}
+	unsigned index = s_freeRequests.back();
+	s_freeRequests.pop_back();
+	return index;
+}
+
+static void FreeRequest(unsigned index)
+{
+	AsyncIoRequest* pRequest = s_requests[index];
+	pRequest->m_oteSemaphore->countDown();
+	pRequest->m_oteSemaphore = NULL;
+	if (pRequest->m_oteBuffer != NULL)
+	{
+		pRequest->m_oteBuffer->countDown();
+		pRequest->m_oteBuffer = NULL;
+	}
+	pRequest->m_generation = (pRequest->m_generation + 1) & AsyncIoGenerationMask;
+	s_freeRequests.push_back(index);
+}
+
+// Answer the request identified by the handle, or NULL if there is no such request
+static AsyncIoRequest* RequestFromHandle(SMALLINTEGER handle, unsigned& index)
+{
+	index = (handle & AsyncIoIndexMask) - 1;
+	const unsigned generation = (handle >> AsyncIoIndexBits) & AsyncIoGenerationMask;
+	if (index >= s_requests.size())
+		return NULL;
+	AsyncIoRequest* pRequest = s_requests[index];
+	return pRequest->m_oteSemaphore != NULL && pRequest->m_generation == generation ? pRequest : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Argument conversion
+
+// A handle may be a SmallInteger or a 4-byte object such as an ExternalHandle
+static bool HandleFromOop(Oop oop, HANDLE& handle)
+{
+	if (ObjectMemoryIsIntegerObject(oop))
+	{
+		handle = HANDLE(ObjectMemoryIntegerValueOf(oop));
+		return true;
+	}
+	const OTE* ote = reinterpret_cast<const OTE*>(oop);
+	if (ote->isBytes() && ote->bytesSize() == sizeof(HANDLE))
+	{
+		handle = reinterpret_cast<const ExternalHandle*>(ote->m_location)->m_handle;
+		return true;
+	}
+	return false;
+}
+
+// A buffer may be external memory, addressed by an ExternalAddress, or a byte object.
+// Answers the byte object, or NULL for external memory.
+static bool BufferFromOop(Oop oop, DWORD dwLength, BYTE*& pBuffer, OTE*& oteBuffer)
+{
+	oteBuffer = NULL;
+	if (oop == Oop(Pointers.Nil))
+	{
+		pBuffer = NULL;
+		return dwLength == 0;
+	}
+	if (ObjectMemoryIsIntegerObject(oop))
+		return false;
+	OTE* ote = reinterpret_cast<OTE*>(oop);
+	if (!ote->isBytes())
+		return false;
+	if (ote->m_oteClass->m_location->isIndirect())
+	{
+		pBuffer = static_cast<BYTE*>(reinterpret_cast<ExternalAddress*>(ote->m_location)->m_pointer);
+		return pBuffer != NULL;
+	}
+	if (ote->isImmutable() || dwLength > ote->bytesSize())
+		return false;
+	pBuffer = reinterpret_cast<BytesOTE*>(ote)->m_location->m_fields;
+	oteBuffer = ote;
+#ifdef LAZYLOADING
+	// The system cannot fault in the pages of a demand loaded object
+	ObjectMemory::MaterializeLazyBytes(pBuffer, dwLength);
+#endif
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Asynchronous I/O Primitives
+
+// Submit an asynchronous operation. The arguments are the operation code (a SmallInteger), the file or socket
+// handle, the buffer, the length of the buffer (or of the address for a connect), an extra argument specific to
+// the operation, and the Semaphore to be signalled on completion.
+//
+//	Associate	Associate the handle with the completion port. This must be done once before submitting other
+//				operations on the handle. The other arguments are ignored, and the answer is the receiver.
+//	Read/Write	The extra argument is the file offset (ignored for sockets).
+//	Accept		The handle is the listening socket, and the extra argument the socket to accept into. The
+//				buffer receives any initial data followed by the local and remote addresses.
+//	Connect		The handle is a bound socket, and the buffer holds the address to connect to.
+//
+// Except for Associate, the answer is a SmallInteger handle for the request, to be passed to
+// primitiveAsyncIoRequest. The primitive fails with the system error code if the operation could not be started.
+BOOL __fastcall Interpreter::primitiveAsyncIoSubmit(CompiledMethod&, unsigned argCount)
+{
+	if (argCount != 6)
+		return primitiveFailure(PrimitiveFailureWrongNumberOfArgs);
+
+	Oop oopOp = stackValue(5);
+	if (!ObjectMemoryIsIntegerObject(oopOp))
+		return primitiveFailure(0);
+	const SMALLINTEGER op = ObjectMemoryIntegerValueOf(oopOp);
+
+	HANDLE hFile;
+	if (!HandleFromOop(stackValue(4), hFile))
+		return primitiveFailure(1);
+
+	if (!StartAsyncIo())
+		return primitiveFailureWithInt(PrimitiveFailureSystemError, ::GetLastError());
+
+	if (op == AsyncIoAssociate)
+	{
+		// A handle can only be associated once, and answers invalid parameter if associated already
+		if (::CreateIoCompletionPort(hFile, s_hCompletionPort, 0, 0) == NULL && ::GetLastError() != ERROR_INVALID_PARAMETER)
+			return primitiveFailureWithInt(PrimitiveFailureSystemError, ::GetLastError());
+		pop(argCount);
+		return primitiveSuccess();
+	}
+
+	Oop oopLength = stackValue(2);
+	if (!ObjectMemoryIsIntegerObject(oopLength) || ObjectMemoryIntegerValueOf(oopLength) < 0)
+		return primitiveFailure(3);
+	const DWORD dwLength = ObjectMemoryIntegerValueOf(oopLength);
+
+	BYTE* pBuffer;
+	OTE* oteBuffer;
+	if (!BufferFromOop(stackValue(3), dwLength, pBuffer, oteBuffer))
+		return primitiveFailure(2);
+
+	Oop oopExtra = stackValue(1);
+	SemaphoreOTE* oteSemaphore = reinterpret_cast<SemaphoreOTE*>(stackTop());
+	if (ObjectMemory::fetchClassOf(Oop(oteSemaphore)) != Pointers.ClassSemaphore)
+		return primitiveFailure(5);
+
+	::EnterCriticalSection(&s_csAsyncIo);
+	const int index = AllocateRequest();
+	if (index < 0)
+	{
+		::LeaveCriticalSection(&s_csAsyncIo);
+		return primitiveFailure(PrimitiveFailureBoundsError);
+	}
+	AsyncIoRequest* pRequest = s_requests[index];
+	ZeroMemory(&pRequest->m_overlapped, sizeof(OVERLAPPED));
+	oteSemaphore->countUp();
+	pRequest->m_oteSemaphore = oteSemaphore;
+	if (oteBuffer != NULL)
+		oteBuffer->countUp();
+	pRequest->m_oteBuffer = oteBuffer;
+	pRequest->m_hFile = hFile;
+	pRequest->m_dwBytes = 0;
+	pRequest->m_dwError = 0;
+	pRequest->m_bCompleted = false;
+	const SMALLINTEGER handle = (pRequest->m_generation << AsyncIoIndexBits) | (index + 1);
+	::LeaveCriticalSection(&s_csAsyncIo);
+
+	// Completion will be notified through the port, even if the operation completes immediately
+	BOOL bStarted = FALSE;
+	DWORD dwError = ERROR_INVALID_PARAMETER;
+	HANDLE hExtra;
+	switch (op)
+	{
+	case AsyncIoRead:
+	case AsyncIoWrite:
+		if (ObjectMemoryIsIntegerObject(oopExtra))
+		{
+			pRequest->m_overlapped.Offset = ObjectMemoryIntegerValueOf(oopExtra);
+			bStarted = op == AsyncIoRead
+				? ::ReadFile(hFile, pBuffer, dwLength, NULL, &pRequest->m_overlapped)
+				: ::WriteFile(hFile, pBuffer, dwLength, NULL, &pRequest->m_overlapped);
+			dwError = ::GetLastError();
+		}
+		break;
+
+	case AsyncIoAccept:
+		if (s_pfnAcceptEx == NULL)
+		{
+			GUID guid = WSAID_ACCEPTEX;
+			s_pfnAcceptEx = static_cast<LPFN_ACCEPTEX>(WinsockExtension(SOCKET(hFile), guid));
+		}
+		if (s_pfnAcceptEx != NULL && dwLength >= 2*AcceptAddressLength && HandleFromOop(oopExtra, hExtra))
+		{
+			DWORD dwReceived;
+			bStarted = s_pfnAcceptEx(SOCKET(hFile), SOCKET(hExtra), pBuffer, dwLength - 2*AcceptAddressLength,
+									AcceptAddressLength, AcceptAddressLength, &dwReceived, &pRequest->m_overlapped);
+			dwError = ::WSAGetLastError();
+		}
+		break;
+
+	case AsyncIoConnect:
+		if (s_pfnConnectEx == NULL)
+		{
+			GUID guid = WSAID_CONNECTEX;
+			s_pfnConnectEx = static_cast<LPFN_CONNECTEX>(WinsockExtension(SOCKET(hFile), guid));
+		}
+		if (s_pfnConnectEx != NULL && pBuffer != NULL)
+		{
+			bStarted = s_pfnConnectEx(SOCKET(hFile), reinterpret_cast<const sockaddr*>(pBuffer), dwLength,
+										NULL, 0, NULL, &pRequest->m_overlapped);
+			dwError = ::WSAGetLastError();
+		}
+		break;
+	}
+
+	if (!bStarted && dwError != ERROR_IO_PENDING)
+	{
+		::EnterCriticalSection(&s_csAsyncIo);
+		FreeRequest(index);
+		::LeaveCriticalSection(&s_csAsyncIo);
+		return primitiveFailureWithInt(PrimitiveFailureSystemError, dwError);
+	}
+
+	pop(argCount);
+	stackTop() = ObjectMemoryIntegerObjectOf(handle);
+	return primitiveSuccess();
+}
+
+// Answer the result of the asynchronous operation with the SmallInteger handle that is the first argument, or
+// cancel it if the second argument is true. The result is nil if the operation has not yet completed, else the
+// number of bytes transferred, or the negated system error code if it failed. Once a result has been answered
+// the handle is no longer valid. Cancelling answers whether the operation was outstanding; a cancelled
+// operation still completes, with an error, and its result must still be collected. Note that cancellation
+// cancels all the VM's outstanding operations on the same file or socket handle.
+BOOL __fastcall Interpreter::primitiveAsyncIoRequest()
+{
+	Oop oopCancel = stackTop();
+	Oop oopHandle = stackValue(1);
+	if (!ObjectMemoryIsIntegerObject(oopHandle))
+		return primitiveFailure(0);
+
+	::EnterCriticalSection(&s_csAsyncIo);
+	unsigned index;
+	AsyncIoRequest* pRequest = RequestFromHandle(ObjectMemoryIntegerValueOf(oopHandle), index);
+	if (pRequest == NULL)
+	{
+		::LeaveCriticalSection(&s_csAsyncIo);
+		return primitiveFailure(1);
+	}
+
+	Oop oopResult;
+	if (oopCancel == Oop(Pointers.True))
+	{
+		// All the I/O is issued by this thread, so CancelIo() (unlike CancelIoEx) reaches it
+		const bool bCancelled = !pRequest->m_bCompleted && ::CancelIo(pRequest->m_hFile);
+		oopResult = Oop(bCancelled ? Pointers.True : Pointers.False);
+	}
+	else if (!pRequest->m_bCompleted)
+		oopResult = Oop(Pointers.Nil);
+	else
+	{
+		oopResult = pRequest->m_dwError == 0
+			? ObjectMemoryIntegerObjectOf(pRequest->m_dwBytes)
+			: ObjectMemoryIntegerObjectOf(-SMALLINTEGER(pRequest->m_dwError));
+		FreeRequest(index);
+	}
+	::LeaveCriticalSection(&s_csAsyncIo);
+
+	pop(2);
+	stackTop() = oopResult;
+	return primitiveSuccess();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GC support. The Semaphores and buffers of requests are roots, and must be updated after a compaction.
+
+#pragma code_seg(GC_SEG)
+
+void Interpreter::MarkAsyncIo()
+{
+	if (s_hCompletionPort == NULL)
+		return;
+
+	::EnterCriticalSection(&s_csAsyncIo);
+	for (unsigned i=0;i<s_requests.size();i++)
+	{
+		AsyncIoRequest* pRequest = s_requests[i];
+		if (pRequest->m_oteSemaphore != NULL)
+		{
+			ObjectMemory::MarkObjectsAccessibleFromRoot(reinterpret_cast<POTE>(pRequest->m_oteSemaphore));
+			if (pRequest->m_oteBuffer != NULL)
+				ObjectMemory::MarkObjectsAccessibleFromRoot(pRequest->m_oteBuffer);
+		}
+	}
+	::LeaveCriticalSection(&s_csAsyncIo);
+}
+
+void Interpreter::CompactAsyncIo()
+{
+	if (s_hCompletionPort == NULL)
+		return;
+
+	::EnterCriticalSection(&s_csAsyncIo);
+	for (unsigned i=0;i<s_requests.size();i++)
+	{
+		AsyncIoRequest* pRequest = s_requests[i];
+		if (pRequest->m_oteSemaphore != NULL)
+		{
+			ObjectMemory::compactOop(pRequest->m_oteSemaphore);
+			if (pRequest->m_oteBuffer != NULL)
+				ObjectMemory::compactOop(pRequest->m_oteBuffer);
+		}
+	}
+	::LeaveCriticalSection(&s_csAsyncIo);
+}
+
+#pragma code_seg(INIT_SEG)
+
+void Interpreter::initializeAsyncIo()
+{
+	::InitializeCriticalSection(&s_csAsyncIo);
+}
+
+#pragma code_seg(TERM_SEG)
+
+void Interpreter::terminateAsyncIo()
+{
+	if (s_hCompletionPort != NULL)
+	{
+		for (unsigned i=0;i<s_completionThreads.size();i++)
+			::PostQueuedCompletionStatus(s_hCompletionPort, 0, AsyncIoShutdownKey, NULL);
+		::WaitForMultipleObjects(s_completionThreads.size(), &s_completionThreads[0], TRUE, INFINITE);
+		for (unsigned i=0;i<s_completionThreads.size();i++)
+			::CloseHandle(s_completionThreads[i]);
+		s_completionThreads.clear();
+		::CloseHandle(s_hCompletionPort);
+		s_hCompletionPort = NULL;
+	}
+
+	// Requests still outstanding may yet be written by the system, so are deliberately leaked
+	::DeleteCriticalSection(&s_csAsyncIo);
+}
@@ -0,0 +1,222 @@
+/******************************************************************************
+
+	File: BorrowedView.cpp
+
+	Description:
+
+	Borrowed views over external memory. A borrowed view is a byte object whose
+	body is not allocated by the object memory, but is a region of memory that
+	belongs to someone else, e.g. a buffer handed to us by a native library. The
+	OTE simply points at the region, and its size is that of the region, so the
+	view can be accessed in place by all the primitives that operate on byte
+	objects (with the usual bounds checks) without first being copied.
+
+	The region must remain valid for as long as the view exists, so each view
+	has an owner, typically the object whose finalization releases the memory,
+	which is kept alive for the lifetime of the view. The owners are held in a
+	table keyed by the view's OTE, which is consulted when the view is
+	deallocated, and whose owners are marked as roots by the collector. For
+	this reason #become: fails if either object is a view, as the view's body
+	would otherwise outlive its entry (a #oneWayBecome: is fine, since it
+	deallocates the view).
+
+	Views are in HeapSpace with demand loaded objects (see LazyLoad.cpp), so
+	their bodies are not freed with them. They cannot be resized, and a copy of
+	a view is an ordinary byte object. A view saved in an image is loaded as an
+	ordinary byte object holding the contents of the region at the time of the
+	save.
+
+******************************************************************************/
+#include "Ist.h"
+
+#pragma code_seg(MEM_SEG)
+
+#include "ObjMem.h"
+#include "Interprt.h"
+#include "ObjMemPriv.inl"
+
+// Smalltalk classes
+#include "STBehavior.h"
+
+struct BorrowedViewEntry
+{
+	OTE*	m_oteView;			// NULL if the slot is empty
+	OTE*	m_oteOwner;
+};
+
+// Open addressed with linear probing, and kept at most half full
+static BorrowedViewEntry*	s_pViews;
+static unsigned				s_nViewsCapacity;	// Always a power of 2
+static unsigned				s_nViews;
+
+static const unsigned InitialViewsCapacity = 64;
+
+inline unsigned ViewHash(const OTE* ote)
+{
+	return reinterpret_cast<DWORD>(ote) / sizeof(OTE);
+}
+
+// Answer the index of the slot holding the specified view, or of the empty slot at which it would be inserted
+static unsigned FindViewSlot(const OTE* oteView)
+{
+	const unsigned mask = s_nViewsCapacity - 1;
+	unsigned i = ViewHash(oteView) & mask;
+	while (s_pViews[i].m_oteView != NULL && s_pViews[i].m_oteView != oteView)
+		i = (i+1) & mask;
+	return i;
+}
+
+// Rebuild the table at the specified capacity, e.g. to grow it, or because the keys have been changed
+static void RehashViews(unsigned nCapacity)
+{
+	BorrowedViewEntry* pOldViews = s_pViews;
+	const unsigned nOldCapacity = s_nViewsCapacity;
+
+	s_pViews = new BorrowedViewEntry[nCapacity];
+	memset(s_pViews, 0, nCapacity*sizeof(BorrowedViewEntry));
+	s_nViewsCapacity = nCapacity;
+	s_nViews = 0;
+
+	for (unsigned i=0;i<nOldCapacity;i++)
+	{
+		if (pOldViews[i].m_oteView != NULL)
+		{
+			s_pViews[FindViewSlot(pOldViews[i].m_oteView)] = pOldViews[i];
+			s_nViews++;
+		}
+	}
+
+	delete[] pOldViews;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Answer a new instance of the specified byte class which is a view of the byteSize bytes of external
+// memory at pBytes, owned by oteOwner. If the class is null terminated, the terminator must be present
+// in the external memory immediately after the view.
+BytesOTE* __fastcall ObjectMemory::newBorrowedView(BehaviorOTE* classPointer, void* pBytes, MWORD byteSize, OTE* oteOwner)
+{
+	ASSERT(classPointer->m_location->isBytes() && !classPointer->m_location->isIndirect());
+
+	if ((s_nViews+1)*2 > s_nViewsCapacity)
+		RehashViews(s_nViewsCapacity == 0 ? InitialViewsCapacity : s_nViewsCapacity*2);
+
+	OTE* ote = allocateOop(static_cast<POBJECT>(pBytes));
+	ote->setSize(byteSize);
+	ote->m_oteClass = classPointer;
+	classPointer->countUp();
+	// We don't want to overwrite the identity hash allocated by allocateOop
+	ote->m_flags = m_spaceOTEBits[OTEFlags::HeapSpace];
+	if (classPointer->m_location->m_instanceSpec.m_nullTerminated)
+		ote->setNullTerminated();
+	ASSERT(ote->isBytes());
+
+	oteOwner->countUp();
+	BorrowedViewEntry& entry = s_pViews[FindViewSlot(ote)];
+	entry.m_oteView = ote;
+	entry.m_oteOwner = oteOwner;
+	s_nViews++;
+
+	return reinterpret_cast<BytesOTE*>(ote);
+}
+
+// Answer whether the specified HeapSpace object is a borrowed view (as opposed to a demand loaded object)
+bool __fastcall ObjectMemory::isBorrowedView(const OTE* ote)
+{
+	return s_nViews != 0 && s_pViews[FindViewSlot(ote)].m_oteView == ote;
+}
+
+// The specified HeapSpace object is being deallocated, so if it is a view release the reference to its owner.
+// As for the fields of objects deallocated by the collector, the owner's count is decremented without adding it
+// to the Zct, since this may occur during Zct reconciliation, so if no longer referenced it will be reclaimed
+// by the next collection.
+void __fastcall ObjectMemory::releaseBorrowedView(OTE* ote)
+{
+	if (s_nViews == 0)
+		return;
+
+	const unsigned mask = s_nViewsCapacity - 1;
+	unsigned i = FindViewSlot(ote);
+	if (s_pViews[i].m_oteView == NULL)
+		return;
+
+	decRefs(s_pViews[i].m_oteOwner);
+	s_pViews[i].m_oteView = NULL;
+	s_nViews--;
+
+	// Move back any following entries in the same run that could otherwise no longer be found
+	unsigned j = i;
+	for (;;)
+	{
+		j = (j+1) & mask;
+		const OTE* oteView = s_pViews[j].m_oteView;
+		if (oteView == NULL)
+			break;
+		const unsigned home = ViewHash(oteView) & mask;
+		if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+		{
+			s_pViews[i] = s_pViews[j];
+			s_pViews[j].m_oteView = NULL;
+			i = j;
+		}
+	}
+}
+
+#pragma code_seg(GC_SEG)
+
+// The owners of all the views are roots, whether or not the views themselves are reachable; an unreachable
+// view is deallocated by the collection, and its owner released, to be reclaimed in the next.
+void ObjectMemory::MarkBorrowedViews()
+{
+	for (unsigned i=0;i<s_nViewsCapacity;i++)
+	{
+		BorrowedViewEntry& entry = s_pViews[i];
+		if (entry.m_oteView == NULL)
+			continue;
+
+		// Views cannot be swapped with other objects by #become:, so the body must still be the view's
+		HARDASSERT(entry.m_oteView->heapSpace() == OTEFlags::HeapSpace);
+		MarkObjectsAccessibleFromRoot(entry.m_oteOwner);
+	}
+}
+
+#ifdef _DEBUG
+	// Add back the references from the table when recalculating reference counts
+	void ObjectMemory::addBorrowedViewRefs()
+	{
+		for (unsigned i=0;i<s_nViewsCapacity;i++)
+		{
+			if (s_pViews[i].m_oteView != NULL)
+				s_pViews[i].m_oteOwner->countUp();
+		}
+	}
+#endif
+
+// The OT has been compacted, so update the views and owners from the forwarding pointers, and rehash
+void ObjectMemory::CompactBorrowedViews()
+{
+	if (s_nViews == 0)
+		return;
+
+	for (unsigned i=0;i<s_nViewsCapacity;i++)
+	{
+		BorrowedViewEntry& entry = s_pViews[i];
+		if (entry.m_oteView != NULL)
+		{
+			compactOop(entry.m_oteView);
+			compactOop(entry.m_oteOwner);
+		}
+	}
+
+	RehashViews(s_nViewsCapacity);
+}
+
+#pragma code_seg(TERM_SEG)
+
+void ObjectMemory::TerminateBorrowedViews()
+{
+	delete[] s_pViews;
+	s_pViews = NULL;
+	s_nViewsCapacity = 0;
+	s_nViews = 0;
+}
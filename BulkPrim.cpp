@@ -0,0 +1,220 @@
+/******************************************************************************
+
+	File: BulkPrim.cpp
+
+	Description:
+
+	Implementation of the Interpreter class' primitive methods for filling
+	and copying ranges of the indexable variables of objects, without a send
+	(or even a primitive call) per element.
+
+	The shape of the receiver determines the values it can hold: pointer
+	objects can hold anything (and must be ref. counted), null terminated byte
+	objects (Strings) hold Characters, and other byte objects hold SmallIntegers
+	in the range 0..255.
+
+******************************************************************************/
+#include "Ist.h"
+#pragma code_seg(PRIM_SEG)
+
+#include "ObjMem.h"
+#include "Interprt.h"
+#include "InterprtPrim.inl"
+
+// Smalltalk classes
+#include "STBehavior.h"
+#include "STArray.h"
+#include "STCharacter.h"
+
+// Answer the indexable variables of a pointer object, and the number of them
+inline static Oop* IndexedFieldsOf(PointersOTE* ote, MWORD& size)
+{
+	const MWORD fixedFields = ote->m_oteClass->m_location->m_instanceSpec.m_fixedFields;
+	size = ote->pointersSize() - fixedFields;
+	return ote->m_location->m_fields + fixedFields;
+}
+
+// Answer the byte value that represents the value in the byte object, or -1 if it cannot be stored there
+inline static int ByteValueFor(const OTE* ote, Oop valuePointer)
+{
+	if (ote->isNullTerminated())
+	{
+		if (ObjectMemoryIsIntegerObject(valuePointer) || reinterpret_cast<OTE*>(valuePointer)->m_oteClass != Pointers.ClassCharacter)
+			return -1;
+		return ObjectMemoryIntegerValueOf(reinterpret_cast<CharOTE*>(valuePointer)->m_location->m_asciiValue);
+	}
+	else
+	{
+		if (!ObjectMemoryIsIntegerObject(valuePointer))
+			return -1;
+		const MWORD value = ObjectMemoryIntegerValueOf(valuePointer);
+		return value <= 0xFF ? int(value) : -1;
+	}
+}
+
+// The active process' stack is not ref. counted, so it must not be updated in bulk
+inline static bool IsBulkUpdatable(const OTE* ote)
+{
+	return !ote->isImmutable() && ote->m_oteClass != Pointers.ClassProcess;
+}
+
+// Replace the indexable variables of the receiver from start to stop with those of the replacement
+// from repStart, i.e. replaceFrom:to:with:startingAt: for pointer objects. The ranges may overlap
+// when the replacement is the receiver. All the replacement values are counted up before any of the
+// replaced values are counted down, so it does not matter that a value may be in both, and the
+// replaced values are counted down only once overwritten, as that may reconcile the Zct.
+BOOL __fastcall Interpreter::primitiveReplacePointers()
+{
+	Oop integerPointer = stackTop();
+	if (!ObjectMemoryIsIntegerObject(integerPointer))
+		return primitiveFailure(0);	// repStart is not an integer
+	const SMALLINTEGER repStart = ObjectMemoryIntegerValueOf(integerPointer);
+
+	Oop argPointer = stackValue(1);
+	if (ObjectMemoryIsIntegerObject(argPointer) || !reinterpret_cast<OTE*>(argPointer)->isPointers())
+		return primitiveFailure(1);	// replacement is not a pointer object
+
+	integerPointer = stackValue(2);
+	if (!ObjectMemoryIsIntegerObject(integerPointer))
+		return primitiveFailure(2);	// stop is not an integer
+	const SMALLINTEGER stop = ObjectMemoryIntegerValueOf(integerPointer);
+
+	integerPointer = stackValue(3);
+	if (!ObjectMemoryIsIntegerObject(integerPointer))
+		return primitiveFailure(3);	// start is not an integer
+	const SMALLINTEGER start = ObjectMemoryIntegerValueOf(integerPointer);
+
+	Oop receiverPointer = stackValue(4);
+	if (ObjectMemoryIsIntegerObject(receiverPointer) || !reinterpret_cast<OTE*>(receiverPointer)->isPointers()
+			|| !IsBulkUpdatable(reinterpret_cast<OTE*>(receiverPointer)))
+		return primitiveFailure(4);
+
+	// As for the byte replacement primitives, an empty range is valid regardless of the other arguments
+	if (stop >= start)
+	{
+		MWORD size, repSize;
+		Oop* pTo = IndexedFieldsOf(reinterpret_cast<PointersOTE*>(receiverPointer), size);
+		Oop* pFrom = IndexedFieldsOf(reinterpret_cast<PointersOTE*>(argPointer), repSize);
+		const MWORD count = stop - start + 1;
+		if (start < 1 || MWORD(stop) > size || repStart < 1 || MWORD(repStart) + count - 1 > repSize)
+			return primitiveFailure(5);	// Out of bounds
+
+		pTo += start - 1;
+		pFrom += repStart - 1;
+		if (pTo != pFrom)
+		{
+			Oop* replaced = new Oop[count];
+			memcpy(replaced, pTo, count*sizeof(Oop));
+			for (MWORD i=0;i<count;i++)
+				ObjectMemory::countUp(pFrom[i]);
+			memmove(pTo, pFrom, count*sizeof(Oop));
+			for (MWORD i=0;i<count;i++)
+				ObjectMemory::countDown(replaced[i]);
+			delete[] replaced;
+		}
+	}
+
+	pop(4);
+	return primitiveSuccess();
+}
+
+// Store the value argument into a range or a collection of the indexable variables of the receiver.
+// With three arguments this is from:to:put:, and with two atAll:put:, where the first argument is an
+// Array of SmallInteger indices. All the indices are validated before any variable is updated.
+BOOL __fastcall Interpreter::primitiveFill(CompiledMethod&, unsigned argCount)
+{
+	Oop valuePointer = stackTop();
+	OTE* oteReceiver = reinterpret_cast<OTE*>(stackValue(argCount));
+	if (ObjectMemoryIsIntegerObject(oteReceiver) || !IsBulkUpdatable(oteReceiver))
+		return primitiveFailure(argCount);
+
+	MWORD size;
+	Oop* pFields = NULL;
+	BYTE* pBytes = NULL;
+	int byteValue = 0;
+	if (oteReceiver->isPointers())
+		pFields = IndexedFieldsOf(reinterpret_cast<PointersOTE*>(oteReceiver), size);
+	else
+	{
+		if ((byteValue = ByteValueFor(oteReceiver, valuePointer)) < 0)
+			return primitiveFailure(0);	// Value cannot be stored in the receiver
+		pBytes = reinterpret_cast<BytesOTE*>(oteReceiver)->m_location->m_fields;
+		size = oteReceiver->bytesSize();
+	}
+
+	if (argCount == 3)
+	{
+		Oop integerPointer = stackValue(1);
+		if (!ObjectMemoryIsIntegerObject(integerPointer))
+			return primitiveFailure(1);	// stop is not an integer
+		const SMALLINTEGER stop = ObjectMemoryIntegerValueOf(integerPointer);
+		integerPointer = stackValue(2);
+		if (!ObjectMemoryIsIntegerObject(integerPointer))
+			return primitiveFailure(2);	// start is not an integer
+		const SMALLINTEGER start = ObjectMemoryIntegerValueOf(integerPointer);
+
+		if (stop >= start)
+		{
+			if (start < 1 || MWORD(stop) > size)
+				return primitiveFailure(3);	// Out of bounds
+
+			const MWORD count = stop - start + 1;
+			if (pBytes != NULL)
+				memset(pBytes + start - 1, byteValue, count);
+			else
+			{
+				Oop* pTo = pFields + start - 1;
+				for (MWORD i=0;i<count;i++)
+					ObjectMemory::countUp(valuePointer);
+				for (MWORD i=0;i<count;i++)
+				{
+					Oop oldValue = pTo[i];
+					pTo[i] = valuePointer;
+					ObjectMemory::countDown(oldValue);
+				}
+			}
+		}
+	}
+	else if (argCount == 2)
+	{
+		Oop indicesPointer = stackValue(1);
+		if (ObjectMemoryIsIntegerObject(indicesPointer) || reinterpret_cast<OTE*>(indicesPointer)->m_oteClass != Pointers.ClassArray)
+			return primitiveFailure(1);	// indices not an Array
+		ArrayOTE* oteIndices = reinterpret_cast<ArrayOTE*>(indicesPointer);
+		const Oop* indices = oteIndices->m_location->m_elements;
+		const MWORD count = oteIndices->pointersSize();
+		for (MWORD i=0;i<count;i++)
+		{
+			if (!ObjectMemoryIsIntegerObject(indices[i]))
+				return primitiveFailure(2);	// Non-integer index
+			const SMALLINTEGER index = ObjectMemoryIntegerValueOf(indices[i]);
+			if (index < 1 || MWORD(index) > size)
+				return primitiveFailure(3);	// Out of bounds
+		}
+
+		if (pBytes != NULL)
+		{
+			for (MWORD i=0;i<count;i++)
+				pBytes[ObjectMemoryIntegerValueOf(indices[i])-1] = static_cast<BYTE>(byteValue);
+		}
+		else
+		{
+			for (MWORD i=0;i<count;i++)
+				ObjectMemory::countUp(valuePointer);
+			for (MWORD i=0;i<count;i++)
+			{
+				Oop& field = pFields[ObjectMemoryIntegerValueOf(indices[i])-1];
+				Oop oldValue = field;
+				field = valuePointer;
+				ObjectMemory::countDown(oldValue);
+			}
+		}
+	}
+	else
+		return primitiveFailure(PrimitiveFailureWrongNumberOfArgs);
+
+	// Answer the value
+	pop(argCount);
+	stackTop() = valuePointer;
+	return primitiveSuccess();
+}
@@ -0,0 +1,685 @@
+/******************************************************************************
+
+	File: CallStubBench.cpp
+
+	Description:
+
+	Call overhead benchmark for external library calls. Compares the cost
+	of marshalling the arguments and result of a call in two ways:
+
+		generic		Dispatching on the type code of each argument and of
+					the result through tables of conversion routines, as
+					callExternalFunction does (see ExternalCall.asm).
+		stub		Straight line code generated for the descriptor, as
+					primitiveDLL32Call uses (see ExtCallStubs.cpp).
+
+	The call overhead of a direct C++ call of the same function is also
+	reported as a lower bound.
+
+	Each is measured for descriptors of 1, 2 and 4 arguments of each of the
+	types DWORD, BOOL, HANDLE and LPVOID, calling a trivial stdcall function
+	that answers a DWORD. The arguments are taken from a simulated
+	interpreter stack, and are SmallIntegers (DWORD and HANDLE), true (BOOL)
+	and nil (LPVOID). The stubs are generated with NativeAssembler using
+	the same instruction sequences as ExtCallStubs.cpp for these
+	representations. Byte object arguments, which the stubs also pass
+	inline, are not measured, as this program has no object memory.
+
+	It then measures the marshalling of callback arguments (see
+	Interpreter::pushArgsAt), by sorting an array with a comparator of the
+	form used by LVM_SORTITEMS, which takes three INTPTR arguments. Before
+	comparing, the comparator pushes its arguments onto the simulated stack
+	in one of two ways:
+
+		table		Dispatching on the type code of each argument through
+					a table of marshalling routines.
+		inline		Pushing integer and boolean arguments inline, as
+					pushArgsAt does while only they occur.
+
+	A comparator that does no marshalling is also timed, as a lower bound.
+
+	Usage: CallStubBench [-n <calls per descriptor>] [-s <elements to sort>]
+
+******************************************************************************/
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "DolphinX.h"
+using namespace DolphinX;
+#include "NativeAssembler.h"
+
+typedef NativeAssembler Asm;
+typedef DWORD Oop;
+
+enum { MaxArgs = 4 };
+enum { StubCodeSize = 64*1024 };
+
+// Stub status codes, answered in EDX, as ExtCallStubs.cpp
+enum { StubResult, StubNewObject, StubNotConverted, StubUnwound };
+
+// Stand-ins for the objects nil, true and false. Their Oops are the (even) addresses of these,
+// and are held in variables so that the generated code compares against them as it does against
+// the VM's Pointers
+static __declspec(align(4)) BYTE s_objects[3*sizeof(DWORD)];
+static Oop s_oopNil;
+static Oop s_oopTrue;
+static Oop s_oopFalse;
+
+// Simulated interpreter registers: the receiver and arguments are on the stack, with the stack
+// pointer addressing the last argument
+static Oop s_stack[1+MaxArgs];
+static Oop* s_pStackPointer;
+static void* s_pActiveFrame;
+
+static inline Oop SmallInteger(int value)				{ return (value << 1) | 1; }
+static inline bool IsSmallInteger(Oop oop)				{ return (oop & 1) != 0; }
+static inline int SmallIntegerValue(Oop oop)			{ return static_cast<int>(oop) >> 1; }
+
+// Box a result. The VM would allocate a LargeInteger for values out of SmallInteger range; here
+// they are simply answered as nil.
+static inline Oop __fastcall NewUnsigned32(DWORD value)
+{
+	return value <= 0x3FFFFFFF ? SmallInteger(value) : s_oopNil;
+}
+
+static inline Oop __fastcall NewSigned32(SDWORD value)
+{
+	return value >= -0x40000000 && value <= 0x3FFFFFFF ? SmallInteger(value) : s_oopNil;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The external functions called
+
+static DWORD __stdcall Target1(DWORD a)
+{
+	return a + 1;
+}
+
+static DWORD __stdcall Target2(DWORD a, DWORD b)
+{
+	return a + b + 1;
+}
+
+static DWORD __stdcall Target4(DWORD a, DWORD b, DWORD c, DWORD d)
+{
+	return a + b + c + d + 1;
+}
+
+static FARPROC TargetFor(unsigned argCount)
+{
+	switch (argCount)
+	{
+	case 1:
+		return reinterpret_cast<FARPROC>(&Target1);
+	case 2:
+		return reinterpret_cast<FARPROC>(&Target2);
+	default:
+		return reinterpret_cast<FARPROC>(&Target4);
+	}
+}
+
+struct Descriptor
+{
+	FARPROC		m_proc;
+	BYTE		m_return;
+	BYTE		m_argsLen;
+	BYTE		m_args[MaxArgs];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Generic marshalling, dispatched per argument through a table indexed by type code
+
+typedef bool (__fastcall *ArgConverter)(Oop arg, DWORD& value);
+typedef Oop (__fastcall *ResultConverter)(DWORD value);
+
+static bool __fastcall ConvertInteger(Oop arg, DWORD& value)
+{
+	if (IsSmallInteger(arg))
+		value = SmallIntegerValue(arg);
+	else if (arg == s_oopNil)
+		value = 0;
+	else
+		return false;
+	return true;
+}
+
+static bool __fastcall ConvertBool(Oop arg, DWORD& value)
+{
+	if (IsSmallInteger(arg))
+		value = SmallIntegerValue(arg);
+	else if (arg == s_oopTrue)
+		value = 1;
+	else if (arg == s_oopFalse)
+		value = 0;
+	else
+		return false;
+	return true;
+}
+
+static Oop __fastcall ConvertDWORDResult(DWORD value)
+{
+	return NewUnsigned32(value);
+}
+
+static ArgConverter s_argConverters[ExtCallArgMax+1];
+static ResultConverter s_resultConverters[ExtCallArgMax+1];
+
+static void InitializeConverters()
+{
+	s_argConverters[ExtCallArgDWORD] = ConvertInteger;
+	s_argConverters[ExtCallArgHANDLE] = ConvertInteger;
+	s_argConverters[ExtCallArgLPVOID] = ConvertInteger;
+	s_argConverters[ExtCallArgBOOL] = ConvertBool;
+	s_resultConverters[ExtCallArgDWORD] = ConvertDWORDResult;
+}
+
+// Push the arguments and call the (stdcall) function
+static DWORD CallWithArgs(FARPROC proc, const DWORD* args, unsigned argCount)
+{
+	DWORD result;
+	DWORD savedESP;
+	__asm
+	{
+		mov		savedESP, esp
+		mov		ecx, argCount
+		mov		edx, args
+	pushArgs:
+		test	ecx, ecx
+		jz		performCall
+		push	DWORD PTR [edx+ecx*4-4]
+		dec		ecx
+		jmp		pushArgs
+	performCall:
+		call	proc
+		mov		esp, savedESP
+		mov		result, eax
+	}
+	return result;
+}
+
+static bool GenericCall(const Descriptor& descriptor, Oop& result)
+{
+	DWORD args[MaxArgs];
+	const unsigned argCount = descriptor.m_argsLen;
+	const Oop* pArgs = s_pStackPointer - (argCount - 1);
+	for (unsigned i=0;i<argCount;i++)
+	{
+		ArgConverter pfnConvert = s_argConverters[descriptor.m_args[i]];
+		if (pfnConvert == NULL || !pfnConvert(pArgs[i], args[i]))
+			return false;
+	}
+
+	void* pActiveFrame = s_pActiveFrame;
+	DWORD value = CallWithArgs(descriptor.m_proc, args, argCount);
+	if (s_pActiveFrame != pActiveFrame)
+		return false;
+
+	result = s_resultConverters[descriptor.m_return](value);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Stubs, generated as ExtCallStubs.cpp does, but only for the representations passed here
+
+// Answers the result in EAX and the status in EDX
+typedef unsigned __int64 (__cdecl *CallStubFn)();
+
+static BYTE* s_pStubCode;
+static BYTE* s_pStubFree;
+
+static void EmitArgConversion(Asm& a, BYTE argType, unsigned* fails, unsigned& nFails)
+{
+	unsigned pushes[2];
+	unsigned nPushes = 0;
+
+	a.sarRegOne(Asm::EAX);
+	pushes[nPushes++] = a.jcc(Asm::CondB);
+	a.alu(Asm::ADD, Asm::EAX, Asm::EAX);
+	if (argType == ExtCallArgBOOL)
+	{
+		a.cmpRegAbs(Asm::EAX, &s_oopTrue);
+		unsigned notTrue = a.jcc(Asm::CondNE);
+		a.movRegImm(Asm::EAX, 1);
+		pushes[nPushes++] = a.jmp();
+		a.patch(notTrue, a.offset());
+		a.cmpRegAbs(Asm::EAX, &s_oopFalse);
+	}
+	else
+	{
+		// LPVOID stubs go on to pass byte objects here, but none are passed by this program
+		a.cmpRegAbs(Asm::EAX, &s_oopNil);
+	}
+	fails[nFails++] = a.jcc(Asm::CondNE);
+	a.alu(Asm::XOR, Asm::EAX, Asm::EAX);
+
+	for (unsigned i=0;i<nPushes;i++)
+		a.patch(pushes[i], a.offset());
+}
+
+static CallStubFn GenerateStub(const Descriptor& descriptor)
+{
+	Asm a(s_pStubFree, s_pStubCode + StubCodeSize);
+	unsigned fails[MaxArgs];
+	unsigned nFails = 0;
+	const unsigned argCount = descriptor.m_argsLen;
+
+	a.pushReg(Asm::EBP);
+	a.movRegReg(Asm::EBP, Asm::ESP);
+	a.pushReg(Asm::EBX);
+	a.pushReg(Asm::ESI);
+	a.movRegAbs(Asm::EBX, &s_pActiveFrame);
+	a.movRegAbs(Asm::ESI, &s_pStackPointer);
+
+	// Push the arguments right to left
+	for (unsigned i=0;i<argCount;i++)
+	{
+		a.movRegMem(Asm::EAX, Asm::ESI, -int(i*sizeof(Oop)));
+		EmitArgConversion(a, descriptor.m_args[argCount-1-i], fails, nFails);
+		a.pushReg(Asm::EAX);
+	}
+
+	a.movRegImm(Asm::EAX, reinterpret_cast<DWORD>(descriptor.m_proc));
+	a.callReg(Asm::EAX);
+
+	a.leaRegMem(Asm::ESP, Asm::EBP, -8);
+	a.cmpRegAbs(Asm::EBX, &s_pActiveFrame);
+	unsigned unwound = a.jcc(Asm::CondNE);
+
+	a.movRegReg(Asm::ECX, Asm::EAX);
+	a.movRegImm(Asm::EAX, reinterpret_cast<DWORD>(&NewUnsigned32));
+	a.callReg(Asm::EAX);
+	a.movRegImm(Asm::EDX, StubNewObject);
+
+	unsigned epilogue = a.offset();
+	a.popReg(Asm::ESI);
+	a.popReg(Asm::EBX);
+	a.popReg(Asm::EBP);
+	a.ret();
+
+	for (unsigned i=0;i<nFails;i++)
+		a.patch(fails[i], a.offset());
+	a.leaRegMem(Asm::ESP, Asm::EBP, -8);
+	a.movRegImm(Asm::EDX, StubNotConverted);
+	a.patch(a.jmp(), epilogue);
+
+	a.patch(unwound, a.offset());
+	a.movRegImm(Asm::EDX, StubUnwound);
+	a.patch(a.jmp(), epilogue);
+
+	if (a.overflowed())
+		return NULL;
+	::FlushInstructionCache(::GetCurrentProcess(), s_pStubFree, a.offset());
+	CallStubFn pfnStub = reinterpret_cast<CallStubFn>(s_pStubFree);
+	s_pStubFree += (a.offset() + 15) & ~15;
+	return pfnStub;
+}
+
+static bool StubCall(CallStubFn pfnStub, Oop& result)
+{
+	const unsigned __int64 answer = pfnStub();
+	if (DWORD(answer >> 32) != StubNewObject)
+		return false;
+	result = DWORD(answer);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Callback argument marshalling, as Interpreter::pushArgsAt
+
+typedef unsigned (__fastcall *CallbackArgPusher)(BYTE* lpParm, BYTE literal);
+
+struct CallbackArgMarshaler
+{
+	CallbackArgPusher	m_pfnPush;
+	bool				m_bHasLiteral;
+};
+
+static inline void PushOop(Oop oop)
+{
+	*++s_pStackPointer = oop;
+}
+
+static unsigned __fastcall PushUnknownArg(BYTE*, BYTE)
+{
+	PushOop(s_oopNil);
+	return sizeof(DWORD);
+}
+
+static unsigned __fastcall PushUnsignedArg(BYTE* lpParm, BYTE)
+{
+	PushOop(NewUnsigned32(*reinterpret_cast<DWORD*>(lpParm)));
+	return sizeof(DWORD);
+}
+
+static unsigned __fastcall PushSignedArg(BYTE* lpParm, BYTE)
+{
+	PushOop(NewSigned32(*reinterpret_cast<SDWORD*>(lpParm)));
+	return sizeof(SDWORD);
+}
+
+static unsigned __fastcall PushBoolArg(BYTE* lpParm, BYTE)
+{
+	PushOop(*reinterpret_cast<BOOL*>(lpParm) ? s_oopTrue : s_oopFalse);
+	return sizeof(BOOL);
+}
+
+static CallbackArgMarshaler s_callbackArgMarshalers[ExtCallArgMax+1];
+
+static void InitializeMarshalers()
+{
+	for (unsigned i=0;i<=ExtCallArgMax;i++)
+	{
+		s_callbackArgMarshalers[i].m_pfnPush = PushUnknownArg;
+		s_callbackArgMarshalers[i].m_bHasLiteral = i >= ExtCallArgSTRUCT;
+	}
+	s_callbackArgMarshalers[ExtCallArgDWORD].m_pfnPush = PushUnsignedArg;
+	s_callbackArgMarshalers[ExtCallArgUINTPTR].m_pfnPush = PushUnsignedArg;
+	s_callbackArgMarshalers[ExtCallArgSDWORD].m_pfnPush = PushSignedArg;
+	s_callbackArgMarshalers[ExtCallArgINTPTR].m_pfnPush = PushSignedArg;
+	s_callbackArgMarshalers[ExtCallArgHRESULT].m_pfnPush = PushSignedArg;
+	s_callbackArgMarshalers[ExtCallArgBOOL].m_pfnPush = PushBoolArg;
+}
+
+static void PushArgsThroughTable(const BYTE* argTypes, unsigned argsLen, BYTE* lpParms)
+{
+	unsigned i=0;
+	while (i<argsLen)
+	{
+		const CallbackArgMarshaler& marshaler = s_callbackArgMarshalers[min(argTypes[i++], ExtCallArgMax)];
+		BYTE literal = 0;
+		if (marshaler.m_bHasLiteral)
+			literal = argTypes[i++];
+		lpParms += marshaler.m_pfnPush(lpParms, literal);
+	}
+}
+
+static void PushArgsInline(const BYTE* argTypes, unsigned argsLen, BYTE* lpParms)
+{
+	for (unsigned i=0;i<argsLen;i++)
+	{
+		const DWORD value = *reinterpret_cast<DWORD*>(lpParms);
+		switch (argTypes[i])
+		{
+		case ExtCallArgDWORD:
+		case ExtCallArgUINTPTR:
+			PushOop(NewUnsigned32(value));
+			break;
+
+		case ExtCallArgSDWORD:
+		case ExtCallArgINTPTR:
+		case ExtCallArgHRESULT:
+			PushOop(NewSigned32(value));
+			break;
+
+		case ExtCallArgBOOL:
+			PushOop(value ? s_oopTrue : s_oopFalse);
+			break;
+
+		default:
+			PushArgsThroughTable(argTypes+i, argsLen-i, lpParms);
+			return;
+		}
+		lpParms += sizeof(DWORD);
+	}
+}
+
+// An LVM_SORTITEMS comparator: int CALLBACK Compare(LPARAM lParam1, LPARAM lParam2, LPARAM lParamSort)
+static const BYTE s_compareArgTypes[] = { ExtCallArgINTPTR, ExtCallArgINTPTR, ExtCallArgINTPTR };
+
+typedef int (__stdcall *CompareFn)(LPARAM, LPARAM, LPARAM);
+typedef void (*PushArgsFn)(const BYTE* argTypes, unsigned argsLen, BYTE* lpParms);
+
+static PushArgsFn s_pfnPushArgs;
+static CompareFn volatile s_pfnCompare;
+static unsigned __int64 s_nComparisons;
+
+static int __stdcall CompareDirect(LPARAM lParam1, LPARAM lParam2, LPARAM)
+{
+	return (lParam1 > lParam2) - (lParam1 < lParam2);
+}
+
+// Push the arguments, as the VM does before sending the callback to Smalltalk, and compare them there
+static int __stdcall CompareMarshalled(LPARAM lParam1, LPARAM, LPARAM)
+{
+	Oop* sp = s_pStackPointer;
+	s_pfnPushArgs(s_compareArgTypes, sizeof(s_compareArgTypes), reinterpret_cast<BYTE*>(&lParam1));
+	const int arg1 = SmallIntegerValue(sp[1]);
+	const int arg2 = SmallIntegerValue(sp[2]);
+	s_pStackPointer = sp;
+	return (arg1 > arg2) - (arg1 < arg2);
+}
+
+struct CompareThrough
+{
+	bool operator()(LPARAM a, LPARAM b) const
+	{
+		s_nComparisons++;
+		return s_pfnCompare(a, b, 0) < 0;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+static unsigned s_nCalls;
+static unsigned s_nSortElements;
+static LARGE_INTEGER s_freq;
+
+static double NanosecondsPerCall(const LARGE_INTEGER& start, const LARGE_INTEGER& end)
+{
+	return double(end.QuadPart - start.QuadPart) * 1.0e9 / s_freq.QuadPart / s_nCalls;
+}
+
+// Answer false if the two ways of calling disagree
+static bool Run(BYTE argType, const char* typeName, unsigned argCount)
+{
+	Descriptor descriptor;
+	descriptor.m_proc = TargetFor(argCount);
+	descriptor.m_return = ExtCallArgDWORD;
+	descriptor.m_argsLen = static_cast<BYTE>(argCount);
+
+	s_stack[0] = s_oopNil;
+	for (unsigned i=0;i<argCount;i++)
+	{
+		descriptor.m_args[i] = argType;
+		switch (argType)
+		{
+		case ExtCallArgBOOL:
+			s_stack[1+i] = s_oopTrue;
+			break;
+		case ExtCallArgLPVOID:
+			s_stack[1+i] = s_oopNil;
+			break;
+		default:
+			s_stack[1+i] = SmallInteger(1000+i);
+			break;
+		}
+	}
+	s_pStackPointer = &s_stack[argCount];
+
+	CallStubFn pfnStub = GenerateStub(descriptor);
+	if (pfnStub == NULL)
+	{
+		fprintf(stderr, "Out of stub code space\n");
+		return false;
+	}
+
+	Oop genericResult = 0, stubResult = 0;
+	if (!GenericCall(descriptor, genericResult) || !StubCall(pfnStub, stubResult) || genericResult != stubResult)
+	{
+		fprintf(stderr, "%s x %u: generic and stub calls disagree (%08x, %08x)\n", typeName, argCount, genericResult, stubResult);
+		return false;
+	}
+
+	LARGE_INTEGER start, end;
+	volatile Oop sink = 0;
+
+	// Direct calls, through a volatile pointer so that the call is not inlined
+	FARPROC volatile proc = descriptor.m_proc;
+	DWORD args[MaxArgs] = { 1, 2, 3, 4 };
+	::QueryPerformanceCounter(&start);
+	for (unsigned i=0;i<s_nCalls;i++)
+	{
+		switch (argCount)
+		{
+		case 1:
+			sink = reinterpret_cast<DWORD (__stdcall*)(DWORD)>(proc)(args[0]);
+			break;
+		case 2:
+			sink = reinterpret_cast<DWORD (__stdcall*)(DWORD, DWORD)>(proc)(args[0], args[1]);
+			break;
+		default:
+			sink = reinterpret_cast<DWORD (__stdcall*)(DWORD, DWORD, DWORD, DWORD)>(proc)(args[0], args[1], args[2], args[3]);
+			break;
+		}
+	}
+	::QueryPerformanceCounter(&end);
+	const double direct = NanosecondsPerCall(start, end);
+
+	Oop result;
+	::QueryPerformanceCounter(&start);
+	for (unsigned i=0;i<s_nCalls;i++)
+	{
+		GenericCall(descriptor, result);
+		sink = result;
+	}
+	::QueryPerformanceCounter(&end);
+	const double generic = NanosecondsPerCall(start, end);
+
+	::QueryPerformanceCounter(&start);
+	for (unsigned i=0;i<s_nCalls;i++)
+	{
+		StubCall(pfnStub, result);
+		sink = result;
+	}
+	::QueryPerformanceCounter(&end);
+	const double stub = NanosecondsPerCall(start, end);
+
+	printf("%-8s %4u %10.2f %10.2f %10.2f %8.2f\n", typeName, argCount, direct, generic, stub, generic / stub);
+	return true;
+}
+
+// Sort the values with the comparator, answering false if they are not sorted correctly
+static bool Sort(const char* name, const LPARAM* values, LPARAM* work, CompareFn pfnCompare)
+{
+	Oop stack[1+MaxArgs];
+	s_pStackPointer = &stack[0];
+	memcpy(work, values, s_nSortElements*sizeof(LPARAM));
+	s_pfnCompare = pfnCompare;
+	s_nComparisons = 0;
+
+	LARGE_INTEGER start, end;
+	::QueryPerformanceCounter(&start);
+	std::sort(work, work+s_nSortElements, CompareThrough());
+	::QueryPerformanceCounter(&end);
+
+	for (unsigned i=1;i<s_nSortElements;i++)
+	{
+		if (work[i-1] > work[i])
+		{
+			fprintf(stderr, "%s: sorted incorrectly\n", name);
+			return false;
+		}
+	}
+
+	const double secs = double(end.QuadPart - start.QuadPart) / s_freq.QuadPart;
+	printf("%-8s %10.2f %10I64u %10.2f\n", name, secs * 1000.0, s_nComparisons, secs * 1.0e9 / s_nComparisons);
+	return true;
+}
+
+static bool RunCallbacks()
+{
+	LPARAM* values = new LPARAM[s_nSortElements];
+	LPARAM* work = new LPARAM[s_nSortElements];
+	// Pseudo-random values in SmallInteger range, the same for each run
+	DWORD seed = 1;
+	for (unsigned i=0;i<s_nSortElements;i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		values[i] = (seed >> 2) & 0x1FFFFFFF;
+	}
+
+	printf("\nSort of %u elements with an LVM_SORTITEMS comparator\n", s_nSortElements);
+	printf("%-8s %10s %10s %10s\n", "args", "mS", "compares", "nS/compare");
+	bool bOk = Sort("none", values, work, CompareDirect);
+	s_pfnPushArgs = PushArgsThroughTable;
+	if (!Sort("table", values, work, CompareMarshalled))
+		bOk = false;
+	s_pfnPushArgs = PushArgsInline;
+	if (!Sort("inline", values, work, CompareMarshalled))
+		bOk = false;
+
+	delete[] work;
+	delete[] values;
+	return bOk;
+}
+
+int __cdecl main(int argc, char* argv[])
+{
+	s_nCalls = 10000000;
+	s_nSortElements = 1000000;
+
+	for (int i=1;i<argc;i++)
+	{
+		if (strcmp(argv[i], "-n") == 0 && i+1 < argc)
+			s_nCalls = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-s") == 0 && i+1 < argc)
+			s_nSortElements = atoi(argv[++i]);
+		else
+		{
+			fprintf(stderr, "Usage: CallStubBench [-n <calls per descriptor>] [-s <elements to sort>]\n");
+			return 1;
+		}
+	}
+	if (s_nCalls < 1 || s_nSortElements < 1)
+	{
+		fprintf(stderr, "The numbers of calls and of elements to sort must be at least 1\n");
+		return 1;
+	}
+
+	s_oopNil = Oop(&s_objects[0]);
+	s_oopTrue = Oop(&s_objects[sizeof(DWORD)]);
+	s_oopFalse = Oop(&s_objects[2*sizeof(DWORD)]);
+	InitializeConverters();
+	InitializeMarshalers();
+
+	s_pStubCode = static_cast<BYTE*>(::VirtualAlloc(NULL, StubCodeSize, MEM_RESERVE|MEM_COMMIT, PAGE_EXECUTE_READWRITE));
+	if (s_pStubCode == NULL)
+	{
+		fprintf(stderr, "Unable to allocate stub code space\n");
+		return 1;
+	}
+	s_pStubFree = s_pStubCode;
+
+	static const struct { BYTE m_type; const char* m_name; } types[] =
+	{
+		{ ExtCallArgDWORD, "DWORD" },
+		{ ExtCallArgBOOL, "BOOL" },
+		{ ExtCallArgHANDLE, "HANDLE" },
+		{ ExtCallArgLPVOID, "LPVOID" },
+	};
+	static const unsigned argCounts[] = { 1, 2, 4 };
+
+	::QueryPerformanceFrequency(&s_freq);
+	printf("%u calls per descriptor, nS per call\n", s_nCalls);
+	printf("%-8s %4s %10s %10s %10s %8s\n", "type", "args", "direct", "generic", "stub", "speedup");
+	int ret = 0;
+	for (unsigned i=0;i<sizeof(types)/sizeof(types[0]);i++)
+	{
+		for (unsigned j=0;j<sizeof(argCounts)/sizeof(argCounts[0]);j++)
+		{
+			if (!Run(types[i].m_type, types[i].m_name, argCounts[j]))
+				ret = 1;
+		}
+	}
+
+	::VirtualFree(s_pStubCode, 0, MEM_RELEASE);
+
+	if (!RunCallbacks())
+		ret = 1;
+	return ret;
+}
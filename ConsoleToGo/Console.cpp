@@ -45,8 +45,15 @@ HRESULT __stdcall ErrorUnableToCreateVM(HRESULT hr)
 	return hr;
 }
 
+// See WorkerPool.cpp
+int __stdcall RunWorkerPool(unsigned nWorkers);
+
 int __cdecl main(int argc, char* argv[])
 {
+	// <stub>.exe -workers <n> ... runs n copies of the application under a supervisor
+	if (argc > 2 && _stricmp(argv[1], "-workers") == 0)
+		return RunWorkerPool(atoi(argv[2]));
+
 	// The VM is created through COM, or if TO GO may still be needed to load compiler
 	::CoInitialize(NULL);
  	HRESULT hr = RunEmbeddedImage(GetResLibHandle(), IDR_IMAGE);
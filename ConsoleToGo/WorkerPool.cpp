@@ -0,0 +1,321 @@
+/******************************************************************************
+
+	File: WorkerPool.cpp
+
+	Description:
+
+	Supervisor for a pool of worker processes, for running many instances of
+	a console application in parallel, e.g. to serve stateless requests.
+	When started as:
+
+		<stub>.exe -workers <n> <arguments>
+
+	the stub does not run its image itself, but starts n copies of itself with
+	the remaining arguments, each with the environment variable DOLPHINWORKER
+	set to its index (from 0), by which the image's startup can select its
+	worker entry point. The standard output of each worker is a pipe back to
+	the supervisor, which copies it line by line, prefixed with the worker
+	index, to its own standard output. A worker that exits with a non-zero
+	exit code is restarted. The supervisor exits once all the workers have
+	exited normally.
+
+	A worker is considered to have warmed up when it reports its first line,
+	at which point its private memory and working set are measured and
+	reported on standard error. The total and average over the workers are
+	reported when the supervisor exits.
+
+	Windows has no fork(), so the workers cannot share one loaded heap copy on
+	write, and each loads and privately holds the whole image by default.
+	Demand loading (see LazyLoad.cpp) reduces this only for byte objects of
+	at least the size in the ObjMem\LazyLoadThreshold registry value, and
+	only when that value is set; pointer objects are always loaded. Whether
+	it is enabled is reported on startup.
+
+******************************************************************************/
+#include "ist.h"
+#include "regkey.h"
+
+#include <process.h>
+#include <psapi.h>
+
+#pragma comment(lib, "psapi.lib")
+
+static const char WorkerEnvironmentVariable[] = "DOLPHINWORKER";
+static const DWORD MinWorkerLifetime = 1000;	// Failing workers are not restarted more often than this (mS)
+
+struct Worker
+{
+	unsigned	m_index;
+	HANDLE		m_hProcess;
+	HANDLE		m_hOutput;					// Read end of the pipe from the worker's standard output
+	HANDLE		m_hReader;					// Thread copying the output
+	DWORD		m_dwStarted;				// Tick count when last started
+	SIZE_T		m_cbPrivate;				// Memory after the last warm-up, or 0 if the worker has never warmed up
+	SIZE_T		m_cbWorkingSet;
+};
+
+static CRITICAL_SECTION s_csOutput;
+
+static void ReportMemory(Worker& worker)
+{
+	PROCESS_MEMORY_COUNTERS_EX pmc;
+	if (!::GetProcessMemoryInfo(worker.m_hProcess, reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&pmc), sizeof(pmc)))
+		return;
+
+	::EnterCriticalSection(&s_csOutput);
+	worker.m_cbPrivate = pmc.PrivateUsage;
+	worker.m_cbWorkingSet = pmc.WorkingSetSize;
+	fprintf(stderr, "Worker %u: %u Kb private, %u Kb working set after warm-up\n",
+		worker.m_index, pmc.PrivateUsage/1024, pmc.WorkingSetSize/1024);
+	::LeaveCriticalSection(&s_csOutput);
+}
+
+static void ReportLine(const Worker& worker, const char* szLine)
+{
+	::EnterCriticalSection(&s_csOutput);
+	printf("[%u] %s\n", worker.m_index, szLine);
+	fflush(stdout);
+	::LeaveCriticalSection(&s_csOutput);
+}
+
+// Report the total and average warm-up memory of the workers that have warmed up
+static void ReportMemorySummary(const Worker* workers, unsigned nWorkers)
+{
+	unsigned nWarm = 0;
+	unsigned __int64 cbPrivate = 0, cbWorkingSet = 0;
+	for (unsigned i=0;i<nWorkers;i++)
+	{
+		if (workers[i].m_cbPrivate != 0)
+		{
+			nWarm++;
+			cbPrivate += workers[i].m_cbPrivate;
+			cbWorkingSet += workers[i].m_cbWorkingSet;
+		}
+	}
+	if (nWarm == 0)
+		return;
+
+	fprintf(stderr, "%u workers: %I64u Kb private (%I64u Kb each), %I64u Kb working set (%I64u Kb each) after warm-up\n",
+		nWarm, cbPrivate/1024, cbPrivate/1024/nWarm, cbWorkingSet/1024, cbWorkingSet/1024/nWarm);
+}
+
+// Report whether the workers will demand load cold objects, which is the only reduction in their
+// private memory over each holding the entire image
+static void ReportLazyLoading()
+{
+	CRegKey rkObjMem;
+	DWORD dwThreshold = 0;
+	if (OpenDolphinKey(rkObjMem, "ObjMem", KEY_READ) == ERROR_SUCCESS)
+		rkObjMem.QueryDWORDValue("LazyLoadThreshold", dwThreshold);
+	if (dwThreshold == 0)
+		fprintf(stderr, "Demand loading is disabled (ObjMem\\LazyLoadThreshold is not set), so each worker holds the entire image\n");
+	else
+		fprintf(stderr, "Byte objects of %u bytes or more are demand loaded, all other objects are held by each worker\n", dwThreshold);
+}
+
+// Worker output thread. Lines longer than the buffer are split.
+static unsigned __stdcall ReadWorkerOutput(void* pv)
+{
+	Worker& worker = *static_cast<Worker*>(pv);
+	bool bWarm = false;
+	char line[1024];
+	size_t len = 0;
+	char buf[4096];
+	DWORD cbRead;
+	while (::ReadFile(worker.m_hOutput, buf, sizeof(buf), &cbRead, NULL) && cbRead != 0)
+	{
+		for (DWORD i=0;i<cbRead;i++)
+		{
+			if (buf[i] != '\n')
+			{
+				line[len++] = buf[i];
+				if (len < sizeof(line)-1)
+					continue;
+			}
+
+			if (len > 0 && line[len-1] == '\r')
+				len--;
+			line[len] = 0;
+			len = 0;
+			ReportLine(worker, line);
+
+			if (!bWarm)
+			{
+				bWarm = true;
+				ReportMemory(worker);
+			}
+		}
+	}
+
+	if (len > 0)
+	{
+		line[len] = 0;
+		ReportLine(worker, line);
+	}
+
+	return 0;
+}
+
+static bool StartWorker(Worker& worker, const char* szCommandLine)
+{
+	SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+	HANDLE hRead, hWrite;
+	if (!::CreatePipe(&hRead, &hWrite, &sa, 0))
+		return false;
+	// Only the write end is to be inherited by the worker
+	::SetHandleInformation(hRead, HANDLE_FLAG_INHERIT, 0);
+
+	// The worker inherits the supervisor's environment
+	char szIndex[16];
+	_itoa_s(worker.m_index, szIndex, 10);
+	::SetEnvironmentVariable(WorkerEnvironmentVariable, szIndex);
+
+	STARTUPINFO si = { sizeof(si) };
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdInput = ::GetStdHandle(STD_INPUT_HANDLE);
+	si.hStdOutput = hWrite;
+	si.hStdError = ::GetStdHandle(STD_ERROR_HANDLE);
+
+	// CreateProcess may modify the command line
+	char* szCmd = _strdup(szCommandLine);
+	PROCESS_INFORMATION pi;
+	BOOL bStarted = ::CreateProcess(NULL, szCmd, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi);
+	free(szCmd);
+	::CloseHandle(hWrite);
+	if (!bStarted)
+	{
+		::CloseHandle(hRead);
+		return false;
+	}
+
+	::CloseHandle(pi.hThread);
+	worker.m_hProcess = pi.hProcess;
+	worker.m_hOutput = hRead;
+	worker.m_dwStarted = ::GetTickCount();
+	worker.m_hReader = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, ReadWorkerOutput, &worker, 0, NULL));
+	return true;
+}
+
+// The worker has exited, so wait for the remainder of its output, and release it
+static void ReleaseWorker(Worker& worker)
+{
+	if (worker.m_hReader != NULL)
+	{
+		::WaitForSingleObject(worker.m_hReader, INFINITE);
+		::CloseHandle(worker.m_hReader);
+		worker.m_hReader = NULL;
+	}
+	::CloseHandle(worker.m_hOutput);
+	worker.m_hOutput = NULL;
+	::CloseHandle(worker.m_hProcess);
+	worker.m_hProcess = NULL;
+}
+
+// Answer the command line for the workers, i.e. the full path of this executable followed by the
+// arguments after the -workers switch and its count
+static char* WorkerCommandLine()
+{
+	// Skip the program name, the switch, and the count, respecting quotes
+	const char* p = ::GetCommandLine();
+	for (int i=0;i<3;i++)
+	{
+		while (*p == ' ' || *p == '\t')
+			p++;
+		bool bQuoted = false;
+		while (*p && (bQuoted || (*p != ' ' && *p != '\t')))
+		{
+			if (*p == '"')
+				bQuoted = !bQuoted;
+			p++;
+		}
+	}
+
+	char szModule[_MAX_PATH];
+	::GetModuleFileName(NULL, szModule, _MAX_PATH);
+	const size_t cch = strlen(szModule) + strlen(p) + 3;
+	char* szCommandLine = static_cast<char*>(malloc(cch));
+	sprintf_s(szCommandLine, cch, "\"%s\"%s", szModule, p);
+	return szCommandLine;
+}
+
+// Run the supervisor for the specified number of workers. Answers the process exit code.
+int __stdcall RunWorkerPool(unsigned nWorkers)
+{
+	if (nWorkers < 1 || nWorkers > MAXIMUM_WAIT_OBJECTS)
+	{
+		fprintf(stderr, "The number of workers must be between 1 and %d\n", MAXIMUM_WAIT_OBJECTS);
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	::InitializeCriticalSection(&s_csOutput);
+	char* szCommandLine = WorkerCommandLine();
+	ReportLazyLoading();
+
+	Worker workers[MAXIMUM_WAIT_OBJECTS];
+	unsigned nRunning = 0;
+	for (unsigned i=0;i<nWorkers;i++)
+	{
+		Worker& worker = workers[i];
+		memset(&worker, 0, sizeof(worker));
+		worker.m_index = i;
+		if (StartWorker(worker, szCommandLine))
+			nRunning++;
+		else
+			fprintf(stderr, "Unable to start worker %u (%u)\n", i, ::GetLastError());
+	}
+
+	int exitCode = 0;
+	while (nRunning > 0)
+	{
+		HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+		Worker* running[MAXIMUM_WAIT_OBJECTS];
+		DWORD nHandles = 0;
+		for (unsigned i=0;i<nWorkers;i++)
+		{
+			if (workers[i].m_hProcess != NULL)
+			{
+				handles[nHandles] = workers[i].m_hProcess;
+				running[nHandles] = &workers[i];
+				nHandles++;
+			}
+		}
+
+		DWORD dwWait = ::WaitForMultipleObjects(nHandles, handles, FALSE, INFINITE);
+		if (dwWait >= WAIT_OBJECT_0 + nHandles)
+		{
+			exitCode = ::GetLastError();
+			break;
+		}
+
+		Worker& worker = *running[dwWait - WAIT_OBJECT_0];
+		DWORD dwExitCode;
+		::GetExitCodeProcess(worker.m_hProcess, &dwExitCode);
+		const DWORD dwLifetime = ::GetTickCount() - worker.m_dwStarted;
+		ReleaseWorker(worker);
+
+		if (dwExitCode == 0)
+		{
+			nRunning--;
+			continue;
+		}
+
+		::EnterCriticalSection(&s_csOutput);
+		fprintf(stderr, "Worker %u failed with exit code %#x, restarting\n", worker.m_index, dwExitCode);
+		::LeaveCriticalSection(&s_csOutput);
+
+		// Avoid spinning on a worker that fails immediately
+		if (dwLifetime < MinWorkerLifetime)
+			::Sleep(MinWorkerLifetime - dwLifetime);
+
+		if (!StartWorker(worker, szCommandLine))
+		{
+			fprintf(stderr, "Unable to restart worker %u (%u)\n", worker.m_index, ::GetLastError());
+			nRunning--;
+		}
+	}
+
+	ReportMemorySummary(workers, nWorkers);
+	free(szCommandLine);
+	::DeleteCriticalSection(&s_csOutput);
+	return exitCode;
+}
@@ -0,0 +1,543 @@
+/******************************************************************************
+
+	File: DeltaImage.cpp
+
+	Description:
+
+	Incremental (delta) image support. A delta image records only the objects
+	which have been freed, created or changed since its base image (which may
+	itself be a delta) was saved. Changes are detected by comparing a digest
+	of each object against the digests taken when the base was loaded or saved.
+	On load a chain of deltas is folded back onto its base in memory, and the
+	result loaded as a normal image. The same fold can be written out as a
+	full image (see FoldImageChain).
+
+******************************************************************************/
+#include "ist.h"
+#include <io.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "binstream.h"
+#include "zbinstream.h"
+#include "blockbinstream.h"
+#include "objmem.h"
+#include "interprt.h"
+#include "rc_vm.h"
+#include "regkey.h"
+
+#if !defined(DELTAIMAGES)
+	#error Incremental images are not supported by this VM
+#endif
+
+#ifndef _DEBUG
+	#pragma optimize("s", on)
+	#pragma auto_inline(off)
+#endif
+
+ObjectMemory::DeltaDigest*	ObjectMemory::m_pDeltaDigests;
+unsigned	ObjectMemory::m_nDeltaDigests;
+DWORD		ObjectMemory::m_dwDeltaBaseChecksum;
+char		ObjectMemory::m_szDeltaBase[_MAX_PATH];
+
+///////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+// Answer the entire contents of the named file in a new buffer, or NULL if it cannot be read
+static BYTE* ReadImageFile(const char* szFileName, UINT& cbSize)
+{
+	int fd;
+	if (::_sopen_s(&fd, szFileName, _O_RDONLY|_O_BINARY|_O_SEQUENTIAL, _SH_DENYWR, _S_IREAD) != 0)
+		return NULL;
+
+	long cbFile = ::_filelength(fd);
+	BYTE* pBytes = NULL;
+	if (cbFile > long(sizeof(ISTImageHeader)))
+	{
+		pBytes = new BYTE[cbFile];
+		if (::_read(fd, pBytes, cbFile) != cbFile)
+		{
+			delete[] pBytes;
+			pBytes = NULL;
+		}
+	}
+	::_close(fd);
+
+	cbSize = cbFile;
+	return pBytes;
+}
+
+inline DWORD ImageChecksum(const BYTE* pBytes, UINT cbSize)
+{
+	return adler32(adler32(0L, Z_NULL, 0), pBytes, cbSize);
+}
+
+inline ImageHeader* ImageHeaderOf(BYTE* pImageBytes)
+{
+	return &reinterpret_cast<ISTImageHeader*>(pImageBytes)->header;
+}
+
+inline DeltaImageHeader* DeltaHeaderOf(BYTE* pImageBytes)
+{
+	return reinterpret_cast<DeltaImageHeader*>(pImageBytes + sizeof(ISTImageHeader));
+}
+
+// Read the base image of the specified delta, trying first the full path recorded in the delta,
+// and then the same file name in the delta's own directory (so that chains can be moved together)
+static BYTE* ReadBaseImageFile(const char* szDeltaName, const char* szBaseName, UINT& cbSize)
+{
+	BYTE* pBytes = ReadImageFile(szBaseName, cbSize);
+	if (pBytes == NULL)
+	{
+		char drive[_MAX_DRIVE];
+		char dir[_MAX_DIR];
+		char fname[_MAX_FNAME];
+		char ext[_MAX_EXT];
+		char szLocalName[_MAX_PATH];
+		_splitpath_s(szDeltaName, drive, _MAX_DRIVE, dir, _MAX_DIR, NULL, 0, NULL, 0);
+		_splitpath_s(szBaseName, NULL, 0, NULL, 0, fname, _MAX_FNAME, ext, _MAX_EXT);
+		_makepath_s(szLocalName, _MAX_PATH, drive, dir, fname, ext);
+		pBytes = ReadImageFile(szLocalName, cbSize);
+	}
+	return pBytes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Change tracking
+
+// Answer a digest of the saved form of an object, i.e. its OTE (excluding the GC mark and, other
+// than for virtual objects, its location) and its body. Never answers 0 (absent) or DeltaFreedDigest.
+// An object whose digest is unchanged is left out of the next delta, so a collision would silently
+// lose a change. The digest therefore combines a CRC-32 and an Adler-32 of the same bytes, which are
+// computed by unrelated arithmetic, so that a change must defeat both to go unnoticed, i.e. one in
+// about 2^64 rather than 2^32 for a CRC alone.
+ObjectMemory::DeltaDigest __fastcall ObjectMemory::ObjectDigest(const OTE* ote)
+{
+	OTE saved = *ote;
+	saved.m_flags.m_mark = 0;
+	if (saved.heapSpace() != OTEFlags::VirtualSpace)
+		saved.m_location = NULL;
+
+	const Bytef* pBody = static_cast<const Bytef*>(ote->m_location);
+	const MWORD cbBody = ote->sizeOf();
+	uLong crc = crc32(0L, reinterpret_cast<const Bytef*>(&saved), sizeof(OTE));
+	crc = crc32(crc, pBody, cbBody);
+	uLong adler = adler32(adler32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(&saved), sizeof(OTE));
+	adler = adler32(adler, pBody, cbBody);
+
+	const DeltaDigest digest = DeltaDigest(crc) << 32 | adler;
+	return digest > DeltaFreedDigest ? digest : digest + 2;
+}
+
+// Called before the objects in an image are loaded to allocate the digest table, if enabled.
+// Tracking costs 8 bytes per OT entry, and a digest of every object on each save.
+void __stdcall ObjectMemory::BeginDeltaBaseline(unsigned nTableSize)
+{
+	delete[] m_pDeltaDigests;
+	m_pDeltaDigests = NULL;
+	m_nDeltaDigests = 0;
+
+	CRegKey rkObjMem;
+	DWORD dwEnabled = 0;
+	if (OpenDolphinKey(rkObjMem, "ObjMem", KEY_READ) == ERROR_SUCCESS)
+		rkObjMem.QueryDWORDValue("DeltaImages", dwEnabled);
+	if (!dwEnabled)
+		return;
+
+	m_pDeltaDigests = new DeltaDigest[nTableSize];
+	memset(m_pDeltaDigests, 0, nTableSize*sizeof(DeltaDigest));
+	m_nDeltaDigests = nTableSize;
+}
+
+// Called after an image has been loaded to record the digests of the loaded objects and the identity
+// of the image file. Entries freed during the load (i.e. the image stamp) are already marked.
+void __stdcall ObjectMemory::EndDeltaBaseline(const char* szImageName, const BYTE* pImageBytes, UINT imageSize)
+{
+	for (unsigned i=0;i<m_nDeltaDigests;i++)
+	{
+		const OTE* ote = m_pOT+i;
+		if (!ote->isFree())
+			m_pDeltaDigests[i] = ObjectDigest(ote);
+	}
+
+	m_dwDeltaBaseChecksum = ImageChecksum(pImageBytes, imageSize);
+	if (!_fullpath(m_szDeltaBase, szImageName, _MAX_PATH))
+		strncpy_s(m_szDeltaBase, _MAX_PATH, szImageName, _TRUNCATE);
+}
+
+// Called after an image has been successfully saved to make it the base for the next delta.
+void __stdcall ObjectMemory::AcceptDeltaDigests(DeltaDigest* pDigests, unsigned nTableSize, const char* szImageName)
+{
+	if (pDigests == NULL)
+		return;
+
+	delete[] m_pDeltaDigests;
+	m_pDeltaDigests = pDigests;
+	m_nDeltaDigests = nTableSize;
+
+	// The file is read back to checksum it, since compressed images are written via zlib
+	UINT cbSize;
+	BYTE* pBytes = ReadImageFile(szImageName, cbSize);
+	if (pBytes == NULL)
+	{
+		// Can't identify the base, so deltas can't be saved until the next full save
+		trace("Unable to read back '%s', incremental saves disabled\n", szImageName);
+		delete[] m_pDeltaDigests;
+		m_pDeltaDigests = NULL;
+		m_nDeltaDigests = 0;
+		return;
+	}
+
+	m_dwDeltaBaseChecksum = ImageChecksum(pBytes, cbSize);
+	delete[] pBytes;
+	if (!_fullpath(m_szDeltaBase, szImageName, _MAX_PATH))
+		strncpy_s(m_szDeltaBase, _MAX_PATH, szImageName, _TRUNCATE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Folding of delta chains
+
+// A base image with a chain of deltas applied, held in memory. The body of each object remains
+// in the buffer of the file from which it was read. The object pointers in the bodies of all
+// objects are relative to the base pointer of the base image.
+class FoldedImage
+{
+public:
+	enum { MaxChain = 64 };
+
+	ImageHeader	m_header;
+	OTE*		m_pOT;
+	BYTE**		m_pBodies;
+
+private:
+	unsigned	m_nCapacity;
+	BYTE*		m_buffers[MaxChain+2];
+	int			m_nBuffers;
+
+public:
+	FoldedImage() : m_pOT(NULL), m_pBodies(NULL), m_nCapacity(0), m_nBuffers(0)
+	{
+		memset(&m_header, 0, sizeof(m_header));
+	}
+
+	~FoldedImage()
+	{
+		delete[] m_pOT;
+		delete[] m_pBodies;
+		for (int i=0;i<m_nBuffers;i++)
+			delete[] m_buffers[i];
+	}
+
+	HRESULT Fold(const char* szImageName, const BYTE* pImageBytes, UINT imageSize);
+	BYTE* Serialize(UINT& cbSize) const;
+
+private:
+	HRESULT LoadBase(BYTE* pBytes, UINT cbSize);
+	HRESULT LoadBase(ibinstream& imageFile);
+	HRESULT ApplyDelta(const char* szDeltaName, BYTE* pBytes, UINT cbSize);
+	void Grow(unsigned nTableSize);
+	BYTE* Own(BYTE* pBytes) { m_buffers[m_nBuffers++] = pBytes; return pBytes; }
+
+	static MWORD SavedSize(const OTE& ote)
+	{
+		return ote.sizeOf() + (ote.heapSpace() == OTEFlags::VirtualSpace ? sizeof(VirtualObjectHeader) : 0);
+	}
+};
+
+void FoldedImage::Grow(unsigned nTableSize)
+{
+	if (nTableSize <= m_nCapacity)
+		return;
+
+	OTE* pOT = new OTE[nTableSize];
+	BYTE** pBodies = new BYTE*[nTableSize];
+	if (m_nCapacity > 0)
+	{
+		memcpy(pOT, m_pOT, m_nCapacity*sizeof(OTE));
+		memcpy(pBodies, m_pBodies, m_nCapacity*sizeof(BYTE*));
+	}
+	for (unsigned i=m_nCapacity;i<nTableSize;i++)
+	{
+		memset(pOT+i, 0, sizeof(OTE));
+		pOT[i].beFree();
+		pBodies[i] = NULL;
+	}
+
+	delete[] m_pOT;
+	delete[] m_pBodies;
+	m_pOT = pOT;
+	m_pBodies = pBodies;
+	m_nCapacity = nTableSize;
+}
+
+HRESULT FoldedImage::Fold(const char* szImageName, const BYTE* pImageBytes, UINT imageSize)
+{
+	// Deltas are patched in place, so even the image passed in (which is usually mapped read-only)
+	// must be copied
+	const char* names[MaxChain+1];
+	char baseNames[MaxChain][_MAX_PATH];
+	BYTE* chain[MaxChain+1];
+	UINT sizes[MaxChain+1];
+
+	names[0] = szImageName;
+	chain[0] = Own(new BYTE[imageSize]);
+	memcpy(chain[0], pImageBytes, imageSize);
+	sizes[0] = imageSize;
+
+	int nDeltas = 0;
+	while (ImageHeaderOf(chain[nDeltas])->flags.bIsDelta)
+	{
+		if (nDeltas == MaxChain || sizes[nDeltas] < sizeof(ISTImageHeader)+sizeof(DeltaImageHeader))
+			return ReportError(IDP_IMAGEFILETRUNCATED);
+
+		const DeltaImageHeader* pDelta = DeltaHeaderOf(chain[nDeltas]);
+		strncpy_s(baseNames[nDeltas], _MAX_PATH, pDelta->szBaseImage, _TRUNCATE);
+
+		UINT cbBase;
+		BYTE* pBase = ReadBaseImageFile(names[nDeltas], baseNames[nDeltas], cbBase);
+		if (pBase == NULL)
+			return ReportError(IDP_DELTABASEMISSING, baseNames[nDeltas], names[nDeltas]);
+		Own(pBase);
+
+		if (ImageChecksum(pBase, cbBase) != pDelta->dwBaseChecksum)
+			return ReportError(IDP_DELTABASEMISMATCH, names[nDeltas], baseNames[nDeltas]);
+
+		nDeltas++;
+		names[nDeltas] = baseNames[nDeltas-1];
+		chain[nDeltas] = pBase;
+		sizes[nDeltas] = cbBase;
+	}
+
+	HRESULT hr = LoadBase(chain[nDeltas], sizes[nDeltas]);
+	while (SUCCEEDED(hr) && nDeltas-- > 0)
+		hr = ApplyDelta(names[nDeltas], chain[nDeltas], sizes[nDeltas]);
+
+	return hr;
+}
+
+// Read the OT and object bodies of a full image
+HRESULT FoldedImage::LoadBase(BYTE* pBytes, UINT cbSize)
+{
+	m_header = *ImageHeaderOf(pBytes);
+	Grow(m_header.nTableSize);
+
+	const int offset = sizeof(ISTImageHeader);
+	if (m_header.flags.bIsCompressed)
+	{
+		zibinstream stream(pBytes + offset, cbSize - offset);
+		HRESULT hr = LoadBase(stream);
+		stream.close();
+		return hr;
+	}
+	else if (m_header.flags.bIsBlockCompressed)
+	{
+		blockibinstream stream(pBytes + offset, cbSize - offset);
+		return stream.good() 
+			? LoadBase(stream)
+			: ReportError(IDP_IMAGEREADERROR, stream.fail());
+	}
+	else
+	{
+		imbinstream stream(pBytes + offset, cbSize - offset);
+		return LoadBase(stream);
+	}
+}
+
+HRESULT FoldedImage::LoadBase(ibinstream& imageFile)
+{
+	if (!imageFile.read(m_pOT, m_header.nTableSize*sizeof(OTE)))
+		return ReportError(IDP_IMAGEFILETRUNCATED);
+
+	size_t cbData = 0;
+	for (unsigned i=0;i<m_header.nTableSize;i++)
+	{
+		if (!m_pOT[i].isFree())
+			cbData += SavedSize(m_pOT[i]);
+	}
+
+	BYTE* pData = Own(new BYTE[cbData]);
+	size_t nCheckSum;
+	if (!imageFile.read(pData, cbData) || !imageFile.read(&nCheckSum, sizeof(nCheckSum)))
+		return ReportError(IDP_IMAGEFILETRUNCATED);
+	if (nCheckSum != cbData)
+		return ReportError(IDP_CORRUPTIMAGE, cbData, nCheckSum);
+
+	for (unsigned i=0;i<m_header.nTableSize;i++)
+	{
+		if (!m_pOT[i].isFree())
+		{
+			m_pBodies[i] = pData;
+			pData += SavedSize(m_pOT[i]);
+		}
+	}
+
+	return S_OK;
+}
+
+// Apply the freed and changed object records of a delta, rebasing the object pointers in the
+// changed objects to the base pointer of the base image.
+HRESULT FoldedImage::ApplyDelta(const char* szDeltaName, BYTE* pBytes, UINT cbSize)
+{
+	const ImageHeader* pHeader = ImageHeaderOf(pBytes);
+	const DeltaImageHeader* pDelta = DeltaHeaderOf(pBytes);
+	if (pDelta->nBaseTableSize != m_header.nTableSize)
+		return ReportError(IDP_DELTABASEMISMATCH, szDeltaName, pDelta->szBaseImage);
+
+	const Oop oldBase = Oop(pHeader->BasePointer);
+	const Oop newBase = Oop(m_header.BasePointer);
+	Grow(pHeader->nTableSize);
+
+	BYTE* pNext = reinterpret_cast<BYTE*>(DeltaHeaderOf(pBytes)+1);
+	const BYTE* pEnd = pBytes + cbSize;
+
+	const DWORD* pFreed = reinterpret_cast<const DWORD*>(pNext);
+	pNext += pDelta->nFreed*sizeof(DWORD);
+	if (pNext > pEnd)
+		return ReportError(IDP_IMAGEFILETRUNCATED);
+	for (unsigned i=0;i<pDelta->nFreed;i++)
+	{
+		const DWORD index = pFreed[i];
+		if (index >= m_nCapacity)
+			return ReportError(IDP_DELTABASEMISMATCH, szDeltaName, pDelta->szBaseImage);
+		m_pOT[index].beFree();
+		m_pBodies[index] = NULL;
+	}
+
+	DWORD dwDataSize = 0;
+	for (unsigned i=0;i<pDelta->nChanged;i++)
+	{
+		if (pNext + sizeof(DWORD) + sizeof(OTE) > pEnd)
+			return ReportError(IDP_IMAGEFILETRUNCATED);
+
+		const DWORD index = *reinterpret_cast<const DWORD*>(pNext);
+		OTE& ote = *reinterpret_cast<OTE*>(pNext + sizeof(DWORD));
+		BYTE* pBody = pNext + sizeof(DWORD) + sizeof(OTE);
+		const MWORD cbBody = SavedSize(ote);
+		pNext = pBody + cbBody;
+		if (pNext > pEnd)
+			return ReportError(IDP_IMAGEFILETRUNCATED);
+		if (index >= pHeader->nTableSize)
+			return ReportError(IDP_CORRUPTIMAGE, index, pHeader->nTableSize);
+		dwDataSize += sizeof(DWORD) + sizeof(OTE) + cbBody;
+
+		ote.m_oteClass = reinterpret_cast<BehaviorOTE*>(Oop(ote.m_oteClass) - oldBase + newBase);
+		if (ote.isPointers())
+		{
+			Oop* pFields = reinterpret_cast<Oop*>(pBody + (cbBody - ote.sizeOf()));
+			const MWORD numFields = ote.getSize()/sizeof(Oop);
+			for (MWORD j=0;j<numFields;j++)
+			{
+				if (!isIntegerObject(pFields[j]))
+					pFields[j] = pFields[j] - oldBase + newBase;
+			}
+		}
+
+		m_pOT[index] = ote;
+		m_pBodies[index] = pBody;
+	}
+
+	if (pNext + sizeof(DWORD) > pEnd)
+		return ReportError(IDP_IMAGEFILETRUNCATED);
+	const DWORD dwCheckSum = *reinterpret_cast<const DWORD*>(pNext);
+	if (dwCheckSum != dwDataSize)
+		return ReportError(IDP_CORRUPTIMAGE, dwDataSize, dwCheckSum);
+
+	// Any entries beyond the end of the new table must have been freed by the delta
+	for (unsigned i=pHeader->nTableSize;i<m_header.nTableSize;i++)
+		ASSERT(m_pOT[i].isFree());
+
+	const LPVOID basePointer = m_header.BasePointer;
+	m_header = *pHeader;
+	m_header.BasePointer = basePointer;
+	m_header.flags.bIsDelta = false;
+	m_header.flags.bIsCompressed = false;
+	m_header.flags.bIsBlockCompressed = false;
+	return S_OK;
+}
+
+// Answer a new buffer containing the OT and object data of the folded image, in the form
+// written by SaveObjectTable and SaveObjects
+BYTE* FoldedImage::Serialize(UINT& cbSize) const
+{
+	const unsigned nTableSize = m_header.nTableSize;
+	size_t cbData = 0;
+	for (unsigned i=0;i<nTableSize;i++)
+	{
+		if (!m_pOT[i].isFree())
+			cbData += SavedSize(m_pOT[i]);
+	}
+
+	cbSize = nTableSize*sizeof(OTE) + cbData + sizeof(DWORD);
+	BYTE* pOut = new BYTE[cbSize];
+	memcpy(pOut, m_pOT, nTableSize*sizeof(OTE));
+	BYTE* pNext = pOut + nTableSize*sizeof(OTE);
+	for (unsigned i=0;i<nTableSize;i++)
+	{
+		if (!m_pOT[i].isFree())
+		{
+			const MWORD cbBody = SavedSize(m_pOT[i]);
+			memcpy(pNext, m_pBodies[i], cbBody);
+			pNext += cbBody;
+		}
+	}
+	*reinterpret_cast<DWORD*>(pNext) = cbData;
+	return pOut;
+}
+
+#pragma code_seg(INIT_SEG)
+
+HRESULT ObjectMemory::LoadDeltaImage(const char* szImageName, BYTE* pImageBytes, UINT imageSize)
+{
+	FoldedImage image;
+	HRESULT hr = image.Fold(szImageName, pImageBytes, imageSize);
+	if (FAILED(hr))
+		return hr;
+
+	UINT cbData;
+	BYTE* pData = image.Serialize(cbData);
+	imbinstream stream(pData, cbData);
+	hr = LoadImage(stream, &image.m_header);
+	delete[] pData;
+	return hr;
+}
+
+#pragma code_seg()
+
+// Fold the named image and any chain of deltas beneath it into a single uncompressed full image
+HRESULT __stdcall ObjectMemory::FoldImageChain(const char* szImageName, const char* szOutputName)
+{
+	UINT cbSize;
+	BYTE* pBytes = ReadImageFile(szImageName, cbSize);
+	if (pBytes == NULL)
+		return HRESULT_FROM_WIN32(ERROR_OPEN_FAILED);
+
+	FoldedImage image;
+	HRESULT hr = image.Fold(szImageName, pBytes, cbSize);
+	delete[] pBytes;
+	if (FAILED(hr))
+		return hr;
+
+	UINT cbData;
+	BYTE* pData = image.Serialize(cbData);
+
+	int fd;
+	if (::_sopen_s(&fd, szOutputName, _O_WRONLY|_O_BINARY|_O_CREAT|_O_TRUNC|_O_SEQUENTIAL, _SH_DENYRW, _S_IWRITE|_S_IREAD) != 0)
+		hr = HRESULT_FROM_WIN32(ERROR_OPEN_FAILED);
+	else
+	{
+		if (::_write(fd, ISTHDRTYPE, sizeof(ISTHDRTYPE)) != sizeof(ISTHDRTYPE)
+				|| ::_write(fd, &image.m_header, sizeof(ImageHeader)) != sizeof(ImageHeader)
+				|| ::_write(fd, pData, cbData) != int(cbData))
+			hr = HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+		::_close(fd);
+	}
+
+	delete[] pData;
+	return hr;
+}
+
+// Exported so that delta chains can be compacted from the image or an external tool
+extern "C" HRESULT __stdcall FoldImageChain(const char* szImageName, const char* szOutputName)
+{
+	return ObjectMemory::FoldImageChain(szImageName, szOutputName);
+}
@@ -0,0 +1,426 @@
+/******************************************************************************
+
+	File: ExtCallStubs.cpp
+
+	Description:
+
+	Specialised machine code stubs for external library calls.
+
+	The generic external call routine (callExternalFunction in ExternalCall.asm)
+	interprets the argument type codes of the call descriptor on every call,
+	dispatching through a table for each argument and for the return value.
+	For the common case of a call whose arguments and result are all plain
+	32-bit values, primitiveDLL32Call instead calls a stub generated for that
+	particular descriptor, which converts and pushes the arguments, calls the
+	function, and boxes the result with straight line code.
+
+	A stub handles only the usual representations of its arguments (e.g.
+	SmallIntegers and nil for integer arguments, and byte objects for pointer
+	arguments). If it meets anything else it returns before calling the
+	function, having pushed nothing, and the primitive falls back on the
+	generic routine, which performs the full range of coercions and fails the
+	primitive if the argument cannot be converted.
+
+	Stubs are found through a table keyed by the descriptor object, which is
+	cleared whenever the cached lookups are flushed or purged (i.e. whenever a
+	method is installed), and after a compacting GC. An entry is in any case
+	only used if the descriptor bytes, which include the cached function
+	address, still match those from which the stub was generated. The
+	generated code itself is shared by all descriptors with the same bytes,
+	and is never discarded because a stub may be on the stack during a
+	callback into Smalltalk. When the code region is full no more stubs are
+	generated.
+
+	Stub register usage:
+
+		ESI		Interpreter stack pointer (the last argument is at [ESI])
+		EBX		The active frame on entry, to detect an unwind during the call
+		EBP		Frame pointer, through which ESP is restored after the call
+
+	Stubs answer the result Oop in EAX, and their status in EDX: StubNewObject
+	if the result may be a new object that must be added to the Zct,
+	StubNotConverted if the arguments could not be converted (nothing was
+	called), StubUnwound if the call was unwound, or otherwise 0. The status is
+	kept out of EAX since an OOP result can be any value at all.
+
+******************************************************************************/
+#include "Ist.h"
+#pragma code_seg(FFI_SEG)
+
+#include <vector>
+#include "ObjMem.h"
+#include "Interprt.h"
+#include "DolphinX.h"
+using namespace DolphinX;
+#include "NativeAssembler.h"
+
+// Smalltalk Classes
+#include "STBehavior.h"
+#include "STExternal.h"
+#include "STMethod.h"
+#include "STInteger.h"
+
+typedef NativeAssembler Asm;
+
+enum { CallStubMaxArgs = 16 };
+enum { CallStubMaxDescriptor = sizeof(ExternalMethodDescriptor) + CallStubMaxArgs };
+enum { CallStubTableSize = 4096, CallStubLinkTableSize = 1024 };
+enum { CallStubCodeSize = 256*1024 };
+
+// Stub status codes, answered in EDX. N.B. Must be kept in sync with ExternalCall.asm
+enum { StubResult, StubNewObject, StubNotConverted, StubUnwound };
+
+// InstanceSpecification::m_indirect
+enum { IndirectSpecMask = 1 << 12 };
+
+// The generated code, which is shared by all descriptors with the same bytes. Open addressed by a
+// hash of the descriptor bytes.
+struct CallStub
+{
+	BYTE		m_descriptor[CallStubMaxDescriptor];
+	unsigned	m_cbDescriptor;				// 0 if the entry is free
+	BYTE*		m_pCode;					// NULL if the descriptor cannot be handled by a stub
+
+	bool matches(const BYTE* pDescriptor, unsigned cbDescriptor) const
+	{
+		return m_cbDescriptor == cbDescriptor && memcmp(m_descriptor, pDescriptor, cbDescriptor) == 0;
+	}
+};
+
+// The stub last used for each descriptor object, direct mapped by the OTE
+struct CallStubLink
+{
+	const OTE*		m_oteDescriptor;
+	const CallStub*	m_pStub;
+};
+
+static CallStub s_callStubs[CallStubTableSize];
+static unsigned s_nCallStubs;
+static CallStubLink s_callStubLinks[CallStubLinkTableSize];
+
+static BYTE* s_pCallStubCode;
+static BYTE* s_pCallStubFree;
+
+///////////////////////////////////////////////////////////////////////////////
+// Code generation
+
+static bool IsStubArgType(BYTE argType)
+{
+	switch (argType)
+	{
+	case ExtCallArgLPVOID:
+	case ExtCallArgDWORD:
+	case ExtCallArgSDWORD:
+	case ExtCallArgBOOL:
+	case ExtCallArgHANDLE:
+	case ExtCallArgOOP:
+	case ExtCallArgHRESULT:
+	case ExtCallArgOTE:
+	case ExtCallArgUINTPTR:
+	case ExtCallArgINTPTR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool IsStubReturnType(BYTE returnType)
+{
+	switch (returnType)
+	{
+	case ExtCallArgVOID:
+	case ExtCallArgDWORD:
+	case ExtCallArgSDWORD:
+	case ExtCallArgBOOL:
+	case ExtCallArgOOP:
+	case ExtCallArgUINTPTR:
+	case ExtCallArgINTPTR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Emit the conversion of the argument Oop in EAX to the 32-bit value to be pushed, leaving it in EAX.
+// The positions of jumps to the failure exit are added to fails.
+static void EmitArgConversion(Asm& a, BYTE argType, std::vector<unsigned>& fails)
+{
+	unsigned pushes[3];
+	unsigned nPushes = 0;
+
+	switch (argType)
+	{
+	case ExtCallArgOOP:
+		break;
+
+	case ExtCallArgOTE:
+		a.testLowByte(Asm::EAX, 1);
+		fails.push_back(a.jcc(Asm::CondNE));
+		break;
+
+	case ExtCallArgBOOL:
+		{
+			// SmallIntegers are passed as their value, true as 1 and false as 0
+			a.sarRegOne(Asm::EAX);
+			pushes[nPushes++] = a.jcc(Asm::CondB);
+			a.alu(Asm::ADD, Asm::EAX, Asm::EAX);
+			a.cmpRegAbs(Asm::EAX, &Pointers.True);
+			unsigned notTrue = a.jcc(Asm::CondNE);
+			a.movRegImm(Asm::EAX, 1);
+			pushes[nPushes++] = a.jmp();
+			a.patch(notTrue, a.offset());
+			a.cmpRegAbs(Asm::EAX, &Pointers.False);
+			fails.push_back(a.jcc(Asm::CondNE));
+			a.alu(Asm::XOR, Asm::EAX, Asm::EAX);
+		}
+		break;
+
+	case ExtCallArgLPVOID:
+		{
+			// SmallIntegers are passed as their value, nil as NULL, and byte objects as the address of their
+			// contents, or the address they contain if of an indirection class such as ExternalAddress.
+			// Pointer objects are left to the generic routine.
+			a.sarRegOne(Asm::EAX);
+			pushes[nPushes++] = a.jcc(Asm::CondB);
+			a.alu(Asm::ADD, Asm::EAX, Asm::EAX);
+			a.cmpRegAbs(Asm::EAX, &Pointers.Nil);
+			unsigned notNil = a.jcc(Asm::CondNE);
+			a.alu(Asm::XOR, Asm::EAX, Asm::EAX);
+			pushes[nPushes++] = a.jmp();
+			a.patch(notNil, a.offset());
+			a.testMemImm(Asm::EAX, offsetof(OTE, m_dwFlags), OTE::PointerMask);
+			fails.push_back(a.jcc(Asm::CondNE));
+			a.movRegMem(Asm::ECX, Asm::EAX, offsetof(OTE, m_oteClass));
+			a.movRegMem(Asm::EAX, Asm::EAX, offsetof(OTE, m_location));
+			a.movRegMem(Asm::ECX, Asm::ECX, offsetof(BehaviorOTE, m_location));
+			a.testMemImm(Asm::ECX, offsetof(Behavior, m_instanceSpec), IndirectSpecMask);
+			pushes[nPushes++] = a.jcc(Asm::CondE);
+			a.movRegMem(Asm::EAX, Asm::EAX, offsetof(ExternalAddress, m_pointer));
+		}
+		break;
+
+	default:
+		// The integer types: SmallIntegers are passed as their value and nil as 0. LargeIntegers
+		// are left to the generic routine.
+		a.sarRegOne(Asm::EAX);
+		pushes[nPushes++] = a.jcc(Asm::CondB);
+		a.alu(Asm::ADD, Asm::EAX, Asm::EAX);
+		a.cmpRegAbs(Asm::EAX, &Pointers.Nil);
+		fails.push_back(a.jcc(Asm::CondNE));
+		a.alu(Asm::XOR, Asm::EAX, Asm::EAX);
+		break;
+	}
+
+	for (unsigned i=0;i<nPushes;i++)
+		a.patch(pushes[i], a.offset());
+}
+
+// Emit the boxing of the function result in EAX
+static void EmitResultConversion(Asm& a, BYTE returnType, unsigned argCount, Oop** ppStackPointer)
+{
+	switch (returnType)
+	{
+	case ExtCallArgVOID:
+		// Answer the receiver
+		a.movRegAbs(Asm::EAX, ppStackPointer);
+		a.movRegMem(Asm::EAX, Asm::EAX, -int(argCount*sizeof(Oop)));
+		a.movRegImm(Asm::EDX, StubResult);
+		break;
+
+	case ExtCallArgBOOL:
+		a.alu(Asm::OR, Asm::EAX, Asm::EAX);
+		a.movRegAbs(Asm::EAX, &Pointers.False);
+		a.movRegAbs(Asm::ECX, &Pointers.True);
+		a.cmov(Asm::CondNE, Asm::EAX, Asm::ECX);
+		a.movRegImm(Asm::EDX, StubResult);
+		break;
+
+	case ExtCallArgSDWORD:
+	case ExtCallArgINTPTR:
+	case ExtCallArgDWORD:
+	case ExtCallArgUINTPTR:
+		{
+			Oop (__fastcall *pfnNew)(DWORD) = returnType == ExtCallArgSDWORD || returnType == ExtCallArgINTPTR
+				? reinterpret_cast<Oop (__fastcall *)(DWORD)>(&Integer::NewSigned32)
+				: &Integer::NewUnsigned32;
+			a.movRegReg(Asm::ECX, Asm::EAX);
+			a.movRegImm(Asm::EAX, reinterpret_cast<DWORD>(pfnNew));
+			a.callReg(Asm::EAX);
+			a.movRegImm(Asm::EDX, StubNewObject);
+		}
+		break;
+
+	case ExtCallArgOOP:
+		a.movRegImm(Asm::EDX, StubNewObject);
+		break;
+	}
+}
+
+// Answer whether a stub could be generated for the descriptor (the code may still have overflowed)
+static bool EmitCallStub(Asm& a, const ExternalMethodDescriptor* pDescriptor, Oop** ppStackPointer, StackFrame** ppActiveFrame)
+{
+	const CallDescriptor& descriptor = pDescriptor->m_descriptor;
+	if (descriptor.m_callConv != ExtCallStdCall && descriptor.m_callConv != ExtCallCDecl)
+		return false;
+	if (!IsStubReturnType(descriptor.m_return))
+		return false;
+	const unsigned argCount = descriptor.m_argsLen;
+	for (unsigned i=0;i<argCount;i++)
+	{
+		if (!IsStubArgType(descriptor.m_args[i]))
+			return false;
+	}
+
+	std::vector<unsigned> fails;
+
+	a.pushReg(Asm::EBP);
+	a.movRegReg(Asm::EBP, Asm::ESP);
+	a.pushReg(Asm::EBX);
+	a.pushReg(Asm::ESI);
+	a.movRegAbs(Asm::EBX, ppActiveFrame);
+	a.movRegAbs(Asm::ESI, ppStackPointer);
+
+	// Push the arguments right to left
+	bool bPointers = false;
+	for (unsigned i=0;i<argCount;i++)
+	{
+		a.movRegMem(Asm::EAX, Asm::ESI, -int(i*sizeof(Oop)));
+		EmitArgConversion(a, descriptor.m_args[argCount-1-i], fails);
+		a.pushReg(Asm::EAX);
+		bPointers |= descriptor.m_args[argCount-1-i] == ExtCallArgLPVOID;
+	}
+
+#ifdef LAZYLOADING
+	// The system cannot fault in demand loaded objects, so any that the pointer arguments address
+	// must be loaded before the call (see LazyLoad.cpp)
+	if (bPointers)
+	{
+		a.cmpAbsImm(&ObjectMemory::m_nLazyPagesUnloaded, 0);
+		unsigned loaded = a.jcc(Asm::CondE);
+		a.leaRegMem(Asm::EAX, Asm::EBP, -8);
+		a.movRegReg(Asm::ECX, Asm::ESP);
+		a.pushReg(Asm::EAX);
+		a.pushReg(Asm::ECX);
+		a.movRegImm(Asm::EAX, reinterpret_cast<DWORD>(&ObjectMemory::MaterializeLazyReferences));
+		a.callReg(Asm::EAX);
+		a.patch(loaded, a.offset());
+	}
+#endif
+
+	a.movRegImm(Asm::EAX, reinterpret_cast<DWORD>(pDescriptor->m_proc));
+	a.callReg(Asm::EAX);
+
+	// Remove the arguments, if the function did not
+	a.leaRegMem(Asm::ESP, Asm::EBP, -8);
+	a.cmpRegAbs(Asm::EBX, ppActiveFrame);
+	unsigned unwound = a.jcc(Asm::CondNE);
+
+	EmitResultConversion(a, descriptor.m_return, argCount, ppStackPointer);
+
+	unsigned epilogue = a.offset();
+	a.popReg(Asm::ESI);
+	a.popReg(Asm::EBX);
+	a.popReg(Asm::EBP);
+	a.ret();
+
+	if (!fails.empty())
+	{
+		for (unsigned i=0;i<fails.size();i++)
+			a.patch(fails[i], a.offset());
+		a.leaRegMem(Asm::ESP, Asm::EBP, -8);
+		a.movRegImm(Asm::EDX, StubNotConverted);
+		a.patch(a.jmp(), epilogue);
+	}
+
+	a.patch(unwound, a.offset());
+	a.movRegImm(Asm::EDX, StubUnwound);
+	a.patch(a.jmp(), epilogue);
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static unsigned HashDescriptor(const BYTE* pDescriptor, unsigned cbDescriptor)
+{
+	unsigned hash = 2166136261u;
+	for (unsigned i=0;i<cbDescriptor;i++)
+		hash = (hash ^ pDescriptor[i]) * 16777619u;
+	return hash;
+}
+
+// Find the stub for the descriptor bytes, generating it if necessary. Answers NULL if the table is full.
+static const CallStub* FindCallStub(const ExternalMethodDescriptor* pDescriptor, unsigned cbDescriptor,
+										Oop** ppStackPointer, StackFrame** ppActiveFrame)
+{
+	const BYTE* pBytes = reinterpret_cast<const BYTE*>(pDescriptor);
+	unsigned index = HashDescriptor(pBytes, cbDescriptor) & (CallStubTableSize-1);
+	while (s_callStubs[index].m_cbDescriptor != 0)
+	{
+		if (s_callStubs[index].matches(pBytes, cbDescriptor))
+			return &s_callStubs[index];
+		index = (index + 1) & (CallStubTableSize-1);
+	}
+
+	// Keep the table sparse enough for probing to be short
+	if (s_nCallStubs >= CallStubTableSize/2)
+		return NULL;
+
+	if (s_pCallStubCode == NULL)
+	{
+		s_pCallStubCode = static_cast<BYTE*>(::VirtualAlloc(NULL, CallStubCodeSize, MEM_RESERVE|MEM_COMMIT, PAGE_EXECUTE_READWRITE));
+		if (s_pCallStubCode == NULL)
+			return NULL;
+		s_pCallStubFree = s_pCallStubCode;
+	}
+
+	CallStub& stub = s_callStubs[index];
+	memcpy(stub.m_descriptor, pBytes, cbDescriptor);
+	stub.m_cbDescriptor = cbDescriptor;
+	stub.m_pCode = NULL;
+	s_nCallStubs++;
+
+	Asm a(s_pCallStubFree, s_pCallStubCode + CallStubCodeSize);
+	if (EmitCallStub(a, pDescriptor, ppStackPointer, ppActiveFrame) && !a.overflowed())
+	{
+		::FlushInstructionCache(::GetCurrentProcess(), s_pCallStubFree, a.offset());
+		stub.m_pCode = s_pCallStubFree;
+		s_pCallStubFree += (a.offset() + 15) & ~15;
+	}
+
+	return &stub;
+}
+
+// Answer the stub for the external call method, or NULL if the generic call routine must be used.
+// Called from primitiveDLL32Call, once the function address has been cached in the descriptor.
+BYTE* __fastcall Interpreter::lookupCallStub(CompiledMethod& method, unsigned argCount)
+{
+	const OTE* oteDescriptor = reinterpret_cast<const OTE*>(method.m_aLiterals[LibCallArgArray]);
+	const ExternalMethodDescriptor* pDescriptor = static_cast<const ExternalMethodDescriptor*>(oteDescriptor->m_location);
+	const unsigned argsLen = pDescriptor->m_descriptor.m_argsLen;
+
+	// Argument types with parameters (e.g. structures) consume more than one byte of the descriptor,
+	// and are not handled by stubs anyway
+	if (argsLen != argCount || argsLen > CallStubMaxArgs)
+		return NULL;
+	const unsigned cbDescriptor = sizeof(ExternalMethodDescriptor) + argsLen;
+	if (cbDescriptor > oteDescriptor->bytesSize())
+		return NULL;
+
+	CallStubLink& link = s_callStubLinks[(Oop(oteDescriptor) / sizeof(OTE)) & (CallStubLinkTableSize-1)];
+	if (link.m_oteDescriptor != oteDescriptor || !link.m_pStub->matches(reinterpret_cast<const BYTE*>(pDescriptor), cbDescriptor))
+	{
+		const CallStub* pStub = FindCallStub(pDescriptor, cbDescriptor, &m_registers.m_stackPointer, &m_registers.m_pActiveFrame);
+		if (pStub == NULL)
+			return NULL;
+		link.m_oteDescriptor = oteDescriptor;
+		link.m_pStub = pStub;
+	}
+	return link.m_pStub->m_pCode;
+}
+
+// Forget the stubs associated with descriptor objects, e.g. because a method has been installed
+void Interpreter::flushCallStubs()
+{
+	ZeroMemory(s_callStubLinks, sizeof(s_callStubLinks));
+}
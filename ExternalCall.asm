@@ -52,6 +52,19 @@ extern SysAllocString:near32
 REQUESTCOMPLETION EQU ?OnCallReturned@OverlappedCall@@AAEXXZ
 extern REQUESTCOMPLETION:near32
 
+LOOKUPCALLSTUB EQU ?lookupCallStub@Interpreter@@CIPAEAAVCompiledMethod@@I@Z
+extern LOOKUPCALLSTUB:near32
+
+; Call stub status codes, answered in EDX. N.B. Must be kept in sync with ExtCallStubs.cpp
+StubNewObject		EQU		1
+StubNotConverted	EQU		2
+StubUnwound			EQU		3
+
+MATERIALIZELAZYREFERENCES EQU ?MaterializeLazyReferences@ObjectMemory@@SGXPBK0@Z
+extern MATERIALIZELAZYREFERENCES:near32
+LAZYPAGESUNLOADED EQU ?m_nLazyPagesUnloaded@ObjectMemory@@2IA
+extern LAZYPAGESUNLOADED:DWORD
+
 ; We need to test the structure type specially
 ArgSTRUCT	EQU		50
 
@@ -343,6 +356,42 @@ primitiveDLL32Call PROC
 
 @@:
 	push	eax												; ARG1: cached proc address
+
+	; Use the specialised stub for the descriptor, if there is one (see ExtCallStubs.cpp)
+	mov		ecx, [esp+12]									; Method
+	mov		edx, [esp+4]									; argCount
+	call	LOOKUPCALLSTUB
+	test	eax, eax
+	jz		genericCall
+
+	call	eax												; Answers result in EAX, and status in EDX
+	cmp		edx, StubNotConverted
+	je		genericCall										; Nothing was pushed or called, so retry generically
+
+	mov		ecx, [esp+4]									; Reload argCount
+	add		esp, 24											; Remove args pushed for generic call
+	LoadInterpreterRegisters
+	cmp		edx, StubUnwound
+	je		stubUnwound
+
+	shl		ecx, 2
+	sub		_SP, ecx										; Pop off the arguments
+	mov		[_SP], eax										; Answer the result
+
+	cmp		edx, StubNewObject								; Could it be a new object?
+	jne		@F
+	test	al, 1											; SmallIntegers need not go in the Zct
+	jnz		@F
+	AddToZct <a>
+@@:
+	ret
+
+stubUnwound:
+	; We succeed so as not to run Smalltalk code after primitive (as for unwindExit)
+	mov		eax, 1
+	ret
+
+genericCall:
 	call	callExternalFunction
 	ret
 
@@ -462,7 +511,7 @@ callExternalFunction PROC NEAR STDCALL,
 
 	
 	; We need EBP based address for these as we'll be modifying ESP
-	LOCAL activeFrame:PStackFrame, returnStructure:PTR DWORD	;, savedSP:PTR DWORD
+	LOCAL activeFrame:PStackFrame, returnStructure:PTR DWORD, argsEnd:PTR DWORD	;, savedSP:PTR DWORD
 
 	; Save off active frame, etc
 	mov		eax, callContext
@@ -506,11 +555,22 @@ retStruct:
 
 	ASSERTNEQU %INDEX, %DESCRIPTOR
 
+	mov		argsEnd, esp					; Arguments are pushed below here
 	movzx	INDEX, [DESCRIPTOR].m_argsLen	; Get the length of the argument descriptor
 
 	LoopNext								; Process the first arg
 
 performCall:
+	; The system cannot fault in demand loaded objects (see LazyLoad.cpp), so any that the arguments
+	; point into must be loaded before the call. DESCRIPTOR is preserved across the call.
+	cmp		[LAZYPAGESUNLOADED], 0
+	je		@F
+	mov		eax, argsEnd
+	mov		ecx, esp
+	push	eax
+	push	ecx
+	call	MATERIALIZELAZYREFERENCES
+@@:
 	mov		eax, returnStructure
 	test	eax, eax
 	jz		@F							; If not returning a >8 byte struct, then no need pass hidden parameter
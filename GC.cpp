@@ -186,6 +186,7 @@ void ObjectMemory::reclaimInaccessibleObjects(DWORD gcFlags)
 	// also be finalizable, then this will delay their finalization until their parent has disappeared.
 	markObjectsAccessibleFrom(pointerFromIndex(0));
 	Interpreter::MarkRoots();
+	MarkBorrowedViews();
 
 	// Every object reachable from the roots of the world will now have the current mark bit,
 	// any objects with the old mark bit can be discarded.
@@ -616,6 +617,7 @@ void ObjectMemory::addVMRefs()
 		//TRACESTREAM << nFree << " free slots found in OT, " << cFreeList << " on the free list (" << nFree-cFreeList << ")" <<endl;
 
 		Interpreter::ReincrementVMReferences();
+		addBorrowedViewRefs();
 
 		int refCountTooSmall = 0;
 		const unsigned loopEnd = m_nOTSize;
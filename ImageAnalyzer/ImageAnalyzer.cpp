@@ -0,0 +1,547 @@
+/******************************************************************************
+
+	File: ImageAnalyzer.cpp
+
+	Description:
+
+	Offline image analyzer. Reads a saved image file (plain, compressed or
+	block compressed) without starting the VM, and reports on its contents:
+	per-class instance counts and bytes, size distribution, object table
+	occupancy, sticky reference counts and the largest objects. Given two
+	images it reports the per-class differences, for tracking image bloat
+	in build pipelines.
+
+	The image is walked in the same order as ObjectMemory::LoadImage, so
+	this must be kept in step with LoadImage.cpp and SaveImage.cpp. The
+	object table entries, the number of permanent objects, and the layouts
+	of classes and metaclasses are taken from the VM's own headers (ote.h,
+	objmem.h and STClassDesc.h), so the tool is rebuilt with any change to
+	them.
+
+	Usage: ImageAnalyzer [-n <top>] [-c] <image> [<newer image>]
+
+******************************************************************************/
+
+#include "ist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <io.h>
+#include <fcntl.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+
+#include "zbinstream.h"
+#include "blockbinstream.h"
+// The object table entries, permanent objects and class layouts are those of the VM itself.
+// Only the inline accessors are used, so none of the VM need be linked.
+#include "objmem.h"
+#include "STClassDesc.h"
+
+enum { NoBody = -1 };
+
+struct ClassStats
+{
+	DWORD		nInstances;
+	unsigned __int64 cbBytes;
+
+	ClassStats() : nInstances(0), cbBytes(0) {}
+};
+
+typedef std::map<std::string, ClassStats> ClassStatsMap;
+
+///////////////////////////////////////////////////////////////////////////////
+// A loaded image
+
+class Image
+{
+public:
+	std::string				m_strPath;
+	ImageHeader				m_header;
+	std::vector<OTE>	m_ot;
+	std::vector<int>		m_bodies;		// Offset of each object's body in m_data, or NoBody
+	std::vector<BYTE>		m_data;
+	DWORD					m_cbFile;
+	size_t					m_cbVirtualReserved;
+
+	Image() : m_cbFile(0), m_cbVirtualReserved(0) {}
+
+	bool Load(const char* szPath);
+
+	bool isValidIndex(DWORD index) const
+	{
+		return index < m_ot.size() && !m_ot[index].isFree();
+	}
+
+	// Convert a saved object pointer to an OT index, answering -1 for SmallIntegers and garbage
+	int indexOf(DWORD oop) const
+	{
+		DWORD base = reinterpret_cast<DWORD>(m_header.BasePointer);
+		if ((oop & 1) || oop < base || (oop - base) % sizeof(OTE) != 0)
+			return -1;
+		DWORD index = (oop - base) / sizeof(OTE);
+		return isValidIndex(index) ? int(index) : -1;
+	}
+
+	int fieldOf(DWORD index, DWORD nField) const
+	{
+		const OTE& ote = m_ot[index];
+		if (!ote.isPointers() || m_bodies[index] == NoBody || (nField+1) * sizeof(DWORD) > ote.getSize())
+			return -1;
+		const DWORD* fields = reinterpret_cast<const DWORD*>(&m_data[m_bodies[index]]);
+		return indexOf(fields[nField]);
+	}
+
+	std::string ClassName(DWORD classIndex) const;
+	void CollectStats(ClassStatsMap& stats) const;
+
+private:
+	bool ReadObjects(ibinstream& stream);
+	bool ReadBody(ibinstream& stream, DWORD index, size_t& cbRead);
+};
+
+static bool ReportLoadError(const char* szPath, const char* szMsg)
+{
+	fprintf(stderr, "%s: %s\n", szPath, szMsg);
+	return false;
+}
+
+bool Image::Load(const char* szPath)
+{
+	m_strPath = szPath;
+
+	FILE* fp = NULL;
+	if (fopen_s(&fp, szPath, "rb") != 0)
+		return ReportLoadError(szPath, "unable to open image file");
+
+	m_cbFile = _filelength(_fileno(fp));
+	std::vector<BYTE> fileBytes(m_cbFile);
+	bool bRead = m_cbFile > 0 && fread(&fileBytes[0], 1, m_cbFile, fp) == m_cbFile;
+	fclose(fp);
+	if (!bRead || m_cbFile < sizeof(ISTImageHeader))
+		return ReportLoadError(szPath, "unable to read image header");
+
+	const ISTImageHeader* pISTHeader = reinterpret_cast<const ISTImageHeader*>(&fileBytes[0]);
+	if (pISTHeader->imageType != IMAGETYPEENCODE("IST"))
+		return ReportLoadError(szPath, "not a Dolphin image file");
+
+	m_header = pISTHeader->header;
+	if (m_header.flags.bIsDelta)
+		return ReportLoadError(szPath, "incremental images are not supported, fold the chain first (see FoldImageChain)");
+
+	if (m_header.nTableSize <= ObjectMemory::NumPermanent)
+		return ReportLoadError(szPath, "corrupt object table size");
+
+	BYTE* pData = &fileBytes[0] + sizeof(ISTImageHeader);
+	UINT cbData = m_cbFile - sizeof(ISTImageHeader);
+	if (m_header.flags.bIsCompressed)
+	{
+		zibinstream stream(pData, cbData);
+		return ReadObjects(stream);
+	}
+	else if (m_header.flags.bIsBlockCompressed)
+	{
+		blockibinstream stream(pData, cbData);
+		if (!stream.good())
+			return ReportLoadError(szPath, "corrupt compressed block");
+		return ReadObjects(stream);
+	}
+	else
+	{
+		imbinstream stream(pData, cbData);
+		return ReadObjects(stream);
+	}
+}
+
+bool Image::ReadBody(ibinstream& stream, DWORD index, size_t& cbRead)
+{
+	const OTE& ote = m_ot[index];
+	// Permanent objects are never virtual (see ObjectMemory::LoadPointers)
+	if (index >= ObjectMemory::NumPermanent && ote.heapSpace() == OTEFlags::VirtualSpace)
+	{
+		DWORD dwMaxAlloc;
+		if (!stream.read(&dwMaxAlloc, sizeof(dwMaxAlloc)))
+			return false;
+		cbRead += sizeof(dwMaxAlloc);
+		m_cbVirtualReserved += dwMaxAlloc;
+	}
+
+	DWORD byteSize = ote.sizeOf();
+	if (byteSize == 0)
+		return true;
+
+	size_t offset = m_data.size();
+	m_data.resize(offset + byteSize);
+	if (!stream.read(&m_data[offset], byteSize))
+		return false;
+	m_bodies[index] = int(offset);
+	cbRead += byteSize;
+	return true;
+}
+
+// Read the object table and all the object bodies, in the order they are written by SaveImage
+bool Image::ReadObjects(ibinstream& stream)
+{
+	const DWORD nTableSize = m_header.nTableSize;
+	m_ot.resize(nTableSize);
+	if (!stream.read(&m_ot[0], nTableSize*sizeof(OTE)))
+		return ReportLoadError(m_strPath.c_str(), "image file truncated in object table");
+
+	m_bodies.assign(nTableSize, NoBody);
+	m_data.reserve(m_cbFile);
+
+	// The permanent objects are always written, whether free or not
+	size_t cbRead = 0;
+	for (DWORD i=0;i<nTableSize;i++)
+	{
+		if (i >= ObjectMemory::NumPermanent && m_ot[i].isFree())
+			continue;
+		if (!ReadBody(stream, i, cbRead))
+			return ReportLoadError(m_strPath.c_str(), "image file truncated in object data");
+	}
+
+	size_t nCheckSum;
+	if (!stream.read(&nCheckSum, sizeof(nCheckSum)) || nCheckSum != cbRead)
+		return ReportLoadError(m_strPath.c_str(), "image checksum mismatch, the image is corrupt");
+
+	return true;
+}
+
+// Answer the name of the class at classIndex, or a description of the metaclass
+std::string Image::ClassName(DWORD classIndex) const
+{
+	char buf[32];
+	if (!isValidIndex(classIndex))
+	{
+		sprintf_s(buf, "<invalid class %u>", classIndex);
+		return buf;
+	}
+
+	const OTE& ote = m_ot[classIndex];
+	if (ote.isPointers() && ote.getSize() == MetaClass::FixedSize*sizeof(DWORD))
+	{
+		int instanceClass = fieldOf(classIndex, MetaClass::InstanceClassIndex);
+		if (instanceClass >= 0 && DWORD(instanceClass) != classIndex)
+			return ClassName(instanceClass) + " class";
+	}
+	else if (ote.isPointers() && ote.getSize() >= Class::FixedSize*sizeof(DWORD))
+	{
+		int name = fieldOf(classIndex, Class::NameIndex);
+		if (name >= 0 && !m_ot[name].isPointers() && m_bodies[name] != NoBody)
+		{
+			const char* psz = reinterpret_cast<const char*>(&m_data[m_bodies[name]]);
+			return std::string(psz, m_ot[name].getSize());
+		}
+	}
+
+	sprintf_s(buf, "<class %u>", classIndex);
+	return buf;
+}
+
+// Accumulate per-class statistics, keyed by name so that different images can be compared
+void Image::CollectStats(ClassStatsMap& stats) const
+{
+	std::map<DWORD, ClassStats> byClass;
+	for (DWORD i=0;i<m_ot.size();i++)
+	{
+		const OTE& ote = m_ot[i];
+		if (ote.isFree())
+			continue;
+		int classIndex = indexOf(Oop(ote.m_oteClass));
+		ClassStats& s = byClass[classIndex < 0 ? DWORD(-1) : DWORD(classIndex)];
+		s.nInstances++;
+		s.cbBytes += ote.sizeOf();
+	}
+
+	for (std::map<DWORD, ClassStats>::const_iterator it = byClass.begin(); it != byClass.end(); ++it)
+	{
+		ClassStats& s = stats[ClassName(it->first)];
+		s.nInstances += it->second.nInstances;
+		s.cbBytes += it->second.cbBytes;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reports
+
+static bool s_bCSV = false;
+static unsigned s_nTop = 20;
+
+typedef std::pair<std::string, ClassStats> ClassStatsEntry;
+
+static bool LargerBytes(const ClassStatsEntry& a, const ClassStatsEntry& b)
+{
+	return a.second.cbBytes > b.second.cbBytes;
+}
+
+static void ReportSummary(const Image& image)
+{
+	DWORD nFree = 0, nSticky = 0, nPointerObjs = 0, nByteObjs = 0, nVirtual = 0;
+	unsigned __int64 cbPointers = 0, cbBytes = 0;
+	for (DWORD i=0;i<image.m_ot.size();i++)
+	{
+		const OTE& ote = image.m_ot[i];
+		if (ote.isFree())
+		{
+			nFree++;
+			continue;
+		}
+		if (ote.isSticky())
+			nSticky++;
+		if (ote.heapSpace() == OTEFlags::VirtualSpace)
+			nVirtual++;
+		if (ote.isPointers())
+		{
+			nPointerObjs++;
+			cbPointers += ote.sizeOf();
+		}
+		else
+		{
+			nByteObjs++;
+			cbBytes += ote.sizeOf();
+		}
+	}
+
+	const ImageHeader& h = image.m_header;
+	const DWORD nTableSize = h.nTableSize;
+	if (s_bCSV)
+	{
+		printf("image,version,format,fileBytes,otSize,otMax,freeOTEs,objects,sticky,pointerObjects,pointerBytes,byteObjects,byteBytes,virtualObjects,virtualReserved\n");
+		printf("\"%s\",%u.%u.%u.%u,%s,%u,%u,%u,%u,%u,%u,%u,%I64u,%u,%I64u,%u,%Iu\n",
+			image.m_strPath.c_str(),
+			HIWORD(h.versionMS), LOWORD(h.versionMS), HIWORD(h.versionLS), LOWORD(h.versionLS),
+			h.flags.bIsCompressed ? "zlib" : h.flags.bIsBlockCompressed ? "lz4" : "plain",
+			image.m_cbFile, nTableSize, h.nMaxTableSize, nFree, nTableSize - nFree, nSticky,
+			nPointerObjs, cbPointers, nByteObjs, cbBytes, nVirtual, image.m_cbVirtualReserved);
+		return;
+	}
+
+	printf("Image '%s'\n", image.m_strPath.c_str());
+	printf("  Saved by VM version %u.%u.%u.%u, %s, %u bytes on disk\n",
+			HIWORD(h.versionMS), LOWORD(h.versionMS), HIWORD(h.versionLS), LOWORD(h.versionLS),
+			h.flags.bIsCompressed ? "zlib compressed" : h.flags.bIsBlockCompressed ? "block compressed" : "uncompressed",
+			image.m_cbFile);
+	printf("  Object table: %u entries (max %u), %u free (%.1f%%)\n",
+			nTableSize, h.nMaxTableSize, nFree, 100.0 * nFree / nTableSize);
+	printf("  Objects: %u, of which %u have sticky reference counts\n", nTableSize - nFree, nSticky);
+	printf("  Pointer objects: %u, %I64u bytes\n", nPointerObjs, cbPointers);
+	printf("  Byte objects: %u, %I64u bytes\n", nByteObjs, cbBytes);
+	printf("  Virtual objects: %u, %Iu bytes reserved\n", nVirtual, image.m_cbVirtualReserved);
+	printf("\n");
+}
+
+static void ReportClasses(const Image& image)
+{
+	ClassStatsMap stats;
+	image.CollectStats(stats);
+	std::vector<ClassStatsEntry> entries(stats.begin(), stats.end());
+	std::sort(entries.begin(), entries.end(), LargerBytes);
+
+	if (s_bCSV)
+		printf("class,instances,bytes\n");
+	else
+		printf("%-48s %10s %12s %8s\n", "Class", "Instances", "Bytes", "Average");
+
+	for (size_t i=0;i<entries.size();i++)
+	{
+		const ClassStats& s = entries[i].second;
+		if (s_bCSV)
+			printf("\"%s\",%u,%I64u\n", entries[i].first.c_str(), s.nInstances, s.cbBytes);
+		else
+			printf("%-48s %10u %12I64u %8I64u\n", entries[i].first.c_str(), s.nInstances, s.cbBytes, s.cbBytes / s.nInstances);
+	}
+	printf("\n");
+}
+
+// Distribution of object sizes in power of two buckets
+static void ReportSizeHistogram(const Image& image)
+{
+	enum { NumBuckets = 33 };
+	DWORD counts[NumBuckets] = {0};
+	unsigned __int64 bytes[NumBuckets] = {0};
+	for (DWORD i=0;i<image.m_ot.size();i++)
+	{
+		const OTE& ote = image.m_ot[i];
+		if (ote.isFree())
+			continue;
+		DWORD size = ote.sizeOf();
+		int bucket = 0;
+		while (size > 0)
+		{
+			bucket++;
+			size >>= 1;
+		}
+		counts[bucket]++;
+		bytes[bucket] += ote.sizeOf();
+	}
+
+	if (s_bCSV)
+		printf("sizeFrom,sizeTo,objects,bytes\n");
+	else
+		printf("%-24s %10s %12s\n", "Size", "Objects", "Bytes");
+
+	for (int i=0;i<NumBuckets;i++)
+	{
+		if (counts[i] == 0)
+			continue;
+		DWORD from = i == 0 ? 0 : 1 << (i-1);
+		DWORD to = i == 0 ? 0 : (1 << (i-1)) * 2 - 1;
+		if (s_bCSV)
+			printf("%u,%u,%u,%I64u\n", from, to, counts[i], bytes[i]);
+		else
+		{
+			char range[32];
+			sprintf_s(range, "%u..%u", from, to);
+			printf("%-24s %10u %12I64u\n", range, counts[i], bytes[i]);
+		}
+	}
+	printf("\n");
+}
+
+static const Image* s_pSortImage;
+
+static bool LargerObject(DWORD a, DWORD b)
+{
+	return s_pSortImage->m_ot[a].sizeOf() > s_pSortImage->m_ot[b].sizeOf();
+}
+
+static void ReportLargestObjects(const Image& image)
+{
+	std::vector<DWORD> indices;
+	for (DWORD i=0;i<image.m_ot.size();i++)
+	{
+		if (!image.m_ot[i].isFree())
+			indices.push_back(i);
+	}
+	size_t nTop = min(size_t(s_nTop), indices.size());
+	s_pSortImage = &image;
+	std::partial_sort(indices.begin(), indices.begin() + nTop, indices.end(), LargerObject);
+
+	if (s_bCSV)
+		printf("index,class,bytes\n");
+	else
+		printf("%-10s %-48s %12s\n", "Index", "Class", "Bytes");
+
+	for (size_t i=0;i<nTop;i++)
+	{
+		const OTE& ote = image.m_ot[indices[i]];
+		int classIndex = image.indexOf(Oop(ote.m_oteClass));
+		std::string className = image.ClassName(classIndex < 0 ? DWORD(-1) : DWORD(classIndex));
+		if (s_bCSV)
+			printf("%u,\"%s\",%u\n", indices[i], className.c_str(), ote.sizeOf());
+		else
+			printf("%-10u %-48s %12u\n", indices[i], className.c_str(), ote.sizeOf());
+	}
+	printf("\n");
+}
+
+struct ClassDelta
+{
+	std::string			m_strName;
+	int					m_nInstances;
+	__int64				m_cbBytes;
+};
+
+static bool LargerDelta(const ClassDelta& a, const ClassDelta& b)
+{
+	return _abs64(a.m_cbBytes) > _abs64(b.m_cbBytes);
+}
+
+// Report the per-class differences between two images, largest growth (or shrinkage) first
+static void ReportDiff(const Image& oldImage, const Image& newImage)
+{
+	ClassStatsMap oldStats, newStats;
+	oldImage.CollectStats(oldStats);
+	newImage.CollectStats(newStats);
+
+	// Include classes which have disappeared from the new image
+	for (ClassStatsMap::const_iterator it = oldStats.begin(); it != oldStats.end(); ++it)
+		newStats[it->first];
+
+	std::vector<ClassDelta> deltas;
+	__int64 cbTotal = 0;
+	int nTotal = 0;
+	for (ClassStatsMap::const_iterator it = newStats.begin(); it != newStats.end(); ++it)
+	{
+		ClassStatsMap::const_iterator found = oldStats.find(it->first);
+		ClassStats before = found == oldStats.end() ? ClassStats() : found->second;
+		ClassDelta delta;
+		delta.m_strName = it->first;
+		delta.m_nInstances = int(it->second.nInstances) - int(before.nInstances);
+		delta.m_cbBytes = __int64(it->second.cbBytes) - __int64(before.cbBytes);
+		if (delta.m_nInstances != 0 || delta.m_cbBytes != 0)
+			deltas.push_back(delta);
+		nTotal += delta.m_nInstances;
+		cbTotal += delta.m_cbBytes;
+	}
+	std::sort(deltas.begin(), deltas.end(), LargerDelta);
+
+	if (s_bCSV)
+		printf("class,instancesDelta,bytesDelta\n");
+	else
+	{
+		printf("Differences from '%s' to '%s'\n", oldImage.m_strPath.c_str(), newImage.m_strPath.c_str());
+		printf("  File size: %+I64d bytes\n", __int64(newImage.m_cbFile) - __int64(oldImage.m_cbFile));
+		printf("  Objects: %+d, %+I64d bytes\n\n", nTotal, cbTotal);
+		printf("%-48s %10s %12s\n", "Class", "Instances", "Bytes");
+	}
+
+	for (size_t i=0;i<deltas.size();i++)
+	{
+		if (s_bCSV)
+			printf("\"%s\",%d,%I64d\n", deltas[i].m_strName.c_str(), deltas[i].m_nInstances, deltas[i].m_cbBytes);
+		else
+			printf("%-48s %+10d %+12I64d\n", deltas[i].m_strName.c_str(), deltas[i].m_nInstances, deltas[i].m_cbBytes);
+	}
+}
+
+static int Usage()
+{
+	fprintf(stderr, "Usage: ImageAnalyzer [-n <top>] [-c] <image> [<newer image>]\n"
+					"  Reports the contents of a saved image, or the differences between two images\n"
+					"  -n <top>  number of largest objects to list (default 20)\n"
+					"  -c        output in CSV format\n");
+	return 1;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* szImages[2] = { NULL, NULL };
+	int nImages = 0;
+	for (int i=1;i<argc;i++)
+	{
+		if (strcmp(argv[i], "-c") == 0)
+			s_bCSV = true;
+		else if (strcmp(argv[i], "-n") == 0 && i+1 < argc)
+			s_nTop = atoi(argv[++i]);
+		else if (argv[i][0] != '-' && nImages < 2)
+			szImages[nImages++] = argv[i];
+		else
+			return Usage();
+	}
+	if (nImages == 0)
+		return Usage();
+
+	Image image;
+	if (!image.Load(szImages[0]))
+		return 2;
+
+	if (nImages == 1)
+	{
+		ReportSummary(image);
+		ReportClasses(image);
+		ReportSizeHistogram(image);
+		ReportLargestObjects(image);
+	}
+	else
+	{
+		Image newImage;
+		if (!newImage.Load(szImages[1]))
+			return 2;
+		ReportDiff(image, newImage);
+	}
+
+	return 0;
+}
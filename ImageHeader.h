@@ -14,6 +14,8 @@ struct ImageHeader
 	struct 
 	{
 		DWORD		bIsCompressed:1;	// Whether or not this image has been compressed when saved
+		DWORD		bIsDelta:1;			// Whether this is an incremental image (see DeltaImageHeader)
+		DWORD		bIsBlockCompressed:1;	// Whether the data is in LZ4 compressed blocks (see BlockImageHeader)
 	} flags;
 
 	DWORD		nTableSize;			// Number of object table entries written
@@ -23,6 +25,37 @@ struct ImageHeader
 	DWORD		nMaxTableSize;		// The maximum size of OT table required by this image
 };
 
+// An incremental (delta) image has this header immediately after its ImageHeader. It is followed 
+// by the OT indices of the objects freed since the base image was written, and then a record 
+// (index, OTE, body) for each new or changed object. The OT itself is not written, and 
+// delta images are never compressed.
+struct DeltaImageHeader
+{
+	DWORD		dwBaseChecksum;		// Adler-32 of the entire base image file
+	DWORD		nBaseTableSize;		// Number of object table entries in the base image
+	DWORD		nChanged;			// Number of new/changed object records
+	DWORD		nFreed;				// Number of freed OT indices
+	char		szBaseImage[_MAX_PATH];	// Path of the base image (which may itself be a delta)
+};
+
+// A block compressed image has this header immediately after its ImageHeader, followed by
+// a BlockDescriptor for each block, and then the compressed blocks in order. Each block 
+// holds nBlockSize bytes of the data otherwise written directly to the file (the last may be
+// shorter), and is compressed independently so that blocks can be processed in parallel.
+struct BlockImageHeader
+{
+	DWORD		nBlockSize;			// Uncompressed size of each block
+	DWORD		nBlocks;			// Number of blocks
+	DWORD		cbData;				// Total uncompressed size of the data
+};
+
+struct BlockDescriptor
+{
+	DWORD		cbCompressed;		// Size of the LZ4 compressed block
+	DWORD		cbData;				// Uncompressed size of the block
+	DWORD		dwChecksum;			// Adler-32 of the uncompressed block
+};
+
 struct ISTImageHeader
 {
 	IMAGETYPE	imageType;			// Should be "IST"
@@ -16,6 +16,7 @@
 #include "OopQ.h"
 #include <fpieee.h>
 #include "InterpRegisters.h"
+#include "Isolate.h"
 
 #include "DolphinX.h"
 #include "bytecdes.h"
@@ -45,6 +46,19 @@
 	#define CHECKREFSNOFIX
 #endif
 
+#if defined(CPP_BYTECODELOOP) && defined(_DEBUG)
+	// Counts of the sequences of instructions executed by the C++ loop (see ByteLoop.cpp)
+	enum { ByteCodeSequenceTableSize = 65536 };
+	struct ByteCodeSequence
+	{
+		DWORD		m_opcodes;			// One per byte, the last in the low byte
+		unsigned	m_length;
+		unsigned	m_count;
+	};
+	extern ByteCodeSequence byteCodeSequences[ByteCodeSequenceTableSize];
+	extern unsigned byteCodeSequencesDropped;
+#endif
+
 // Entry point (from CPP) for invocation of assembler interpreter
 // This is where the stack overflow handling is carried out
 
@@ -86,6 +100,31 @@ public:
 	// Initialise
 	static HRESULT initializeAfterLoad();
 
+	// Send site cache statistics
+	struct SendSiteInfo
+	{
+		DWORD	methodIndex;			// OT index of the method containing the send
+		DWORD	ipOffset;				// Offset of the following instruction in its byte codes
+		DWORD	selectorIndex;
+		DWORD	nClasses;				// Greater than the maximum if megamorphic
+		DWORD	hits;
+		DWORD	misses;
+	};
+	static void SendSiteStatistics(DWORD* pnHits, DWORD* pnMisses, DWORD* pnMegamorphic);
+	static unsigned SendSiteSnapshot(SendSiteInfo* pSites, unsigned nMaxSites);
+
+	// Method cache profile saved alongside the image, used to pre-warm the cache (see MethodCacheProfile.cpp)
+	static void WarmMethodCache(const char* szImageName);
+	static bool SaveMethodCacheProfile(const char* szImageName);
+	static bool IsMethodCacheProfileEnabled();
+
+	// Sampling profiler (see MethodSampler.cpp)
+	enum { MaxSampleDepth = 64, MethodSampleCapacity = 4096 };
+	static bool SaveMethodSamples(const char* szFileName);
+
+	// Per-method activation counts (see MethodCounters.cpp)
+	static void EnableMethodCounters(bool bEnabled);
+
 	// To allow the ObjectMemory to account for objects referenced from the VM we maintain an "Array"
 	// to keep the ref. count on our behalf
 	//
@@ -347,6 +386,12 @@ private:
 	// Timer init and shutdown
 	static HRESULT initializeTimer();
 	static void terminateTimer();
+	static void initializeTimerWheel();
+	static void terminateTimerWheel();
+
+	// Asynchronous I/O init and shutdown
+	static void initializeAsyncIo();
+	static void terminateAsyncIo();
 
 private:
 	///////////////////////////////////////////////////////////////////////////
@@ -370,12 +415,20 @@ private:
 	static void __fastcall sendVMInterrupt(Oop nInterrupt, Oop argPointer);
 	static MethodOTE* __fastcall findNewMethodInClass(BehaviorOTE* classPointer, const unsigned argCount);
 	static MethodOTE* __stdcall findNewMethodInClassNoCache(BehaviorOTE* classPointer, const unsigned argCount);
+	static MethodOTE* __stdcall findNewMethodAtSendSite(BehaviorOTE* classPointer, const unsigned argCount);
 
 	static BOOL __stdcall MsgSendPoll();
 	static BOOL	__stdcall BytecodePoll();
+	static void parkAtSafepoint();
 	static BOOL sampleInput();
 	
 	static void __fastcall executeNewMethod(MethodOTE* methodOTE, unsigned argCount);
+#ifdef CPP_BYTECODELOOP
+	// C++ byte code loop (see ByteLoop.cpp), used in place of the assembler loop
+	static void interpretByteCodes();
+	static void __fastcall sendFromByteCode(SymbolOTE* selector, unsigned argCount);
+	static void __fastcall superSendFromByteCode(SymbolOTE* selector, unsigned argCount);
+#endif
 	static void __fastcall returnValueTo(Oop resultPointer, Oop contextPointer);
 	static void __fastcall returnValueToCaller(Oop resultPointer, Oop contextPointer);
 	static void __fastcall nonLocalReturnValueTo(Oop resultPointer, Oop contextPointer);
@@ -428,6 +481,20 @@ private:
 	#endif
 
 	static void CALLBACK TimeProc(UINT uID, UINT uMsg, DWORD dwUser, DWORD dw1, DWORD dw2);
+	#ifdef _DEBUG
+		static void checkTimerSemaphore();
+	#endif
+
+	// Timer wheel (see TimerWheel.cpp)
+	static SMALLINTEGER registerTimer(SemaphoreOTE* oteSemaphore, SMALLINTEGER microseconds);
+	static bool cancelTimer(SMALLINTEGER handle);
+	static void reapFiredTimers();
+	static void MarkTimerWheel();
+	static void CompactTimerWheel();
+
+	// Asynchronous I/O (see AsyncIO.cpp)
+	static void MarkAsyncIo();
+	static void CompactAsyncIo();
 
 	// Signal a semaphore; synchronously if no interrupts are pending, else asynchronously.
 	// May initiate a Process switch, but does not perform the actual context switch
@@ -441,6 +508,7 @@ public:
 	static void GrabAsyncProtect();
 	static void RelinquishAsyncProtect();
 	static void NotifyAsyncPending();
+	static void NotifySafepointRequested();
 	static bool QueueAPC(PAPCFUNC pfnAPC, DWORD dwClosure);
 	static void BeginAPC();
 	static BOOL SetWakeupEvent();
@@ -510,6 +578,31 @@ private:
 		static void ResetInputPollCounter();
 #endif
 
+private:
+	static HANDLE	m_hMethodSampleTimer;
+	static DWORD	m_dwMethodSampleInterval;
+
+	static void InitializeMethodSampler();
+	static void TerminateMethodSampler();
+	static HRESULT StartMethodSampler(DWORD dwInterval);
+	static void StopMethodSampler();
+	static VOID CALLBACK MethodSamplerProc(PVOID lpParam, BOOLEAN TimerOrWaitFired);
+
+	struct MethodCounter
+	{
+		DWORD	activations;
+		hash_t	idHash;					// Identity hash of the counted method
+	};
+	static MethodCounter*	m_pMethodCounters;	// Indexed by OT index, NULL unless counting enabled
+	static unsigned			m_nMethodCounters;
+
+	static void InitializeMethodCounters();
+	static void TerminateMethodCounters();
+	static void growMethodCounters();
+	static void __fastcall countMethodActivation(MethodOTE* oteMethod);
+	static void compactMethodCounters();
+	static bool isCountedMethod(unsigned index);
+
 public:
 	///////////////////////////////////////////////////////////////////////////
 	// Primitive Methods
@@ -689,6 +782,10 @@ private:
 
 	// Process primitives
 	static BOOL __fastcall primitiveSignalAtTick(CompiledMethod&, unsigned argumentCount);
+	static BOOL __fastcall primitiveSignalAfter(CompiledMethod&, unsigned argumentCount);
+	static BOOL __fastcall primitiveCancelTimer();
+	static BOOL __fastcall primitiveAsyncIoSubmit(CompiledMethod&, unsigned argumentCount);
+	static BOOL __fastcall primitiveAsyncIoRequest();
 	static BOOL __fastcall primitiveSignal(CompiledMethod&, unsigned argumentCount);
 	static BOOL __fastcall primitiveWait(CompiledMethod&, unsigned argumentCount);
 	static BOOL __fastcall primitiveResume(CompiledMethod&, unsigned argumentCount);
@@ -696,9 +793,17 @@ private:
 	static BOOL __fastcall primitiveSuspend();
 	static BOOL __fastcall primitiveSetSignals();
 	static BOOL __fastcall primitiveFlushCache();
+	static BOOL __fastcall primitiveMethodCacheStatistics();
 	static BOOL __fastcall primitiveInputSemaphore(CompiledMethod&, unsigned argumentCount);
 	static BOOL __fastcall primitiveSampleInterval();
+	static BOOL __fastcall primitiveSampleMethods();
+	static BOOL __fastcall primitiveMethodCounts();
+
+	// Bulk access primitives
+	static BOOL __fastcall primitiveReplacePointers();
+	static BOOL __fastcall primitiveFill(CompiledMethod&, unsigned argCount);
 	static BOOL __fastcall primitiveNewVirtual();
+	static BOOL __fastcall primitiveNewBorrowedView();
 	static BOOL __fastcall primitiveProcessPriority();
 	static BOOL __fastcall primitiveTerminateProcess();
 	static BOOL __fastcall primitiveMillisecondClockValue();
@@ -758,6 +863,10 @@ private:
 private:
 
 	static BOOL __stdcall callExternalFunction(FARPROC pProc, unsigned argCount, DolphinX::CallDescriptor* argTypes, BOOL isVirtual);
+
+	// External call stubs (see ExtCallStubs.cpp)
+	static BYTE* __fastcall lookupCallStub(CompiledMethod& method, unsigned argCount);
+	static void flushCallStubs();
 	
 	// Pushs object on stack instantiated from address, and returns size of object pushed
 	static void pushArgsAt(CallbackDescriptor* descriptor, unsigned argCount, BYTE* lpParms);
@@ -802,9 +911,11 @@ public:
 	enum {NumSpecialSelectors = 32};
 
 private:
-	// Method cache is a hash table with overwrite on collision
-	// If changing method cache size, then must also modify METHODCACHEWORDS in ISTASM.INC!
-	enum { MethodCacheSize = 1024 };
+	// Method cache is a 2-way set associative hash table, with LRU replacement within each set. The
+	// most recently used entry of a set is always first, and is the only one probed inline by the 
+	// assembler send routine (see execMethodOfClass in byteasm.asm). The size (a power of 2) is chosen
+	// on startup from the number of methods in the image, or the registry setting MethodCache\Size.
+	enum { MethodCacheWays = 2, MinMethodCacheSize = 1024, MaxMethodCacheSize = 65536 };
 	__declspec(align(16)) struct MethodCacheEntry 
 	{
 		// Note that the method cache must include the class, as if one tests against
@@ -817,7 +928,12 @@ private:
 		DWORD				primAddress;
 	};
 
-	static MethodCacheEntry methodCache[MethodCacheSize];
+	static MethodCacheEntry* methodCache;
+	static unsigned methodCacheSize;				// Number of entries (not sets)
+	static DWORD methodCacheMask;					// Mask for set index, pre-multiplied by sizeof(OTE)
+	static unsigned __int64 m_nMethodCacheHits;		// Counted inline in the assembler send routine
+	static unsigned __int64 m_nMethodCacheMisses;
+	static unsigned __int64 m_nMethodCacheEvictions;
 
 	__declspec(align(16)) struct AtCacheEntry
 	{
@@ -827,18 +943,80 @@ private:
 		int		type;
 	};
 
-	enum { AtCacheEntries = 16 };
+	// Direct mapped by OTE address, so objects with nearby OTEs (e.g. those allocated together) do not collide
+	enum { AtCacheEntries = 256 };
 	enum { AtCacheMask = (AtCacheEntries - 1)*16 };
 	enum { AtCachePointers = 0, AtCacheBytes, AtCacheString };
 
 	static AtCacheEntry AtCache[AtCacheEntries];
 	static AtCacheEntry AtPutCache[AtCacheEntries];
 
+	// Polymorphic inline caches for send sites, consulted before the global method cache. A site caches
+	// the methods for up to SendSiteClasses receiver classes, most recently used first, after which it
+	// is megamorphic and relies on the global cache alone. Sites are identified by the instruction pointer
+	// after the send, and held in a direct mapped table as there is no space in the CompiledMethods. The
+	// entries hold no references, so are purged and revalidated with those of the method cache.
+	// N.B. The layout must be kept in sync with istasm.inc
+	enum { SendSiteCacheSize = 2048, SendSiteClasses = 4, SendSiteMegamorphic = SendSiteClasses+1 };
+	struct SendSiteEntry
+	{
+		const BehaviorOTE*	classPointer;
+		MethodOTE*			method;
+	};
+
+	struct SendSiteCache
+	{
+		const BYTE*				ip;						// Instruction pointer after the send
+		const CompiledMethod*	pMethod;
+		const MethodOTE*		oteMethod;				// Not ref. counted, for reporting only
+		const SymbolOTE*		selector;
+		WORD					ipOffset;				// Offset of ip in the byte codes, for reporting
+		WORD					nClasses;				// SendSiteMegamorphic if too many
+		DWORD					hits;					// Sends satisfied by the site
+		DWORD					misses;
+		SendSiteEntry			entries[SendSiteClasses];
+	};
+
+	static SendSiteCache sendSiteCache[SendSiteCacheSize];
+	static DWORD m_nSendSiteHits;
+	static DWORD m_nSendSiteMisses;
+	static DWORD m_nMegamorphicMisses;
+
+#ifdef BASELINE_JIT
+	// Methods counted for, or compiled by, the baseline JIT (see NativeCode.cpp). Direct mapped
+	// by the method's OTE, and validated against the method body in case the OTE has been reused.
+	enum { NativeMethodTableSize = 4096, NativeCompileThreshold = 1000 };
+	struct NativeMethod
+	{
+		MethodOTE*				oteMethod;
+		const CompiledMethod*	pMethod;
+		Oop						byteCodes;
+		DWORD					nActivations;
+		BYTE*					pCode;					// NULL until compiled
+		WORD*					entryPoints;			// Native code offset for each IP, if it can be entered there
+	};
+	static NativeMethod nativeMethods[NativeMethodTableSize];
+
+	static BOOL __fastcall runNativeCode(bool bActivation);
+	static bool compileNativeMethod(NativeMethod& native);
+	static void flushNativeCode();
+#endif
+
 	static void flushCaches();
 	static void flushAtCaches();
+	static void purgeObjectFromAtCaches(const OTE* ote);
 	static void initializeCaches();
+	static bool cacheMethodLookup(BehaviorOTE* classPointer, SymbolOTE* selector);
+	static MethodCacheEntry* methodCacheSet(const BehaviorOTE* classPointer, const SymbolOTE* selector);
+	static MethodOTE* findCachedMethod(const BehaviorOTE* classPointer, const SymbolOTE* selector);
+	static void cacheMethod(const BehaviorOTE* classPointer, const SymbolOTE* selector, MethodOTE* oteMethod);
+	static void allocateMethodCache(unsigned nEntries);
 	//static unsigned __fastcall cacheHash(Oop classPointer, Oop messageSelector);
 	static void purgeObjectFromCaches(OTE*);
+	static void purgeSelectorFromCaches(const SymbolOTE* selector);
+	static void purgeClassFromCaches(const BehaviorOTE* classPointer);
+	static void purgeFreeFromCaches();
+	static void compactCaches();
 	
 	enum { FIXEDVMREFERENCES };
 	enum { SIGNALQGROWTH=32, SIGNALQSIZE=64 };
@@ -869,8 +1047,7 @@ private:
 	static HWND	 m_hWndVM;
 
 	// Context related registers
-	static DWORD				m_dwThreadId;	// Interpreter thread
-	static HANDLE				m_hThread;
+	static Isolate*				m_pIsolate;		// Running on this interpreter thread
 	static ProcessorScheduler*	m_pProcessor;
 	static InterpreterRegisters16 m_registers;
 
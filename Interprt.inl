@@ -168,12 +168,12 @@ inline bool Interpreter::IsShuttingDown()
 
 inline DWORD Interpreter::MainThreadId()
 {
-	return m_dwThreadId;
+	return m_pIsolate ? m_pIsolate->ThreadId() : 0;
 }
 
 inline HANDLE Interpreter::MainThreadHandle()
 {
-	return m_hThread;
+	return m_pIsolate ? m_pIsolate->ThreadHandle() : NULL;
 }
 
 inline InterpreterRegisters& Interpreter::GetRegisters() 
@@ -212,6 +212,15 @@ inline void	Interpreter::NotifyAsyncPending()
 	::InterlockedExchange((LPLONG)m_pbAsyncPending, TRUE);
 }
 
+// Make the interpreter poll at the next opportunity so that it parks at the requested safepoint. Unlike
+// other async events, the normal flag is set even when interrupts are disabled, as the wait must be bounded.
+inline void Interpreter::NotifySafepointRequested()
+{
+	::InterlockedExchange((LPLONG)&m_bAsyncPending, TRUE);
+	// In case the idle process has put the VM to sleep
+	SetWakeupEvent();
+}
+
 #define ACEAt(cache,offset) (reinterpret_cast<AtCacheEntry*>(reinterpret_cast<BYTE*>(&cache[0])+atCacheOffset))
 
 inline void Interpreter::purgeObjectFromCaches(OTE* ote)
@@ -0,0 +1,148 @@
+/******************************************************************************
+
+	File: Isolate.cpp
+
+	Description:
+
+	Creation and destruction of isolates, and safepoints, see Isolate.h
+
+******************************************************************************/
+#include "Ist.h"
+
+#pragma code_seg(INIT_SEG)
+
+#include "Isolate.h"
+#include "ObjMem.h"
+#include "Interprt.h"
+#include "InterprtProc.inl"
+
+// The TLS index is allocated when the first isolate is created, and is never released, as the
+// VM may be restarted in the same process
+DWORD Isolate::s_dwTlsIndex = TLS_OUT_OF_INDEXES;
+Isolate* volatile Isolate::s_pRunning;
+
+HRESULT Isolate::Create(const char* szImagePath, Isolate*& pIsolate)
+{
+	pIsolate = NULL;
+
+	if (s_dwTlsIndex == TLS_OUT_OF_INDEXES)
+	{
+		DWORD dwIndex = ::TlsAlloc();
+		if (dwIndex == TLS_OUT_OF_INDEXES)
+			return HRESULT_FROM_WIN32(::GetLastError());
+		if (DWORD(::InterlockedCompareExchange(reinterpret_cast<LONG volatile*>(&s_dwTlsIndex), dwIndex, TLS_OUT_OF_INDEXES)) != TLS_OUT_OF_INDEXES)
+			// Another thread got there first
+			::TlsFree(dwIndex);
+	}
+
+	Isolate* pNew = new Isolate;
+	pNew->m_dwThreadId = ::GetCurrentThreadId();
+	HANDLE hProc = ::GetCurrentProcess();
+	HANDLE hThread;
+	if (!::DuplicateHandle(hProc, ::GetCurrentThread(), hProc, &hThread, 0, FALSE, DUPLICATE_SAME_ACCESS))
+	{
+		HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+		delete pNew;
+		return hr;
+	}
+	pNew->m_hThread = hThread;
+	strncpy_s(pNew->m_szImagePath, szImagePath, _TRUNCATE);
+
+	::InitializeCriticalSection(&pNew->m_csSafepoint);
+	pNew->m_hSafepointParked = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+	pNew->m_hSafepointResume = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (pNew->m_hSafepointParked == NULL || pNew->m_hSafepointResume == NULL)
+	{
+		HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+		pNew->Destroy();
+		return hr;
+	}
+
+	// The interpreter and object memory state is shared, so only one isolate can be running
+	if (::InterlockedCompareExchangePointer(reinterpret_cast<PVOID volatile*>(&s_pRunning), pNew, NULL) != NULL)
+	{
+		pNew->Destroy();
+		return HRESULT_FROM_WIN32(ERROR_BUSY);
+	}
+
+	::TlsSetValue(s_dwTlsIndex, pNew);
+	pIsolate = pNew;
+	return S_OK;
+}
+
+#pragma code_seg()
+
+///////////////////////////////////////////////////////////////////////////////
+// Safepoints
+//
+// The state moves from idle to requested under the requester's lock, then to parked when the
+// interpreter acknowledges the request, and back to idle on release. If the request times out the
+// requester withdraws it, unless the interpreter parked in the meantime, in which case the request
+// succeeds after all. Whichever thread makes a transition out of the requested state therefore
+// decides the outcome, and the events are each set exactly once for each successful request.
+
+HRESULT Isolate::RequestSafepoint(DWORD dwTimeout)
+{
+	HARDASSERT(::GetCurrentThreadId() != m_dwThreadId);
+
+	::EnterCriticalSection(&m_csSafepoint);
+	HARDASSERT(m_lSafepointState == SafepointIdle);
+
+	::InterlockedExchange(&m_lSafepointState, SafepointRequested);
+	Interpreter::NotifySafepointRequested();
+
+	if (::WaitForSingleObject(m_hSafepointParked, dwTimeout) != WAIT_OBJECT_0)
+	{
+		if (::InterlockedCompareExchange(&m_lSafepointState, SafepointIdle, SafepointRequested) == SafepointRequested)
+		{
+			::LeaveCriticalSection(&m_csSafepoint);
+			return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+		}
+
+		// Parked just too late, but the event is set or about to be
+		::WaitForSingleObject(m_hSafepointParked, INFINITE);
+	}
+
+	return S_OK;
+}
+
+void Isolate::ReleaseSafepoint()
+{
+	HARDASSERT(m_lSafepointState == SafepointParked);
+
+	::InterlockedExchange(&m_lSafepointState, SafepointIdle);
+	::SetEvent(m_hSafepointResume);
+	::LeaveCriticalSection(&m_csSafepoint);
+}
+
+// The interpreter is at a safe point, so wait there until the pending request (if any) is released
+void Isolate::ParkAtSafepoint()
+{
+	HARDASSERT(::GetCurrentThreadId() == m_dwThreadId);
+
+	if (::InterlockedCompareExchange(&m_lSafepointState, SafepointParked, SafepointRequested) == SafepointRequested)
+	{
+		::SetEvent(m_hSafepointParked);
+		::WaitForSingleObject(m_hSafepointResume, INFINITE);
+	}
+}
+
+#pragma code_seg(TERM_SEG)
+
+// Release the isolate, which must have been shut down and no longer have any threads running in it,
+// or waiting to request a safepoint
+void Isolate::Destroy()
+{
+	HANDLE hThread = ReleaseThreadHandle();
+	if (hThread != NULL)
+		::CloseHandle(hThread);
+	if (m_hSafepointParked != NULL)
+		::CloseHandle(m_hSafepointParked);
+	if (m_hSafepointResume != NULL)
+		::CloseHandle(m_hSafepointResume);
+	::DeleteCriticalSection(&m_csSafepoint);
+	if (Current() == this)
+		::TlsSetValue(s_dwTlsIndex, NULL);
+	::InterlockedCompareExchangePointer(reinterpret_cast<PVOID volatile*>(&s_pRunning), NULL, this);
+	delete this;
+}
@@ -0,0 +1,107 @@
+/******************************************************************************
+
+	File: Isolate.h
+
+	Description:
+
+	An isolate is an instance of the VM: an image loaded into an object memory,
+	and the interpreter thread that runs it. The isolate whose interpreter
+	thread is the calling thread is reachable through a thread local, so that
+	entry points called on arbitrary threads (e.g. callbacks) can tell whether
+	they are running in an isolate, and which.
+
+	This does NOT provide multiple isolated VM instances per process. An
+	isolate holds only the image path, the interpreter thread's id and handle,
+	and the safepoint state. The registers, caches, object table, Zct, pools
+	and the rest of the state of the Interpreter and ObjectMemory are still
+	static, so only one isolate can be running in a process at a time. An
+	attempt to create a second fails with ERROR_BUSY, rather than corrupting
+	the state of the first.
+
+	Running several isolates in one process would need all of that state to
+	move here, in two stages:
+
+	1.	State used only from C++ (the async and finalization queues, the
+		timer, async I/O and overlapped call state, the Zct and the pools).
+		The interpreter thread reaches it through Current(). Other threads
+		that signal or queue interrupts (timer, I/O completion, overlapped
+		calls) must be given their isolate when they are registered, as
+		Current() is NULL for them.
+	2.	State also addressed from the assembler modules (the registers, the
+		method, send site and at caches, the OT base and the Pointers). The
+		modules refer to it through absolute EQUs. Each would become an
+		offset within the isolate, based on a callee saved register loaded
+		from the isolate's TLS slot on entry to the interpreter and on entry
+		to each routine called from C++.
+
+	Neither stage is done.
+
+	Other threads (e.g. helpers for the collector, snapshotting, or profiling)
+	must not otherwise read object memory while the interpreter is running, as
+	objects may be changed, freed, or moved by compaction at any time. Such a
+	thread can instead request a safepoint, which parks the interpreter at its
+	next poll for asynchronous events (i.e. on the next message send or
+	backwards jump, or when woken from idle), and then has object memory to
+	itself until it releases the safepoint. Requests are serialized, and a
+	request fails if the interpreter has not parked within the timeout, e.g.
+	because it is blocked in a long running external call.
+
+******************************************************************************/
+
+#ifndef _IST_ISOLATE_H
+#define _IST_ISOLATE_H
+
+class Isolate
+{
+public:
+	// Create an isolate for the image at the specified path, with the calling thread as its
+	// interpreter thread. Fails if another isolate is already running in the process.
+	static HRESULT Create(const char* szImagePath, Isolate*& pIsolate);
+	void Destroy();
+
+	// Answer the isolate of which the calling thread is the interpreter thread, or NULL
+	static Isolate* Current()				{ return static_cast<Isolate*>(::TlsGetValue(s_dwTlsIndex)); }
+	// Answer the isolate that owns the shared interpreter and object memory state, or NULL
+	static Isolate* Running()				{ return s_pRunning; }
+
+	DWORD ThreadId() const					{ return m_dwThreadId; }
+	HANDLE ThreadHandle() const				{ return m_hThread; }
+	const char* ImagePath() const			{ return m_szImagePath; }
+
+	// Answer the interpreter thread handle, which is then no longer available to other threads
+	// for queueing APCs, etc. The caller is responsible for closing it.
+	HANDLE ReleaseThreadHandle()
+	{
+		return reinterpret_cast<HANDLE>(::InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(&m_hThread), NULL));
+	}
+
+	// Safepoints. Request and release are called on other threads, never the interpreter thread.
+	// If the request succeeds, it must be followed by a release on the same thread.
+	HRESULT RequestSafepoint(DWORD dwTimeout);
+	void ReleaseSafepoint();
+
+	// Called by the interpreter thread when polling
+	bool IsSafepointRequested() const		{ return m_lSafepointState == SafepointRequested; }
+	void ParkAtSafepoint();
+
+private:
+	Isolate() : m_dwThreadId(0), m_hThread(NULL), m_lSafepointState(SafepointIdle),
+		m_hSafepointParked(NULL), m_hSafepointResume(NULL) { m_szImagePath[0] = 0; }
+	~Isolate() {}
+
+	enum { SafepointIdle, SafepointRequested, SafepointParked };
+
+	DWORD				m_dwThreadId;			// Interpreter thread
+	HANDLE volatile		m_hThread;
+	char				m_szImagePath[_MAX_PATH];
+
+	CRITICAL_SECTION	m_csSafepoint;			// Held by the requester from request to release
+	LONG volatile		m_lSafepointState;
+	HANDLE				m_hSafepointParked;		// Auto-reset, set by the interpreter when it parks
+	HANDLE				m_hSafepointResume;		// Auto-reset, set by the requester to unpark the interpreter
+
+	static DWORD		s_dwTlsIndex;
+	static Isolate* volatile s_pRunning;
+};
+
+#endif
@@ -8,7 +8,7 @@ int ImageFileMapping::Open(LPCSTR szImageName)
 	// Open the image file
 	m_hFile = CreateFile(szImageName,
 				GENERIC_READ,
-				FILE_SHARE_WRITE,	// Prevent anyone else writing to the file while mapped
+				FILE_SHARE_READ,	// Prevent anyone else writing to the file while mapped
 				NULL,
 				OPEN_EXISTING,
 				FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
@@ -0,0 +1,483 @@
+/******************************************************************************
+
+	File: LazyLoad.cpp
+
+	Description:
+
+	Demand loading of cold objects. When enabled, byte objects over a threshold
+	size in an uncompressed image are not copied out of the image on load. Instead
+	each is assigned a location in a region that is initially inaccessible, and the
+	bodies are copied in a page at a time from the mapped image when first touched,
+	i.e. from a vectored exception handler on the resulting access violation.
+	Deployed images have a great many byte code arrays, strings, etc, that are
+	never touched in a typical run.
+
+	The region is a view of a section backed by the paging file, with a second,
+	writable, view through which each page is filled before it is made accessible
+	in the first, so no thread can ever see a partially loaded page.
+
+	The kernel does not raise exceptions when a system call touches an
+	inaccessible page, but fails the call (typically with ERROR_NOACCESS), so
+	the objects must be loaded before their addresses are passed to external
+	code. The external call routines do this for arguments that point into the
+	region (see MaterializeLazyReferences), as do the asynchronous I/O primitives
+	for their buffers. Addresses of lazy objects stored into structures passed
+	to external functions are not detected.
+
+	Only byte objects are loaded lazily, since the bodies of pointer objects are
+	traversed by the collector. Demand loaded objects are in HeapSpace; when freed
+	their space in the region is not reused, and when resized they move to the heap.
+
+******************************************************************************/
+#include "ist.h"
+#include "binstream.h"
+#include "objmem.h"
+#include "interprt.h"
+#include "regkey.h"
+#include "CritSect.h"
+
+#if !defined(LAZYLOADING)
+	#error Demand loading is not supported by this VM
+#endif
+
+#ifndef _DEBUG
+	#pragma optimize("s", on)
+	#pragma auto_inline(off)
+#endif
+
+// A byte object whose body remains in the image
+struct LazyObject
+{
+	MWORD		m_offset;					// Offset of the body in the lazy region
+	MWORD		m_byteSize;
+	const BYTE*	m_pSource;					// Body in the image
+};
+
+static const imbinstream*	s_pLazyStream;		// Stream over the image being loaded, if lazy loading
+static int					s_nSourceBias;		// Offset from the image being loaded to the persistent copy
+static MWORD				s_cbLazyThreshold;	// Minimum size of object to be demand loaded
+static BYTE*				s_pLazyRegion;		// View at which demand loaded objects are located, no access until loaded
+static BYTE*				s_pLazyFill;		// Writable view of the same pages, through which they are loaded
+static HANDLE				s_hLazySection;
+static MWORD				s_cbLazyRegion;
+static LazyObject*			s_pLazyObjects;		// In order of location
+static unsigned				s_nLazyObjects;
+static unsigned				s_nMaxLazyObjects;
+static bool*				s_pLazyLoaded;		// Whether each lazy object has yet been touched
+static unsigned				s_nLazyLoaded;
+static BYTE*				s_pCommitted;		// Whether each page of the region has been loaded (and is accessible)
+static HANDLE				s_hImageFile;
+static HANDLE				s_hImageMapping;
+static const BYTE*			s_pImageView;
+static PVOID				s_hExceptionHandler;
+static CMonitor				s_lazyLoadMonitor;
+
+unsigned ObjectMemory::m_nLazyPagesUnloaded;
+
+///////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+static void CloseImageMapping()
+{
+	if (s_pImageView)
+	{
+		::UnmapViewOfFile(s_pImageView);
+		s_pImageView = NULL;
+	}
+	if (s_hImageMapping)
+	{
+		::CloseHandle(s_hImageMapping);
+		s_hImageMapping = NULL;
+	}
+	if (s_hImageFile)
+	{
+		::CloseHandle(s_hImageFile);
+		s_hImageFile = NULL;
+	}
+}
+
+static void ReleaseLazyRegion()
+{
+	if (s_pLazyRegion)
+	{
+		::UnmapViewOfFile(s_pLazyRegion);
+		s_pLazyRegion = NULL;
+	}
+	if (s_pLazyFill)
+	{
+		::UnmapViewOfFile(s_pLazyFill);
+		s_pLazyFill = NULL;
+	}
+	if (s_hLazySection)
+	{
+		::CloseHandle(s_hLazySection);
+		s_hLazySection = NULL;
+	}
+	s_cbLazyRegion = 0;
+}
+
+// Answer a view of the image file that will remain valid after the image has loaded,
+// or NULL if none can be established
+static const BYTE* PersistentImage(const char* szImageName, const BYTE* pImageBytes, UINT imageSize)
+{
+	// Images bound into an executable (e.g. To Go applications) remain mapped with their module
+	HMODULE hModule;
+	if (::GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS|GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+							reinterpret_cast<LPCSTR>(pImageBytes), &hModule))
+		return pImageBytes;
+
+	// Otherwise map the image file ourselves, as the launcher's mapping will not outlive the load
+	s_hImageFile = ::CreateFile(szImageName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (s_hImageFile == INVALID_HANDLE_VALUE)
+	{
+		s_hImageFile = NULL;
+		return NULL;
+	}
+
+	if (::GetFileSize(s_hImageFile, NULL) == imageSize)
+	{
+		s_hImageMapping = ::CreateFileMapping(s_hImageFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (s_hImageMapping != NULL)
+			s_pImageView = static_cast<const BYTE*>(::MapViewOfFile(s_hImageMapping, FILE_MAP_READ, 0, 0, 0));
+	}
+
+	// Must be the same image (the header includes the identity hash counter, which changes on every save)
+	if (s_pImageView == NULL || memcmp(s_pImageView, pImageBytes, sizeof(ISTImageHeader)) != 0)
+	{
+		CloseImageMapping();
+		return NULL;
+	}
+
+	return s_pImageView;
+}
+
+// Answer the index of the first lazy object that ends after the specified offset in the region
+static unsigned FindLazyObject(MWORD offset)
+{
+	unsigned lo = 0, hi = s_nLazyObjects;
+	while (lo < hi)
+	{
+		unsigned mid = (lo+hi)/2;
+		const LazyObject& object = s_pLazyObjects[mid];
+		if (object.m_offset + object.m_byteSize <= offset)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Load the page of the lazy region containing the specified address, answering whether it was loaded
+static bool MaterializeLazyPage(const BYTE* pFault)
+{
+	const MWORD pageOffset = MWORD(pFault - s_pLazyRegion) & ~(dwPageSize-1);
+	const unsigned nPage = pageOffset/dwPageSize;
+
+	CMonitorLock lock(s_lazyLoadMonitor);
+	// Another thread may have got here first
+	if (s_pCommitted[nPage])
+		return true;
+
+	// Copy the overlapping part of each object on the page into the writable view. The page remains
+	// inaccessible at the objects' location until it is complete.
+	const MWORD pageEnd = pageOffset + dwPageSize;
+	const unsigned first = FindLazyObject(pageOffset);
+	unsigned i;
+	for (i=first;i<s_nLazyObjects && s_pLazyObjects[i].m_offset < pageEnd;i++)
+	{
+		const LazyObject& object = s_pLazyObjects[i];
+		const MWORD start = max(object.m_offset, pageOffset);
+		const MWORD end = min(object.m_offset + object.m_byteSize, pageEnd);
+		memcpy(s_pLazyFill + start, object.m_pSource + (start - object.m_offset), end - start);
+	}
+
+	DWORD dwOldProtect;
+	if (!::VirtualProtect(s_pLazyRegion + pageOffset, dwPageSize, PAGE_READWRITE, &dwOldProtect))
+		return false;
+
+	for (unsigned j=first;j<i;j++)
+	{
+		if (!s_pLazyLoaded[j])
+		{
+			s_pLazyLoaded[j] = true;
+			s_nLazyLoaded++;
+		}
+	}
+	s_pCommitted[nPage] = true;
+	ObjectMemory::m_nLazyPagesUnloaded--;
+	return true;
+}
+
+// Load any pages of the lazy region in the specified range of offsets
+static void MaterializeLazyPages(MWORD start, MWORD end)
+{
+	for (MWORD offset = start & ~(dwPageSize-1); offset < end; offset += dwPageSize)
+	{
+		if (!s_pCommitted[offset/dwPageSize])
+			MaterializeLazyPage(s_pLazyRegion + offset);
+	}
+}
+
+// Vectored handler, and so first in line for all access violations on all threads
+static LONG CALLBACK LazyLoadExceptionHandler(PEXCEPTION_POINTERS pExInfo)
+{
+	EXCEPTION_RECORD* pExRec = pExInfo->ExceptionRecord;
+	if (pExRec->ExceptionCode == EXCEPTION_ACCESS_VIOLATION)
+	{
+		const BYTE* pFault = reinterpret_cast<const BYTE*>(pExRec->ExceptionInformation[1]);
+		if (pFault >= s_pLazyRegion && pFault < s_pLazyRegion + s_cbLazyRegion && MaterializeLazyPage(pFault))
+			return EXCEPTION_CONTINUE_EXECUTION;
+	}
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Loading
+
+#pragma code_seg(INIT_SEG)
+
+// Called before loading an uncompressed image to decide whether objects are to be left in it.
+// Enabled by setting the ObjMem\LazyLoadThreshold registry value to the minimum object size.
+void ObjectMemory::PrepareLazyLoad(const char* szImageName, const BYTE* pImageBytes, UINT imageSize, const imbinstream& imageFile)
+{
+	s_pLazyStream = NULL;
+
+	CRegKey rkObjMem;
+	DWORD dwThreshold = 0;
+	if (OpenDolphinKey(rkObjMem, "ObjMem", KEY_READ) == ERROR_SUCCESS)
+		rkObjMem.QueryDWORDValue("LazyLoadThreshold", dwThreshold);
+	if (dwThreshold == 0)
+		return;
+
+	const BYTE* pPersistent = PersistentImage(szImageName, pImageBytes, imageSize);
+	if (pPersistent == NULL)
+	{
+		trace("Unable to map '%s', demand loading disabled\n", szImageName);
+		return;
+	}
+
+	s_cbLazyThreshold = dwThreshold;
+	s_nSourceBias = pPersistent - pImageBytes;
+	s_pLazyStream = &imageFile;
+}
+
+// Answer whether the specified OTE (which has not yet been fixed up) is for an object that could be demand loaded
+bool ObjectMemory::IsLazyCandidate(const OTE* ote, const ImageHeader* pHeader)
+{
+	if (ote->isFree() || ote->isPointers() || ote->heapSpace() == OTEFlags::VirtualSpace || ote->sizeOf() < s_cbLazyThreshold)
+		return false;
+
+	// Some objects are patched by FixupObject, and so must be loaded immediately
+	const OTE* classPointer = pointerFromIndex(reinterpret_cast<OTE*>(ote->m_oteClass) - static_cast<OTE*>(pHeader->BasePointer));
+	return classPointer != reinterpret_cast<OTE*>(_Pointers.ClassExternalHandle)
+			&& classPointer != reinterpret_cast<OTE*>(_Pointers.ClassContext);
+}
+
+// Called once the object table and permanent objects have been loaded to reserve space for the objects to be
+// loaded on demand
+void ObjectMemory::BeginLazyLoad(const ImageHeader* pHeader)
+{
+	if (s_pLazyStream == NULL)
+		return;
+
+#ifdef DELTAIMAGES
+	// Taking the digests touches every object
+	if (IsTrackingDeltas())
+	{
+		s_pLazyStream = NULL;
+		return;
+	}
+#endif
+
+	unsigned nObjects = 0;
+	MWORD cbObjects = 0;
+	const OTE* pEnd = m_pOT + pHeader->nTableSize;
+	for (const OTE* ote = m_pOT+NumPermanent; ote < pEnd; ote++)
+	{
+		if (IsLazyCandidate(ote, pHeader))
+		{
+			nObjects++;
+			cbObjects += _ROUND2(ote->sizeOf(), sizeof(MWORD));
+		}
+	}
+
+	if (nObjects == 0)
+	{
+		s_pLazyStream = NULL;
+		return;
+	}
+
+	// The section is committed against the paging file, but pages are only allocated when loaded
+	s_cbLazyRegion = _ROUND2(cbObjects, dwPageSize);
+	s_hLazySection = ::CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE|SEC_COMMIT, 0, s_cbLazyRegion, NULL);
+	if (s_hLazySection != NULL)
+	{
+		s_pLazyRegion = static_cast<BYTE*>(::MapViewOfFile(s_hLazySection, FILE_MAP_WRITE, 0, 0, 0));
+		s_pLazyFill = static_cast<BYTE*>(::MapViewOfFile(s_hLazySection, FILE_MAP_WRITE, 0, 0, 0));
+	}
+	DWORD dwOldProtect;
+	if (s_pLazyRegion == NULL || s_pLazyFill == NULL
+			|| !::VirtualProtect(s_pLazyRegion, s_cbLazyRegion, PAGE_NOACCESS, &dwOldProtect))
+	{
+		ReleaseLazyRegion();
+		s_pLazyStream = NULL;
+		return;
+	}
+
+	s_pLazyObjects = new LazyObject[nObjects];
+	s_nMaxLazyObjects = nObjects;
+	s_nLazyObjects = 0;
+	s_pLazyLoaded = new bool[nObjects];
+	memset(s_pLazyLoaded, 0, nObjects*sizeof(bool));
+	s_nLazyLoaded = 0;
+	const unsigned nPages = s_cbLazyRegion/dwPageSize;
+	s_pCommitted = new BYTE[nPages];
+	memset(s_pCommitted, 0, nPages);
+	m_nLazyPagesUnloaded = nPages;
+
+	s_hExceptionHandler = ::AddVectoredExceptionHandler(TRUE, LazyLoadExceptionHandler);
+}
+
+// Leave the body of an object in the image to be loaded on demand, if it is a candidate. Answers
+// false if the object should be loaded normally.
+bool ObjectMemory::LoadLazyObject(OTE* ote, ibinstream& imageFile, const ImageHeader* pHeader)
+{
+	if (&imageFile != s_pLazyStream || s_nLazyObjects == s_nMaxLazyObjects || !IsLazyCandidate(ote, pHeader))
+		return false;
+
+	const MWORD byteSize = ote->sizeOf();
+	const BYTE* pSource = s_pLazyStream->current() + s_nSourceBias;
+	if (!const_cast<imbinstream*>(s_pLazyStream)->skip(byteSize))
+		// Truncated, let the normal load report the error
+		return false;
+
+	LazyObject& object = s_pLazyObjects[s_nLazyObjects];
+	object.m_offset = s_nLazyObjects == 0
+						? 0
+						: _ROUND2(s_pLazyObjects[s_nLazyObjects-1].m_offset + s_pLazyObjects[s_nLazyObjects-1].m_byteSize, sizeof(MWORD));
+	object.m_byteSize = byteSize;
+	object.m_pSource = pSource;
+	s_nLazyObjects++;
+
+	ote->m_location = reinterpret_cast<POBJECT>(s_pLazyRegion + object.m_offset);
+	ote->m_flags.m_space = OTEFlags::HeapSpace;
+	return true;
+}
+
+// Called when the image has been loaded (or failed to load), after which no more objects can be made lazy
+void ObjectMemory::EndLazyLoad()
+{
+	if (s_pLazyStream == NULL)
+		return;
+
+	s_pLazyStream = NULL;
+	#ifdef _DEBUG
+		TRACESTREAM << dec << s_nLazyObjects << " objects (" << s_cbLazyRegion << " bytes) to be loaded on demand" << endl;
+	#endif
+}
+
+#pragma code_seg(MEM_SEG)
+
+// Load the whole of any demand loaded object to which one of the values points, before the values are
+// passed to external code, which cannot fault the pages in. Values are examined regardless of their
+// type, so an integer that happens to fall within the region may cause an object to be loaded early.
+void ObjectMemory::MaterializeLazyReferences(const DWORD* pValues, const DWORD* pEnd)
+{
+	for (;pValues < pEnd && m_nLazyPagesUnloaded != 0;pValues++)
+	{
+		const BYTE* p = reinterpret_cast<const BYTE*>(*pValues);
+		if (p < s_pLazyRegion || p >= s_pLazyRegion + s_cbLazyRegion)
+			continue;
+
+		const MWORD offset = p - s_pLazyRegion;
+		const unsigned i = FindLazyObject(offset);
+		if (i < s_nLazyObjects && s_pLazyObjects[i].m_offset <= offset)
+			MaterializeLazyPages(s_pLazyObjects[i].m_offset, s_pLazyObjects[i].m_offset + s_pLazyObjects[i].m_byteSize);
+		else
+			// Padding, or beyond the last object
+			MaterializeLazyPages(offset, offset+1);
+	}
+}
+
+// Load any part of the lazy region overlapping the specified memory, e.g. an I/O buffer
+void ObjectMemory::MaterializeLazyBytes(const void* pBytes, MWORD cb)
+{
+	if (m_nLazyPagesUnloaded == 0 || cb == 0)
+		return;
+
+	const BYTE* pStart = max(static_cast<const BYTE*>(pBytes), s_pLazyRegion);
+	const BYTE* pEnd = min(static_cast<const BYTE*>(pBytes) + cb, s_pLazyRegion + s_cbLazyRegion);
+	if (pStart < pEnd)
+		MaterializeLazyPages(pStart - s_pLazyRegion, pEnd - s_pLazyRegion);
+}
+
+// Answer whether the specified file is the image file from which objects are being loaded
+static bool IsLazyImageFile(const char* szFileName)
+{
+	// No access is requested, so this does not conflict with the sharing mode of our own handle
+	HANDLE hFile = ::CreateFile(szFileName, 0, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	BY_HANDLE_FILE_INFORMATION info, imageInfo;
+	bool bSame = ::GetFileInformationByHandle(hFile, &info) && ::GetFileInformationByHandle(s_hImageFile, &imageInfo)
+					&& info.dwVolumeSerialNumber == imageInfo.dwVolumeSerialNumber
+					&& info.nFileIndexHigh == imageInfo.nFileIndexHigh && info.nFileIndexLow == imageInfo.nFileIndexLow;
+	::CloseHandle(hFile);
+	return bSame;
+}
+
+// If the specified file is the image file, load all the objects remaining in it, and release it,
+// so that it can be overwritten or renamed. Answers false if the objects could not be loaded.
+bool ObjectMemory::ReleaseLazyImage(const char* szFileName)
+{
+	if (s_pImageView == NULL || !IsLazyImageFile(szFileName))
+		return true;
+
+	const unsigned nPages = s_cbLazyRegion/dwPageSize;
+	for (unsigned i=0;i<nPages;i++)
+	{
+		if (!s_pCommitted[i] && !MaterializeLazyPage(s_pLazyRegion + i*dwPageSize))
+			return false;
+	}
+
+	CloseImageMapping();
+	return true;
+}
+
+#pragma code_seg(TERM_SEG)
+
+void ObjectMemory::TerminateLazyLoad()
+{
+	if (s_hExceptionHandler)
+	{
+		::RemoveVectoredExceptionHandler(s_hExceptionHandler);
+		s_hExceptionHandler = NULL;
+
+		trace("%u of %u demand loadable objects were loaded\n", s_nLazyLoaded, s_nLazyObjects);
+	}
+
+	ReleaseLazyRegion();
+	m_nLazyPagesUnloaded = 0;
+
+	delete[] s_pLazyObjects;
+	s_pLazyObjects = NULL;
+	s_nLazyObjects = s_nMaxLazyObjects = 0;
+	delete[] s_pLazyLoaded;
+	s_pLazyLoaded = NULL;
+	s_nLazyLoaded = 0;
+	delete[] s_pCommitted;
+	s_pCommitted = NULL;
+
+	CloseImageMapping();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Statistics
+
+// Answer the number of objects left in the image on load, and the number of those since touched
+extern "C" void __stdcall LazyLoadStatistics(DWORD* pnLazy, DWORD* pnLoaded)
+{
+	*pnLazy = s_nLazyObjects;
+	*pnLoaded = s_nLazyLoaded;
+}
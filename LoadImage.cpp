@@ -18,6 +18,7 @@
 #ifndef _AFX
 	//#include "zfbinstream.h"
 	#include "zbinstream.h"
+	#include "blockbinstream.h"
 #endif
 #include "objmem.h"
 #include "ObjMemPriv.inl"
@@ -86,11 +87,27 @@ HRESULT ObjectMemory::LoadImage(const char* szImageName, LPVOID imageData, UINT
 	ImageHeader* pHeader = reinterpret_cast<ImageHeader*>(pImageBytes+sizeof(ISTHDRTYPE));
 	int offset = sizeof(ISTHDRTYPE)+sizeof(ImageHeader);
 
+#ifdef DELTAIMAGES
+	if (pHeader->flags.bIsDelta)
+	{
+		// Fold the chain of incremental images back to its base, and load the result
+		hr = LoadDeltaImage(szImageName, pImageBytes, imageSize);
+	}
+	else
+#endif
 	if (pHeader->flags.bIsCompressed)
 	{
 		zibinstream stream(pImageBytes + offset, imageSize - offset);
 		hr = LoadImage(stream, pHeader);
 	}
+	else if (pHeader->flags.bIsBlockCompressed)
+	{
+		// The blocks are all decompressed in parallel up front, then read from memory
+		blockibinstream stream(pImageBytes + offset, imageSize - offset);
+		hr = stream.good() 
+			? LoadImage(stream, pHeader)
+			: ReportError(IDP_IMAGEREADERROR, stream.fail());
+	}
 	else
 	{
 		// It seems that using a memory mapped file is about twice as fast - of course a lot of performance
@@ -104,8 +121,21 @@ HRESULT ObjectMemory::LoadImage(const char* szImageName, LPVOID imageData, UINT
 		//stream.read(&h, sizeof(h));
 		//pHeader = &h;
 		imbinstream stream(pImageBytes + offset, imageSize - offset);
+#ifdef LAZYLOADING
+		// Cold objects may be left in the image file to be loaded when first touched
+		PrepareLazyLoad(szImageName, pImageBytes, imageSize, stream);
 		hr = LoadImage(stream, pHeader);
+		EndLazyLoad();
+#else
+		hr = LoadImage(stream, pHeader);
+#endif
 	}
+
+#ifdef DELTAIMAGES
+	// The image just loaded becomes the base for the next incremental save
+	if (SUCCEEDED(hr) && IsTrackingDeltas())
+		EndDeltaBaseline(szImageName, pImageBytes, imageSize);
+#endif
 #endif
 
 #ifdef PROFILE_IMAGELOADSAVE
@@ -161,6 +191,10 @@ HRESULT ObjectMemory::LoadImage(ibinstream& imageFile, ImageHeader* pHeader)
 	if (FAILED(hr))
 		return hr;
 
+#ifdef DELTAIMAGES
+	BeginDeltaBaseline(pHeader->nTableSize);
+#endif
+
 	hr = LoadObjectTable(imageFile, pHeader);
 	if (FAILED(hr))
 		return hr;
@@ -170,6 +204,10 @@ HRESULT ObjectMemory::LoadImage(ibinstream& imageFile, ImageHeader* pHeader)
 	if (FAILED(hr))
 		return hr;
 
+#ifdef LAZYLOADING
+	BeginLazyLoad(pHeader);
+#endif
+
 	hr = LoadObjects(imageFile, pHeader, nDataRead);
 	if (FAILED(hr))
 		return hr;
@@ -314,6 +352,17 @@ HRESULT ObjectMemory::LoadObject(OTE* ote, ibinstream& imageFile, const ImageHea
 
 	MWORD* oldLocation = reinterpret_cast<MWORD*>(ote->m_location);
 
+#ifdef LAZYLOADING
+	if (LoadLazyObject(ote, imageFile, pHeader))
+	{
+		// The body remains in the image file until first touched
+		markObject(ote);
+		FixupObject(ote, oldLocation, pHeader);
+		cbRead += byteSize;
+		return S_OK;
+	}
+#endif
+
 	// Allocate space for the object, and copy into that space
 	if (ote->heapSpace() == OTEFlags::VirtualSpace)
 	{
@@ -445,6 +494,12 @@ void ObjectMemory::FixupObject(OTE* ote, MWORD* oldLocation, const ImageHeader*
 			// Can't deallocate now - must leave for collection later - maybe could go in the Zct though.
 			VERIFY(ote->decRefs());
 			deallocate(reinterpret_cast<OTE*>(ote));
+
+#ifdef DELTAIMAGES
+			// The stamp is in the image file, but not in memory, so must be freed by the next delta
+			if (IsTrackingDeltas())
+				m_pDeltaDigests[ote->getIndex()] = DeltaFreedDigest;
+#endif
 		}
 	}
 }
@@ -23,6 +23,7 @@
 
 // Smalltalk classes
 #include "STBehavior.h"
+#include "STExternal.h"		// For ExternalAddress
 
 ///////////////////////////////////////////////////////////////////////////////
 //	Storage Management Primitives
@@ -53,3 +54,48 @@ BOOL __fastcall Interpreter::primitiveNewVirtual()
 	return replaceStackTopWithNew(newObject);
 }
 
+// Answer a new instance of the receiver, a variable byte class, which is a borrowed view of external memory (see
+// BorrowedView.cpp). The first argument is the owner of the memory, which is kept alive as long as the view, the
+// second the address of the memory (an address object or SmallInteger), and the third the size of the view in bytes.
+// If the receiver is null terminated, the byte after the view must be the terminator.
+BOOL __fastcall Interpreter::primitiveNewBorrowedView()
+{
+	Oop oopSize = stackTop();
+	if (!ObjectMemoryIsIntegerObject(oopSize))
+		return primitiveFailure(0);	// Size not a SmallInteger
+	SMALLINTEGER byteSize = ObjectMemoryIntegerValueOf(oopSize);
+	if (byteSize < 0)
+		return primitiveFailure(0);
+
+	Oop oopAddress = stackValue(1);
+	BYTE* pBytes;
+	if (ObjectMemoryIsIntegerObject(oopAddress))
+		pBytes = reinterpret_cast<BYTE*>(ObjectMemoryIntegerValueOf(oopAddress));
+	else
+	{
+		OTE* oteAddress = reinterpret_cast<OTE*>(oopAddress);
+		if (!oteAddress->isBytes() || !oteAddress->m_oteClass->m_location->isIndirect())
+			return primitiveFailure(1);	// Not an address
+		pBytes = static_cast<BYTE*>(reinterpret_cast<AddressOTE*>(oteAddress)->m_location->m_pointer);
+	}
+	if (pBytes == NULL)
+		return primitiveFailure(1);
+
+	Oop oopOwner = stackValue(2);
+	if (ObjectMemoryIsIntegerObject(oopOwner))
+		return primitiveFailure(2);	// A SmallInteger cannot own anything
+
+	BehaviorOTE* receiverClass = reinterpret_cast<BehaviorOTE*>(stackValue(3));
+	Behavior* behavior = receiverClass->m_location;
+	if (behavior->isPointers() || !behavior->isIndexable() || behavior->isIndirect())
+		return primitiveFailure(3);	// Not a variable byte class
+	if (behavior->m_instanceSpec.m_nullTerminated && pBytes[byteSize] != 0)
+		return primitiveFailure(1);	// Not null terminated
+
+	// We'll not fail now, args are correct types
+	pop(3);
+
+	BytesOTE* newObject = ObjectMemory::newBorrowedView(receiverClass, pBytes, byteSize, reinterpret_cast<OTE*>(oopOwner));
+	return replaceStackTopWithNew(newObject);
+}
+
@@ -0,0 +1,193 @@
+/******************************************************************************
+
+	File: MethodCacheProfile.cpp
+
+	Description:
+
+	Persisted method cache profile. The method cache is empty after every start,
+	so the first sends of each (class, selector) pair pay for a method dictionary
+	walk up the class hierarchy. When enabled the (class, selector) pairs in the
+	cache are written to a profile file alongside the image whenever it is saved
+	(or on request from a deployed application via SaveMethodCacheProfile), and
+	if such a profile is present on startup the cache is repopulated from it.
+
+	The profile records OT indices, which are preserved by save and load. Each
+	entry also records the identity hashes of the class and selector, and is only
+	used if both objects are still of the expected kind, so a stale profile is
+	harmless: the method cached for each pair is always looked up afresh.
+
+******************************************************************************/
+#include "ist.h"
+#include <io.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ImageHeader.h"
+#include "objmem.h"
+#include "interprt.h"
+#include "regkey.h"
+
+#ifndef _DEBUG
+	#pragma optimize("s", on)
+	#pragma auto_inline(off)
+#endif
+
+struct MethodCacheProfileHeader
+{
+	IMAGETYPE	profileType;		// Should be "MCP"
+	DWORD		nEntries;
+};
+
+struct MethodCacheProfileEntry
+{
+	DWORD		classIndex;
+	DWORD		selectorIndex;
+	hash_t		classHash;
+	hash_t		selectorHash;
+};
+
+static const IMAGETYPE MCPPROFILE = IMAGETYPEENCODE("MCP");
+
+// The image loaded, for which a profile can be saved later on request
+static char s_szProfileImage[_MAX_PATH];
+
+// The profile is named after the image, with the extension .mcp
+static void MethodCacheProfileName(const char* szImageName, char* szProfileName)
+{
+	char drive[_MAX_DRIVE];
+	char dir[_MAX_DIR];
+	char fname[_MAX_FNAME];
+	_splitpath_s(szImageName, drive, _MAX_DRIVE, dir, _MAX_DIR, fname, _MAX_FNAME, NULL, 0);
+	_makepath_s(szProfileName, _MAX_PATH, drive, dir, fname, "mcp");
+}
+
+// Answer the live object at the specified index, provided its identity hash matches
+static OTE* ProfiledObject(DWORD index, hash_t idHash)
+{
+	if (index >= ObjectMemory::GetOTSize())
+		return NULL;
+	OTE* ote = ObjectMemory::PointerFromIndex(index);
+	return !ote->isFree() && ote->m_idHash == idHash ? ote : NULL;
+}
+
+#pragma code_seg(INIT_SEG)
+
+// Repopulate the method cache from the profile saved with the image, if any. Called once the
+// image has been loaded and the caches initialized.
+void Interpreter::WarmMethodCache(const char* szImageName)
+{
+	strncpy_s(s_szProfileImage, szImageName, _TRUNCATE);
+
+	char szProfileName[_MAX_PATH];
+	MethodCacheProfileName(szImageName, szProfileName);
+
+	int fd;
+	if (::_sopen_s(&fd, szProfileName, _O_RDONLY|_O_BINARY|_O_SEQUENTIAL, _SH_DENYWR, _S_IREAD) != 0)
+		return;
+
+	MethodCacheProfileHeader header;
+	if (::_read(fd, &header, sizeof(header)) != sizeof(header)
+			|| header.profileType != MCPPROFILE
+			|| header.nEntries > MaxMethodCacheSize)
+	{
+		::_close(fd);
+		return;
+	}
+
+	// The profile may have been saved from a larger cache, in which case some entries will be evicted
+	MethodCacheProfileEntry* entries = new MethodCacheProfileEntry[header.nEntries];
+	int cbEntries = header.nEntries * sizeof(MethodCacheProfileEntry);
+	bool bRead = ::_read(fd, entries, cbEntries) == cbEntries;
+	::_close(fd);
+	if (!bRead)
+	{
+		delete[] entries;
+		return;
+	}
+
+	unsigned nCached = 0;
+	for (unsigned i=0;i<header.nEntries;i++)
+	{
+		OTE* oteClass = ProfiledObject(entries[i].classIndex, entries[i].classHash);
+		OTE* oteSelector = ProfiledObject(entries[i].selectorIndex, entries[i].selectorHash);
+		if (oteClass == NULL || oteSelector == NULL
+				|| !oteClass->isBehavior()
+				|| oteSelector->m_oteClass != Pointers.ClassSymbol)
+			continue;
+
+		if (cacheMethodLookup(reinterpret_cast<BehaviorOTE*>(oteClass), reinterpret_cast<SymbolOTE*>(oteSelector)))
+			nCached++;
+	}
+	delete[] entries;
+
+#ifdef _DEBUG
+	TRACESTREAM << "Method cache warmed with " << dec << nCached << " of " << header.nEntries << " profiled entries" << endl;
+#endif
+}
+
+#pragma code_seg(PRIM_SEG)
+
+// Saving the profile with each image save is enabled by the registry setting MethodCache\SaveProfile
+bool Interpreter::IsMethodCacheProfileEnabled()
+{
+	CRegKey rkMethodCache;
+	DWORD dwEnabled = 0;
+	if (OpenDolphinKey(rkMethodCache, "MethodCache", KEY_READ) == ERROR_SUCCESS)
+		rkMethodCache.QueryDWORDValue("SaveProfile", dwEnabled);
+	return dwEnabled != 0;
+}
+
+// Write the (class, selector) pairs currently in the method cache to the profile for the named image
+bool Interpreter::SaveMethodCacheProfile(const char* szImageName)
+{
+	MethodCacheProfileHeader header;
+	header.profileType = MCPPROFILE;
+	header.nEntries = 0;
+
+	// Least recently used entries are written first, so that they are evicted first when warming
+	MethodCacheProfileEntry* entries = new MethodCacheProfileEntry[methodCacheSize];
+	for (unsigned j=methodCacheSize;j>0;j--)
+	{
+		const MethodCacheEntry& cached = methodCache[j-1];
+		if (cached.classPointer == NULL || cached.method == NULL)
+			continue;
+
+		MethodCacheProfileEntry& entry = entries[header.nEntries++];
+		entry.classIndex = cached.classPointer->getIndex();
+		entry.classHash = cached.classPointer->m_idHash;
+		entry.selectorIndex = cached.selector->getIndex();
+		entry.selectorHash = cached.selector->m_idHash;
+	}
+
+	char szProfileName[_MAX_PATH];
+	MethodCacheProfileName(szImageName, szProfileName);
+
+	int fd;
+	if (::_sopen_s(&fd, szProfileName, _O_WRONLY|_O_BINARY|_O_CREAT|_O_TRUNC|_O_SEQUENTIAL, _SH_DENYRW, _S_IWRITE|_S_IREAD) != 0)
+	{
+		delete[] entries;
+		return false;
+	}
+
+	int cbEntries = header.nEntries * sizeof(MethodCacheProfileEntry);
+	bool bSaved = ::_write(fd, &header, sizeof(header)) == sizeof(header)
+					&& ::_write(fd, entries, cbEntries) == cbEntries;
+	::_close(fd);
+	delete[] entries;
+	if (!bSaved)
+		remove(szProfileName);
+	return bSaved;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Exports
+
+// Save the current method cache contents as the profile for the named image, or if NULL
+// the image that was loaded. Intended for deployed applications that cannot save the image,
+// once warmed up by a representative workload.
+extern "C" BOOL __stdcall SaveMethodCacheProfile(const char* szImageName)
+{
+	if (szImageName == NULL)
+		szImageName = s_szProfileImage;
+	return szImageName[0] != 0 && Interpreter::SaveMethodCacheProfile(szImageName);
+}
@@ -0,0 +1,199 @@
+/******************************************************************************
+
+	File: MethodCounters.cpp
+
+	Description:
+
+	Optional per-method activation counts. When counting is enabled (by the
+	primitive, or from startup by the registry value Profiler\CountMethods) each
+	activation of a CompiledMethod increments a counter in a side table indexed
+	by the method's OT index. The table is allocated only while counting is
+	enabled, and the activation code tests a single flag when it is not.
+
+	Counts are attributed to the method by identity hash too, so that a counter
+	left over from a method which has since been collected is reset, rather than
+	inherited, when its OTE is reused. Counters follow their methods through
+	compaction (see compactCaches).
+
+******************************************************************************/
+#include "ist.h"
+#include <algorithm>
+#include <vector>
+
+#include "objmem.h"
+#include "interprt.h"
+#include "InterprtPrim.inl"
+#include "regkey.h"
+
+// Smalltalk classes
+#include "STArray.h"
+#include "STInteger.h"
+
+#ifndef _DEBUG
+	#pragma optimize("s", on)
+	#pragma auto_inline(off)
+#endif
+
+// Tested by primitiveActivateMethod in byteasm.asm
+unsigned methodCountingEnabled = 0;
+
+Interpreter::MethodCounter* Interpreter::m_pMethodCounters;
+unsigned Interpreter::m_nMethodCounters;
+
+// Grow the counter table to cover the current size of the object table
+void Interpreter::growMethodCounters()
+{
+	unsigned nCounters = ObjectMemory::GetOTSize();
+	MethodCounter* pCounters = new MethodCounter[nCounters];
+	memcpy(pCounters, m_pMethodCounters, m_nMethodCounters*sizeof(MethodCounter));
+	ZeroMemory(pCounters+m_nMethodCounters, (nCounters-m_nMethodCounters)*sizeof(MethodCounter));
+	delete[] m_pMethodCounters;
+	m_pMethodCounters = pCounters;
+	m_nMethodCounters = nCounters;
+}
+
+void Interpreter::EnableMethodCounters(bool bEnabled)
+{
+	if (bEnabled == (methodCountingEnabled != 0))
+		return;
+
+	methodCountingEnabled = bEnabled;
+	delete[] m_pMethodCounters;
+	m_pMethodCounters = NULL;
+	m_nMethodCounters = 0;
+	if (bEnabled)
+		growMethodCounters();
+}
+
+#pragma code_seg(INTERP_SEG)
+
+// Called from primitiveActivateMethod only when counting is enabled
+void __fastcall Interpreter::countMethodActivation(MethodOTE* oteMethod)
+{
+	MWORD index = oteMethod->getIndex();
+	if (index >= m_nMethodCounters)
+		growMethodCounters();
+
+	MethodCounter& counter = m_pMethodCounters[index];
+	if (counter.idHash != oteMethod->m_idHash)
+	{
+		counter.idHash = oteMethod->m_idHash;
+		counter.activations = 0;
+	}
+	counter.activations++;
+}
+
+#pragma code_seg(GC_SEG)
+
+// A compacting GC has occurred, so move the counters of methods that have been moved along with
+// them. Compaction only moves objects down the table, so each counter is moved to a slot that has
+// already been visited. Must be called while the forwarding pointers in the old OTEs are intact.
+void Interpreter::compactMethodCounters()
+{
+	const OTE* pOT = ObjectMemory::m_pOT;
+	const unsigned nOTSize = ObjectMemory::GetOTSize();
+	for (unsigned i=0;i<m_nMethodCounters;i++)
+	{
+		MethodCounter& counter = m_pMethodCounters[i];
+		if (counter.activations == 0 || i >= nOTSize || !pOT[i].isFree())
+			continue;
+
+		const OTE* ote = reinterpret_cast<const OTE*>(pOT[i].m_location);
+		MWORD newIndex = ote - pOT;
+		if (ote >= pOT && newIndex < i && !ote->isFree() && ote->m_idHash == counter.idHash)
+			m_pMethodCounters[newIndex] = counter;
+		counter.activations = 0;
+	}
+}
+
+#pragma code_seg(INIT_SEG)
+
+void Interpreter::InitializeMethodCounters()
+{
+	CRegKey rkProfiler;
+	DWORD dwEnabled = 0;
+	if (OpenDolphinKey(rkProfiler, "Profiler", KEY_READ) == ERROR_SUCCESS)
+		rkProfiler.QueryDWORDValue("CountMethods", dwEnabled);
+	EnableMethodCounters(dwEnabled != 0);
+}
+
+#pragma code_seg(TERM_SEG)
+
+void Interpreter::TerminateMethodCounters()
+{
+	EnableMethodCounters(false);
+}
+
+#pragma code_seg(PRIM_SEG)
+
+// Answer whether the counter at the specified index is still that of the live method occupying it
+inline bool Interpreter::isCountedMethod(unsigned index)
+{
+	const OTE* ote = ObjectMemory::PointerFromIndex(index);
+	return index < ObjectMemory::GetOTSize() && !ote->isFree()
+			&& ote->m_idHash == m_pMethodCounters[index].idHash
+			&& ObjectMemory::isKindOf(Oop(ote), Pointers.ClassCompiledMethod);
+}
+
+typedef std::pair<DWORD, unsigned> MethodCount;
+
+static bool MoreActivations(const MethodCount& a, const MethodCount& b)
+{
+	return a.first > b.first;
+}
+
+// Enable or disable method activation counting. If the SmallInteger argument is zero, counting is
+// disabled and the counts discarded. If it is positive, counting is enabled (if not already), and the
+// answer is an Array of up to that number of pairs of methods and activation counts, most frequently
+// activated first.
+BOOL __fastcall Interpreter::primitiveMethodCounts()
+{
+	Oop argPointer = stackTop();
+	if (!ObjectMemoryIsIntegerObject(argPointer))
+		return primitiveFailure(PrimitiveFailureNonInteger);
+	SMALLINTEGER nTop = ObjectMemoryIntegerValueOf(argPointer);
+	if (nTop < 0)
+		return primitiveFailure(PrimitiveFailureBoundsError);
+
+	if (nTop == 0)
+	{
+		EnableMethodCounters(false);
+		popStack();
+		replaceStackTopWith(Oop(Pointers.Nil));
+		return primitiveSuccess();
+	}
+
+	EnableMethodCounters(true);
+
+	std::vector<MethodCount> counts;
+	for (unsigned i=0;i<m_nMethodCounters;i++)
+	{
+		if (m_pMethodCounters[i].activations != 0 && isCountedMethod(i))
+			counts.push_back(MethodCount(m_pMethodCounters[i].activations, i));
+	}
+	unsigned nMethods = min(counts.size(), static_cast<unsigned>(nTop));
+	std::partial_sort(counts.begin(), counts.begin()+nMethods, counts.end(), MoreActivations);
+
+	ArrayOTE* oteResult = Array::NewUninitialized(nMethods);
+	for (unsigned i=0;i<nMethods;i++)
+	{
+		Oop oopCount = Integer::NewUnsigned32(counts[i].first);
+		ArrayOTE* otePair = Array::New(2);
+		Array* pair = otePair->m_location;
+		// The allocations may have caused the method to be collected
+		if (isCountedMethod(counts[i].second))
+		{
+			pair->m_elements[0] = Oop(ObjectMemory::PointerFromIndex(counts[i].second));
+			ObjectMemory::countUp(pair->m_elements[0]);
+		}
+		pair->m_elements[1] = oopCount;
+		ObjectMemory::countUp(oopCount);
+
+		oteResult->m_location->m_elements[i] = Oop(otePair);
+		otePair->countUp();
+	}
+
+	popStack();
+	replaceStackTopWithNew(oteResult);
+	return primitiveSuccess();
+}
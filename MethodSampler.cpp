@@ -0,0 +1,335 @@
+/******************************************************************************
+
+	File: MethodSampler.cpp
+
+	Description:
+
+	Statistical profiler for Smalltalk methods. A timer queue timer, running at
+	a configurable interval, briefly suspends the interpreter thread and records
+	the methods on the active process' call chain. Each sample is appended to a
+	fixed size ring buffer shared between the timer thread (the only writer) and
+	the interpreter thread (the only reader), so no locks are required.
+
+	The samples are drained either by a primitive, which answers them as Arrays
+	of CompiledMethods, or by the SaveMethodSamples export, which appends them to a
+	file in the "folded stacks" format understood by flamegraph.pl, speedscope, etc.
+
+	The frame chain is read while the interpreter is at an arbitrary point, so
+	every frame and method is validated before use, and the walk stops at the
+	first inconsistency. Since the interpreter thread is suspended at that time,
+	the sampler must not allocate or take any locks until it has been resumed.
+
+	The interval (in milliseconds) may be set in the registry value
+	Profiler\SampleInterval to profile an image from startup.
+
+******************************************************************************/
+#include "ist.h"
+#include <io.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+
+#include "objmem.h"
+#include "interprt.h"
+#include "InterprtPrim.inl"
+#include "regkey.h"
+
+// Smalltalk classes
+#include "STArray.h"
+#include "STProcess.h"
+#include "STStackFrame.h"
+
+#ifndef _DEBUG
+	#pragma optimize("s", on)
+	#pragma auto_inline(off)
+#endif
+
+struct SampledFrame
+{
+	MethodOTE*	method;
+	hash_t		idHash;				// Identity hash of the method when sampled, to detect reuse of the OTE
+};
+
+struct MethodSample
+{
+	unsigned		nFrames;
+	bool			bTruncated;		// Call chain was deeper than MaxSampleDepth
+	SampledFrame	frames[Interpreter::MaxSampleDepth];	// Leaf frame first
+};
+
+// Ring buffer of samples, allocated when the profiler is first started. The head is only
+// advanced by the sampler thread, and the tail by the interpreter thread.
+static MethodSample* s_pSamples;
+static SHAREDLONG s_nSampleHead;
+static SHAREDLONG s_nSampleTail;
+static SHAREDLONG s_nSamplesDropped;
+
+HANDLE Interpreter::m_hMethodSampleTimer;
+DWORD Interpreter::m_dwMethodSampleInterval;
+
+// Answer whether pFrame is a plausible frame in the stack bounded by pBase and pLimit
+static inline bool IsSampledFrame(const StackFrame* pFrame, const Oop* pBase, const Oop* pLimit)
+{
+	return (DWORD(pFrame) & (sizeof(Oop)-1)) == 0
+			&& reinterpret_cast<const Oop*>(pFrame) >= pBase
+			&& reinterpret_cast<const Oop*>(pFrame+1) <= pLimit;
+}
+
+// Answer whether oteMethod is a live pointer object in the object table
+static inline bool IsSampledMethod(const MethodOTE* oteMethod)
+{
+	const OTE* ote = reinterpret_cast<const OTE*>(oteMethod);
+	return ote >= ObjectMemory::m_pOT && ote < ObjectMemory::m_pOT + ObjectMemory::GetOTSize()
+			&& (DWORD(reinterpret_cast<const BYTE*>(ote) - reinterpret_cast<const BYTE*>(ObjectMemory::m_pOT)) % sizeof(OTE)) == 0
+			&& !ote->isFree() && ote->isPointers();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sampler thread
+
+VOID CALLBACK Interpreter::MethodSamplerProc(PVOID, BOOLEAN TimerOrWaitFired)
+{
+	if (!TimerOrWaitFired)
+		return;
+
+	LONG head = s_nSampleHead;
+	if (head - s_nSampleTail >= MethodSampleCapacity)
+	{
+		// The buffer has not been drained quickly enough
+		::InterlockedIncrement(&s_nSamplesDropped);
+		return;
+	}
+
+	HANDLE hMain = MainThreadHandle();
+	if (hMain == NULL || int(::SuspendThread(hMain)) < 0)
+		return;
+
+	MethodSample& sample = s_pSamples[head & (MethodSampleCapacity-1)];
+	sample.nFrames = 0;
+	sample.bTruncated = false;
+	__try
+	{
+		ProcessOTE* oteProcess = m_registers.m_oteActiveProcess;
+		Process* pProcess = oteProcess->m_location;
+		const Oop* pBase = pProcess->m_stack;
+		const Oop* pLimit = reinterpret_cast<const Oop*>(reinterpret_cast<const BYTE*>(pProcess) + oteProcess->getSize());
+		const StackFrame* pFrame = m_registers.m_pActiveFrame;
+		while (IsSampledFrame(pFrame, pBase, pLimit) && IsSampledMethod(pFrame->m_method))
+		{
+			if (sample.nFrames == MaxSampleDepth)
+			{
+				sample.bTruncated = true;
+				break;
+			}
+			SampledFrame& frame = sample.frames[sample.nFrames++];
+			frame.method = pFrame->m_method;
+			frame.idHash = pFrame->m_method->m_idHash;
+
+			// Callers are always deeper in the stack, which guarantees that the walk terminates
+			Oop callerPointer = pFrame->m_caller;
+			const StackFrame* pCaller = reinterpret_cast<const StackFrame*>(callerPointer-1);
+			if (!isIntegerObject(callerPointer) || pCaller >= pFrame)
+				break;
+			pFrame = pCaller;
+		}
+	}
+	__except(EXCEPTION_EXECUTE_HANDLER)
+	{
+		sample.nFrames = 0;
+	}
+
+	::ResumeThread(hMain);
+
+	// Publish the sample (the interlocked operation is a full barrier)
+	if (sample.nFrames > 0)
+		::InterlockedExchange(&s_nSampleHead, head+1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Interpreter thread
+
+// Start sampling at the specified interval (in milliseconds), or change the interval if already running
+HRESULT Interpreter::StartMethodSampler(DWORD dwInterval)
+{
+	HARDASSERT(::GetCurrentThreadId() == MainThreadId());
+	ASSERT(dwInterval > 0);
+
+	if (s_pSamples == NULL)
+	{
+		s_pSamples = new MethodSample[MethodSampleCapacity];
+		s_nSampleHead = s_nSampleTail = s_nSamplesDropped = 0;
+	}
+
+	BOOL bSuccess = TRUE;
+	if (m_hMethodSampleTimer == NULL)
+		bSuccess = ::CreateTimerQueueTimer(&m_hMethodSampleTimer, NULL, MethodSamplerProc, NULL, dwInterval, dwInterval, WT_EXECUTEINTIMERTHREAD);
+	else if (dwInterval != m_dwMethodSampleInterval)
+		bSuccess = ::ChangeTimerQueueTimer(NULL, m_hMethodSampleTimer, dwInterval, dwInterval);
+
+	if (!bSuccess)
+		return HRESULT_FROM_WIN32(::GetLastError());
+
+	m_dwMethodSampleInterval = dwInterval;
+	return S_OK;
+}
+
+// Stop sampling. Any samples already taken remain in the buffer until drained.
+void Interpreter::StopMethodSampler()
+{
+	if (m_hMethodSampleTimer != NULL)
+	{
+		// Waits for any callback in progress to complete
+		::DeleteTimerQueueTimer(NULL, m_hMethodSampleTimer, INVALID_HANDLE_VALUE);
+		m_hMethodSampleTimer = NULL;
+	}
+	m_dwMethodSampleInterval = 0;
+}
+
+#pragma code_seg(INIT_SEG)
+
+// Start the profiler if a sampling interval is configured in the registry
+void Interpreter::InitializeMethodSampler()
+{
+	m_hMethodSampleTimer = NULL;
+	m_dwMethodSampleInterval = 0;
+
+	CRegKey rkProfiler;
+	DWORD dwInterval = 0;
+	if (OpenDolphinKey(rkProfiler, "Profiler", KEY_READ) == ERROR_SUCCESS)
+		rkProfiler.QueryDWORDValue("SampleInterval", dwInterval);
+	if (dwInterval > 0)
+		StartMethodSampler(dwInterval);
+}
+
+#pragma code_seg(TERM_SEG)
+
+void Interpreter::TerminateMethodSampler()
+{
+	StopMethodSampler();
+	delete[] s_pSamples;
+	s_pSamples = NULL;
+}
+
+#pragma code_seg(PRIM_SEG)
+
+// Remove the oldest sample from the buffer, answering false if it is empty
+static bool NextMethodSample(MethodSample& sample)
+{
+	LONG tail = s_nSampleTail;
+	if (s_pSamples == NULL || tail == s_nSampleHead)
+		return false;
+	sample = s_pSamples[tail & (Interpreter::MethodSampleCapacity-1)];
+	::InterlockedExchange(&s_nSampleTail, tail+1);
+	return true;
+}
+
+// Answer whether a sampled method is still the same live method, as it may have been
+// garbage collected (and the OTE reused) since the sample was taken
+static inline bool IsLiveSampledMethod(const SampledFrame& frame)
+{
+	const MethodOTE* oteMethod = frame.method;
+	return !oteMethod->isFree() && oteMethod->m_idHash == frame.idHash
+			&& ObjectMemory::isBehavior(Oop(oteMethod->m_location->m_methodClass));
+}
+
+// Drain the sample buffer, and set the sampling interval to the SmallInteger argument (in milliseconds).
+// A zero interval stops sampling, and a negative interval leaves it unchanged. Answers an Array with
+// an Array of CompiledMethods for each sample, ordered from the outermost to the active method.
+BOOL __fastcall Interpreter::primitiveSampleMethods()
+{
+	Oop argPointer = stackTop();
+	if (!ObjectMemoryIsIntegerObject(argPointer))
+		return primitiveFailure(PrimitiveFailureNonInteger);
+
+	SMALLINTEGER interval = ObjectMemoryIntegerValueOf(argPointer);
+	if (interval == 0)
+		StopMethodSampler();
+	else if (interval > 0 && FAILED(StartMethodSampler(interval)))
+		return primitiveFailure(PrimitiveFailureSystemError);
+
+	LONG nSamples = s_nSampleHead - s_nSampleTail;
+	ArrayOTE* oteSamples = Array::NewUninitialized(nSamples);
+	Array* samples = oteSamples->m_location;
+	MethodSample sample;
+	for (LONG i=0;i<nSamples && NextMethodSample(sample);i++)
+	{
+		ArrayOTE* oteChain = Array::NewUninitialized(sample.nFrames);
+		Array* chain = oteChain->m_location;
+		for (unsigned j=0;j<sample.nFrames;j++)
+		{
+			const SampledFrame& frame = sample.frames[sample.nFrames-j-1];
+			Oop oopMethod = IsLiveSampledMethod(frame) ? Oop(frame.method) : Oop(Pointers.Nil);
+			chain->m_elements[j] = oopMethod;
+			ObjectMemory::countUp(oopMethod);
+		}
+		samples->m_elements[i] = Oop(oteChain);
+		oteChain->countUp();
+	}
+
+#ifdef _DEBUG
+	if (s_nSamplesDropped > 0)
+		TRACESTREAM << dec << s_nSamplesDropped << " method samples dropped" << endl;
+#endif
+
+	popStack();
+	replaceStackTopWithNew(oteSamples);
+	return primitiveSuccess();
+}
+
+// Drain the sample buffer, appending each sample to the named file as a folded stack, i.e. the
+// names of the sampled methods from the outermost inwards separated by semi-colons, followed by
+// the number of occurrences of that stack. Answers false if the file could not be written.
+bool Interpreter::SaveMethodSamples(const char* szFileName)
+{
+	HARDASSERT(::GetCurrentThreadId() == MainThreadId());
+
+	typedef std::map<std::string, unsigned> FoldedStacks;
+	FoldedStacks stacks;
+	MethodSample sample;
+	while (NextMethodSample(sample))
+	{
+		ostringstream stack;
+		if (sample.bTruncated)
+			stack << "...";
+		for (unsigned j=sample.nFrames;j>0;j--)
+		{
+			const SampledFrame& frame = sample.frames[j-1];
+			if (j < sample.nFrames || sample.bTruncated)
+				stack << ';';
+			if (IsLiveSampledMethod(frame))
+				stack << frame.method;
+			else
+				stack << "???";
+		}
+		stacks[stack.str()]++;
+	}
+
+	int fd;
+	if (::_sopen_s(&fd, szFileName, _O_WRONLY|_O_APPEND|_O_CREAT|_O_TEXT|_O_SEQUENTIAL, _SH_DENYWR, _S_IWRITE|_S_IREAD) != 0)
+		return false;
+
+	bool bSaved = true;
+	for (FoldedStacks::const_iterator it = stacks.begin(); bSaved && it != stacks.end(); it++)
+	{
+		char szCount[16];
+		_snprintf_s(szCount, sizeof(szCount), _TRUNCATE, " %u\n", it->second);
+		int cbStack = it->first.length();
+		int cbCount = strlen(szCount);
+		bSaved = ::_write(fd, it->first.c_str(), cbStack) == cbStack
+					&& ::_write(fd, szCount, cbCount) == cbCount;
+	}
+	::_close(fd);
+	return bSaved;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Exports
+
+// Append the method samples taken since the last drain to the named file in folded stack format.
+// Must be called from the interpreter thread.
+extern "C" BOOL __stdcall SaveMethodSamples(const char* szFileName)
+{
+	return szFileName != NULL && Interpreter::SaveMethodSamples(szFileName);
+}
@@ -0,0 +1,105 @@
+/******************************************************************************
+
+	File: NativeAssembler.h
+
+	Description:
+
+	x86 instruction encoding for the VM's generated code: the baseline JIT
+	(see NativeCode.cpp) and the external call stubs (see ExtCallStubs.cpp).
+	Only the handful of forms needed by their templates are provided.
+
+	Code is emitted into a caller supplied buffer. Emission continues past
+	the limit without writing, so that the caller can detect overflow once
+	the code is complete.
+
+******************************************************************************/
+
+#ifndef _IST_NATIVEASSEMBLER_H
+#define _IST_NATIVEASSEMBLER_H
+
+class NativeAssembler
+{
+public:
+	enum Reg { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+	enum Cond { CondO, CondNO, CondB, CondAE, CondE, CondNE, CondBE, CondA,
+				CondS, CondNS, CondP, CondNP, CondL, CondGE, CondLE, CondG };
+	// Opcodes of the "op r/m32, r32" forms of the ALU instructions
+	enum AluOp { ADD = 0x01, OR = 0x09, AND = 0x21, SUB = 0x29, XOR = 0x31, CMP = 0x39 };
+
+	NativeAssembler(BYTE* pCode, BYTE* pLimit) : m_pStart(pCode), m_pNext(pCode), m_pLimit(pLimit) {}
+
+	bool overflowed() const									{ return m_pNext > m_pLimit; }
+	unsigned offset() const									{ return m_pNext - m_pStart; }
+	BYTE* start() const										{ return m_pStart; }
+
+	void byte(BYTE b)
+	{
+		if (m_pNext < m_pLimit)
+			*m_pNext = b;
+		m_pNext++;
+	}
+
+	void dword(DWORD d)
+	{
+		for (int i=0;i<4;i++)
+			byte(static_cast<BYTE>(d >> (i*8)));
+	}
+
+	void movRegMem(Reg dst, Reg base, int disp)				{ byte(0x8B); modRMDisp(dst, base, disp); }
+	void movMemReg(Reg base, int disp, Reg src)				{ byte(0x89); modRMDisp(src, base, disp); }
+	void movRegAbs(Reg dst, const void* p)					{ byte(0x8B); byte(static_cast<BYTE>(0x05|dst<<3)); dword(DWORD(p)); }
+	void movRegImm(Reg dst, DWORD imm)						{ byte(static_cast<BYTE>(0xB8+dst)); dword(imm); }
+	void movRegReg(Reg dst, Reg src)						{ alu(static_cast<AluOp>(0x89), dst, src); }
+	void leaRegMem(Reg dst, Reg base, int disp)				{ byte(0x8D); modRMDisp(dst, base, disp); }
+	void alu(AluOp op, Reg dst, Reg src)					{ byte(static_cast<BYTE>(op)); byte(static_cast<BYTE>(0xC0|src<<3|dst)); }
+	void addRegImm(Reg dst, signed char imm)				{ byte(0x83); byte(static_cast<BYTE>(0xC0|dst)); byte(imm); }
+	void subRegImm(Reg dst, signed char imm)				{ byte(0x83); byte(static_cast<BYTE>(0xE8|dst)); byte(imm); }
+	void cmpRegAbs(Reg reg, const void* p)					{ byte(0x3B); byte(static_cast<BYTE>(0x05|reg<<3)); dword(DWORD(p)); }
+	void cmpMemImm(Reg base, int disp, signed char imm)		{ byte(0x83); modRMDisp(7, base, disp); byte(imm); }
+	void cmpAbsImm(const volatile void* p, signed char imm)	{ byte(0x83); byte(0x3D); dword(DWORD(p)); byte(imm); }
+	// Only the low byte registers of EAX, ECX, EDX and EBX can be tested
+	void testLowByte(Reg reg, BYTE imm)						{ byte(0xF6); byte(static_cast<BYTE>(0xC0|reg)); byte(imm); }
+	void testMemImm(Reg base, int disp, DWORD imm)			{ byte(0xF7); modRMDisp(0, base, disp); dword(imm); }
+	void sarRegOne(Reg reg)									{ byte(0xD1); byte(static_cast<BYTE>(0xF8|reg)); }
+	void decReg(Reg reg)									{ byte(static_cast<BYTE>(0x48+reg)); }
+	void cmov(Cond cc, Reg dst, Reg src)					{ byte(0x0F); byte(static_cast<BYTE>(0x40+cc)); byte(static_cast<BYTE>(0xC0|dst<<3|src)); }
+	void pushReg(Reg reg)									{ byte(static_cast<BYTE>(0x50+reg)); }
+	void popReg(Reg reg)									{ byte(static_cast<BYTE>(0x58+reg)); }
+	void callReg(Reg reg)									{ byte(0xFF); byte(static_cast<BYTE>(0xD0|reg)); }
+	void ret()												{ byte(0xC3); }
+
+	// Jumps are always emitted with 32-bit displacements, and answer the position of the
+	// displacement for later patching
+	unsigned jmp()											{ byte(0xE9); dword(0); return offset()-4; }
+	unsigned jcc(Cond cc)									{ byte(0x0F); byte(static_cast<BYTE>(0x80+cc)); dword(0); return offset()-4; }
+
+	void patch(unsigned pos, unsigned target)
+	{
+		if (!overflowed())
+			*reinterpret_cast<DWORD*>(m_pStart+pos) = target - (pos+4);
+	}
+
+private:
+	// ModR/M (and displacement) for [base+disp]. ESP is never used as a base, as it would need a SIB byte
+	void modRMDisp(int reg, Reg base, int disp)
+	{
+		if (disp == 0 && base != EBP)
+			byte(static_cast<BYTE>(reg<<3|base));
+		else if (disp >= -128 && disp <= 127)
+		{
+			byte(static_cast<BYTE>(0x40|reg<<3|base));
+			byte(static_cast<BYTE>(disp));
+		}
+		else
+		{
+			byte(static_cast<BYTE>(0x80|reg<<3|base));
+			dword(disp);
+		}
+	}
+
+	BYTE*	m_pStart;
+	BYTE*	m_pNext;
+	BYTE*	m_pLimit;
+};
+
+#endif
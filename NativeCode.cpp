@@ -0,0 +1,914 @@
+/******************************************************************************
+
+	File: NativeCode.cpp
+
+	Description:
+
+	Baseline JIT for the C++ byte code loop (see ByteLoop.cpp), enabled by
+	defining BASELINE_JIT as well as CPP_BYTECODELOOP.
+
+	N.B. This is experimental, and is not part of any build: neither this file
+	nor NativeAssembler.h is in the VM projects, and the C++ loop it depends on
+	is not the production loop. It has not been tested against the results of
+	the interpreter. Its limitations are that sends always exit to the loop (so
+	native code has no inline cached sends of its own), and that every purge of
+	the method caches, every compaction, and single stepping discard all the
+	native code. To try it, add this file to VMLib, and define both symbols.
+
+	Methods are counted as they are activated, and once a method has been
+	activated NativeCompileThreshold times its byte codes are translated into x86
+	machine code, instruction by instruction, from a template for each. The
+	templates cover the push, pop, temp store and jump instructions, and the
+	SmallInteger responses of the arithmetic, comparison and bitwise special
+	selectors; comparisons followed by a conditional jump on the result are
+	compiled together as a compare and branch. Any other instruction (sends,
+	returns, stores into heap objects, block creation, and the slow paths of the
+	templates) exits back to the byte code loop, with the IP at that instruction.
+	Sends are therefore still bound through the method cache and the per-send-site
+	inline caches, and the loop re-enters the method's native code when a send
+	returns to it.
+
+	Native code never remains on the stack across an exit, so there is no native
+	state to unwind when the code is invalidated. Deoptimisation is just a matter
+	of discarding the code: this is done whenever a method is installed or the
+	cached lookups are otherwise flushed, after a compacting GC (which moves the
+	OTEs by which the code is found), and when the debugger starts to step a
+	process. Native code is not entered at all while stepping.
+
+	Native code register usage:
+
+		ESI		Stack pointer
+		EBX		Base pointer (the receiver is at [EBX-4])
+		EDI		NativeFrame, through which the method is accessed
+		EAX, ECX, EDX	Scratch
+
+	Exits answer the offset of the next instruction to interpret in EAX.
+
+******************************************************************************/
+#include "Ist.h"
+
+#ifdef BASELINE_JIT
+
+#ifndef CPP_BYTECODELOOP
+	#error The baseline JIT requires the C++ byte code loop (CPP_BYTECODELOOP)
+#endif
+
+#pragma code_seg(INTERP_SEG)
+
+#include "ObjMem.h"
+#include "Interprt.h"
+#include "STMethod.h"
+#include "STContext.h"
+#include "STAssoc.h"
+#include "NativeAssembler.h"
+
+// The registers passed to native code. Only the stack pointer is updated on exit.
+struct NativeFrame
+{
+	Oop*			sp;
+	Oop*			bp;
+	CompiledMethod*	method;
+};
+
+typedef unsigned (__cdecl *NativeTrampoline)(BYTE* pEntry, NativeFrame* pFrame);
+
+// All native code lives in a single region, which is discarded in its entirety when full
+enum { NativeCodeSize = 4*1024*1024 };
+enum { NoNativeEntry = 0xFFFF };
+
+static BYTE* s_pNativeCode;
+static BYTE* s_pNativeFree;
+static NativeTrampoline s_trampoline;
+
+Interpreter::NativeMethod Interpreter::nativeMethods[NativeMethodTableSize];
+
+typedef NativeAssembler Asm;
+
+///////////////////////////////////////////////////////////////////////////////
+// Translation of a method's byte codes
+
+class NativeCompiler
+{
+public:
+	NativeCompiler(BYTE* pByteCodes, unsigned cbByteCodes, BYTE* pCode, BYTE* pLimit,
+					StackFrame* const* ppActiveFrame, const volatile LONG* pbAsyncPending)
+		: m_asm(pCode, pLimit), m_pByteCodes(pByteCodes), m_cbByteCodes(cbByteCodes),
+			m_ppActiveFrame(ppActiveFrame), m_pbAsyncPending(pbAsyncPending),
+			m_nStubs(0), m_nFixups(0)
+	{
+		m_nativeOffsets = new DWORD[cbByteCodes];
+		m_entryPoints = new WORD[cbByteCodes];
+		m_isJumpTarget = new bool[cbByteCodes];
+		m_stubs = new Stub[cbByteCodes*2];
+		m_fixups = new Fixup[cbByteCodes];
+	}
+
+	~NativeCompiler()
+	{
+		delete[] m_fixups;
+		delete[] m_stubs;
+		delete[] m_isJumpTarget;
+		delete[] m_entryPoints;
+		delete[] m_nativeOffsets;
+	}
+
+	bool compile();
+	bool outOfSpace() const									{ return m_asm.overflowed(); }
+	unsigned codeSize() const								{ return m_asm.offset(); }
+	const WORD* entryPoints() const							{ return m_entryPoints; }
+
+private:
+	// Exits from conditional paths, and the polls on taken jumps, are emitted out of line
+	struct Stub
+	{
+		enum Kind { Exit, ExitUnpop, PollJump };
+		Kind		kind;
+		unsigned	ip;			// Instruction at which to exit, or the target of the jump
+		unsigned	patch;		// Displacement of the jump to the stub
+	};
+
+	struct Fixup
+	{
+		unsigned	patch;
+		unsigned	ip;			// Target instruction
+	};
+
+	bool emitInstruction(unsigned ip);
+	bool emitCompareAndBranch(unsigned ip, unsigned next);
+
+	void toStub(Stub::Kind kind, unsigned ip, unsigned patch)
+	{
+		Stub& stub = m_stubs[m_nStubs++];
+		stub.kind = kind;
+		stub.ip = ip;
+		stub.patch = patch;
+	}
+
+	void exitIf(Asm::Cond cc, unsigned ip)					{ toStub(Stub::Exit, ip, m_asm.jcc(cc)); }
+	void exitUnpopIf(Asm::Cond cc, unsigned ip)				{ toStub(Stub::ExitUnpop, ip, m_asm.jcc(cc)); }
+	void pollJumpIf(Asm::Cond cc, unsigned target)			{ toStub(Stub::PollJump, target, m_asm.jcc(cc)); }
+
+	void exitAt(unsigned ip)
+	{
+		m_asm.movRegImm(Asm::EAX, ip);
+		m_asm.ret();
+	}
+
+	void jumpTo(unsigned patch, unsigned target)
+	{
+		Fixup& fixup = m_fixups[m_nFixups++];
+		fixup.patch = patch;
+		fixup.ip = target;
+	}
+
+	void pushEax()
+	{
+		m_asm.addRegImm(Asm::ESI, sizeof(Oop));
+		m_asm.movMemReg(Asm::ESI, 0, Asm::EAX);
+	}
+
+	void popStack()											{ m_asm.subRegImm(Asm::ESI, sizeof(Oop)); }
+
+	void loadTemp(Asm::Reg reg, unsigned index)				{ m_asm.movRegMem(reg, Asm::EBX, index*sizeof(Oop)); }
+	void storeTemp(unsigned index, Asm::Reg reg)			{ m_asm.movMemReg(Asm::EBX, index*sizeof(Oop), reg); }
+	void loadSelf(Asm::Reg reg)								{ m_asm.movRegMem(reg, Asm::EBX, -static_cast<int>(sizeof(Oop))); }
+
+	void loadInstVar(unsigned index)
+	{
+		loadSelf(Asm::EAX);
+		m_asm.movRegMem(Asm::EAX, Asm::EAX, offsetof(OTE, m_location));
+		m_asm.movRegMem(Asm::EAX, Asm::EAX, index*sizeof(Oop));
+	}
+
+	void loadLiteral(unsigned index)
+	{
+		m_asm.movRegMem(Asm::EAX, Asm::EDI, offsetof(NativeFrame, method));
+		m_asm.movRegMem(Asm::EAX, Asm::EAX, offsetof(CompiledMethod, m_aLiterals) + index*sizeof(Oop));
+	}
+
+	void loadStatic(unsigned index)
+	{
+		loadLiteral(index);
+		m_asm.movRegMem(Asm::EAX, Asm::EAX, offsetof(OTE, m_location));
+		m_asm.movRegMem(Asm::EAX, Asm::EAX, offsetof(VariableBinding, m_value));
+	}
+
+	void loadOuterTemp(unsigned depth, unsigned index)
+	{
+		m_asm.movRegAbs(Asm::EAX, m_ppActiveFrame);
+		m_asm.movRegMem(Asm::EAX, Asm::EAX, offsetof(StackFrame, m_environment));
+		m_asm.movRegMem(Asm::EAX, Asm::EAX, offsetof(OTE, m_location));
+		while (depth-- > 0)
+		{
+			m_asm.movRegMem(Asm::EAX, Asm::EAX, offsetof(Context, m_outer));
+			m_asm.movRegMem(Asm::EAX, Asm::EAX, offsetof(OTE, m_location));
+		}
+		m_asm.movRegMem(Asm::EAX, Asm::EAX, offsetof(Context, m_tempFrame) + index*sizeof(Oop));
+	}
+
+	// Set EAX to true or false, depending on the condition
+	void selectBoolean(Asm::Cond cc)
+	{
+		m_asm.movRegAbs(Asm::EAX, &Pointers.False);
+		m_asm.movRegAbs(Asm::ECX, &Pointers.True);
+		m_asm.cmov(cc, Asm::EAX, Asm::ECX);
+	}
+
+	// Load the receiver and argument of a binary special send into EAX and EDX, and exit
+	// unless both are SmallIntegers
+	void loadSmallIntegerOperands(unsigned ip)
+	{
+		m_asm.movRegMem(Asm::EAX, Asm::ESI, -static_cast<int>(sizeof(Oop)));
+		m_asm.movRegMem(Asm::EDX, Asm::ESI, 0);
+		m_asm.movRegReg(Asm::ECX, Asm::EAX);
+		m_asm.alu(Asm::AND, Asm::ECX, Asm::EDX);
+		m_asm.testLowByte(Asm::ECX, 1);
+		exitIf(Asm::CondE, ip);
+	}
+
+	// Replace the receiver and argument of a binary special send with the result in the register
+	void popAndReplaceTop(Asm::Reg reg)
+	{
+		popStack();
+		m_asm.movMemReg(Asm::ESI, 0, reg);
+	}
+
+	void compareIntegers(unsigned ip, Asm::Cond cc)
+	{
+		loadSmallIntegerOperands(ip);
+		m_asm.alu(Asm::CMP, Asm::EAX, Asm::EDX);
+		selectBoolean(cc);
+		popAndReplaceTop(Asm::EAX);
+	}
+
+	void incrementTop(unsigned ip, bool bIncrement)
+	{
+		m_asm.movRegMem(Asm::EAX, Asm::ESI, 0);
+		m_asm.testLowByte(Asm::EAX, 1);
+		exitIf(Asm::CondE, ip);
+		if (bIncrement)
+			m_asm.addRegImm(Asm::EAX, 2);
+		else
+			m_asm.subRegImm(Asm::EAX, 2);
+		exitIf(Asm::CondO, ip);
+		m_asm.movMemReg(Asm::ESI, 0, Asm::EAX);
+	}
+
+	void incrementTemp(unsigned ip, unsigned index, bool bIncrement, bool bPush)
+	{
+		loadTemp(Asm::EAX, index);
+		m_asm.testLowByte(Asm::EAX, 1);
+		exitIf(Asm::CondE, ip);
+		if (bIncrement)
+			m_asm.addRegImm(Asm::EAX, 2);
+		else
+			m_asm.subRegImm(Asm::EAX, 2);
+		exitIf(Asm::CondO, ip);
+		storeTemp(index, Asm::EAX);
+		if (bPush)
+			pushEax();
+	}
+
+	// Taken near and long jumps poll for async events, as in the byte code loop
+	void jump(unsigned target, bool bPoll)
+	{
+		if (bPoll)
+		{
+			m_asm.cmpAbsImm(m_pbAsyncPending, 0);
+			exitIf(Asm::CondNE, target);
+		}
+		jumpTo(m_asm.jmp(), target);
+	}
+
+	// Conditional jumps on a boolean exit before the pop if the top is not a boolean, so that
+	// the byte code loop sends #mustBeBoolean
+	void jumpIfBoolean(unsigned ip, unsigned target, bool bJumpIfTrue, bool bPoll)
+	{
+		m_asm.movRegMem(Asm::EAX, Asm::ESI, 0);
+		popStack();
+		m_asm.cmpRegAbs(Asm::EAX, bJumpIfTrue ? &Pointers.True : &Pointers.False);
+		if (bPoll)
+			pollJumpIf(Asm::CondE, target);
+		else
+			jumpTo(m_asm.jcc(Asm::CondE), target);
+		m_asm.cmpRegAbs(Asm::EAX, bJumpIfTrue ? &Pointers.False : &Pointers.True);
+		exitUnpopIf(Asm::CondNE, ip);
+	}
+
+	void jumpIfNil(unsigned target, bool bJumpIfNil)
+	{
+		m_asm.movRegMem(Asm::EAX, Asm::ESI, 0);
+		popStack();
+		m_asm.cmpRegAbs(Asm::EAX, &Pointers.Nil);
+		pollJumpIf(bJumpIfNil ? Asm::CondE : Asm::CondNE, target);
+	}
+
+	Asm						m_asm;
+	BYTE*					m_pByteCodes;
+	unsigned				m_cbByteCodes;
+	StackFrame* const*		m_ppActiveFrame;
+	const volatile LONG*	m_pbAsyncPending;
+	DWORD*					m_nativeOffsets;
+	WORD*					m_entryPoints;
+	bool*					m_isJumpTarget;
+	Stub*					m_stubs;
+	unsigned				m_nStubs;
+	Fixup*					m_fixups;
+	unsigned				m_nFixups;
+};
+
+// Answer whether the instruction at the specified offset is a jump, and if so its target
+static bool JumpTarget(const BYTE* pByteCodes, unsigned ip, unsigned& target)
+{
+	const BYTE* pInstruction = pByteCodes + ip;
+	const unsigned op = pInstruction[0];
+	const unsigned next = ip + lengthOfByteCode(pInstruction[0]);
+	if (op >= ShortJump && op < ShortJump+NumShortJumps)
+		target = next + op - ShortJump + 1;
+	else if (op >= ShortJumpIfFalse && op < ShortJumpIfFalse+NumShortJumpsIfFalse)
+		target = next + op - ShortJumpIfFalse + 1;
+	else if (op >= NearJump && op <= NearJumpIfNotNil)
+		target = next + static_cast<signed char>(pInstruction[1]);
+	else if (op >= LongJump && op <= LongJumpIfNotNil)
+		target = next + *reinterpret_cast<const SHORT*>(pInstruction+1);
+	else
+		return false;
+	return true;
+}
+
+// Compare and branch superinstruction, as in the byte code loop (see BRANCHON in ByteLoop.cpp): 
+// a comparison followed by a conditional jump on its result becomes a compare and conditional
+// branch, with no boolean pushed or tested. The jump is not compiled separately, so it must not
+// be the target of another jump; it has no entry point, so the loop will interpret it should the
+// comparison take its slow path.
+bool NativeCompiler::emitCompareAndBranch(unsigned ip, unsigned next)
+{
+	const unsigned op = m_pByteCodes[ip];
+	const unsigned jumpOp = m_pByteCodes[next];
+	unsigned target;
+	if (m_isJumpTarget[next] || next + lengthOfByteCode(static_cast<BYTE>(jumpOp)) > m_cbByteCodes
+			|| !JumpTarget(m_pByteCodes, next, target))
+		return false;
+
+	bool bJumpIfTrue, bPoll;
+	if (jumpOp >= ShortJumpIfFalse && jumpOp < ShortJumpIfFalse+NumShortJumpsIfFalse)
+		bJumpIfTrue = bPoll = false;
+	else if (jumpOp == NearJumpIfTrue || jumpOp == LongJumpIfTrue)
+		bJumpIfTrue = bPoll = true;
+	else if (jumpOp == NearJumpIfFalse || jumpOp == LongJumpIfFalse)
+	{
+		bJumpIfTrue = false;
+		bPoll = true;
+	}
+	else
+		return false;
+
+	Asm::Cond cc;
+	switch (op)
+	{
+	case SendArithmeticLT:
+		cc = Asm::CondL;
+		break;
+	case SendArithmeticGT:
+		cc = Asm::CondG;
+		break;
+	case SendArithmeticLE:
+		cc = Asm::CondLE;
+		break;
+	case SendArithmeticGE:
+		cc = Asm::CondGE;
+		break;
+	case SendArithmeticEQ:
+	case SpecialSendIdentical:
+	case SpecialSendIsNil:
+		cc = Asm::CondE;
+		break;
+	case SendArithmeticNE:
+	case SpecialSendNotNil:
+		cc = Asm::CondNE;
+		break;
+	default:
+		return false;
+	}
+
+	// The operands are popped before the comparison, as that would otherwise overwrite the flags
+	if (op == SpecialSendIsNil || op == SpecialSendNotNil)
+	{
+		m_asm.movRegMem(Asm::EAX, Asm::ESI, 0);
+		popStack();
+		m_asm.cmpRegAbs(Asm::EAX, &Pointers.Nil);
+	}
+	else
+	{
+		if (op == SpecialSendIdentical)
+		{
+			m_asm.movRegMem(Asm::EAX, Asm::ESI, -static_cast<int>(sizeof(Oop)));
+			m_asm.movRegMem(Asm::EDX, Asm::ESI, 0);
+		}
+		else
+			loadSmallIntegerOperands(ip);
+		m_asm.subRegImm(Asm::ESI, 2*sizeof(Oop));
+		m_asm.alu(Asm::CMP, Asm::EAX, Asm::EDX);
+	}
+
+	// The conditions are encoded in complementary pairs
+	if (!bJumpIfTrue)
+		cc = static_cast<Asm::Cond>(cc ^ 1);
+	if (bPoll)
+		pollJumpIf(cc, target);
+	else
+		jumpTo(m_asm.jcc(cc), target);
+	return true;
+}
+
+// Emit the template for the instruction at the specified offset, answering false if the
+// instruction has no template and should be executed by the byte code loop
+bool NativeCompiler::emitInstruction(unsigned ip)
+{
+	const BYTE* pInstruction = m_pByteCodes + ip;
+	const unsigned op = pInstruction[0];
+	const unsigned next = ip + lengthOfByteCode(static_cast<BYTE>(op));
+
+	if (op >= ShortPushInstVar && op < ShortPushInstVar+NumShortPushInstVars)
+		loadInstVar(op - ShortPushInstVar), pushEax();
+	else if (op >= ShortPushTemp && op < ShortPushTemp+NumShortPushTemps)
+		loadTemp(Asm::EAX, op - ShortPushTemp), pushEax();
+	else if (op >= ShortPushContextTemp && op < ShortPushContextTemp+NumPushContextTemps)
+		loadOuterTemp(0, op - ShortPushContextTemp), pushEax();
+	else if (op >= ShortPushOuterTemp && op < ShortPushOuterTemp+NumPushOuterTemps)
+		loadOuterTemp(1, op - ShortPushOuterTemp), pushEax();
+	else if (op >= ShortPushConst && op < ShortPushConst+NumShortPushConsts)
+		loadLiteral(op - ShortPushConst), pushEax();
+	else if (op >= ShortPushStatic && op < ShortPushStatic+NumShortPushStatics)
+		loadStatic(op - ShortPushStatic), pushEax();
+	else if (op >= ShortPushMinusOne && op <= ShortPushTwo)
+		m_asm.movRegImm(Asm::EAX, integerObjectOf(static_cast<int>(op) - ShortPushZero)), pushEax();
+	else if (op >= ShortPushSelfAndTemp && op < ShortPushSelfAndTemp+NumShortPushSelfAndTemps)
+	{
+		loadSelf(Asm::EAX), pushEax();
+		loadTemp(Asm::EAX, op - ShortPushSelfAndTemp), pushEax();
+	}
+	else if (op >= ShortStoreTemp && op < ShortStoreTemp+NumShortStoreTemps)
+	{
+		m_asm.movRegMem(Asm::EAX, Asm::ESI, 0);
+		storeTemp(op - ShortStoreTemp, Asm::EAX);
+	}
+	else if (op >= ShortPopPushTemp && op < ShortPopPushTemp+NumShortPopPushTemps)
+	{
+		loadTemp(Asm::EAX, op - ShortPopPushTemp);
+		m_asm.movMemReg(Asm::ESI, 0, Asm::EAX);
+	}
+	else if (op >= ShortPopStoreTemp && op < ShortPopStoreTemp+NumShortPopStoreTemps)
+	{
+		m_asm.movRegMem(Asm::EAX, Asm::ESI, 0);
+		storeTemp(op - ShortPopStoreTemp, Asm::EAX);
+		popStack();
+	}
+	else if (op >= ShortJump && op < ShortJump+NumShortJumps)
+		jump(next + op - ShortJump + 1, false);
+	else if (op >= ShortJumpIfFalse && op < ShortJumpIfFalse+NumShortJumpsIfFalse)
+		jumpIfBoolean(ip, next + op - ShortJumpIfFalse + 1, false, false);
+	else
+	{
+		switch (op)
+		{
+		case ShortPushSelf:
+			loadSelf(Asm::EAX);
+			pushEax();
+			break;
+
+		case ShortPushTrue:
+		case ShortPushFalse:
+		case ShortPushNil:
+			m_asm.movRegAbs(Asm::EAX, op == ShortPushTrue ? &Pointers.True : op == ShortPushFalse ? &Pointers.False : &Pointers.Nil);
+			pushEax();
+			break;
+
+		case PopPushSelf:
+			loadSelf(Asm::EAX);
+			m_asm.movMemReg(Asm::ESI, 0, Asm::EAX);
+			break;
+
+		case PopDup:
+			m_asm.movRegMem(Asm::EAX, Asm::ESI, -static_cast<int>(sizeof(Oop)));
+			m_asm.movMemReg(Asm::ESI, 0, Asm::EAX);
+			break;
+
+		case PopStackTop:
+			popStack();
+			break;
+
+		case DuplicateStackTop:
+			m_asm.movRegMem(Asm::EAX, Asm::ESI, 0);
+			pushEax();
+			break;
+
+		case IncrementStackTop:
+		case DecrementStackTop:
+			incrementTop(ip, op == IncrementStackTop);
+			break;
+
+		case Nop:
+			break;
+
+		case SendArithmeticAdd:
+			// (2a+1) + 2b = 2(a+b)+1, and overflow of the tagged result is overflow of the SmallInteger
+			loadSmallIntegerOperands(ip);
+			m_asm.decReg(Asm::EDX);
+			m_asm.alu(Asm::ADD, Asm::EAX, Asm::EDX);
+			exitIf(Asm::CondO, ip);
+			popAndReplaceTop(Asm::EAX);
+			break;
+
+		case SendArithmeticSub:
+			loadSmallIntegerOperands(ip);
+			m_asm.decReg(Asm::EDX);
+			m_asm.alu(Asm::SUB, Asm::EAX, Asm::EDX);
+			exitIf(Asm::CondO, ip);
+			popAndReplaceTop(Asm::EAX);
+			break;
+
+		// Tagged SmallIntegers compare as their values
+		case SendArithmeticLT:
+			compareIntegers(ip, Asm::CondL);
+			break;
+		case SendArithmeticGT:
+			compareIntegers(ip, Asm::CondG);
+			break;
+		case SendArithmeticLE:
+			compareIntegers(ip, Asm::CondLE);
+			break;
+		case SendArithmeticGE:
+			compareIntegers(ip, Asm::CondGE);
+			break;
+		case SendArithmeticEQ:
+			compareIntegers(ip, Asm::CondE);
+			break;
+		case SendArithmeticNE:
+			compareIntegers(ip, Asm::CondNE);
+			break;
+
+		case SendArithmeticBitAnd:
+			// ECX already holds the result
+			loadSmallIntegerOperands(ip);
+			popAndReplaceTop(Asm::ECX);
+			break;
+
+		case SendArithmeticBitOr:
+			loadSmallIntegerOperands(ip);
+			m_asm.alu(Asm::OR, Asm::EAX, Asm::EDX);
+			popAndReplaceTop(Asm::EAX);
+			break;
+
+		case SpecialSendIdentical:
+			m_asm.movRegMem(Asm::EAX, Asm::ESI, -static_cast<int>(sizeof(Oop)));
+			m_asm.movRegMem(Asm::EDX, Asm::ESI, 0);
+			m_asm.alu(Asm::CMP, Asm::EAX, Asm::EDX);
+			selectBoolean(Asm::CondE);
+			popAndReplaceTop(Asm::EAX);
+			break;
+
+		case SpecialSendIsNil:
+		case SpecialSendNotNil:
+			m_asm.movRegMem(Asm::EDX, Asm::ESI, 0);
+			m_asm.cmpRegAbs(Asm::EDX, &Pointers.Nil);
+			selectBoolean(op == SpecialSendIsNil ? Asm::CondE : Asm::CondNE);
+			m_asm.movMemReg(Asm::ESI, 0, Asm::EAX);
+			break;
+
+		case SpecialSendIsZero:
+			m_asm.cmpMemImm(Asm::ESI, 0, static_cast<signed char>(ZeroPointer));
+			selectBoolean(Asm::CondE);
+			m_asm.movMemReg(Asm::ESI, 0, Asm::EAX);
+			break;
+
+		case PushInstVar:
+			loadInstVar(pInstruction[1]);
+			pushEax();
+			break;
+
+		case PushTemp:
+			loadTemp(Asm::EAX, pInstruction[1]);
+			pushEax();
+			break;
+
+		case PushConst:
+			loadLiteral(pInstruction[1]);
+			pushEax();
+			break;
+
+		case PushStatic:
+			loadStatic(pInstruction[1]);
+			pushEax();
+			break;
+
+		case StoreTemp:
+		case PopStoreTemp:
+			m_asm.movRegMem(Asm::EAX, Asm::ESI, 0);
+			storeTemp(pInstruction[1], Asm::EAX);
+			if (op == PopStoreTemp)
+				popStack();
+			break;
+
+		case PushImmediate:
+			m_asm.movRegImm(Asm::EAX, integerObjectOf(static_cast<signed char>(pInstruction[1])));
+			pushEax();
+			break;
+
+		case PushSelfAndTemp:
+			loadSelf(Asm::EAX);
+			pushEax();
+			loadTemp(Asm::EAX, pInstruction[1]);
+			pushEax();
+			break;
+
+		case PushTempPair:
+			loadTemp(Asm::EAX, pInstruction[1] >> 4);
+			pushEax();
+			loadTemp(Asm::EAX, pInstruction[1] & 0xF);
+			pushEax();
+			break;
+
+		case PushOuterTemp:
+			loadOuterTemp(pInstruction[1] >> OuterTempIndexBits, pInstruction[1] & OuterTempMaxIndex);
+			pushEax();
+			break;
+
+		case NearJump:
+			jump(next + static_cast<signed char>(pInstruction[1]), true);
+			break;
+
+		case NearJumpIfTrue:
+		case NearJumpIfFalse:
+			jumpIfBoolean(ip, next + static_cast<signed char>(pInstruction[1]), op == NearJumpIfTrue, true);
+			break;
+
+		case NearJumpIfNil:
+		case NearJumpIfNotNil:
+			jumpIfNil(next + static_cast<signed char>(pInstruction[1]), op == NearJumpIfNil);
+			break;
+
+		case LongPushConst:
+			loadLiteral(*reinterpret_cast<const WORD*>(pInstruction+1));
+			pushEax();
+			break;
+
+		case LongPushStatic:
+			loadStatic(*reinterpret_cast<const WORD*>(pInstruction+1));
+			pushEax();
+			break;
+
+		case LongPushImmediate:
+			m_asm.movRegImm(Asm::EAX, integerObjectOf(*reinterpret_cast<const SHORT*>(pInstruction+1)));
+			pushEax();
+			break;
+
+		case LongJump:
+			jump(next + *reinterpret_cast<const SHORT*>(pInstruction+1), true);
+			break;
+
+		case LongJumpIfTrue:
+		case LongJumpIfFalse:
+			jumpIfBoolean(ip, next + *reinterpret_cast<const SHORT*>(pInstruction+1), op == LongJumpIfTrue, true);
+			break;
+
+		case LongJumpIfNil:
+		case LongJumpIfNotNil:
+			jumpIfNil(next + *reinterpret_cast<const SHORT*>(pInstruction+1), op == LongJumpIfNil);
+			break;
+
+		case LongPushOuterTemp:
+			loadOuterTemp(pInstruction[1], pInstruction[2]);
+			pushEax();
+			break;
+
+		// The embedded store is skipped on the fast path
+		case IncrementTemp:
+		case IncrementPushTemp:
+		case DecrementTemp:
+		case DecrementPushTemp:
+			incrementTemp(ip, pInstruction[2], op == IncrementTemp || op == IncrementPushTemp,
+							op == IncrementPushTemp || op == DecrementPushTemp);
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool NativeCompiler::compile()
+{
+	// Mark the start of each instruction, so that jumps into the middle of instructions (which
+	// the compiler never generates) can be detected
+	const DWORD NotAnInstruction = 0xFFFFFFFF;
+	for (unsigned i=0;i<m_cbByteCodes;i++)
+	{
+		m_nativeOffsets[i] = NotAnInstruction;
+		m_entryPoints[i] = NoNativeEntry;
+		m_isJumpTarget[i] = false;
+	}
+
+	unsigned ip = 0;
+	while (ip < m_cbByteCodes)
+	{
+		unsigned length = lengthOfByteCode(m_pByteCodes[ip]);
+		if (ip + length > m_cbByteCodes)
+			return false;
+		unsigned target;
+		if (JumpTarget(m_pByteCodes, ip, target) && target < m_cbByteCodes)
+			m_isJumpTarget[target] = true;
+		ip += length;
+	}
+
+	ip = 0;
+	while (ip < m_cbByteCodes)
+	{
+		unsigned length = lengthOfByteCode(m_pByteCodes[ip]);
+		unsigned next = ip + length;
+
+		m_nativeOffsets[ip] = m_asm.offset();
+		if (next < m_cbByteCodes && emitCompareAndBranch(ip, next))
+		{
+			m_entryPoints[ip] = static_cast<WORD>(m_nativeOffsets[ip]);
+			ip = next + lengthOfByteCode(m_pByteCodes[next]);
+			continue;
+		}
+
+		if (emitInstruction(ip))
+			m_entryPoints[ip] = static_cast<WORD>(m_nativeOffsets[ip]);
+		else
+			exitAt(ip);
+		ip += length;
+	}
+	// Running off the end cannot happen, as the last instruction must be a return, but just in case
+	exitAt(m_cbByteCodes);
+
+	// Polls emitted from stubs add further exit stubs, which are emitted in turn
+	for (unsigned i=0;i<m_nStubs;i++)
+	{
+		const Stub& stub = m_stubs[i];
+		m_asm.patch(stub.patch, m_asm.offset());
+		switch (stub.kind)
+		{
+		case Stub::ExitUnpop:
+			m_asm.addRegImm(Asm::ESI, sizeof(Oop));
+			exitAt(stub.ip);
+			break;
+
+		case Stub::PollJump:
+			jump(stub.ip, true);
+			break;
+
+		default:
+			exitAt(stub.ip);
+			break;
+		}
+	}
+
+	for (unsigned i=0;i<m_nFixups;i++)
+	{
+		const Fixup& fixup = m_fixups[i];
+		if (fixup.ip >= m_cbByteCodes || m_nativeOffsets[fixup.ip] == NotAnInstruction)
+			return false;
+		m_asm.patch(fixup.patch, m_nativeOffsets[fixup.ip]);
+	}
+
+	// Entry points are held in 16-bits
+	return !m_asm.overflowed() && m_asm.offset() < NoNativeEntry;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Emit the trampoline through which native code is called into the start of the region
+static void EmitTrampoline()
+{
+	static const BYTE trampoline[] =
+	{
+		0x55,					// push	ebp
+		0x53,					// push	ebx
+		0x56,					// push	esi
+		0x57,					// push	edi
+		0x8B, 0x44, 0x24, 0x14,	// mov	eax, [esp+20]		; pEntry
+		0x8B, 0x7C, 0x24, 0x18,	// mov	edi, [esp+24]		; pFrame
+		0x8B, 0x37,				// mov	esi, [edi]			; sp
+		0x8B, 0x5F, 0x04,		// mov	ebx, [edi+4]		; bp
+		0xFF, 0xD0,				// call	eax
+		0x89, 0x37,				// mov	[edi], esi
+		0x5F,					// pop	edi
+		0x5E,					// pop	esi
+		0x5B,					// pop	ebx
+		0x5D,					// pop	ebp
+		0xC3					// ret
+	};
+	memcpy(s_pNativeCode, trampoline, sizeof(trampoline));
+	s_trampoline = reinterpret_cast<NativeTrampoline>(s_pNativeCode);
+	s_pNativeFree = s_pNativeCode + ((sizeof(trampoline) + 15) & ~15);
+}
+
+// Discard all native code. Safe at any time that native code is not running, as it never
+// remains on the stack across an exit to the byte code loop.
+void Interpreter::flushNativeCode()
+{
+	ZeroMemory(nativeMethods, sizeof(nativeMethods));
+	if (s_pNativeCode != NULL)
+		EmitTrampoline();
+}
+
+bool Interpreter::compileNativeMethod(NativeMethod& native)
+{
+	if (s_pNativeCode == NULL)
+	{
+		s_pNativeCode = static_cast<BYTE*>(::VirtualAlloc(NULL, NativeCodeSize, MEM_RESERVE|MEM_COMMIT, PAGE_EXECUTE_READWRITE));
+		if (s_pNativeCode == NULL)
+			return false;
+		EmitTrampoline();
+	}
+
+	// Methods whose byte codes are packed into a SmallInteger are too short to be worth compiling
+	if (isIntegerObject(native.byteCodes))
+		return false;
+	BytesOTE* oteByteCodes = reinterpret_cast<BytesOTE*>(native.byteCodes);
+	unsigned cbByteCodes = oteByteCodes->bytesSize();
+
+	for (int attempt=0;;attempt++)
+	{
+		BYTE* pLimit = s_pNativeCode + NativeCodeSize;
+		NativeCompiler compiler(oteByteCodes->m_location->m_fields, cbByteCodes, s_pNativeFree, pLimit,
+									&m_registers.m_pActiveFrame, &m_bAsyncPending);
+		if (compiler.compile())
+		{
+			// The entry points follow the code
+			BYTE* pCode = s_pNativeFree;
+			WORD* entryPoints = reinterpret_cast<WORD*>((reinterpret_cast<DWORD_PTR>(pCode) + compiler.codeSize() + 1) & ~1);
+			if (reinterpret_cast<BYTE*>(entryPoints + cbByteCodes) <= pLimit)
+			{
+				memcpy(entryPoints, compiler.entryPoints(), cbByteCodes*sizeof(WORD));
+				::FlushInstructionCache(::GetCurrentProcess(), pCode, compiler.codeSize());
+				s_pNativeFree = reinterpret_cast<BYTE*>((reinterpret_cast<DWORD_PTR>(entryPoints + cbByteCodes) + 15) & ~15);
+				native.pCode = pCode;
+				native.entryPoints = entryPoints;
+				return true;
+			}
+		}
+		else if (!compiler.outOfSpace())
+			return false;
+
+		// Out of space, so start again with an empty region, keeping only this method's entry.
+		// If it still does not fit it never will.
+		if (attempt > 0)
+			return false;
+		NativeMethod keep = native;
+		flushNativeCode();
+		native = keep;
+	}
+}
+
+// Run the native code for the active method from the current IP, if it has been compiled, or count
+// an activation of the method if not. Answers whether the native code was run, in which case the
+// IP and SP will have been updated.
+BOOL __fastcall Interpreter::runNativeCode(bool bActivation)
+{
+	MethodOTE* oteMethod = m_registers.m_pActiveFrame->m_method;
+	NativeMethod& native = nativeMethods[(Oop(oteMethod) / sizeof(OTE)) & (NativeMethodTableSize-1)];
+	CompiledMethod* pMethod = oteMethod->m_location;
+	if (native.oteMethod != oteMethod || native.pMethod != pMethod || native.byteCodes != pMethod->m_byteCodes)
+	{
+		// A different method, or the slot's method has been freed and its OTE reused. Any code
+		// for the previous occupant remains in the region until it is next flushed.
+		if (!bActivation)
+			return FALSE;
+		native.oteMethod = oteMethod;
+		native.pMethod = pMethod;
+		native.byteCodes = pMethod->m_byteCodes;
+		native.nActivations = 0;
+		native.pCode = NULL;
+		native.entryPoints = NULL;
+	}
+
+	if (native.pCode == NULL)
+	{
+		// Compilation is attempted only once
+		if (!bActivation || ++native.nActivations != NativeCompileThreshold || !compileNativeMethod(native))
+			return FALSE;
+	}
+
+	BYTE* pByteCodes = ObjectMemory::ByteAddressOfObjectContents(pMethod->m_byteCodes);
+	unsigned ip = m_registers.m_instructionPointer - pByteCodes;
+	WORD entry = native.entryPoints[ip];
+	if (entry == NoNativeEntry)
+		return FALSE;
+
+	NativeFrame frame;
+	frame.sp = m_registers.m_stackPointer;
+	frame.bp = m_registers.m_basePointer;
+	frame.method = pMethod;
+	unsigned exitIP = s_trampoline(native.pCode + entry, &frame);
+	m_registers.m_stackPointer = frame.sp;
+	m_registers.m_instructionPointer = pByteCodes + exitIP;
+	return TRUE;
+}
+
+#endif	// BASELINE_JIT
@@ -0,0 +1,198 @@
+/******************************************************************************
+
+	File: SafepointTest.cpp
+
+	Description:
+
+	Tests of isolate safepoints (see Isolate.h). The main thread creates an
+	isolate, and so plays the part of its interpreter thread, while other
+	threads request safepoints. Isolate.cpp is linked in on its own, so the
+	interpreter state it uses (the async pending flag and the wakeup event)
+	is defined here.
+
+		timeout		A request made while the interpreter is not polling
+					fails with ERROR_TIMEOUT, and is withdrawn, so that the
+					interpreter does not then park, and a later request
+					can be made.
+		park		Requests made while the interpreter is polling succeed,
+					the interpreter does not run from the request until the
+					release, and then resumes. Each request sets the
+					wakeup event, in case the interpreter is idle.
+
+	Answers a non-zero exit code if any test fails.
+
+	Usage: SafepointTest [-n <requests>]
+
+******************************************************************************/
+
+#include "ist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Interprt.h"
+#include "STExternal.h"
+
+// Interpreter state used by Isolate.cpp
+SHAREDLONG Interpreter::m_bAsyncPending = FALSE;
+VMPointers Pointers;
+static ExternalHandle s_wakeupEvent;
+static HandleOTE s_oteWakeupEvent;
+
+// Time allowed for the interpreter to park when it is polling, and to resume after release
+static const DWORD PARKTIMEOUT = 5000;
+// Time allowed for a request when the interpreter is not polling, which is expected to expire
+static const DWORD SHORTTIMEOUT = 50;
+// Time for which the interpreter is checked not to run while parked
+static const DWORD PARKEDINTERVAL = 10;
+
+static Isolate* s_pIsolate;
+static unsigned s_nRequests;
+
+// Incremented by the simulated interpreter between polls
+static SHAREDLONG s_nSteps;
+
+static bool Check(bool bOk, const char* szWhat)
+{
+	if (!bOk)
+		fprintf(stderr, "FAILED: %s\n", szWhat);
+	return bOk;
+}
+
+static HANDLE StartThread(LPTHREAD_START_ROUTINE pfnProc)
+{
+	DWORD dwThreadId;
+	return ::CreateThread(NULL, 0, pfnProc, NULL, 0, &dwThreadId);
+}
+
+static DWORD ThreadResult(HANDLE hThread)
+{
+	DWORD dwResult = FALSE;
+	::GetExitCodeThread(hThread, &dwResult);
+	::CloseHandle(hThread);
+	return dwResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Timeout
+
+static DWORD WINAPI TimeoutRequester(LPVOID)
+{
+	return Check(s_pIsolate->RequestSafepoint(SHORTTIMEOUT) == HRESULT_FROM_WIN32(ERROR_TIMEOUT),
+				"request while not polling times out");
+}
+
+static bool TestTimeout()
+{
+	// The interpreter does not poll until the requester has given up
+	HANDLE hThread = StartThread(TimeoutRequester);
+	if (!Check(hThread != NULL, "start requester"))
+		return false;
+	::WaitForSingleObject(hThread, INFINITE);
+	bool bOk = ThreadResult(hThread) != FALSE;
+
+	if (!Check(!s_pIsolate->IsSafepointRequested(), "timed out request is withdrawn"))
+		return false;
+	// Would never return if the withdrawn request were still pending
+	s_pIsolate->ParkAtSafepoint();
+	return bOk;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Request, park and release
+
+static DWORD WINAPI ParkRequester(LPVOID)
+{
+	HANDLE hWakeup = s_wakeupEvent.m_handle;
+	bool bOk = true;
+	for (unsigned i=0;i<s_nRequests && bOk;i++)
+	{
+		::ResetEvent(hWakeup);
+		if (!Check(s_pIsolate->RequestSafepoint(PARKTIMEOUT) == S_OK, "request while polling succeeds"))
+			return FALSE;
+		bOk = Check(::WaitForSingleObject(hWakeup, 0) == WAIT_OBJECT_0, "request sets the wakeup event");
+
+		// Only the first request waits for long, to keep the run short
+		LONG nSteps = s_nSteps;
+		::Sleep(i == 0 ? PARKEDINTERVAL : 0);
+		if (!Check(s_nSteps == nSteps, "interpreter does not run while parked"))
+			bOk = false;
+
+		s_pIsolate->ReleaseSafepoint();
+
+		DWORD dwStart = ::GetTickCount();
+		while (s_nSteps == nSteps && ::GetTickCount() - dwStart < PARKTIMEOUT)
+			::Sleep(0);
+		if (!Check(s_nSteps != nSteps, "interpreter resumes after release"))
+			bOk = false;
+	}
+	return bOk;
+}
+
+static bool TestPark()
+{
+	s_nSteps = 0;
+	HANDLE hThread = StartThread(ParkRequester);
+	if (!Check(hThread != NULL, "start requester"))
+		return false;
+
+	// Poll as BytecodePoll() does, until the requester has finished
+	while (::WaitForSingleObject(hThread, 0) == WAIT_TIMEOUT)
+	{
+		::InterlockedIncrement(&s_nSteps);
+		if (s_pIsolate->IsSafepointRequested())
+			s_pIsolate->ParkAtSafepoint();
+	}
+
+	return ThreadResult(hThread) != FALSE && Check(!s_pIsolate->IsSafepointRequested(), "no request left pending");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+int __cdecl main(int argc, char* argv[])
+{
+	s_nRequests = 1000;
+
+	for (int i=1;i<argc;i++)
+	{
+		if (strcmp(argv[i], "-n") == 0 && i+1 < argc)
+			s_nRequests = atoi(argv[++i]);
+		else
+		{
+			fprintf(stderr, "Usage: SafepointTest [-n <requests>]\n");
+			return 1;
+		}
+	}
+	if (s_nRequests < 1)
+	{
+		fprintf(stderr, "The number of requests must be at least 1\n");
+		return 1;
+	}
+
+	s_wakeupEvent.m_handle = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	s_oteWakeupEvent.m_location = &s_wakeupEvent;
+	Pointers.WakeupEvent = &s_oteWakeupEvent;
+
+	HRESULT hr = Isolate::Create("SafepointTest", s_pIsolate);
+	if (FAILED(hr))
+	{
+		fprintf(stderr, "Unable to create isolate: %#x\n", hr);
+		return 1;
+	}
+
+	int ret = 0;
+
+	bool bOk = TestTimeout();
+	printf("%-8s %s\n", "timeout", bOk ? "passed" : "FAILED");
+	if (!bOk)
+		ret = 1;
+
+	bOk = TestPark();
+	printf("%-8s %s (%u requests)\n", "park", bOk ? "passed" : "FAILED", s_nRequests);
+	if (!bOk)
+		ret = 1;
+
+	s_pIsolate->Destroy();
+	::CloseHandle(s_wakeupEvent.m_handle);
+	return ret;
+}
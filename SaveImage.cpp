@@ -23,6 +23,7 @@
 #include "binstream.h"
 #ifndef _AFX
 	#include "zfbinstream.h"
+	#include "blockbinstream.h"
 #endif
 #include "objmem.h"
 #include "ObjMemPriv.inl"
@@ -61,7 +62,7 @@ bool ObjectMemory::Expire(const char* szFileName)
 	return SaveImageFile(szFileName, false, false)==0;
 }
 
-int __stdcall ObjectMemory::SaveImageFile(const char* szFileName, bool bBackup, int nCompressionLevel)
+int __stdcall ObjectMemory::SaveImageFile(const char* szFileName, bool bBackup, int nCompressionLevel, bool bDelta)
 {
 	// Answer:
 	//	NULL = success
@@ -73,6 +74,14 @@ int __stdcall ObjectMemory::SaveImageFile(const char* szFileName, bool bBackup,
 	if (!szFileName)
 		return 2;
 
+#ifdef DELTAIMAGES
+	// An incremental image can only be written against the last image loaded or saved
+	if (bDelta && !IsTrackingDeltas())
+		return 3;
+#else
+	if (bDelta)
+		return 3;
+#endif
 	
 	int nRet = 3;
 
@@ -114,6 +123,12 @@ int __stdcall ObjectMemory::SaveImageFile(const char* szFileName, bool bBackup,
 	else
 		saveName = szFileName;
 
+#ifdef LAZYLOADING
+	// The image file can't be overwritten, or renamed to the backup, while objects remain to be loaded from it
+	if (!ReleaseLazyImage(szFileName))
+		return 2;
+#endif
+
 	int fd;
 	int err = ::_sopen_s(&fd, saveName, _O_WRONLY|_O_BINARY|_O_CREAT|_O_TRUNC|_O_SEQUENTIAL, _SH_DENYRW, _S_IWRITE|_S_IREAD);
 	if (err != 0)
@@ -142,7 +157,11 @@ int __stdcall ObjectMemory::SaveImageFile(const char* szFileName, bool bBackup,
 								((isIntegerObject(_Pointers.ImageVersionMinor))?
 								LOWORD(integerValueOf(_Pointers.ImageVersionMinor)) : 0);
 
-	header.flags.bIsCompressed = nCompressionLevel != 0;
+	// Incremental images are always uncompressed, they are expected to be small.
+	// Compression levels above the zlib maximum select the (faster) block compressed format
+	header.flags.bIsCompressed = nCompressionLevel != 0 && nCompressionLevel <= Z_BEST_COMPRESSION && !bDelta;
+	header.flags.bIsBlockCompressed = nCompressionLevel > Z_BEST_COMPRESSION && !bDelta;
+	header.flags.bIsDelta = bDelta;
 
 	header.nGlobalPointers	= NumPointers;
 
@@ -190,6 +209,7 @@ int __stdcall ObjectMemory::SaveImageFile(const char* szFileName, bool bBackup,
 	::_write(fd, &header, sizeof(ImageHeader));
 	
 	bool bSaved;
+	DeltaDigest* pDigests = NULL;
 	{
 		BYTE buf[dwAllocationGranularity];
 #ifndef _AFX
@@ -200,7 +220,14 @@ int __stdcall ObjectMemory::SaveImageFile(const char* szFileName, bool bBackup,
 			//stream.clrlock();
 			stream.attach(fd, "wb", 0, true);
 			//stream << setcompressionlevel(nCompressionLevel);
-			bSaved = SaveImage(stream, &header, nRet);
+			bSaved = SaveImage(stream, &header, nRet, &pDigests);
+		}
+		else if (header.flags.bIsBlockCompressed)
+		{
+			blockobinstream stream;
+			stream.attach(fd, true);
+			bSaved = SaveImage(stream, &header, nRet, &pDigests);
+			stream.close();
 		}
 		else
 #endif
@@ -211,7 +238,7 @@ int __stdcall ObjectMemory::SaveImageFile(const char* szFileName, bool bBackup,
 			stream.attach(fd, "wb");
 			stream.setbuf(buf, sizeof(buf));
 
-			bSaved = SaveImage(stream, &header, nRet);
+			bSaved = SaveImage(stream, &header, nRet, &pDigests);
 			stream.close();
 			::_close(fd);
 		}
@@ -247,15 +274,40 @@ int __stdcall ObjectMemory::SaveImageFile(const char* szFileName, bool bBackup,
 			nRet = 0;
 	}
 
+#ifdef DELTAIMAGES
+	// The image just written becomes the base for the next incremental save
+	if (nRet == 0)
+		AcceptDeltaDigests(pDigests, header.nTableSize, szFileName);
+	else
+		delete[] pDigests;
+#endif
+
 	return nRet;
 
 }
 
-bool __stdcall ObjectMemory::SaveImage(obinstream& imageFile, const ImageHeader* pHeader, int nRet)
+bool __stdcall ObjectMemory::SaveImage(obinstream& imageFile, const ImageHeader* pHeader, int nRet, DeltaDigest** ppDigests)
 {
 	EmptyZct();
+	bool bResult;
+#ifdef DELTAIMAGES
+	// The digests must be taken after the Zct has been emptied, as that may free objects
+	DeltaImageHeader deltaHeader;
+	if (IsTrackingDeltas())
+		*ppDigests = NewDeltaDigests(pHeader->nTableSize, pHeader->flags.bIsDelta ? &deltaHeader : NULL);
+
+	if (pHeader->flags.bIsDelta)
+	{
+		bResult = imageFile.good() != 0 
+			&& (nRet == 3)
+			&& imageFile.write(&deltaHeader, sizeof(deltaHeader))
+			&& SaveDeltaObjects(imageFile, pHeader, *ppDigests)
+			&& imageFile.flush().good();
+	}
+	else
+#endif
 	// Do the save.
-	bool bResult = imageFile.good() != 0 
+	bResult = imageFile.good() != 0 
 		&& (nRet == 3)
 		&& SaveObjectTable(imageFile, pHeader) 
 		&& SaveObjects(imageFile, pHeader) 
@@ -336,3 +388,96 @@ bool __stdcall ObjectMemory::SaveObjects(obinstream& imageFile, const ImageHeade
 	// Append the amount of data written as a checksum.
 	return imageFile.write(&dwDataSize, sizeof(DWORD));
 }
+
+#ifdef DELTAIMAGES
+
+///////////////////////////////////////////////////////////////////////////////
+// Incremental (delta) image save
+
+// Answer a new array of digests of the first nTableSize OT entries as they are about to be
+// saved. If an incremental image is being written, then also fill in its header with the 
+// number of objects that have been freed or changed since the base image.
+ObjectMemory::DeltaDigest* __stdcall ObjectMemory::NewDeltaDigests(unsigned nTableSize, DeltaImageHeader* pDeltaHeader)
+{
+	DeltaDigest* pDigests = new DeltaDigest[nTableSize];
+	unsigned nChanged = 0;
+	for (unsigned i=0;i<nTableSize;i++)
+	{
+		const OTE* ote = m_pOT+i;
+		DeltaDigest digest = ote->isFree() ? 0 : ObjectDigest(ote);
+		pDigests[i] = digest;
+		if (digest != 0 && (i >= m_nDeltaDigests || m_pDeltaDigests[i] != digest))
+			nChanged++;
+	}
+
+	if (pDeltaHeader)
+	{
+		unsigned nFreed = 0;
+		for (unsigned i=0;i<m_nDeltaDigests;i++)
+		{
+			if (m_pDeltaDigests[i] != 0 && (i >= nTableSize || pDigests[i] == 0))
+				nFreed++;
+		}
+
+		memset(pDeltaHeader, 0, sizeof(DeltaImageHeader));
+		pDeltaHeader->dwBaseChecksum = m_dwDeltaBaseChecksum;
+		pDeltaHeader->nBaseTableSize = m_nDeltaDigests;
+		pDeltaHeader->nChanged = nChanged;
+		pDeltaHeader->nFreed = nFreed;
+		strncpy_s(pDeltaHeader->szBaseImage, sizeof(pDeltaHeader->szBaseImage), m_szDeltaBase, _TRUNCATE);
+
+		#ifdef _DEBUG
+			TRACESTREAM << "Incremental save against '" << m_szDeltaBase << "': " << dec << nChanged 
+				<< " changed, " << nFreed << " freed" << endl;
+		#endif
+	}
+
+	return pDigests;
+}
+
+// Write the OT indices of the objects freed since the base image, then an (index, OTE, body)
+// record for each object which is new or has changed since then.
+bool __stdcall ObjectMemory::SaveDeltaObjects(obinstream& imageFile, const ImageHeader* pHeader, const DeltaDigest* pDigests)
+{
+	const unsigned nTableSize = pHeader->nTableSize;
+	for (unsigned i=0;i<m_nDeltaDigests;i++)
+	{
+		if (m_pDeltaDigests[i] != 0 && (i >= nTableSize || pDigests[i] == 0))
+		{
+			if (!imageFile.write(&i, sizeof(i)))
+				return false;
+		}
+	}
+
+	DWORD dwDataSize = 0;
+	for (unsigned i=0;i<nTableSize;i++)
+	{
+		const DeltaDigest digest = pDigests[i];
+		if (digest == 0 || (i < m_nDeltaDigests && m_pDeltaDigests[i] == digest))
+			continue;
+
+		OTE* ote = m_pOT+i;
+		imageFile.write(&i, sizeof(i));
+		imageFile.write(ote, sizeof(OTE));
+		dwDataSize += sizeof(i) + sizeof(OTE);
+
+		void* obj = ote->m_location;
+		if (ote->heapSpace() == OTEFlags::VirtualSpace)
+		{
+			VirtualObject* vObj = reinterpret_cast<VirtualObject*>(obj);
+			imageFile.write(vObj->getHeader(), sizeof(VirtualObjectHeader));
+			dwDataSize += sizeof(VirtualObjectHeader);
+		}
+
+		MWORD bytesToWrite = ote->sizeOf();
+		imageFile.write(obj, bytesToWrite);
+		if (imageFile.good() == 0)
+			return false;
+		dwDataSize += bytesToWrite;
+	}
+
+	// As for a full image, the amount of record data written is appended as a checksum
+	return imageFile.write(&dwDataSize, sizeof(DWORD));
+}
+
+#endif
@@ -58,6 +58,13 @@ BOOL __fastcall Interpreter::primitiveSnapshot(CompiledMethod& , unsigned argCou
 	else
 		nCompressionLevel = 0;
 
+	// Optional 4th argument requests an incremental image against the last image loaded or saved
+	bool bDelta;
+	if (argCount >= 4)
+		bDelta = reinterpret_cast<OTE*>(stackValue(argCount-4)) == Pointers.True;
+	else
+		bDelta = false;
+
 	// N.B. It is not necessary to clear down the memory pools as the free list is rebuild on every image
 	// load and the pool members, though not on the free list at present, are marked as free entries
 	// in the object table
@@ -74,7 +81,7 @@ BOOL __fastcall Interpreter::primitiveSnapshot(CompiledMethod& , unsigned argCou
 	DWORD timeStart = timeGetTime();
 #endif
 
-	int saveResult = ObjectMemory::SaveImageFile(szFileName, bBackup, nCompressionLevel);
+	int saveResult = ObjectMemory::SaveImageFile(szFileName, bBackup, nCompressionLevel, bDelta);
 
 #ifdef OAD
 	DWORD timeEnd = timeGetTime();
@@ -84,6 +91,8 @@ BOOL __fastcall Interpreter::primitiveSnapshot(CompiledMethod& , unsigned argCou
 	if (!saveResult)
 	{
 		// Success
+		if (IsMethodCacheProfileEnabled())
+			SaveMethodCacheProfile(szFileName);
 		popStack();
 		return primitiveSuccess();
 	}
@@ -0,0 +1,520 @@
+/******************************************************************************
+
+	File: TimerWheel.cpp
+
+	Description:
+
+	Implementation of the Interpreter class' timer wheel, which allows any
+	number of Semaphores to be signalled after specified delays.
+
+	primitiveSignalAtTick supports only one outstanding timer, so the image
+	must multiplex all its Delays through a single timing Process. The timer
+	wheel instead accepts a registration for each (Semaphore, delay) pair, and
+	answers a handle through which the registration can be cancelled in
+	constant time. The wheel is hierarchical: each level has TimerWheelSlots
+	buckets, each bucket of a level covering TimerWheelSlots times the period
+	of a bucket of the level below, so registration, cancellation and expiry
+	are all constant time regardless of the number of timers outstanding.
+	Registrations are cascaded down the levels as their deadlines approach.
+
+	The wheel is advanced by a dedicated thread, which sleeps until the next
+	occupied bucket is due, and signals expired Semaphores through the same
+	asynchronous signal queue as the multimedia timer. Deadlines are held in
+	ticks of TimerWheelTickMicroseconds, measured against the performance
+	counter, so a timer never fires early, although how soon after its
+	deadline it fires is limited by the system timer resolution established
+	in initializeTimer().
+
+	The wheel holds a reference to each registered Semaphore, which is
+	released in the main thread once the timer has fired or been cancelled.
+	Lock ordering is the async protect lock, then the wheel lock.
+
+******************************************************************************/
+#include "Ist.h"
+
+#pragma code_seg(PRIM_SEG)
+
+#include <intrin.h>
+
+#include "ObjMem.h"
+#include "Interprt.h"
+#include "InterprtPrim.inl"
+#include "InterprtProc.inl"
+
+// Smalltalk classes
+#include "STProcess.h"
+
+enum { TimerWheelTickMicroseconds = 100 };
+enum { TimerWheelSlotBits = 6, TimerWheelSlots = 1 << TimerWheelSlotBits, TimerWheelSlotMask = TimerWheelSlots - 1 };
+enum { TimerWheelLevels = 4 };
+enum { TimerWheelTicksPerSecond = 1000000 / TimerWheelTickMicroseconds };
+
+// Handles encode the index of the entry and its generation, so that a stale handle does not cancel a reused entry
+enum { TimerHandleIndexBits = 20, TimerHandleIndexMask = (1 << TimerHandleIndexBits) - 1, TimerHandleGenerationMask = 0x1FF };
+
+static const unsigned NoTimer = unsigned(-1);
+static const ULONGLONG TimerWheelRange = ULONGLONG(1) << (TimerWheelSlotBits*TimerWheelLevels);
+
+struct TimerEntry
+{
+	SemaphoreOTE*	m_oteSemaphore;		// NULL if the entry is free
+	ULONGLONG		m_deadline;			// In wheel ticks
+	unsigned		m_next;
+	unsigned		m_prev;
+	unsigned		m_bucket;			// Index into s_buckets, or NoTimer if not in the wheel
+	unsigned		m_generation;
+};
+
+static TimerEntry* s_pTimers;
+static unsigned s_nTimers;
+static unsigned s_freeTimers = NoTimer;
+static unsigned s_firedTimers = NoTimer;			// Fired, but not yet released by the main thread
+static volatile LONG s_nFiredTimers;
+static unsigned s_nActiveTimers;
+
+static unsigned s_buckets[TimerWheelLevels*TimerWheelSlots];
+static ULONGLONG s_occupied[TimerWheelLevels];		// Bit set for each non-empty bucket of each level
+static ULONGLONG s_currentTick;						// The next tick to be processed
+
+static CRITICAL_SECTION s_csTimerWheel;
+static HANDLE s_hTimerWheelThread;
+static HANDLE s_hTimerWheelEvent;
+static volatile bool s_bTimerWheelShutdown;
+static LARGE_INTEGER s_qpcFrequency;
+
+static ULONGLONG CurrentTick()
+{
+	LARGE_INTEGER now;
+	::QueryPerformanceCounter(&now);
+	const ULONGLONG counts = now.QuadPart;
+	const ULONGLONG frequency = s_qpcFrequency.QuadPart;
+	// Split the conversion to avoid overflow of the intermediate product
+	return (counts / frequency) * TimerWheelTicksPerSecond + ((counts % frequency) * TimerWheelTicksPerSecond) / frequency;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Wheel maintenance, all of which must be performed inside the wheel lock
+
+static void LinkTimer(unsigned index, unsigned bucket)
+{
+	TimerEntry& entry = s_pTimers[index];
+	entry.m_bucket = bucket;
+	entry.m_prev = NoTimer;
+	entry.m_next = s_buckets[bucket];
+	if (entry.m_next != NoTimer)
+		s_pTimers[entry.m_next].m_prev = index;
+	s_buckets[bucket] = index;
+	s_occupied[bucket >> TimerWheelSlotBits] |= ULONGLONG(1) << (bucket & TimerWheelSlotMask);
+}
+
+static void UnlinkTimer(unsigned index)
+{
+	TimerEntry& entry = s_pTimers[index];
+	const unsigned bucket = entry.m_bucket;
+	if (entry.m_prev != NoTimer)
+		s_pTimers[entry.m_prev].m_next = entry.m_next;
+	else
+		s_buckets[bucket] = entry.m_next;
+	if (entry.m_next != NoTimer)
+		s_pTimers[entry.m_next].m_prev = entry.m_prev;
+	if (s_buckets[bucket] == NoTimer)
+		s_occupied[bucket >> TimerWheelSlotBits] &= ~(ULONGLONG(1) << (bucket & TimerWheelSlotMask));
+	entry.m_bucket = NoTimer;
+}
+
+// Place the timer in the bucket of the lowest level whose range covers its deadline
+static void InsertTimer(unsigned index)
+{
+	const TimerEntry& entry = s_pTimers[index];
+	ULONGLONG deadline = entry.m_deadline;
+	if (deadline < s_currentTick)
+		deadline = s_currentTick;
+	const ULONGLONG delta = deadline - s_currentTick;
+	if (delta >= TimerWheelRange)
+		deadline = s_currentTick + TimerWheelRange - 1;	// Will be cascaded again when it comes round
+
+	unsigned level = 0;
+	while (level < TimerWheelLevels-1 && delta >= ULONGLONG(1) << (TimerWheelSlotBits*(level+1)))
+		level++;
+	const unsigned slot = unsigned(deadline >> (TimerWheelSlotBits*level)) & TimerWheelSlotMask;
+	LinkTimer(index, level*TimerWheelSlots + slot);
+}
+
+// Redistribute the timers in a bucket to the lower levels
+static void CascadeTimers(unsigned level, unsigned slot)
+{
+	const unsigned bucket = level*TimerWheelSlots + slot;
+	unsigned index = s_buckets[bucket];
+	s_buckets[bucket] = NoTimer;
+	s_occupied[level] &= ~(ULONGLONG(1) << slot);
+	while (index != NoTimer)
+	{
+		const unsigned next = s_pTimers[index].m_next;
+		InsertTimer(index);
+		index = next;
+	}
+}
+
+// Move a timer which has fired to the list to be released by the main thread, and signal its Semaphore
+static void FireTimer(unsigned index)
+{
+	TimerEntry& entry = s_pTimers[index];
+	// Invalidate the handle, so that an attempt to cancel the timer answers false
+	entry.m_generation = (entry.m_generation + 1) & TimerHandleGenerationMask;
+	entry.m_next = s_firedTimers;
+	s_firedTimers = index;
+	s_nActiveTimers--;
+	::InterlockedIncrement(&s_nFiredTimers);
+	Interpreter::asynchronousSignalNoProtect(entry.m_oteSemaphore);
+}
+
+// Process all the ticks up to and including the specified tick, answering the number of timers fired
+static unsigned AdvanceTimerWheel(ULONGLONG now)
+{
+	unsigned nFired = 0;
+	while (s_currentTick <= now)
+	{
+		const ULONGLONG tick = s_currentTick;
+		for (unsigned level=1;level<TimerWheelLevels;level++)
+		{
+			const unsigned shift = TimerWheelSlotBits*level;
+			if (tick & ((ULONGLONG(1) << shift) - 1))
+				break;
+			CascadeTimers(level, unsigned(tick >> shift) & TimerWheelSlotMask);
+		}
+
+		const unsigned bucket = unsigned(tick) & TimerWheelSlotMask;
+		unsigned index = s_buckets[bucket];
+		s_buckets[bucket] = NoTimer;
+		s_occupied[0] &= ~(ULONGLONG(1) << bucket);
+		while (index != NoTimer)
+		{
+			const unsigned next = s_pTimers[index].m_next;
+			s_pTimers[index].m_bucket = NoTimer;
+			if (s_pTimers[index].m_deadline <= tick)
+			{
+				FireTimer(index);
+				nFired++;
+			}
+			else
+			{
+				// Deadline clamped to the range of the wheel
+				s_currentTick = tick + 1;
+				InsertTimer(index);
+				s_currentTick = tick;
+			}
+			index = next;
+		}
+
+		s_currentTick++;
+
+		// Skip the empty remainder of level 0 up to the next cascade, or entirely if the wheel is empty
+		if (s_occupied[0] == 0)
+		{
+			if (s_nActiveTimers == 0)
+				s_currentTick = max(s_currentTick, now + 1);
+			else
+			{
+				const ULONGLONG nextCascade = (s_currentTick + TimerWheelSlotMask) & ~ULONGLONG(TimerWheelSlotMask);
+				s_currentTick = min(nextCascade, now + 1);
+			}
+		}
+	}
+	return nFired;
+}
+
+// Answer the tick at which the wheel next needs attention, assuming it is not empty
+static ULONGLONG NextTimerWheelTick()
+{
+	const unsigned slot = unsigned(s_currentTick) & TimerWheelSlotMask;
+	const ULONGLONG pending = s_occupied[0] & (~ULONGLONG(0) << slot);
+	if (pending != 0)
+	{
+		unsigned long next;
+		if (!_BitScanForward(&next, DWORD(pending)))
+		{
+			_BitScanForward(&next, DWORD(pending >> 32));
+			next += 32;
+		}
+		return s_currentTick + (next - slot);
+	}
+	// Otherwise at the next cascade
+	return (s_currentTick + TimerWheelSlots) & ~ULONGLONG(TimerWheelSlotMask);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The timer wheel thread
+
+static DWORD WINAPI TimerWheelThreadProc(LPVOID)
+{
+	while (!s_bTimerWheelShutdown)
+	{
+		DWORD dwTimeout = INFINITE;
+		{
+			// The async protect lock must be held to access Semaphores, since a compaction could be in progress
+			Interpreter::GrabAsyncProtect();
+			::EnterCriticalSection(&s_csTimerWheel);
+			const ULONGLONG now = CurrentTick();
+			if (AdvanceTimerWheel(now) != 0)
+				Interpreter::SetWakeupEvent();
+			if (s_nActiveTimers != 0)
+			{
+				const ULONGLONG ticks = NextTimerWheelTick() - now;
+				dwTimeout = DWORD((ticks * TimerWheelTickMicroseconds + 999) / 1000);
+			}
+			::LeaveCriticalSection(&s_csTimerWheel);
+			Interpreter::RelinquishAsyncProtect();
+		}
+
+		::WaitForSingleObject(s_hTimerWheelEvent, dwTimeout);
+	}
+	return 0;
+}
+
+static bool StartTimerWheelThread()
+{
+	if (s_hTimerWheelThread != NULL)
+		return true;
+
+	s_hTimerWheelEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (s_hTimerWheelEvent == NULL)
+		return false;
+	DWORD dwThreadId;
+	s_hTimerWheelThread = ::CreateThread(NULL, 0, TimerWheelThreadProc, NULL, 0, &dwThreadId);
+	if (s_hTimerWheelThread == NULL)
+	{
+		::CloseHandle(s_hTimerWheelEvent);
+		s_hTimerWheelEvent = NULL;
+		return false;
+	}
+	// Like the multimedia timer thread, this must run promptly if timers are to be accurate
+	::SetThreadPriority(s_hTimerWheelThread, THREAD_PRIORITY_TIME_CRITICAL);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Main thread interface
+
+// Release the Semaphores of timers which have fired, and return their entries to the free list
+void Interpreter::reapFiredTimers()
+{
+	if (s_nFiredTimers == 0)
+		return;
+
+	::EnterCriticalSection(&s_csTimerWheel);
+	unsigned index = s_firedTimers;
+	s_firedTimers = NoTimer;
+	::InterlockedExchange(&s_nFiredTimers, 0);
+	while (index != NoTimer)
+	{
+		TimerEntry& entry = s_pTimers[index];
+		const unsigned next = entry.m_next;
+		entry.m_oteSemaphore->countDown();
+		entry.m_oteSemaphore = NULL;
+		entry.m_next = s_freeTimers;
+		s_freeTimers = index;
+		index = next;
+	}
+	::LeaveCriticalSection(&s_csTimerWheel);
+}
+
+// Answer the index of a free timer entry, growing the table if necessary. Answers NoTimer if the table is full.
+static unsigned AllocateTimer()
+{
+	if (s_freeTimers == NoTimer)
+	{
+		if (s_nTimers > TimerHandleIndexMask)
+			return NoTimer;
+		const unsigned nTimers = min(max(s_nTimers * 2, 256u), unsigned(TimerHandleIndexMask) + 1);
+		TimerEntry* pTimers = new TimerEntry[nTimers];
+		memcpy(pTimers, s_pTimers, s_nTimers*sizeof(TimerEntry));
+		for (unsigned i=s_nTimers;i<nTimers;i++)
+		{
+			pTimers[i].m_oteSemaphore = NULL;
+			pTimers[i].m_bucket = NoTimer;
+			pTimers[i].m_generation = 0;
+			pTimers[i].m_next = i+1 < nTimers ? i+1 : NoTimer;
+		}
+		delete[] s_pTimers;
+		s_pTimers = pTimers;
+		s_freeTimers = s_nTimers;
+		s_nTimers = nTimers;
+	}
+
+	const unsigned index = s_freeTimers;
+	s_freeTimers = s_pTimers[index].m_next;
+	return index;
+}
+
+// Register a timer to signal the Semaphore after the specified number of microseconds, answering
+// a positive handle, or zero if the timer could not be registered
+SMALLINTEGER Interpreter::registerTimer(SemaphoreOTE* oteSemaphore, SMALLINTEGER microseconds)
+{
+	if (!StartTimerWheelThread())
+		return 0;
+
+	::EnterCriticalSection(&s_csTimerWheel);
+	const unsigned index = AllocateTimer();
+	if (index == NoTimer)
+	{
+		::LeaveCriticalSection(&s_csTimerWheel);
+		return 0;
+	}
+
+	TimerEntry& entry = s_pTimers[index];
+	oteSemaphore->countUp();
+	entry.m_oteSemaphore = oteSemaphore;
+	// Round up, so that the timer never fires early
+	entry.m_deadline = CurrentTick() + (microseconds + TimerWheelTickMicroseconds - 1) / TimerWheelTickMicroseconds;
+	if (s_nActiveTimers++ == 0)
+		s_currentTick = max(s_currentTick, CurrentTick());
+	InsertTimer(index);
+	const SMALLINTEGER handle = (entry.m_generation << TimerHandleIndexBits) | (index + 1);
+	::LeaveCriticalSection(&s_csTimerWheel);
+
+	// Wake the wheel thread so it can recalculate its timeout
+	::SetEvent(s_hTimerWheelEvent);
+	return handle;
+}
+
+// Cancel a registered timer, answering whether it was cancelled before it fired
+bool Interpreter::cancelTimer(SMALLINTEGER handle)
+{
+	const unsigned index = (handle & TimerHandleIndexMask) - 1;
+	const unsigned generation = (handle >> TimerHandleIndexBits) & TimerHandleGenerationMask;
+
+	::EnterCriticalSection(&s_csTimerWheel);
+	bool bCancelled = false;
+	if (index < s_nTimers)
+	{
+		TimerEntry& entry = s_pTimers[index];
+		if (entry.m_generation == generation && entry.m_bucket != NoTimer)
+		{
+			UnlinkTimer(index);
+			entry.m_generation = (entry.m_generation + 1) & TimerHandleGenerationMask;
+			entry.m_oteSemaphore->countDown();
+			entry.m_oteSemaphore = NULL;
+			entry.m_next = s_freeTimers;
+			s_freeTimers = index;
+			s_nActiveTimers--;
+			bCancelled = true;
+		}
+	}
+	::LeaveCriticalSection(&s_csTimerWheel);
+	return bCancelled;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Timer Wheel Primitives
+
+// Register a timer to signal the Semaphore argument after the SmallInteger number of
+// microseconds argument, answering a SmallInteger handle that can be passed to
+// primitiveCancelTimer. If the delay is not positive the Semaphore is signalled immediately,
+// and the answer is zero.
+BOOL __fastcall Interpreter::primitiveSignalAfter(CompiledMethod&, unsigned argumentCount)
+{
+	argumentCount;
+	HARDASSERT(argumentCount == 2);
+
+	Oop delayPointer = stackTop();
+	if (!ObjectMemoryIsIntegerObject(delayPointer))
+		return primitiveFailureWith(PrimitiveFailureNonInteger, reinterpret_cast<OTE*>(delayPointer));
+	const SMALLINTEGER microseconds = ObjectMemoryIntegerValueOf(delayPointer);
+
+	SemaphoreOTE* semaphorePointer = reinterpret_cast<SemaphoreOTE*>(stackValue(1));
+	if (ObjectMemory::fetchClassOf(Oop(semaphorePointer)) != Pointers.ClassSemaphore)
+		return primitiveFailure(1);
+
+	reapFiredTimers();
+
+	if (microseconds <= 0)
+	{
+		// Must adjust the stack before signalling, as may change Process
+		pop(2);
+		stackTop() = ObjectMemoryIntegerObjectOf(0);
+		signalSemaphore(semaphorePointer);
+		CheckProcessSwitch();
+		return primitiveSuccess();
+	}
+
+	const SMALLINTEGER handle = registerTimer(semaphorePointer, microseconds);
+	if (handle == 0)
+		return primitiveFailureWithInt(PrimitiveFailureSystemError, GetLastError());
+
+	pop(2);
+	stackTop() = ObjectMemoryIntegerObjectOf(handle);
+	return primitiveSuccess();
+}
+
+// Cancel the timer with the SmallInteger handle argument, answering true if it had not fired
+BOOL __fastcall Interpreter::primitiveCancelTimer()
+{
+	Oop handlePointer = stackTop();
+	if (!ObjectMemoryIsIntegerObject(handlePointer))
+		return primitiveFailure(PrimitiveFailureNonInteger);
+
+	reapFiredTimers();
+	const bool bCancelled = cancelTimer(ObjectMemoryIntegerValueOf(handlePointer));
+	popStack();
+	stackTop() = Oop(bCancelled ? Pointers.True : Pointers.False);
+	return primitiveSuccess();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GC support. The Semaphores of registered timers are roots, and must be updated after a compaction.
+
+#pragma code_seg(GC_SEG)
+
+void Interpreter::MarkTimerWheel()
+{
+	::EnterCriticalSection(&s_csTimerWheel);
+	for (unsigned i=0;i<s_nTimers;i++)
+	{
+		if (s_pTimers[i].m_oteSemaphore != NULL)
+			ObjectMemory::MarkObjectsAccessibleFromRoot(reinterpret_cast<POTE>(s_pTimers[i].m_oteSemaphore));
+	}
+	::LeaveCriticalSection(&s_csTimerWheel);
+}
+
+void Interpreter::CompactTimerWheel()
+{
+	::EnterCriticalSection(&s_csTimerWheel);
+	for (unsigned i=0;i<s_nTimers;i++)
+	{
+		if (s_pTimers[i].m_oteSemaphore != NULL)
+			ObjectMemory::compactOop(s_pTimers[i].m_oteSemaphore);
+	}
+	::LeaveCriticalSection(&s_csTimerWheel);
+}
+
+#pragma code_seg(INIT_SEG)
+
+void Interpreter::initializeTimerWheel()
+{
+	::InitializeCriticalSection(&s_csTimerWheel);
+	::QueryPerformanceFrequency(&s_qpcFrequency);
+	for (unsigned i=0;i<TimerWheelLevels*TimerWheelSlots;i++)
+		s_buckets[i] = NoTimer;
+	s_currentTick = CurrentTick();
+}
+
+#pragma code_seg(TERM_SEG)
+
+void Interpreter::terminateTimerWheel()
+{
+	if (s_hTimerWheelThread != NULL)
+	{
+		s_bTimerWheelShutdown = true;
+		::SetEvent(s_hTimerWheelEvent);
+		::WaitForSingleObject(s_hTimerWheelThread, INFINITE);
+		::CloseHandle(s_hTimerWheelThread);
+		::CloseHandle(s_hTimerWheelEvent);
+		s_hTimerWheelThread = s_hTimerWheelEvent = NULL;
+	}
+
+	// The image is going away, so there is no need to release the Semaphores
+	delete[] s_pTimers;
+	s_pTimers = NULL;
+	s_nTimers = 0;
+	::DeleteCriticalSection(&s_csTimerWheel);
+}
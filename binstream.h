@@ -88,6 +88,21 @@ public:
 		m_nPosition += cRead;
 		return cRead == cRequested;
 	}
+
+	// Answer the address of the next byte to be read
+	const BYTE* current() const
+	{
+		return m_pBytes+m_nPosition;
+	}
+
+	// Advance over the next cRequested bytes without reading them
+	bool skip(size_t cRequested)
+	{
+		UINT available = m_cBytes - m_nPosition;
+		size_t cSkipped = (cRequested > available) ? available: cRequested;
+		m_nPosition += cSkipped;
+		return cSkipped == cRequested;
+	}
 };
 
 class fbinstream : public obinstream, public ibinstream
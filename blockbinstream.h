@@ -0,0 +1,356 @@
+/******************************************************************************
+
+	File: blockbinstream.h
+
+	Description:
+
+  Binary streams over the block compressed image container (see BlockImageHeader).
+  The data is split into independent blocks, each LZ4 compressed and carrying its
+  own Adler-32 checksum, so that blocks can be compressed or decompressed in
+  parallel on the system thread pool.
+
+  N.B. The VM's heap is not serialized, so the work items must not allocate memory.
+  All buffers are allocated on the calling thread.
+
+******************************************************************************/
+#ifndef _BLOCKBINSTREAM_H_
+#define _BLOCKBINSTREAM_H_
+
+#include <io.h>
+#include "binstream.h"
+#include "ImageHeader.h"
+#include "zlib.h"
+#include "lz4\lz4.h"
+
+// A single block to be compressed or decompressed
+struct BlockCodecJob
+{
+	class BlockCodecBatch*	m_pBatch;
+	const BYTE*	m_pSrc;
+	UINT		m_cbSrc;
+	BYTE*		m_pDst;
+	UINT		m_cbDst;			// Capacity on input, actual size on output
+	DWORD		m_dwChecksum;		// Of the uncompressed data
+	bool		m_bCompress;
+	bool		m_bOK;
+
+	void Run()
+	{
+		if (m_bCompress)
+		{
+			m_dwChecksum = adler32(adler32(0L, Z_NULL, 0), m_pSrc, m_cbSrc);
+			int cbOut = LZ4_compress_default(reinterpret_cast<const char*>(m_pSrc), reinterpret_cast<char*>(m_pDst), m_cbSrc, m_cbDst);
+			m_bOK = cbOut > 0;
+			m_cbDst = cbOut;
+		}
+		else
+		{
+			int cbOut = LZ4_decompress_safe(reinterpret_cast<const char*>(m_pSrc), reinterpret_cast<char*>(m_pDst), m_cbSrc, m_cbDst);
+			m_bOK = cbOut == int(m_cbDst) && adler32(adler32(0L, Z_NULL, 0), m_pDst, m_cbDst) == m_dwChecksum;
+		}
+	}
+};
+
+// A set of BlockCodecJobs run on the system thread pool. The batch holds a pending count
+// of its own until Wait() is called, so that jobs can be added while others are running.
+class BlockCodecBatch
+{
+	volatile LONG	m_nPending;
+	HANDLE			m_hDone;
+
+	static DWORD WINAPI WorkItem(LPVOID pv)
+	{
+		BlockCodecJob* pJob = static_cast<BlockCodecJob*>(pv);
+		pJob->Run();
+		pJob->m_pBatch->JobDone();
+		return 0;
+	}
+
+	void JobDone()
+	{
+		if (::InterlockedDecrement(&m_nPending) == 0)
+			::SetEvent(m_hDone);
+	}
+
+public:
+	BlockCodecBatch() : m_nPending(1)
+	{
+		m_hDone = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+	}
+
+	~BlockCodecBatch()
+	{
+		::CloseHandle(m_hDone);
+	}
+
+	void Submit(BlockCodecJob* pJob)
+	{
+		pJob->m_pBatch = this;
+		::InterlockedIncrement(&m_nPending);
+		if (m_hDone == NULL || !::QueueUserWorkItem(WorkItem, pJob, WT_EXECUTEDEFAULT))
+			// No thread pool available, so just do it now
+			WorkItem(pJob);
+	}
+
+	void Wait()
+	{
+		if (::InterlockedDecrement(&m_nPending) != 0)
+			::WaitForSingleObject(m_hDone, INFINITE);
+		// Ready for reuse
+		m_nPending = 1;
+		if (m_hDone)
+			::ResetEvent(m_hDone);
+	}
+};
+
+// Input stream over a block compressed container held in memory. All blocks are
+// decompressed in parallel on construction, and then read as from memory.
+class blockibinstream : public imbinstream
+{
+	BYTE*	m_pData;
+	int		m_nError;
+
+public:
+	blockibinstream(void* pBytes, UINT cBytes) : m_pData(NULL), m_nError(0)
+	{
+		const BYTE* pIn = static_cast<const BYTE*>(pBytes);
+		const BYTE* pEnd = pIn + cBytes;
+		const BlockImageHeader* pHeader = reinterpret_cast<const BlockImageHeader*>(pIn);
+		const BlockDescriptor* pBlocks = reinterpret_cast<const BlockDescriptor*>(pHeader+1);
+		if (cBytes < sizeof(BlockImageHeader) || pHeader->nBlocks > (cBytes - sizeof(BlockImageHeader)) / sizeof(BlockDescriptor))
+		{
+			m_nError = Z_DATA_ERROR;
+			return;
+		}
+		pIn = reinterpret_cast<const BYTE*>(pBlocks + pHeader->nBlocks);
+		if (pIn > pEnd)
+		{
+			m_nError = Z_DATA_ERROR;
+			return;
+		}
+
+		m_pData = new BYTE[pHeader->cbData];
+		BlockCodecJob* pJobs = new BlockCodecJob[pHeader->nBlocks];
+		BlockCodecBatch batch;
+		BYTE* pOut = m_pData;
+		unsigned nSubmitted = 0;
+		for (unsigned i=0;i<pHeader->nBlocks;i++)
+		{
+			BlockCodecJob& job = pJobs[i];
+			job.m_pSrc = pIn;
+			job.m_cbSrc = pBlocks[i].cbCompressed;
+			job.m_pDst = pOut;
+			job.m_cbDst = pBlocks[i].cbData;
+			job.m_dwChecksum = pBlocks[i].dwChecksum;
+			job.m_bCompress = false;
+			job.m_bOK = false;
+			pIn += job.m_cbSrc;
+			pOut += job.m_cbDst;
+			if (pIn > pEnd || pOut > m_pData + pHeader->cbData)
+			{
+				m_nError = Z_DATA_ERROR;
+				break;
+			}
+			batch.Submit(&job);
+			nSubmitted++;
+		}
+		batch.Wait();
+
+		for (unsigned i=0;i<nSubmitted;i++)
+		{
+			if (!pJobs[i].m_bOK)
+				m_nError = Z_DATA_ERROR;
+		}
+		delete[] pJobs;
+
+		initialize(m_pData, m_nError == 0 ? pHeader->cbData : 0);
+	}
+
+	~blockibinstream()
+	{
+		delete[] m_pData;
+	}
+
+	bool good() const
+	{
+		return m_nError == 0;
+	}
+
+	int fail() const
+	{
+		return m_nError;
+	}
+};
+
+// Output stream to a block compressed container. Each block is queued for compression as
+// soon as it is filled, overlapping compression with serialization. The container is written
+// to the file on flush().
+class blockobinstream : public obinstream
+{
+	enum { DefaultBlockSize = 256*1024 };
+
+	int				m_fd;
+	bool			m_bOwner;
+	bool			m_bFailed;
+	UINT			m_nBlockSize;
+	UINT			m_cbData;			// Total bytes written
+	UINT			m_cbBlock;			// Bytes in current block
+	BYTE*			m_pBlock;			// Current block (not yet submitted)
+	BlockCodecJob**	m_pJobs;
+	unsigned		m_nJobs;
+	unsigned		m_nMaxJobs;
+	BlockCodecBatch	m_batch;
+
+	void submitBlock()
+	{
+		if (m_pBlock == NULL)
+			return;
+
+		if (m_nJobs == m_nMaxJobs)
+		{
+			unsigned nMax = m_nMaxJobs ? m_nMaxJobs*2 : 64;
+			BlockCodecJob** pJobs = new BlockCodecJob*[nMax];
+			if (m_nJobs)
+				memcpy(pJobs, m_pJobs, m_nJobs*sizeof(BlockCodecJob*));
+			delete[] m_pJobs;
+			m_pJobs = pJobs;
+			m_nMaxJobs = nMax;
+		}
+
+		BlockCodecJob* pJob = new BlockCodecJob;
+		pJob->m_pSrc = m_pBlock;
+		pJob->m_cbSrc = m_cbBlock;
+		pJob->m_cbDst = LZ4_compressBound(m_cbBlock);
+		pJob->m_pDst = new BYTE[pJob->m_cbDst];
+		pJob->m_bCompress = true;
+		pJob->m_bOK = false;
+		m_pJobs[m_nJobs++] = pJob;
+		m_batch.Submit(pJob);
+
+		m_pBlock = NULL;
+		m_cbBlock = 0;
+	}
+
+	bool writeContainer()
+	{
+		BlockImageHeader header;
+		header.nBlockSize = m_nBlockSize;
+		header.nBlocks = m_nJobs;
+		header.cbData = m_cbData;
+		bool bOK = ::_write(m_fd, &header, sizeof(header)) == sizeof(header);
+
+		for (unsigned i=0;bOK && i<m_nJobs;i++)
+		{
+			BlockDescriptor desc;
+			desc.cbCompressed = m_pJobs[i]->m_cbDst;
+			desc.cbData = m_pJobs[i]->m_cbSrc;
+			desc.dwChecksum = m_pJobs[i]->m_dwChecksum;
+			bOK = m_pJobs[i]->m_bOK && ::_write(m_fd, &desc, sizeof(desc)) == sizeof(desc);
+		}
+
+		for (unsigned i=0;bOK && i<m_nJobs;i++)
+			bOK = ::_write(m_fd, m_pJobs[i]->m_pDst, m_pJobs[i]->m_cbDst) == int(m_pJobs[i]->m_cbDst);
+
+		return bOK;
+	}
+
+	void freeJobs()
+	{
+		for (unsigned i=0;i<m_nJobs;i++)
+		{
+			delete[] m_pJobs[i]->m_pSrc;
+			delete[] m_pJobs[i]->m_pDst;
+			delete m_pJobs[i];
+		}
+		delete[] m_pJobs;
+		m_pJobs = NULL;
+		m_nJobs = m_nMaxJobs = 0;
+		delete[] m_pBlock;
+		m_pBlock = NULL;
+		m_cbBlock = 0;
+	}
+
+public:
+	blockobinstream() : m_fd(-1), m_bOwner(false), m_bFailed(false), m_nBlockSize(DefaultBlockSize),
+			m_cbData(0), m_cbBlock(0), m_pBlock(NULL), m_pJobs(NULL), m_nJobs(0), m_nMaxJobs(0)
+	{}
+
+	~blockobinstream()
+	{
+		close();
+	}
+
+	bool attach(int fd, bool bAssumeOwnership=false, UINT nBlockSize=DefaultBlockSize)
+	{
+		close();
+		m_fd = fd;
+		m_bOwner = bAssumeOwnership;
+		m_bFailed = false;
+		m_nBlockSize = nBlockSize;
+		m_cbData = 0;
+		return m_fd != -1;
+	}
+
+	virtual bool write(const void* pbIn, size_t cBytes)
+	{
+		const BYTE* pIn = static_cast<const BYTE*>(pbIn);
+		m_cbData += cBytes;
+		while (cBytes > 0)
+		{
+			if (m_pBlock == NULL)
+				m_pBlock = new BYTE[m_nBlockSize];
+			size_t cbChunk = min(cBytes, m_nBlockSize - m_cbBlock);
+			memcpy(m_pBlock + m_cbBlock, pIn, cbChunk);
+			m_cbBlock += cbChunk;
+			pIn += cbChunk;
+			cBytes -= cbChunk;
+			if (m_cbBlock == m_nBlockSize)
+				submitBlock();
+		}
+		return true;
+	}
+
+	// Wait for all the blocks to be compressed, and write out the container
+	obinstream& flush()
+	{
+		if (m_fd != -1 && (m_nJobs > 0 || m_pBlock != NULL))
+		{
+			submitBlock();
+			m_batch.Wait();
+			if (!writeContainer())
+				m_bFailed = true;
+			freeJobs();
+		}
+		return *this;
+	}
+
+	binstream& close()
+	{
+		if (m_fd != -1)
+		{
+			flush();
+			if (m_bOwner)
+				::_close(m_fd);
+			m_fd = -1;
+		}
+		freeJobs();
+		return *this;
+	}
+
+	bool good() const
+	{
+		return m_fd != -1 && !m_bFailed;
+	}
+
+	int fail() const
+	{
+		return m_bFailed;
+	}
+
+	bool eof() const
+	{
+		return false;
+	}
+};
+
+#endif
@@ -107,8 +107,14 @@ ENDIF
 SENDVMINTERRUPT EQU ?sendVMInterrupt@Interpreter@@CIXII@Z
 extern SENDVMINTERRUPT:near32
 
+COUNTMETHODACTIVATION EQU ?countMethodActivation@Interpreter@@CIXPAV?$TOTE@VCompiledMethod@@@@@Z
+extern COUNTMETHODACTIVATION:near32
+extern ?methodCountingEnabled@@3IA:DWORD
+
 FINDNEWMETHODNOCACHE EQU ?findNewMethodInClassNoCache@Interpreter@@CGPAV?$TOTE@VCompiledMethod@@@@PAV?$TOTE@VBehavior@@@@I@Z ; STDCALL, OTE return and arg
 extern FINDNEWMETHODNOCACHE:near32
+FINDNEWMETHODATSENDSITE EQU ?findNewMethodAtSendSite@Interpreter@@CGPAV?$TOTE@VCompiledMethod@@@@PAV?$TOTE@VBehavior@@@@I@Z ; STDCALL, OTE return and arg
+extern FINDNEWMETHODATSENDSITE:near32
 
 BLOCKCOPY EQU ?blockCopy@Interpreter@@CIPAV?$TOTE@VBlockClosure@@@@K@Z
 extern BLOCKCOPY:near32											; See bytecde.cpp
@@ -319,6 +325,10 @@ STORETEMPORARY			EQU (STOREINSTVAR+1)
 STORESTATIC				EQU (STORETEMPORARY+1)
 POPSTOREINSTVAR			EQU (STORESTATIC+1)
 
+; Conditional near jumps, which are fused with a preceding comparison (see BranchOnResult, and bytecdes.h)
+NEARJUMPIFTRUE			EQU (POPSTOREINSTVAR+9)
+NEARJUMPIFFALSE			EQU (NEARJUMPIFTRUE+1)
+
 ; On Pentiums, "The Jump addresses should be placed in the data segment, not in the code seqment" (Ref 1)
 .DATA
 ALIGN 16
@@ -494,6 +504,8 @@ public _byteCodeCounters
 _lastByteCode DD 1 DUP (0)
 _byteCodePairs DD	65536 DUP (0)
 public _byteCodePairs
+_byteCodesFused DD 0
+public _byteCodesFused
 ENDIF
 
 ;ALIGN 16
@@ -638,6 +650,66 @@ PopDispatchByteCode MACRO
 	DispatchNext
 ENDM	
 
+;; Compare and branch superinstruction, for the SmallInteger responses of the comparison special
+;; selectors. If the next instruction is a conditional jump on the result of the comparison, then
+;; it is performed directly, saving its dispatch and the push and test of the boolean result.
+;; Otherwise the result replaces the receiver on the stack as usual.
+;; On entry EDX is the boolean result, _IP is at the next instruction (not prefetched), and _SP at
+;; the receiver, the argument having already been popped.
+BranchOnResult MACRO
+	LOCAL	notShortJumpIfFalse, notNearJump, nearJumpNotTaken, pollAfterJump
+	ASSUME	edx:DWORD
+
+	xor		ecx, ecx
+	mov		cl, [_IP]
+	sub		ecx, FIRSTSHORTJUMPIFFALSE
+	cmp		ecx, NUMSHORTJUMPSIFFALSE
+	jae		notShortJumpIfFalse
+
+	IFDEF _DEBUG
+		inc		[_byteCodesFused]
+	ENDIF
+	PopStack
+	cmp		edx, [oteFalse]
+	jne		@F
+	lea		_IP, [_IP+ecx+2]						;; As shortJumpIfFalse, the minimum jump is +2 from the jump
+	DispatchByteCode
+@@:
+	inc		_IP										;; Not taken, so continue after the jump
+	DispatchByteCode
+
+notShortJumpIfFalse:
+	sub		ecx, NEARJUMPIFTRUE-FIRSTSHORTJUMPIFFALSE
+	cmp		ecx, 2									;; NearJumpIfTrue or NearJumpIfFalse?
+	jae		notNearJump
+
+	IFDEF _DEBUG
+		inc		[_byteCodesFused]
+	ENDIF
+	PopStack
+	imul	ecx, OTENTRYSIZE						;; false follows true in the OT, so the jump is taken if
+	add		ecx, [oteTrue]							;; the result is true for NearJumpIfTrue, false for NearJumpIfFalse
+	cmp		edx, ecx
+	jne		nearJumpNotTaken
+
+	movsx	eax, BYTE PTR[_IP+1]					;; Offset 0 is the instruction after the jump
+	lea		_IP, [_IP+eax+2]
+	cmp		DWORD PTR[ASYNCPENDING], 0				;; Taken jumps poll for async events, as nearJump
+	jne		pollAfterJump
+	DispatchByteCode
+
+pollAfterJump:
+	CallCPPAndLoop	<BYTEPOLL>
+
+nearJumpNotTaken:
+	add		_IP, 2
+	DispatchByteCode
+
+notNearJump:
+	mov		[_SP], edx
+	DispatchByteCode
+ENDM
+
 CountDownOopAndDispatch MACRO
 	LOCAL	deleteObject
 	ASSUME	ecx:PTR OTE						;; ECX contains the object to count down
@@ -2586,20 +2658,13 @@ BEGINBYTECODE sendArithmeticLessThan
 	test	dl, 1										; Arg is a SmallInteger?
 	jz		sendMessageToInteger						; No, skip primitive response
 	PopStack											; Pop argument	(which is not ref. counted)
-	MPrefetch
 	cmp		eax, edx									; receiver < arg?
 	mov		edx, [oteTrue]								; Default - not less than arg
 	jl		@F											; Pentium predicts forward jumps not taken (if not in BTB)
 	add		edx, OTENTRYSIZE							; Yes, receiver < arg, EAX := true
 @@:
-	; Note: The following instruction will probably be a Near Jump If False.
-	; Although the PPRO and later don't use pattern recognition for predicting indirect jumps
-	; (such as our bytecode dispatch), the simpler mechanism that is used (that the target will
-	; be the same as last time) will probably work out pretty well here (see Agner Fog).
-	; Actually it might be worth getting rid of the short jump instruction altogether to increase
-	; the probability of the target really being NearJumpIfFalse
-	mov		[_SP], edx
-	DispatchNext
+	; The following instruction will very probably be a conditional jump on the result
+	BranchOnResult
 
 sendMessageToObject:
 	; Try sending the '<' selector through normal message lookup
@@ -2671,14 +2736,12 @@ BEGINBYTECODE sendArithmeticLessOrEqual
 	test	dl, 1										; Arg is a SmallInteger?
 	jz		sendMessageToInteger						; No, skip primitive response
 	PopStack											; Pop argument	(which is not ref. counted)
-	MPrefetch
 	cmp		eax, edx									; receiver <= arg?
 	mov		edx, [oteFalse]								; Default, No
 	jg		@F											; No, receiver > arg
 	sub		edx, OTENTRYSIZE							; Yes, EAX := true
 @@:
-	mov		[_SP], edx
-	DispatchNext
+	BranchOnResult
 
 sendMessageToObject:
 	; Try sending the '<=' selector through normal message lookup
@@ -2703,9 +2766,7 @@ BEGINBYTECODE sendArithmeticGreaterThan
 	jg		@F											;
 	add		edx, OTENTRYSIZE							; No, EAX := false
 @@:
-	MPrefetch
-	mov		[_SP], edx
-	DispatchNext
+	BranchOnResult
 
 sendMessageToObject:
 	; Try sending the '>' selector through normal message lookup
@@ -2730,9 +2791,7 @@ BEGINBYTECODE sendArithmeticGreaterOrEqual
 	jge		@F											; receiver >= arg?
 	add		edx, OTENTRYSIZE							; No, EAX := false
 @@:
-	MPrefetch
-	mov		[_SP], edx
-	DispatchNext
+	BranchOnResult
 
 sendMessageToObject:
 	; Try sending the '>=' selector through normal message lookup
@@ -2759,8 +2818,8 @@ BEGINBYTECODE sendArithmeticEqual
 	add		edx, OTENTRYSIZE							; Load False, arg not equal
 
 @@:
-	mov		[_SP-OOPSIZE], edx							; Replace stack top integer with boolean result
-	PopDispatchByteCode
+	PopStack											; Pop argument, the result replaces the receiver
+	BranchOnResult
 
 sendMessageToObject:
 	; Try sending the '=' selector through normal message lookup
@@ -2786,8 +2845,8 @@ BEGINBYTECODE sendArithmeticNotEqual
 	sub		edx, OTENTRYSIZE							; Arg not Equal to receiver
 
 @@:
-	mov		[_SP-OOPSIZE], edx							; Replace stack top integer with boolean result
-	PopDispatchByteCode
+	PopStack											; Pop argument, the result replaces the receiver
+	BranchOnResult
 
 sendMessageToObject:
 	; Try sending the '~=' selector through normal message lookup
@@ -3951,33 +4010,82 @@ BEGINPROC execMethodOfClass
 	ASSUME	ecx:PTR OTE		; Class
 							; [ESP] is the argument count (i.e. one arg on stack)
 
+	; Probe the cache for the send site first, which is identified by the IP after the send (see
+	; sendSiteHash in bytecde.cpp). Only the most recently used receiver class of the site is
+	; checked here, the others are checked by findNewMethodAtSendSite.
+	mov		eax, _IP
+	shr		eax, 11
+	xor		eax, _IP
+	and		eax, SendSiteCacheSize-1
+	imul	eax, SIZEOF SendSiteCache
+	add		eax, OFFSET SENDSITECACHE
+	ASSUME	eax:PTR SendSiteCache
+
+	cmp		[eax].instructionPointer, _IP
+	jne		probeMethodCache						; Forward jump (predict not taken) if site miss
+	cmp		[eax].selector, edx
+	jne		probeMethodCache
+	cmp		[eax].entries.classPointer, ecx
+	jne		probeMethodCache
+	mov		edx, [pMethod]							; The selector is also in MESSAGE, so EDX can be reused
+	cmp		[eax].pCompiledMethod, edx
+	mov		edx, [MESSAGE]
+	jne		probeMethodCache
+
+	; The site is already in the cache, and only the interpreter thread writes the counters
+	inc		[eax].hits
+	inc		[SENDSITEHITS]
+
+	mov		ecx, [eax].entries.method
+	ASSUME	eax:NOTHING
+	ASSUME	ecx:PTR OTE
+	mov		[NEWMETHOD], ecx
+	mov		ecx, [ecx].m_location
+	ASSUME	ecx:PTR CompiledMethod
+	xor		eax, eax
+	mov		al, [ecx].m_header.primitiveIndex
+	pop		edx										; Restore arg count
+	mov		eax, DWORD PTR[_primitivesTable+eax*4]	; Load primitive routine address from jump table
+
+	; ECX = CompiledMethod*, EDX = arg count, EAX = primitive routine to call
+	MExecNewMethod
+
+probeMethodCache:
+	ASSUME	eax:NOTHING
+	ASSUME	ecx:PTR OTE
+
 	; Calculate the method cache hash
 	mov		eax, ecx								; Get class Oop into ecx
 	xor		eax, edx								; Xor with selector oop
-	and		eax, METHODCACHEMASK					; Mod method cache size
+	and		eax, [METHODCACHEMASK]					; Mod number of sets in method cache
 
-	; Cache is 16 bytes per entry (a Pentium sweet spot, and since OTE is 16 bytes long, we don't
-	; need to scale the hash we calculated
-	
-	;; The value in EAX we currently have is *4, since its an Oop (bottom two bits always zero)
-	; The value in EAX we currently have is *16, since its an Oop (bottom four bits always zero)
-	; shl		eax, 2									; index already * 4 because its an Oop
+	; Cache is 16 bytes per entry (a Pentium sweet spot), and since OTE is 16 bytes long the
+	; value in EAX is already the set index * 16 (bottom four bits always zero). The cache is
+	; 2-way set associative, so sets are 32 bytes, and we need only double it. Only the most
+	; recently used way is probed here, the other is probed on a miss (see findNewMethodAtSendSite)
+	add		eax, eax
+	add		eax, [METHODCACHE]
 	
 	; At this point
-	;	EAX = byte index into cache
+	;	EAX = address of cache set
 	;	ECX = class OTE
 	;	EDX = selectOR OTE
 
-	cmp		(MethodCacheEntry PTR METHODCACHE[eax]).selector, edx
+	cmp		(MethodCacheEntry PTR [eax]).selector, edx
 	jne		findMethodCacheMiss						; Forward jump (predict not taken) if cache miss
 	
-	cmp		(MethodCacheEntry PTR METHODCACHE[eax]).classPointer, ecx
+	cmp		(MethodCacheEntry PTR [eax]).classPointer, ecx
 	jne		findMethodCacheMiss						; Forward jump (predict not taken) if cache miss
 
-	mov		ecx, (MethodCacheEntry PTR METHODCACHE[eax]).method
+	mov		ecx, (MethodCacheEntry PTR [eax]).method
 	assume	ecx:PTR OTE
 
-	mov		eax, (MethodCacheEntry PTR METHODCACHE[eax]).primAddress
+	mov		eax, (MethodCacheEntry PTR [eax]).primAddress
+
+	; 64-bit hit count, only the low half of which is normally written
+	inc		DWORD PTR [METHODCACHEHITS]
+	jz		carryMethodCacheHits					; Forward jump (predict not taken) on wrap
+methodCacheHitCounted:
 
 	IFDEF _DEBUG
 		inc	[CACHEHITS]
@@ -3994,14 +4102,19 @@ BEGINPROC execMethodOfClass
 	; Execute new method, and dispatch the next byte code
 	MExecNewMethod
 
+carryMethodCacheHits:
+	inc		DWORD PTR [METHODCACHEHITS+4]
+	jmp		methodCacheHitCounted
+
 ENDPROC execMethodOfClass
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 ; Create a new context, and run some byte codes, Yeehaaa!
 
 BEGINPROC findMethodCacheMiss
+	StoreIPRegister									; Send site inline cache is keyed by the IP
 	push	ecx
-	call	FINDNEWMETHODNOCACHE
+	call	FINDNEWMETHODATSENDSITE
 	mov		[NEWMETHOD], eax
 	mov		ecx, (OTE PTR[eax]).m_location			; Load address of new method object into ecx
 	ASSUME	ecx:PTR CompiledMethod
@@ -4031,6 +4144,16 @@ BEGINPRIMITIVE primitiveActivateMethod
 		inc 	[?methodsActivated@@3IA]
 	ENDIF
 
+	; Optional per-method activation counts (see MethodCounters.cpp)
+	.IF ([?methodCountingEnabled@@3IA] != 0)
+		push	ecx
+		push	edx
+		mov		ecx, [NEWMETHOD]
+		call	COUNTMETHODACTIVATION
+		pop		edx
+		pop		ecx
+	.ENDIF
+
 	;; Work out _IP index before overwriting old method pointer
 	mov		eax, [pMethod]
 	ASSUME	eax:PTR CompiledMethod
@@ -4471,9 +4594,10 @@ BEGINPROC ?activateNewMethod@Interpreter@@SIXPAVCompiledMethod@@@Z
 	call	primitiveActivateMethod					; Call assembler method activation routine
 	StoreInterpreterRegisters
 
-	; Restore the previous state of the process switching triggers
+	; Restore the previous state of the process switching triggers, but without losing any that were
+	; set by other threads in the meantime (e.g. a safepoint request)
 	pop		ecx
-	mov		[ASYNCPENDING], ecx
+	lock or	DWORD PTR [ASYNCPENDING], ecx
 
 	pop		_BP
 	pop		_IP
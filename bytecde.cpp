@@ -150,8 +150,27 @@ inline BOOL Interpreter::sampleInput()
 
 #pragma code_seg(INTERP_SEG)
 
+// A thread has requested a safepoint (see Isolate.h), so wait until it is released
+void Interpreter::parkAtSafepoint()
+{
+	do
+	{
+		m_pIsolate->ParkAtSafepoint();
+
+		// The pending flag was set regardless, so if interrupts are disabled it must be cleared here
+		// or we would poll continually until they are re-enabled. Another request could have been
+		// made since the release, hence the loop.
+		if (m_bInterruptsDisabled)
+			::InterlockedExchange((LPLONG)&m_bAsyncPending, FALSE);
+	}
+	while (m_pIsolate->IsSafepointRequested());
+}
+
 BOOL __stdcall Interpreter::BytecodePoll()
 {
+	if (m_pIsolate->IsSafepointRequested())
+		parkAtSafepoint();
+
 	if (m_nInputPollCounter <= 0 && !m_bStepping)
 		sampleInput();
 
@@ -160,6 +179,9 @@ BOOL __stdcall Interpreter::BytecodePoll()
 
 BOOL __stdcall Interpreter::MsgSendPoll()
 {
+	if (m_pIsolate->IsSafepointRequested())
+		parkAtSafepoint();
+
 	if (m_nInputPollCounter <= 0)
 	{
 		if (m_bStepping)
@@ -183,7 +205,37 @@ BOOL __stdcall Interpreter::MsgSendPoll()
 // Use following for 12-byte OTEs
 //#define cacheHash(classPointer, messageSelector) (((Oop(messageSelector) ^ Oop(classPointer)) >> 2) & (MethodCacheSize-1))
 // Use following for 16-byte OTEs
-#define cacheHash(classPointer, messageSelector) (((Oop(messageSelector) ^ Oop(classPointer)) >> 4) & (MethodCacheSize-1))
+// The method cache is 2-way set associative, so this is the index of the first entry in the set.
+// methodCacheMask is already scaled by the OTE size, and sets are twice the size of an OTE.
+#define cacheHash(classPointer, messageSelector) (((Oop(messageSelector) ^ Oop(classPointer)) & methodCacheMask) >> 3)
+
+inline Interpreter::MethodCacheEntry* Interpreter::methodCacheSet(const BehaviorOTE* classPointer, const SymbolOTE* selector)
+{
+	return &methodCache[cacheHash(classPointer, selector)];
+}
+
+// Probe both ways of the method cache set for the class/selector pair, answering the cached
+// method or NULL. A hit in the second way promotes that entry to the first, as only the first
+// way is probed by the assembler send routine.
+inline MethodOTE* Interpreter::findCachedMethod(const BehaviorOTE* classPointer, const SymbolOTE* selector)
+{
+	MethodCacheEntry* set = methodCacheSet(classPointer, selector);
+	if (set[0].classPointer == classPointer && set[0].selector == selector)
+	{
+		m_nMethodCacheHits++;
+		return set[0].method;
+	}
+	if (set[1].classPointer == classPointer && set[1].selector == selector)
+	{
+		MethodCacheEntry mru = set[1];
+		set[1] = set[0];
+		set[0] = mru;
+		m_nMethodCacheHits++;
+		return mru.method;
+	}
+	m_nMethodCacheMisses++;
+	return NULL;
+}
 
 #pragma code_seg(INTERP_SEG)
 
@@ -193,31 +245,22 @@ MethodOTE* __fastcall Interpreter::findNewMethodInClass(BehaviorOTE* classPointe
 
 	SymbolOTE* oteSelector = m_oopMessageSelector;
 
-	// This hashForCache 'function' relies on the OTEntry size being 12 bytes, meaning
-	// that the bottom 2 bits of the Oops (which are pointers to the OTEntries)
-	// are always the same.
-	unsigned hashForCache = cacheHash(classPointer, oteSelector);
-
-	if (methodCache[hashForCache].classPointer == classPointer)
+	MethodOTE* oteMethod = findCachedMethod(classPointer, oteSelector);
+	if (oteMethod != NULL)
 	{
-		MethodOTE* oteMethod = methodCache[hashForCache].method;
-
-		if (oteMethod->m_location->m_selector == oteSelector)
+		#ifdef _DEBUG
+		cacheHits++;
 		{
-			#ifdef _DEBUG
-			cacheHits++;
+			if (executionTrace)
 			{
-				if (executionTrace)
-				{
-					tracelock lock(TRACESTREAM);
-					TRACESTREAM << "Found method " << classPointer << ">>" << oteSelector << 
-							" (" << oteMethod << ") in cache\n";
-				}
+				tracelock lock(TRACESTREAM);
+				TRACESTREAM << "Found method " << classPointer << ">>" << oteSelector << 
+						" (" << oteMethod << ") in cache\n";
 			}
-			#endif
-
-			return oteMethod;
 		}
+		#endif
+
+		return oteMethod;
 	}
 
 	return findNewMethodInClassNoCache(classPointer, argCount);
@@ -233,6 +276,23 @@ inline DWORD LookupMethodPrimitive(MethodOTE* oteMethod)
 	return primitivesTable[pMethod->m_header.primitiveIndex];
 }
 
+// Enter a method into the method cache as the most recently used in its set, demoting the 
+// previous occupant of the first way to the second, and so evicting the least recently used.
+void Interpreter::cacheMethod(const BehaviorOTE* classPointer, const SymbolOTE* selector, MethodOTE* oteMethod)
+{
+	MethodCacheEntry* set = methodCacheSet(classPointer, selector);
+	if (set[0].classPointer != classPointer || set[0].selector != selector)
+	{
+		if (set[1].method != NULL && (set[1].classPointer != classPointer || set[1].selector != selector))
+			m_nMethodCacheEvictions++;
+		set[1] = set[0];
+	}
+	set[0].selector		= selector;
+	set[0].classPointer	= classPointer;
+	set[0].method		= oteMethod;
+	set[0].primAddress	= LookupMethodPrimitive(oteMethod);
+}
+
 MethodOTE* __stdcall Interpreter::findNewMethodInClassNoCache(BehaviorOTE* classPointer, const unsigned argCount)
 {
 	HARDASSERT(argCount < 256);
@@ -282,12 +342,8 @@ MethodOTE* __stdcall Interpreter::findNewMethodInClassNoCache(BehaviorOTE* class
 				MethodOTE* methodPointer = reinterpret_cast<MethodOTE*>(methodArray->m_location->m_elements[index]);
 				HARDASSERT(ObjectMemory::isKindOf(methodPointer, Pointers.ClassCompiledMethod));
 
-				unsigned hashForCache = cacheHash(classPointer, targetSelector);
-				// Write back into the cache, no longer store selector in the cache
-				methodCache[hashForCache].selector			= targetSelector;
-				methodCache[hashForCache].classPointer 		= classPointer;
-				methodCache[hashForCache].method			= methodPointer;
-				methodCache[hashForCache].primAddress		= LookupMethodPrimitive(methodPointer);
+				// Write back into the cache
+				cacheMethod(classPointer, targetSelector, methodPointer);
 
 				#ifdef _DEBUG
 				{
@@ -327,6 +383,76 @@ MethodOTE* __stdcall Interpreter::findNewMethodInClassNoCache(BehaviorOTE* class
 	return messageNotUnderstood(classPointer, argCount);
 }
 
+// Send sites are identified by the address of the following instruction
+#define sendSiteHash(ip) ((DWORD(ip) ^ (DWORD(ip) >> 11)) & (SendSiteCacheSize-1))
+
+// Called from the assembler send routine when a send misses in the inline probe of its send site
+// and in the first way of the global method cache, with the instruction pointer of the send stored,
+// and from every send in the C++ interpreter. The cache for the send site is consulted before the
+// global method cache, as it is not subject to collisions with other sends of the same selector, or
+// of other selectors to the same class. A site hit is moved to the front of the site, as only the
+// first entry is probed by the assembler. A method found through the global cache, or by lookup, is
+// added to the site.
+MethodOTE* __stdcall Interpreter::findNewMethodAtSendSite(BehaviorOTE* classPointer, const unsigned argCount)
+{
+	const BYTE* ip = m_registers.m_instructionPointer;
+	const CompiledMethod* pMethod = m_registers.m_pMethod;
+	SymbolOTE* targetSelector = m_oopMessageSelector;
+
+	SendSiteCache& site = sendSiteCache[sendSiteHash(ip)];
+	if (site.ip != ip || site.pMethod != pMethod || site.selector != targetSelector)
+	{
+		// New site, or one displaced from the table
+		ZeroMemory(&site, sizeof(site));
+		site.ip = ip;
+		site.pMethod = pMethod;
+		site.oteMethod = m_registers.m_pActiveFrame->m_method;
+		site.selector = targetSelector;
+		site.ipOffset = static_cast<WORD>(ip - ObjectMemory::ByteAddressOfObject(m_registers.m_pMethod->m_byteCodes));
+	}
+	else if (site.nClasses < SendSiteMegamorphic)
+	{
+		for (unsigned i=0;i<site.nClasses;i++)
+		{
+			if (site.entries[i].classPointer == classPointer)
+			{
+				SendSiteEntry mru = site.entries[i];
+				for (;i>0;i--)
+					site.entries[i] = site.entries[i-1];
+				site.entries[0] = mru;
+				site.hits++;
+				m_nSendSiteHits++;
+				return mru.method;
+			}
+		}
+	}
+	else
+		m_nMegamorphicMisses++;
+
+	site.misses++;
+	m_nSendSiteMisses++;
+
+	MethodOTE* oteMethod = findCachedMethod(classPointer, targetSelector);
+	if (oteMethod == NULL)
+		oteMethod = findNewMethodInClassNoCache(classPointer, argCount);
+
+	// Don't cache the #doesNotUnderstand: method
+	if (oteMethod->m_location->m_selector == targetSelector && site.nClasses < SendSiteMegamorphic)
+	{
+		if (site.nClasses < SendSiteClasses)
+		{
+			// The newest class goes first, as the most likely to be seen again soon
+			for (unsigned i=site.nClasses;i>0;i--)
+				site.entries[i] = site.entries[i-1];
+			site.entries[0].classPointer = classPointer;
+			site.entries[0].method = oteMethod;
+		}
+		site.nClasses++;
+	}
+
+	return oteMethod;
+}
+
 #pragma code_seg(INTERP_SEG)
 
 // Translate args on stack to a message containing an array of arguments
@@ -725,13 +851,12 @@ MethodOTE* __fastcall Interpreter::lookupMethod(BehaviorOTE* classPointer, Symbo
 {
 	ASSERT(ObjectMemory::isBehavior(Oop(classPointer)));
 
-	unsigned hashForCache = cacheHash(classPointer, targetSelector);
-
-	if (methodCache[hashForCache].classPointer == classPointer)
+	// Probe both ways, but don't disturb the LRU order or the statistics
+	const MethodCacheEntry* set = methodCacheSet(classPointer, targetSelector);
+	for (unsigned way=0;way<MethodCacheWays;way++)
 	{
-		MethodOTE* oteMethod = methodCache[hashForCache].method;
-		if (oteMethod->m_location->m_selector == targetSelector)
-			return oteMethod;
+		if (set[way].classPointer == classPointer && set[way].selector == targetSelector)
+			return set[way].method;
 	}
 
 	// Lookup the method in the dictionaries of the class & superclass chain
@@ -781,6 +906,18 @@ MethodOTE* __fastcall Interpreter::lookupMethod(BehaviorOTE* classPointer, Symbo
 	return reinterpret_cast<MethodOTE*>(Pointers.Nil);
 }
 
+// Enter the method for the specified class and selector into the method cache, as if it had been
+// sent. Answers false (and caches nothing) if the class does not understand the selector.
+bool Interpreter::cacheMethodLookup(BehaviorOTE* classPointer, SymbolOTE* selector)
+{
+	MethodOTE* oteMethod = lookupMethod(classPointer, selector);
+	if (oteMethod->isNil())
+		return false;
+
+	cacheMethod(classPointer, selector, oteMethod);
+	return true;
+}
+
 #pragma code_seg(DEBUG_SEG)
 
 #ifdef _DEBUG
@@ -789,8 +926,8 @@ MethodOTE* __fastcall Interpreter::lookupMethod(BehaviorOTE* classPointer, Symbo
 		// If not then VM hash lookup logic won't work
 		ASSERT(MethodDictionary::FixedSize == 2);
 
-		int used = 0;
-		for (int i=0;i<MethodCacheSize;i++)
+		unsigned used = 0;
+		for (unsigned i=0;i<methodCacheSize;i++)
 		{
 			if (methodCache[i].method != NULL) used++;
 		}
@@ -799,11 +936,14 @@ MethodOTE* __fastcall Interpreter::lookupMethod(BehaviorOTE* classPointer, Symbo
 		if (cacheHits != 0 || cacheMisses != 0)
 		{
 			char buf[256];
-			_snprintf(buf, sizeof(buf)-1, "%u method cache hits, %u misses %.2lf hit ratio, in use %d, empty %d\n",
+			_snprintf(buf, sizeof(buf)-1, "%u method cache hits, %u misses %.2lf hit ratio, in use %u, empty %u\n",
 							cacheHits, cacheMisses, 
 							(double)cacheHits / 
 								(cacheHits + cacheMisses?cacheHits+cacheMisses:1),
-							used, MethodCacheSize - used);
+							used, methodCacheSize - used);
+			OutputDebugString(buf);
+			_snprintf(buf, sizeof(buf)-1, "%u send site cache hits, %u misses (%u megamorphic)\n",
+							m_nSendSiteHits, m_nSendSiteMisses, m_nMegamorphicMisses);
 			OutputDebugString(buf);
 		}
 
@@ -867,6 +1007,46 @@ MethodOTE* __fastcall Interpreter::lookupMethod(BehaviorOTE* classPointer, Symbo
 	}
 #endif
 
+#pragma code_seg(PRIM_SEG)
+
+void Interpreter::SendSiteStatistics(DWORD* pnHits, DWORD* pnMisses, DWORD* pnMegamorphic)
+{
+	*pnHits = m_nSendSiteHits;
+	*pnMisses = m_nSendSiteMisses;
+	*pnMegamorphic = m_nMegamorphicMisses;
+}
+
+// Copy out the details of up to nMaxSites send sites currently cached, answering the number copied.
+// N.B. The sites are discarded whenever the method cache is flushed.
+unsigned Interpreter::SendSiteSnapshot(SendSiteInfo* pSites, unsigned nMaxSites)
+{
+	unsigned nSites = 0;
+	for (unsigned i=0;i<SendSiteCacheSize && nSites < nMaxSites;i++)
+	{
+		const SendSiteCache& site = sendSiteCache[i];
+		if (site.ip == NULL)
+			continue;
+		SendSiteInfo& info = pSites[nSites++];
+		info.methodIndex = site.oteMethod->getIndex();
+		info.ipOffset = site.ipOffset;
+		info.selectorIndex = site.selector->getIndex();
+		info.nClasses = site.nClasses;
+		info.hits = site.hits;
+		info.misses = site.misses;
+	}
+	return nSites;
+}
+
+extern "C" void __stdcall SendSiteCacheStatistics(DWORD* pnHits, DWORD* pnMisses, DWORD* pnMegamorphic)
+{
+	Interpreter::SendSiteStatistics(pnHits, pnMisses, pnMegamorphic);
+}
+
+extern "C" unsigned __stdcall SendSiteCacheSnapshot(Interpreter::SendSiteInfo* pSites, unsigned nMaxSites)
+{
+	return Interpreter::SendSiteSnapshot(pSites, nMaxSites);
+}
+
 #ifdef PROFILING
 
 	#include "boot/timeval.h"
@@ -0,0 +1,1332 @@
+/******************************************************************************
+
+	File: ByteLoop.cpp
+
+	Description:
+
+	C++ byte code interpreter loop, an alternative to the assembler loop in
+	byteasm.asm that is compiled in place of it when CPP_BYTECODELOOP is defined.
+	It implements the full instruction set described in bytecdes.h, with the same
+	semantics as the assembler loop; that includes the inlined special selectors,
+	the conventions for retrying instructions after #mustBeBoolean and
+	#errorInstVarAt:put:, and the store instructions embedded in the increment and
+	decrement temp instructions. Method activation, primitives, returns and block
+	creation are shared with the assembler build.
+
+	This is not a portable interpreter. Like the rest of the VM it is built only
+	for Win32 with MSVC, and it calls the assembler's method activation and
+	primitives. Its purpose is to be a readable and instrumentable equivalent
+	of the assembler loop (see the instruction sequence counts below), and the
+	base on which the baseline JIT is built (see NativeCode.cpp).
+
+	Dispatch is a switch on the handler for each instruction, looked up in a
+	256 entry table; the range check the switch would otherwise perform on
+	every instruction is removed with __assume.
+
+	There is no conformance harness that runs the same byte codes through this
+	loop and the assembler loop and compares the results, since both need a
+	loaded image and the repository has no test infrastructure. Equivalence
+	has to be checked by running the image's own tests under each build.
+
+	The IP and SP are written back to m_registers as each instruction is
+	dispatched, so that after a fault (see saveContextAfterFault) the walkback
+	shows the faulting instruction, as it does for the assembler loop, which
+	recovers them from the registers in the fault context instead.
+
+	The interpreter registers are held in locals, and must be written back to
+	m_registers before calling anything that might use them: sends, returns, polls,
+	and anything that allocates or counts down an object, as either can reconcile
+	the Zct, which walks the active process' stack.
+
+******************************************************************************/
+#include "Ist.h"
+
+#ifdef CPP_BYTECODELOOP
+
+#pragma code_seg(INTERP_SEG)
+
+#include "ObjMem.h"
+#include "Interprt.h"
+#include "InterprtProc.inl"
+
+#include "STBehavior.h"
+#include "STProcess.h"
+#include "STMethod.h"
+#include "STContext.h"
+#include "STBlockClosure.h"
+#include "STAssoc.h"
+#include "STCharacter.h"
+#include "STInteger.h"
+
+// Instruction handlers. Groups of instructions that differ only in an operand encoded in the
+// opcode share a handler, and calculate the operand from the opcode.
+enum ByteCodeHandler
+{
+	hBreak, hShortPushInstVar, hShortPushTemp, hShortPushContextTemp, hShortPushOuterTemp,
+	hShortPushConst, hShortPushStatic, hShortPushSelf, hShortPushTrue, hShortPushFalse, hShortPushNil,
+	hShortPushImmediate, hShortPushSelfAndTemp, hShortStoreTemp, hShortPopPushTemp, hPopPushSelf,
+	hPopDup, hPopStoreContextTemp, hShortPopStoreOuterTemp, hShortPopStoreInstVar, hShortPopStoreTemp,
+	hPopStackTop, hIncrementStackTop, hDecrementStackTop, hDuplicateStackTop,
+	hReturnSelf, hReturnTrue, hReturnFalse, hReturnNil, hReturnMessageStackTop, hReturnBlockStackTop,
+	hFarReturn, hPopReturnSelf, hNop, hShortJump, hShortJumpIfFalse,
+	hSendArithmeticAdd, hSendArithmeticSub, hSendArithmeticLT, hSendArithmeticGT, hSendArithmeticLE,
+	hSendArithmeticGE, hSendArithmeticEQ, hSendArithmeticNE, hSendArithmeticMul, hSendArithmeticDivide,
+	hSendArithmeticMod, hSendArithmeticBitShift, hSendArithmeticDiv, hSendArithmeticBitAnd,
+	hSendArithmeticBitOr, hSpecialSendIdentical, hSpecialSend, hSpecialSendAt, hSpecialSendAtPut,
+	hSpecialSendBasicClass, hSpecialSendBasicSize, hSpecialSendBasicAt, hSpecialSendBasicAtPut,
+	hSpecialSendIsNil, hSpecialSendNotNil, hShortSendWithNoArgs, hShortSendSelfWithNoArgs,
+	hShortSendWith1Arg, hShortSendWith2Args, hSpecialSendIsZero, hPushActiveFrame,
+	hPushInstVar, hPushTemp, hPushConst, hPushStatic, hStoreInstVar, hStoreTemp, hStoreStatic,
+	hPopStoreInstVar, hPopStoreTemp, hPopStoreStatic, hPushImmediate, hPushChar, hSend, hSupersend,
+	hNearJump, hNearJumpIfTrue, hNearJumpIfFalse, hNearJumpIfNil, hNearJumpIfNotNil,
+	hSendTempWithNoArgs, hPushSelfAndTemp, hPushOuterTemp, hStoreOuterTemp, hPopStoreOuterTemp,
+	hSendSelfWithNoArgs, hPushTempPair,
+	hLongPushConst, hLongPushStatic, hLongStoreStatic, hLongPopStoreStatic, hLongPushImmediate,
+	hLongSend, hLongSupersend, hLongJump, hLongJumpIfTrue, hLongJumpIfFalse, hLongJumpIfNil,
+	hLongJumpIfNotNil, hLongPushOuterTemp, hLongStoreOuterTemp, hIncrementTemp, hIncrementPushTemp,
+	hDecrementTemp, hDecrementPushTemp, hBlockCopy, hExLongSend, hExLongSupersend,
+	hInvalid, NumByteCodeHandlers
+};
+
+static BYTE s_byteCodeHandlers[256];
+
+// Number of arguments taken by each of the special selectors, in the order of the special send
+// instructions. Note that the assembler loop implements the #yourself slot as #basicClass
+static const BYTE s_specialSelectorArgCounts[NumSpecialSelectors] =
+{
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,	// Arithmetic
+	1,												// ==
+	0, 1,											// value, value:
+	0, 0, 0, 1,										// class, size, new, new:
+	1, 2,											// at:, at:put:
+	2, 1,											// value:value:, basicNew:
+	0, 0, 1, 2,										// basicClass, basicSize, basicAt:, basicAt:put:
+	0, 0											// isNil, notNil
+};
+
+static void SetHandlers(int first, int count, ByteCodeHandler handler)
+{
+	for (int i=0;i<count;i++)
+		s_byteCodeHandlers[first+i] = static_cast<BYTE>(handler);
+}
+
+static void InitializeByteCodeHandlers()
+{
+	SetHandlers(0, 256, hInvalid);
+
+	s_byteCodeHandlers[Break] = hBreak;
+	SetHandlers(ShortPushInstVar, NumShortPushInstVars, hShortPushInstVar);
+	SetHandlers(ShortPushTemp, NumShortPushTemps, hShortPushTemp);
+	SetHandlers(ShortPushContextTemp, NumPushContextTemps, hShortPushContextTemp);
+	SetHandlers(ShortPushOuterTemp, NumPushOuterTemps, hShortPushOuterTemp);
+	SetHandlers(ShortPushConst, NumShortPushConsts, hShortPushConst);
+	SetHandlers(ShortPushStatic, NumShortPushStatics, hShortPushStatic);
+	s_byteCodeHandlers[ShortPushSelf] = hShortPushSelf;
+	s_byteCodeHandlers[ShortPushTrue] = hShortPushTrue;
+	s_byteCodeHandlers[ShortPushFalse] = hShortPushFalse;
+	s_byteCodeHandlers[ShortPushNil] = hShortPushNil;
+	SetHandlers(ShortPushMinusOne, 4, hShortPushImmediate);
+	SetHandlers(ShortPushSelfAndTemp, NumShortPushSelfAndTemps, hShortPushSelfAndTemp);
+	SetHandlers(ShortStoreTemp, NumShortStoreTemps, hShortStoreTemp);
+	SetHandlers(ShortPopPushTemp, NumShortPopPushTemps, hShortPopPushTemp);
+	s_byteCodeHandlers[PopPushSelf] = hPopPushSelf;
+	s_byteCodeHandlers[PopDup] = hPopDup;
+	SetHandlers(PopStoreContextTemp, NumPopStoreContextTemps, hPopStoreContextTemp);
+	SetHandlers(ShortPopStoreOuterTemp, NumPopStoreOuterTemps, hShortPopStoreOuterTemp);
+	SetHandlers(ShortPopStoreInstVar, NumShortPopStoreInstVars, hShortPopStoreInstVar);
+	SetHandlers(ShortPopStoreTemp, NumShortPopStoreTemps, hShortPopStoreTemp);
+	s_byteCodeHandlers[PopStackTop] = hPopStackTop;
+	s_byteCodeHandlers[IncrementStackTop] = hIncrementStackTop;
+	s_byteCodeHandlers[DecrementStackTop] = hDecrementStackTop;
+	s_byteCodeHandlers[DuplicateStackTop] = hDuplicateStackTop;
+	s_byteCodeHandlers[ReturnSelf] = hReturnSelf;
+	s_byteCodeHandlers[ReturnTrue] = hReturnTrue;
+	s_byteCodeHandlers[ReturnFalse] = hReturnFalse;
+	s_byteCodeHandlers[ReturnNil] = hReturnNil;
+	s_byteCodeHandlers[ReturnMessageStackTop] = hReturnMessageStackTop;
+	s_byteCodeHandlers[ReturnBlockStackTop] = hReturnBlockStackTop;
+	s_byteCodeHandlers[FarReturn] = hFarReturn;
+	s_byteCodeHandlers[PopReturnSelf] = hPopReturnSelf;
+	s_byteCodeHandlers[Nop] = hNop;
+	SetHandlers(ShortJump, NumShortJumps, hShortJump);
+	SetHandlers(ShortJumpIfFalse, NumShortJumpsIfFalse, hShortJumpIfFalse);
+
+	// The arithmetic special sends have handlers in the same order as the instructions
+	for (int i=SendArithmeticAdd;i<=SendArithmeticBitOr;i++)
+		s_byteCodeHandlers[i] = static_cast<BYTE>(hSendArithmeticAdd + (i - SendArithmeticAdd));
+	s_byteCodeHandlers[SpecialSendIdentical] = hSpecialSendIdentical;
+	SetHandlers(SpecialSendValue0, SpecialSendNotNil-SpecialSendValue0+1, hSpecialSend);
+	s_byteCodeHandlers[SpecialSendAt] = hSpecialSendAt;
+	s_byteCodeHandlers[SpecialSendAtPut] = hSpecialSendAtPut;
+	s_byteCodeHandlers[SpecialSendYourself] = hSpecialSendBasicClass;
+	s_byteCodeHandlers[SpecialSendBasicSize] = hSpecialSendBasicSize;
+	s_byteCodeHandlers[SpecialSendBasicAt] = hSpecialSendBasicAt;
+	s_byteCodeHandlers[SpecialSendBasicAtPut] = hSpecialSendBasicAtPut;
+	s_byteCodeHandlers[SpecialSendIsNil] = hSpecialSendIsNil;
+	s_byteCodeHandlers[SpecialSendNotNil] = hSpecialSendNotNil;
+
+	SetHandlers(ShortSendWithNoArgs, NumShortSendsWithNoArgs, hShortSendWithNoArgs);
+	SetHandlers(ShortSendSelfWithNoArgs, NumShortSendSelfWithNoArgs, hShortSendSelfWithNoArgs);
+	SetHandlers(ShortSendWith1Arg, NumShortSendsWith1Arg, hShortSendWith1Arg);
+	SetHandlers(ShortSendWith2Args, NumShortSendsWith2Args, hShortSendWith2Args);
+	s_byteCodeHandlers[SpecialSendIsZero] = hSpecialSendIsZero;
+	s_byteCodeHandlers[PushActiveFrame] = hPushActiveFrame;
+
+	// Double byte instructions
+	s_byteCodeHandlers[PushInstVar] = hPushInstVar;
+	s_byteCodeHandlers[PushTemp] = hPushTemp;
+	s_byteCodeHandlers[PushConst] = hPushConst;
+	s_byteCodeHandlers[PushStatic] = hPushStatic;
+	s_byteCodeHandlers[StoreInstVar] = hStoreInstVar;
+	s_byteCodeHandlers[StoreTemp] = hStoreTemp;
+	s_byteCodeHandlers[StoreStatic] = hStoreStatic;
+	s_byteCodeHandlers[PopStoreInstVar] = hPopStoreInstVar;
+	s_byteCodeHandlers[PopStoreTemp] = hPopStoreTemp;
+	s_byteCodeHandlers[PopStoreStatic] = hPopStoreStatic;
+	s_byteCodeHandlers[PushImmediate] = hPushImmediate;
+	s_byteCodeHandlers[PushChar] = hPushChar;
+	s_byteCodeHandlers[Send] = hSend;
+	s_byteCodeHandlers[Supersend] = hSupersend;
+	s_byteCodeHandlers[NearJump] = hNearJump;
+	s_byteCodeHandlers[NearJumpIfTrue] = hNearJumpIfTrue;
+	s_byteCodeHandlers[NearJumpIfFalse] = hNearJumpIfFalse;
+	s_byteCodeHandlers[NearJumpIfNil] = hNearJumpIfNil;
+	s_byteCodeHandlers[NearJumpIfNotNil] = hNearJumpIfNotNil;
+	s_byteCodeHandlers[SendTempWithNoArgs] = hSendTempWithNoArgs;
+	s_byteCodeHandlers[PushSelfAndTemp] = hPushSelfAndTemp;
+	s_byteCodeHandlers[PushOuterTemp] = hPushOuterTemp;
+	s_byteCodeHandlers[StoreOuterTemp] = hStoreOuterTemp;
+	s_byteCodeHandlers[PopStoreOuterTemp] = hPopStoreOuterTemp;
+	s_byteCodeHandlers[SendSelfWithNoArgs] = hSendSelfWithNoArgs;
+	s_byteCodeHandlers[PushTempPair] = hPushTempPair;
+
+	// Triple byte instructions
+	for (int i=LongPushConst;i<=DecrementPushTemp;i++)
+		s_byteCodeHandlers[i] = static_cast<BYTE>(hLongPushConst + (i - LongPushConst));
+
+	s_byteCodeHandlers[BlockCopy] = hBlockCopy;
+	s_byteCodeHandlers[ExLongSend] = hExLongSend;
+	s_byteCodeHandlers[ExLongSupersend] = hExLongSupersend;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+inline static Oop* InstVarsOf(Oop receiver)
+{
+	return reinterpret_cast<PointersOTE*>(receiver)->m_location->m_fields;
+}
+
+inline static Oop& StaticValueOf(Oop binding)
+{
+	return static_cast<VariableBinding*>(reinterpret_cast<OTE*>(binding)->m_location)->m_value;
+}
+
+// Answer the Context at the specified depth of nesting from the environment of the frame
+inline static Context* OuterContextOf(const StackFrame* pFrame, unsigned depth)
+{
+	Context* pContext = reinterpret_cast<ContextOTE*>(pFrame->m_environment)->m_location;
+	while (depth-- > 0)
+		pContext = reinterpret_cast<ContextOTE*>(pContext->m_outer)->m_location;
+	return pContext;
+}
+
+inline static Oop BooleanOf(bool bValue)
+{
+	return Oop(bValue ? Pointers.True : Pointers.False);
+}
+
+// Send the selector to the receiver under the specified number of arguments on the stack. On
+// return the interpreter registers are set up to continue with the next instruction of the
+// new method, or if a primitive succeeded, the next instruction of the sending method.
+void __fastcall Interpreter::sendFromByteCode(SymbolOTE* selector, unsigned argCount)
+{
+	m_oopMessageSelector = selector;
+	BehaviorOTE* classPointer = ObjectMemory::fetchClassOf(*(m_registers.m_stackPointer - argCount));
+	MethodOTE* oteMethod = findNewMethodAtSendSite(classPointer, argCount);
+	// May be the #doesNotUnderstand: method, in which case the arguments are now in a Message
+	executeNewMethod(oteMethod, oteMethod->m_location->m_header.argumentCount);
+}
+
+void __fastcall Interpreter::superSendFromByteCode(SymbolOTE* selector, unsigned argCount)
+{
+	m_oopMessageSelector = selector;
+	BehaviorOTE* classPointer = m_registers.m_pMethod->m_methodClass->m_location->m_superclass;
+	MethodOTE* oteMethod = findNewMethodAtSendSite(classPointer, argCount);
+	executeNewMethod(oteMethod, oteMethod->m_location->m_header.argumentCount);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The loop
+
+// Instruction and instruction pair counts are maintained in the same tables as the assembler loop
+// (see DumpBytecodeCounts), along with the number of dispatches saved by superinstructions, and
+// counts of the sequences of three and four instructions executed between sends and returns, which
+// are the candidates for longer superinstructions
+#ifdef _DEBUG
+	extern "C" unsigned byteCodeCounters[];
+	extern "C" unsigned byteCodePairs[];
+	extern "C" unsigned byteCodesFused;
+	static unsigned s_lastByteCode;
+
+	// The sequences are packed one opcode per byte, the last in the low byte, and counted in an
+	// open addressed table. Once the table is full, further new sequences are only counted as dropped.
+	ByteCodeSequence byteCodeSequences[ByteCodeSequenceTableSize];
+	unsigned byteCodeSequencesDropped;
+	static DWORD s_byteCodeHistory;
+	static unsigned s_nByteCodeHistory;
+
+	static void CountByteCodeSequence(DWORD opcodes, unsigned length)
+	{
+		unsigned i = ((opcodes * 2654435761u) ^ length) >> 16;
+		for (unsigned probes=0;probes<ByteCodeSequenceTableSize;probes++,i=(i+1)%ByteCodeSequenceTableSize)
+		{
+			ByteCodeSequence& entry = byteCodeSequences[i];
+			if (entry.m_count == 0)
+			{
+				entry.m_opcodes = opcodes;
+				entry.m_length = length;
+			}
+			else if (entry.m_opcodes != opcodes || entry.m_length != length)
+				continue;
+			entry.m_count++;
+			return;
+		}
+		byteCodeSequencesDropped++;
+	}
+
+	static void CountByteCodeSequences(unsigned op)
+	{
+		s_byteCodeHistory = (s_byteCodeHistory << 8) | op;
+		if (s_nByteCodeHistory < 4)
+			s_nByteCodeHistory++;
+		if (s_nByteCodeHistory >= 3)
+			CountByteCodeSequence(s_byteCodeHistory & 0xFFFFFF, 3);
+		if (s_nByteCodeHistory == 4)
+			CountByteCodeSequence(s_byteCodeHistory, 4);
+	}
+
+	#define COUNTBYTECODE(op)	{ byteCodeCounters[op]++; byteCodePairs[s_lastByteCode*256+(op)]++; s_lastByteCode = (op); \
+									CountByteCodeSequences(op); }
+	#define COUNTFUSED()		(byteCodesFused++)
+	// A superinstruction cannot span a change of context, so sequences are restarted when one may have occurred
+	#define ENDSEQUENCE()		(s_nByteCodeHistory = 0)
+#elif defined(PROFILING)
+	extern unsigned byteCodeCount;
+	#define COUNTBYTECODE(op)	(byteCodeCount++)
+	#define COUNTFUSED()
+	#define ENDSEQUENCE()
+#else
+	#define COUNTBYTECODE(op)
+	#define COUNTFUSED()
+	#define ENDSEQUENCE()
+#endif
+
+#define BYTECODE(handler)	case handler:
+#define NEXT()				continue
+
+#define LOADREGISTERS()		do { ip = m_registers.m_instructionPointer; sp = m_registers.m_stackPointer; \
+								bp = m_registers.m_basePointer; method = m_registers.m_pMethod; ENDSEQUENCE(); } while (0)
+#define SAVEREGISTERS()		do { m_registers.m_instructionPointer = ip; m_registers.m_stackPointer = sp; } while (0)
+#define SAVESP()			(m_registers.m_stackPointer = sp)
+
+#define RECEIVER			(bp[-1])
+#define LITERAL(index)		(method->m_aLiterals[index])
+#define PUSH(oop)			(*++sp = (oop))
+
+// Poll for async events after a jump has been taken, as the assembler loop does
+#define POLL()				{ if (m_bAsyncPending) { SAVEREGISTERS(); BytecodePoll(); LOADREGISTERS(); } }
+
+#ifdef BASELINE_JIT
+	// Continue in the native code of the active method if it has been compiled (see NativeCode.cpp),
+	// counting activations of methods that have not
+	#define ENTERNATIVE(bActivation)	{ if (!m_bStepping) { SAVEREGISTERS(); \
+											if (runNativeCode(bActivation)) { LOADREGISTERS(); POLL(); } } }
+#else
+	#define ENTERNATIVE(bActivation)
+#endif
+
+#define JUMPTAKEN()			{ POLL(); ENTERNATIVE(false); }
+
+// Send the selector to the receiver under argCount arguments, and continue with the next instruction
+#define SEND(selector, argCount)	{ StackFrame* _pCaller = m_registers.m_pActiveFrame; SAVEREGISTERS(); \
+										sendFromByteCode(selector, argCount); LOADREGISTERS(); \
+										ENTERNATIVE(m_registers.m_pActiveFrame != _pCaller); NEXT(); }
+#define SUPERSEND(selector, argCount)	{ StackFrame* _pCaller = m_registers.m_pActiveFrame; SAVEREGISTERS(); \
+										superSendFromByteCode(selector, argCount); LOADREGISTERS(); \
+										ENTERNATIVE(m_registers.m_pActiveFrame != _pCaller); NEXT(); }
+#define SENDSPECIAL()		SEND(Pointers.specialSelectors[op-ShortSpecialSend], s_specialSelectorArgCounts[op-ShortSpecialSend])
+
+// Back the IP up to the start of a conditional jump and undo its pop, so the test is retried
+// if #mustBeBoolean returns
+#define MUSTBEBOOLEAN(instructionSize)	{ ip -= instructionSize; sp++; SEND(Pointers.MustBeBooleanSelector, 0); }
+
+// Store into a slot of a heap object (context temps, statics, inst vars), which must be ref. counted
+#define STOREHEAPSLOT(slot, value)	{ Oop _value = (value); ObjectMemory::countUp(_value); Oop _old = (slot); \
+										(slot) = _value; SAVESP(); ObjectMemory::countDown(_old); }
+
+// Compare and branch superinstruction. A comparison with an inline response is very often followed
+// by a conditional jump on its result, in which case the jump is taken (or not) directly, saving
+// the dispatch of the jump and the push and test of a boolean. Otherwise the boolean is pushed.
+#define BRANCHON(condition, argCount) \
+	{ \
+		bool _bResult = (condition); \
+		unsigned _next = *ip; \
+		if (_next >= ShortJumpIfFalse && _next < ShortJumpIfFalse+NumShortJumpsIfFalse) \
+		{ \
+			COUNTFUSED(); \
+			sp -= (argCount)+1; \
+			ip += _bResult ? 1 : _next - ShortJumpIfFalse + 2; \
+			NEXT(); \
+		} \
+		if (_next == NearJumpIfTrue || _next == NearJumpIfFalse) \
+		{ \
+			COUNTFUSED(); \
+			sp -= (argCount)+1; \
+			if (_bResult == (_next == NearJumpIfTrue)) \
+			{ \
+				ip += static_cast<signed char>(ip[1]) + 2; \
+				JUMPTAKEN(); \
+			} \
+			else \
+				ip += 2; \
+			NEXT(); \
+		} \
+		if (_next == LongJumpIfTrue || _next == LongJumpIfFalse) \
+		{ \
+			COUNTFUSED(); \
+			sp -= (argCount)+1; \
+			if (_bResult == (_next == LongJumpIfTrue)) \
+			{ \
+				ip += *reinterpret_cast<SHORT*>(ip+1) + 3; \
+				JUMPTAKEN(); \
+			} \
+			else \
+				ip += 3; \
+			NEXT(); \
+		} \
+		sp -= (argCount); \
+		*sp = BooleanOf(_bResult); \
+		NEXT(); \
+	}
+
+// Replace the stack top with a newly created integer result
+#define REPLACETOPWITHNEW(oop)		{ SAVESP(); replaceStackTopWithNew(oop); }
+
+// Short return of the value to the caller of the active frame
+#define RETURNTOCALLER(value)		{ Oop _result = (value); SAVEREGISTERS(); \
+										returnValueToCaller(_result, m_registers.m_pActiveFrame->m_caller); \
+										LOADREGISTERS(); ENTERNATIVE(false); NEXT(); }
+
+void Interpreter::interpretByteCodes()
+{
+	BYTE* ip;
+	Oop* sp;
+	Oop* bp;
+	CompiledMethod* method;
+	unsigned op;
+
+	static bool bInitialized = false;
+	if (!bInitialized)
+	{
+		InitializeByteCodeHandlers();
+		bInitialized = true;
+	}
+
+	LOADREGISTERS();
+
+	for (;;)
+	{
+		op = *ip++;
+		SAVEREGISTERS();
+		COUNTBYTECODE(op);
+		switch (s_byteCodeHandlers[op])
+		{
+
+		///////////////////////////////////////////////////////////////////////
+		// Pushes
+
+		BYTECODE(hShortPushInstVar)
+			PUSH(InstVarsOf(RECEIVER)[op-ShortPushInstVar]);
+			NEXT();
+
+		BYTECODE(hShortPushTemp)
+			PUSH(bp[op-ShortPushTemp]);
+			NEXT();
+
+		BYTECODE(hShortPushContextTemp)
+			PUSH(OuterContextOf(m_registers.m_pActiveFrame, 0)->m_tempFrame[op-ShortPushContextTemp]);
+			NEXT();
+
+		BYTECODE(hShortPushOuterTemp)
+			PUSH(OuterContextOf(m_registers.m_pActiveFrame, 1)->m_tempFrame[op-ShortPushOuterTemp]);
+			NEXT();
+
+		BYTECODE(hShortPushConst)
+			PUSH(LITERAL(op-ShortPushConst));
+			NEXT();
+
+		BYTECODE(hShortPushStatic)
+			PUSH(StaticValueOf(LITERAL(op-ShortPushStatic)));
+			NEXT();
+
+		BYTECODE(hShortPushSelf)
+			PUSH(RECEIVER);
+			NEXT();
+
+		BYTECODE(hShortPushTrue)
+			PUSH(Oop(Pointers.True));
+			NEXT();
+
+		BYTECODE(hShortPushFalse)
+			PUSH(Oop(Pointers.False));
+			NEXT();
+
+		BYTECODE(hShortPushNil)
+			PUSH(Oop(Pointers.Nil));
+			NEXT();
+
+		BYTECODE(hShortPushImmediate)
+			PUSH(integerObjectOf(static_cast<int>(op) - ShortPushZero));
+			NEXT();
+
+		BYTECODE(hShortPushSelfAndTemp)
+			sp[1] = RECEIVER;
+			sp[2] = bp[op-ShortPushSelfAndTemp];
+			sp += 2;
+			NEXT();
+
+		BYTECODE(hPushInstVar)
+			PUSH(InstVarsOf(RECEIVER)[*ip++]);
+			NEXT();
+
+		BYTECODE(hPushTemp)
+			PUSH(bp[*ip++]);
+			NEXT();
+
+		BYTECODE(hPushConst)
+			PUSH(LITERAL(*ip++));
+			NEXT();
+
+		BYTECODE(hPushStatic)
+			PUSH(StaticValueOf(LITERAL(*ip++)));
+			NEXT();
+
+		BYTECODE(hPushImmediate)
+			PUSH(integerObjectOf(static_cast<signed char>(*ip++)));
+			NEXT();
+
+		BYTECODE(hPushChar)
+			PUSH(Oop(Character::New(*ip++)));
+			NEXT();
+
+		BYTECODE(hPushSelfAndTemp)
+			sp[1] = RECEIVER;
+			sp[2] = bp[*ip++];
+			sp += 2;
+			NEXT();
+
+		BYTECODE(hPushOuterTemp)
+		{
+			BYTE ext = *ip++;
+			PUSH(OuterContextOf(m_registers.m_pActiveFrame, ext >> OuterTempIndexBits)->m_tempFrame[ext & OuterTempMaxIndex]);
+			NEXT();
+		}
+
+		BYTECODE(hPushTempPair)
+		{
+			BYTE ext = *ip++;
+			sp[1] = bp[ext >> 4];
+			sp[2] = bp[ext & 0xF];
+			sp += 2;
+			NEXT();
+		}
+
+		BYTECODE(hLongPushConst)
+			PUSH(LITERAL(*reinterpret_cast<WORD*>(ip)));
+			ip += sizeof(WORD);
+			NEXT();
+
+		BYTECODE(hLongPushStatic)
+			PUSH(StaticValueOf(LITERAL(*reinterpret_cast<WORD*>(ip))));
+			ip += sizeof(WORD);
+			NEXT();
+
+		BYTECODE(hLongPushImmediate)
+			PUSH(integerObjectOf(*reinterpret_cast<SHORT*>(ip)));
+			ip += sizeof(SHORT);
+			NEXT();
+
+		BYTECODE(hLongPushOuterTemp)
+			PUSH(OuterContextOf(m_registers.m_pActiveFrame, ip[0])->m_tempFrame[ip[1]]);
+			ip += 2;
+			NEXT();
+
+		BYTECODE(hPushActiveFrame)
+		{
+			// Resize the active process to reflect the current top of stack, and push the frame
+			Process* pProcess = m_registers.m_pActiveProcess;
+			m_registers.m_oteActiveProcess->setSize(reinterpret_cast<BYTE*>(sp) - reinterpret_cast<BYTE*>(pProcess) + sizeof(Oop));
+			StackFrame* pFrame = m_registers.m_pActiveFrame;
+			pFrame->setStackPointer(sp);
+			PUSH(m_registers.activeFrameOop());
+			NEXT();
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Stores into the stack, which are not ref. counted
+
+		BYTECODE(hShortStoreTemp)
+			bp[op-ShortStoreTemp] = *sp;
+			NEXT();
+
+		BYTECODE(hShortPopStoreTemp)
+			bp[op-ShortPopStoreTemp] = *sp--;
+			NEXT();
+
+		BYTECODE(hStoreTemp)
+			bp[*ip++] = *sp;
+			NEXT();
+
+		BYTECODE(hPopStoreTemp)
+			bp[*ip++] = *sp--;
+			NEXT();
+
+		BYTECODE(hShortPopPushTemp)
+			*sp = bp[op-ShortPopPushTemp];
+			NEXT();
+
+		BYTECODE(hPopPushSelf)
+			*sp = RECEIVER;
+			NEXT();
+
+		BYTECODE(hPopDup)
+			*sp = sp[-1];
+			NEXT();
+
+		BYTECODE(hPopStackTop)
+			sp--;
+			NEXT();
+
+		BYTECODE(hDuplicateStackTop)
+			sp[1] = *sp;
+			sp++;
+			NEXT();
+
+		///////////////////////////////////////////////////////////////////////
+		// Stores into heap objects
+
+		BYTECODE(hPopStoreContextTemp)
+		{
+			Oop value = *sp--;
+			STOREHEAPSLOT(OuterContextOf(m_registers.m_pActiveFrame, 0)->m_tempFrame[op-PopStoreContextTemp], value);
+			NEXT();
+		}
+
+		BYTECODE(hShortPopStoreOuterTemp)
+		{
+			Oop value = *sp--;
+			STOREHEAPSLOT(OuterContextOf(m_registers.m_pActiveFrame, 1)->m_tempFrame[op-ShortPopStoreOuterTemp], value);
+			NEXT();
+		}
+
+		BYTECODE(hStoreOuterTemp)
+		{
+			BYTE ext = *ip++;
+			STOREHEAPSLOT(OuterContextOf(m_registers.m_pActiveFrame, ext >> OuterTempIndexBits)->m_tempFrame[ext & OuterTempMaxIndex], *sp);
+			NEXT();
+		}
+
+		BYTECODE(hPopStoreOuterTemp)
+		{
+			BYTE ext = *ip++;
+			Oop value = *sp--;
+			STOREHEAPSLOT(OuterContextOf(m_registers.m_pActiveFrame, ext >> OuterTempIndexBits)->m_tempFrame[ext & OuterTempMaxIndex], value);
+			NEXT();
+		}
+
+		BYTECODE(hLongStoreOuterTemp)
+		{
+			Context* pContext = OuterContextOf(m_registers.m_pActiveFrame, ip[0]);
+			unsigned index = ip[1];
+			ip += 2;
+			STOREHEAPSLOT(pContext->m_tempFrame[index], *sp);
+			NEXT();
+		}
+
+		BYTECODE(hStoreStatic)
+			STOREHEAPSLOT(StaticValueOf(LITERAL(*ip++)), *sp);
+			NEXT();
+
+		BYTECODE(hPopStoreStatic)
+		{
+			Oop value = *sp--;
+			STOREHEAPSLOT(StaticValueOf(LITERAL(*ip++)), value);
+			NEXT();
+		}
+
+		BYTECODE(hLongStoreStatic)
+		{
+			unsigned index = *reinterpret_cast<WORD*>(ip);
+			ip += sizeof(WORD);
+			STOREHEAPSLOT(StaticValueOf(LITERAL(index)), *sp);
+			NEXT();
+		}
+
+		BYTECODE(hLongPopStoreStatic)
+		{
+			unsigned index = *reinterpret_cast<WORD*>(ip);
+			ip += sizeof(WORD);
+			Oop value = *sp--;
+			STOREHEAPSLOT(StaticValueOf(LITERAL(index)), value);
+			NEXT();
+		}
+
+		// Stores into inst vars must check for an immutable receiver (which has a negative size) or
+		// an out of bounds index. Either sends #errorInstVarAt:put: to the receiver with the IP left
+		// at the store instruction.
+		BYTECODE(hShortPopStoreInstVar)
+		{
+			unsigned index = op - ShortPopStoreInstVar;
+			PointersOTE* oteReceiver = reinterpret_cast<PointersOTE*>(RECEIVER);
+			if (static_cast<int>(index) >= oteReceiver->pointersSizeForUpdate())
+			{
+				Oop value = *sp;
+				*sp = Oop(oteReceiver);
+				sp[1] = integerObjectOf(index+1);
+				sp[2] = value;
+				sp += 2;
+				ip--;
+				SEND(Pointers.errorInstVarAtPutSymbol, 2);
+			}
+			Oop value = *sp--;
+			STOREHEAPSLOT(oteReceiver->m_location->m_fields[index], value);
+			NEXT();
+		}
+
+		BYTECODE(hStoreInstVar)
+		BYTECODE(hPopStoreInstVar)
+		{
+			unsigned index = *ip++;
+			Oop value = *sp;
+			if (op == PopStoreInstVar)
+				sp--;
+			PointersOTE* oteReceiver = reinterpret_cast<PointersOTE*>(RECEIVER);
+			if (static_cast<int>(index) >= oteReceiver->pointersSizeForUpdate())
+			{
+				sp[1] = Oop(oteReceiver);
+				sp[2] = integerObjectOf(index+1);
+				sp[3] = value;
+				sp += 3;
+				ip -= 2;
+				SEND(Pointers.errorInstVarAtPutSymbol, 2);
+			}
+			STOREHEAPSLOT(oteReceiver->m_location->m_fields[index], value);
+			NEXT();
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Returns
+
+		BYTECODE(hPopReturnSelf)
+			sp--;
+			RETURNTOCALLER(RECEIVER);
+
+		BYTECODE(hReturnSelf)
+			RETURNTOCALLER(RECEIVER);
+
+		BYTECODE(hReturnTrue)
+			RETURNTOCALLER(Oop(Pointers.True));
+
+		BYTECODE(hReturnFalse)
+			RETURNTOCALLER(Oop(Pointers.False));
+
+		BYTECODE(hReturnNil)
+			RETURNTOCALLER(Oop(Pointers.Nil));
+
+		BYTECODE(hReturnMessageStackTop)
+		BYTECODE(hReturnBlockStackTop)
+			RETURNTOCALLER(*sp--);
+
+		BYTECODE(hFarReturn)
+		{
+			// Return to the sender of the home context of the block, which is found by chaining up
+			// through the outer contexts until a method context is found
+			Oop result = *sp--;
+			StackFrame* pActiveFrame = m_registers.m_pActiveFrame;
+			Oop outer = Oop(reinterpret_cast<ContextOTE*>(pActiveFrame->m_environment)->m_location->m_outer);
+			do
+			{
+				outer = Oop(reinterpret_cast<ContextOTE*>(outer)->m_location->m_outer);
+			} while (!isIntegerObject(outer));
+
+			SAVEREGISTERS();
+			StackFrame* pHomeFrame = reinterpret_cast<StackFrame*>(outer-1);
+			if (outer == ZeroPointer || pHomeFrame >= pActiveFrame
+					|| pHomeFrame <= reinterpret_cast<StackFrame*>(m_registers.m_pActiveProcess))
+				invalidReturn(result);
+			else if (pActiveFrame->m_caller == pHomeFrame->m_caller)
+				returnValueToCaller(result, pHomeFrame->m_caller);
+			else
+				nonLocalReturnValueTo(result, pHomeFrame->m_caller);
+			LOADREGISTERS();
+			ENTERNATIVE(false);
+			NEXT();
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Jumps. Offsets are relative to the next instruction. Short jumps are all forward, and
+		// the minimum is +2 from the start of the instruction (a +1 jump would be a Nop).
+
+		BYTECODE(hNop)
+			NEXT();
+
+		BYTECODE(hShortJump)
+			ip += op - ShortJump + 1;
+			NEXT();
+
+		BYTECODE(hShortJumpIfFalse)
+		{
+			Oop top = *sp--;
+			if (top == Oop(Pointers.False))
+				ip += op - ShortJumpIfFalse + 1;
+			else if (top != Oop(Pointers.True))
+				MUSTBEBOOLEAN(1);
+			NEXT();
+		}
+
+		BYTECODE(hNearJump)
+			ip += static_cast<signed char>(*ip) + 1;
+			JUMPTAKEN();
+			NEXT();
+
+		BYTECODE(hNearJumpIfTrue)
+		BYTECODE(hNearJumpIfFalse)
+		{
+			Oop top = *sp--;
+			Oop jumpIf = Oop(op == NearJumpIfTrue ? Pointers.True : Pointers.False);
+			if (top == jumpIf)
+			{
+				ip += static_cast<signed char>(*ip) + 1;
+				JUMPTAKEN();
+			}
+			else if (top == Oop(Pointers.True) || top == Oop(Pointers.False))
+				ip++;
+			else
+				MUSTBEBOOLEAN(1);
+			NEXT();
+		}
+
+		BYTECODE(hNearJumpIfNil)
+		BYTECODE(hNearJumpIfNotNil)
+		{
+			Oop top = *sp--;
+			if ((top == Oop(Pointers.Nil)) == (op == NearJumpIfNil))
+			{
+				ip += static_cast<signed char>(*ip) + 1;
+				JUMPTAKEN();
+			}
+			else
+				ip++;
+			NEXT();
+		}
+
+		BYTECODE(hLongJump)
+			ip += *reinterpret_cast<SHORT*>(ip) + sizeof(SHORT);
+			JUMPTAKEN();
+			NEXT();
+
+		BYTECODE(hLongJumpIfTrue)
+		BYTECODE(hLongJumpIfFalse)
+		{
+			Oop top = *sp--;
+			Oop jumpIf = Oop(op == LongJumpIfTrue ? Pointers.True : Pointers.False);
+			if (top == jumpIf)
+			{
+				ip += *reinterpret_cast<SHORT*>(ip) + sizeof(SHORT);
+				JUMPTAKEN();
+			}
+			else if (top == Oop(Pointers.True) || top == Oop(Pointers.False))
+				ip += sizeof(SHORT);
+			else
+				MUSTBEBOOLEAN(1);
+			NEXT();
+		}
+
+		BYTECODE(hLongJumpIfNil)
+		BYTECODE(hLongJumpIfNotNil)
+		{
+			Oop top = *sp--;
+			if ((top == Oop(Pointers.Nil)) == (op == LongJumpIfNil))
+			{
+				ip += *reinterpret_cast<SHORT*>(ip) + sizeof(SHORT);
+				JUMPTAKEN();
+			}
+			else
+				ip += sizeof(SHORT);
+			NEXT();
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Arithmetic special sends, with inline SmallInteger responses
+
+		BYTECODE(hSendArithmeticAdd)
+		{
+			Oop receiver = sp[-1], arg = *sp;
+			if (!isIntegerObject(receiver & arg))
+				SENDSPECIAL();
+			sp--;
+			SMALLINTEGER result = integerValueOf(receiver) + integerValueOf(arg);
+			if (isIntegerValue(result))
+				*sp = integerObjectOf(result);
+			else
+				REPLACETOPWITHNEW(Integer::NewSigned32(result));
+			NEXT();
+		}
+
+		BYTECODE(hSendArithmeticSub)
+		{
+			Oop receiver = sp[-1], arg = *sp;
+			if (!isIntegerObject(receiver & arg))
+				SENDSPECIAL();
+			sp--;
+			SMALLINTEGER result = integerValueOf(receiver) - integerValueOf(arg);
+			if (isIntegerValue(result))
+				*sp = integerObjectOf(result);
+			else
+				REPLACETOPWITHNEW(Integer::NewSigned32(result));
+			NEXT();
+		}
+
+		BYTECODE(hSendArithmeticMul)
+		{
+			Oop receiver = sp[-1], arg = *sp;
+			if (!isIntegerObject(receiver & arg))
+				SENDSPECIAL();
+			sp--;
+			LONGLONG result = static_cast<LONGLONG>(integerValueOf(receiver)) * integerValueOf(arg);
+			if (result >= MinSmallInteger && result <= MaxSmallInteger)
+				*sp = integerObjectOf(static_cast<SMALLINTEGER>(result));
+			else
+				REPLACETOPWITHNEW(Integer::NewSigned64(result));
+			NEXT();
+		}
+
+		// Only exact division has an inline response, otherwise the primitive answers a Fraction
+		BYTECODE(hSendArithmeticDivide)
+		{
+			Oop receiver = sp[-1], arg = *sp;
+			if (!isIntegerObject(receiver & arg) || arg == ZeroPointer)
+				SENDSPECIAL();
+			SMALLINTEGER numerator = integerValueOf(receiver), denominator = integerValueOf(arg);
+			if (numerator % denominator != 0)
+				SENDSPECIAL();
+			sp--;
+			REPLACETOPWITHNEW(Integer::NewSigned32(numerator / denominator));
+			NEXT();
+		}
+
+		// #\\ and #// round towards negative infinity
+		BYTECODE(hSendArithmeticMod)
+		{
+			Oop receiver = sp[-1], arg = *sp;
+			if (!isIntegerObject(receiver & arg) || arg == ZeroPointer)
+				SENDSPECIAL();
+			SMALLINTEGER denominator = integerValueOf(arg);
+			SMALLINTEGER remainder = integerValueOf(receiver) % denominator;
+			if (remainder != 0 && ((remainder < 0) != (denominator < 0)))
+				remainder += denominator;
+			*--sp = integerObjectOf(remainder);
+			NEXT();
+		}
+
+		BYTECODE(hSendArithmeticDiv)
+		{
+			Oop receiver = sp[-1], arg = *sp;
+			if (!isIntegerObject(receiver & arg) || arg == ZeroPointer)
+				SENDSPECIAL();
+			SMALLINTEGER numerator = integerValueOf(receiver), denominator = integerValueOf(arg);
+			SMALLINTEGER quotient = numerator / denominator;
+			if (numerator % denominator != 0 && ((numerator < 0) != (denominator < 0)))
+				quotient--;
+			sp--;
+			// Can overflow only when dividing the minimum SmallInteger by -1
+			REPLACETOPWITHNEW(Integer::NewSigned32(quotient));
+			NEXT();
+		}
+
+		BYTECODE(hSendArithmeticBitShift)
+		{
+			Oop receiver = sp[-1], arg = *sp;
+			if (!isIntegerObject(receiver & arg))
+				SENDSPECIAL();
+			SMALLINTEGER value = integerValueOf(receiver), shift = integerValueOf(arg);
+			SMALLINTEGER result;
+			if (shift >= 0)
+			{
+				// Left shifts that overflow are left to the primitive, which answers a LargeInteger
+				if (shift >= 30)
+				{
+					if (value != 0)
+						SENDSPECIAL();
+					result = 0;
+				}
+				else
+				{
+					result = value << shift;
+					if ((result >> shift) != value || !isIntegerValue(result))
+						SENDSPECIAL();
+				}
+			}
+			else
+				result = shift <= -31 ? (value < 0 ? -1 : 0) : value >> -shift;
+			*--sp = integerObjectOf(result);
+			NEXT();
+		}
+
+		// The SmallInteger flag survives only if both operands have it
+		BYTECODE(hSendArithmeticBitAnd)
+		{
+			Oop result = sp[-1] & *sp;
+			if (!isIntegerObject(result))
+				SENDSPECIAL();
+			*--sp = result;
+			NEXT();
+		}
+
+		BYTECODE(hSendArithmeticBitOr)
+		{
+			Oop receiver = sp[-1], arg = *sp;
+			if (!isIntegerObject(receiver & arg))
+				SENDSPECIAL();
+			*--sp = receiver | arg;
+			NEXT();
+		}
+
+		// SmallIntegers can be compared without removing the flag
+		#define COMPARISON(handler, operator) \
+			BYTECODE(handler) \
+			{ \
+				Oop receiver = sp[-1], arg = *sp; \
+				if (!isIntegerObject(receiver & arg)) \
+					SENDSPECIAL(); \
+				BRANCHON(SMALLINTEGER(receiver) operator SMALLINTEGER(arg), 1); \
+			}
+
+		COMPARISON(hSendArithmeticLT, <)
+		COMPARISON(hSendArithmeticGT, >)
+		COMPARISON(hSendArithmeticLE, <=)
+		COMPARISON(hSendArithmeticGE, >=)
+		COMPARISON(hSendArithmeticEQ, ==)
+		COMPARISON(hSendArithmeticNE, !=)
+
+		#undef COMPARISON
+
+		BYTECODE(hIncrementStackTop)
+		BYTECODE(hDecrementStackTop)
+		{
+			Oop top = *sp;
+			if (!isIntegerObject(top))
+			{
+				PUSH(OnePointer);
+				SEND(op == IncrementStackTop ? Pointers.specialSelectors[0] : Pointers.specialSelectors[1], 1);
+			}
+			SMALLINTEGER result = integerValueOf(top) + (op == IncrementStackTop ? 1 : -1);
+			if (isIntegerValue(result))
+				*sp = integerObjectOf(result);
+			else
+				REPLACETOPWITHNEW(Integer::NewSigned32(result));
+			NEXT();
+		}
+
+		// The increment/decrement temp instructions embed a (pop) store temp instruction, which
+		// is skipped if the SmallInteger response succeeds, but otherwise stores the result of
+		// sending #+ or #- on return
+		BYTECODE(hIncrementTemp)
+		BYTECODE(hIncrementPushTemp)
+		BYTECODE(hDecrementTemp)
+		BYTECODE(hDecrementPushTemp)
+		{
+			bool bIncrement = op == IncrementTemp || op == IncrementPushTemp;
+			Oop& temp = bp[ip[1]];
+			if (isIntegerObject(temp))
+			{
+				SMALLINTEGER result = integerValueOf(temp) + (bIncrement ? 1 : -1);
+				if (isIntegerValue(result))
+				{
+					temp = integerObjectOf(result);
+					if (op == IncrementPushTemp || op == DecrementPushTemp)
+						PUSH(temp);
+					ip += 2;
+					NEXT();
+				}
+			}
+			sp[1] = temp;
+			sp[2] = OnePointer;
+			sp += 2;
+			SEND(bIncrement ? Pointers.specialSelectors[0] : Pointers.specialSelectors[1], 1);
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Other special sends
+
+		BYTECODE(hSpecialSendIdentical)
+			BRANCHON(sp[-1] == *sp, 1);
+
+		BYTECODE(hSpecialSend)
+			SENDSPECIAL();
+
+		BYTECODE(hSpecialSendBasicClass)
+			*sp = Oop(ObjectMemory::fetchClassOf(*sp));
+			NEXT();
+
+		BYTECODE(hSpecialSendIsNil)
+			BRANCHON(*sp == Oop(Pointers.Nil), 0);
+
+		BYTECODE(hSpecialSendNotNil)
+			BRANCHON(*sp != Oop(Pointers.Nil), 0);
+
+		BYTECODE(hSpecialSendIsZero)
+			*sp = BooleanOf(*sp == ZeroPointer);
+			NEXT();
+
+		BYTECODE(hSpecialSendBasicSize)
+		{
+			Oop receiver = *sp;
+			if (isIntegerObject(receiver))
+				*sp = ZeroPointer;
+			else
+			{
+				OTE* ote = reinterpret_cast<OTE*>(receiver);
+				MWORD size = ote->isPointers()
+								? ote->getWordSize() - ote->m_oteClass->m_location->fixedFields()
+								: ote->getSize();
+				*sp = integerObjectOf(size);
+			}
+			NEXT();
+		}
+
+		BYTECODE(hSpecialSendBasicAt)
+		{
+			Oop receiver = sp[-1], arg = *sp;
+			if (isIntegerObject(receiver) || !isIntegerObject(arg))
+				SENDSPECIAL();
+			SMALLINTEGER offset = integerValueOf(arg) - 1;
+			if (offset < 0)
+				SENDSPECIAL();
+			OTE* ote = reinterpret_cast<OTE*>(receiver);
+			if (ote->isPointers())
+			{
+				offset += ote->m_oteClass->m_location->fixedFields();
+				if (static_cast<MWORD>(offset) >= ote->getWordSize())
+					SENDSPECIAL();
+				*--sp = reinterpret_cast<PointersOTE*>(ote)->m_location->m_fields[offset];
+			}
+			else
+			{
+				if (static_cast<MWORD>(offset) >= ote->getSize())
+					SENDSPECIAL();
+				*--sp = integerObjectOf(reinterpret_cast<BytesOTE*>(ote)->m_location->m_fields[offset]);
+			}
+			NEXT();
+		}
+
+		// Immutable objects have a negative size, and so fail the bounds checks here
+		BYTECODE(hSpecialSendBasicAtPut)
+		{
+			Oop receiver = sp[-2], arg = sp[-1], value = *sp;
+			if (isIntegerObject(receiver) || !isIntegerObject(arg))
+				SENDSPECIAL();
+			SMALLINTEGER offset = integerValueOf(arg) - 1;
+			if (offset < 0)
+				SENDSPECIAL();
+			OTE* ote = reinterpret_cast<OTE*>(receiver);
+			if (ote->isPointers())
+			{
+				offset += ote->m_oteClass->m_location->fixedFields();
+				if (offset >= reinterpret_cast<PointersOTE*>(ote)->pointersSizeForUpdate())
+					SENDSPECIAL();
+				sp -= 2;
+				*sp = value;
+				STOREHEAPSLOT(reinterpret_cast<PointersOTE*>(ote)->m_location->m_fields[offset], value);
+			}
+			else
+			{
+				if (offset >= ote->bytesSizeForUpdate() || !isIntegerObject(value)
+						|| static_cast<MWORD>(integerValueOf(value)) > 0xFF)
+					SENDSPECIAL();
+				reinterpret_cast<BytesOTE*>(ote)->m_location->m_fields[offset] = static_cast<BYTE>(integerValueOf(value));
+				sp -= 2;
+				*sp = value;
+			}
+			NEXT();
+		}
+
+		// #at: and #at:put: are inlined only for objects already in the AtCaches, which are
+		// populated by the primitives
+		BYTECODE(hSpecialSendAt)
+		{
+			Oop receiver = sp[-1], arg = *sp;
+			if (isIntegerObject(receiver) || !isIntegerObject(arg))
+				SENDSPECIAL();
+			AtCacheEntry* entry = reinterpret_cast<AtCacheEntry*>(reinterpret_cast<BYTE*>(AtCache) + (receiver & AtCacheMask));
+			SMALLINTEGER offset = integerValueOf(arg) - 1;
+			if (entry->oteArray != reinterpret_cast<OTE*>(receiver) || offset < 0 || offset >= static_cast<SMALLINTEGER>(entry->maxIndex))
+				SENDSPECIAL();
+			switch (entry->type)
+			{
+			case AtCachePointers:
+				*--sp = static_cast<Oop*>(entry->pElements)[offset];
+				break;
+			case AtCacheBytes:
+				*--sp = integerObjectOf(static_cast<BYTE*>(entry->pElements)[offset]);
+				break;
+			default:
+				*--sp = Oop(Character::New(static_cast<BYTE*>(entry->pElements)[offset]));
+				break;
+			}
+			NEXT();
+		}
+
+		BYTECODE(hSpecialSendAtPut)
+		{
+			Oop receiver = sp[-2], arg = sp[-1], value = *sp;
+			if (isIntegerObject(receiver) || !isIntegerObject(arg))
+				SENDSPECIAL();
+			AtCacheEntry* entry = reinterpret_cast<AtCacheEntry*>(reinterpret_cast<BYTE*>(AtPutCache) + (receiver & AtCacheMask));
+			SMALLINTEGER offset = integerValueOf(arg) - 1;
+			if (entry->oteArray != reinterpret_cast<OTE*>(receiver) || offset < 0 || offset >= static_cast<SMALLINTEGER>(entry->maxIndex))
+				SENDSPECIAL();
+			if (entry->type == AtCachePointers)
+			{
+				sp -= 2;
+				*sp = value;
+				STOREHEAPSLOT(static_cast<Oop*>(entry->pElements)[offset], value);
+			}
+			else if (entry->type == AtCacheBytes && isIntegerObject(value) && static_cast<MWORD>(integerValueOf(value)) <= 0xFF)
+			{
+				static_cast<BYTE*>(entry->pElements)[offset] = static_cast<BYTE>(integerValueOf(value));
+				sp -= 2;
+				*sp = value;
+			}
+			else
+				SENDSPECIAL();
+			NEXT();
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Sends
+
+		BYTECODE(hShortSendWithNoArgs)
+			SEND(reinterpret_cast<SymbolOTE*>(LITERAL(op-ShortSendWithNoArgs)), 0);
+
+		BYTECODE(hShortSendSelfWithNoArgs)
+			PUSH(RECEIVER);
+			SEND(reinterpret_cast<SymbolOTE*>(LITERAL(op-ShortSendSelfWithNoArgs)), 0);
+
+		BYTECODE(hShortSendWith1Arg)
+			SEND(reinterpret_cast<SymbolOTE*>(LITERAL(op-ShortSendWith1Arg)), 1);
+
+		BYTECODE(hShortSendWith2Args)
+			SEND(reinterpret_cast<SymbolOTE*>(LITERAL(op-ShortSendWith2Args)), 2);
+
+		BYTECODE(hSend)
+		{
+			BYTE ext = *ip++;
+			SEND(reinterpret_cast<SymbolOTE*>(LITERAL(ext & SendXMaxLiteral)), ext >> SendXLiteralBits);
+		}
+
+		BYTECODE(hSupersend)
+		{
+			BYTE ext = *ip++;
+			SUPERSEND(reinterpret_cast<SymbolOTE*>(LITERAL(ext & SendXMaxLiteral)), ext >> SendXLiteralBits);
+		}
+
+		BYTECODE(hSendTempWithNoArgs)
+		{
+			BYTE ext = *ip++;
+			PUSH(bp[ext >> SendXLiteralBits]);
+			SEND(reinterpret_cast<SymbolOTE*>(LITERAL(ext & SendXMaxLiteral)), 0);
+		}
+
+		BYTECODE(hSendSelfWithNoArgs)
+			PUSH(RECEIVER);
+			SEND(reinterpret_cast<SymbolOTE*>(LITERAL(*ip++)), 0);
+
+		BYTECODE(hLongSend)
+		{
+			unsigned argCount = ip[0];
+			SymbolOTE* selector = reinterpret_cast<SymbolOTE*>(LITERAL(ip[1]));
+			ip += 2;
+			SEND(selector, argCount);
+		}
+
+		BYTECODE(hLongSupersend)
+		{
+			unsigned argCount = ip[0];
+			SymbolOTE* selector = reinterpret_cast<SymbolOTE*>(LITERAL(ip[1]));
+			ip += 2;
+			SUPERSEND(selector, argCount);
+		}
+
+		BYTECODE(hExLongSend)
+		{
+			unsigned argCount = ip[0];
+			SymbolOTE* selector = reinterpret_cast<SymbolOTE*>(LITERAL(*reinterpret_cast<WORD*>(ip+1)));
+			ip += 3;
+			SEND(selector, argCount);
+		}
+
+		BYTECODE(hExLongSupersend)
+		{
+			unsigned argCount = ip[0];
+			SymbolOTE* selector = reinterpret_cast<SymbolOTE*>(LITERAL(*reinterpret_cast<WORD*>(ip+1)));
+			ip += 3;
+			SUPERSEND(selector, argCount);
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Blocks
+
+		// The extension is followed by the offset of the first instruction after the block body.
+		// The block's initial IP is taken from the IP saved before the jump over the body.
+		BYTECODE(hBlockCopy)
+		{
+			DWORD ext = *reinterpret_cast<DWORD*>(ip);
+			int offset = *reinterpret_cast<SHORT*>(ip+sizeof(DWORD));
+			ip += sizeof(DWORD)+sizeof(SHORT);
+			SAVEREGISTERS();
+			BlockOTE* oteBlock = blockCopy(ext);
+			// Copied values are popped off the stack
+			sp = m_registers.m_stackPointer;
+			ip += offset;
+			PUSH(Oop(oteBlock));
+			SAVESP();
+			ObjectMemory::AddToZct(reinterpret_cast<OTE*>(oteBlock));
+			NEXT();
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Debugging
+
+		BYTECODE(hBreak)
+			SAVEREGISTERS();
+			m_bStepping = FALSE;
+			m_nInputPollCounter = 2;		// See ResetInputPollCounter
+			sendVMInterrupt(VMI_BREAKPOINT, m_registers.activeFrameOop());
+			LOADREGISTERS();
+			NEXT();
+
+		BYTECODE(hInvalid)
+			SAVEREGISTERS();
+			__debugbreak();
+			NEXT();
+
+		default:
+			// Every entry of s_byteCodeHandlers is a valid handler, so the jump table needs no range check
+			__assume(0);
+		}
+	}
+}
+
+#endif	// CPP_BYTECODELOOP
@@ -89,6 +89,8 @@ size_t ObjectMemory::compact()
 	reclaimInaccessibleObjects(GCNormal);
 
 	Interpreter::freePools();
+	// Drop cache entries for free OTEs before they can be reused by the compaction
+	Interpreter::purgeFreeFromCaches();
 
 	// Walk the OT from the bottom to locate free entries, and from the top to locate candidates to move
 	// 
@@ -155,6 +157,7 @@ size_t ObjectMemory::compact()
 	// We must inform the interpreter that it needs to update any cached Oops from the forward pointers
 	// before we rebuild the free list (which will destroy those pointers to the new OTEs)
 	Interpreter::OnCompact();
+	CompactBorrowedViews();
 
 	// The last used slot will be the slot before the first entry in the free list
 	// Using this, round up from the last used slot to the to commit granularity, then uncommit any later slots
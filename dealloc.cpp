@@ -106,8 +106,10 @@ void ObjectMemory::deallocate(OTE* ote)
 			break;
 
 		case OTEFlags::HeapSpace:
-			//_asm int 3;
-			HARDASSERT(FALSE);
+			// Either a borrowed view, the body of which belongs to its owner, or demand loaded from the
+			// image, the space for which is not reclaimed until the VM terminates
+			releaseBorrowedView(ote);
+			releasePointer(ote);
 			break;
 		
 		case OTEFlags::FloatSpace:
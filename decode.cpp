@@ -1653,9 +1653,107 @@ void DumpMethod(OTE* oteMethod)
 
 extern "C" unsigned byteCodeCounters[];
 extern "C" unsigned byteCodePairs[];
+extern "C" unsigned byteCodesFused;
+
+// The most frequently executed instruction pairs are the candidates for superinstructions
+static void DumpHottestBytecodePairs()
+{
+	const int NumHottestPairs = 20;
+	unsigned hottest[NumHottestPairs];
+	int nHottest = 0;
+	for (unsigned pair=0;pair<256*256;pair++)
+	{
+		if (byteCodePairs[pair] == 0)
+			continue;
+		// Insertion sort into the small table of the hottest pairs seen so far
+		int i = nHottest < NumHottestPairs ? nHottest++ : NumHottestPairs;
+		while (i > 0 && byteCodePairs[hottest[i-1]] < byteCodePairs[pair])
+		{
+			if (i < NumHottestPairs)
+				hottest[i] = hottest[i-1];
+			i--;
+		}
+		if (i < NumHottestPairs)
+			hottest[i] = pair;
+	}
+
+	unsigned __int64 nDispatched = 0;
+	for (int i=0;i<256;i++)
+		nDispatched += byteCodeCounters[i];
+
+	TRACESTREAM << endl << "Hottest bytecode pairs" << endl << "-----------------------------" << endl;
+	for (int i=0;i<nHottest;i++)
+	{
+		unsigned count = byteCodePairs[hottest[i]];
+		TRACESTREAM << dec << (hottest[i] >> 8) << ", " << (hottest[i] & 0xFF) << ": " << count
+			<< " (" << (nDispatched ? count * 100.0 / nDispatched : 0.0) << "%)" << endl;
+	}
+	// The dispatches saved by the compare and branch superinstructions are not included in the counts above
+	TRACESTREAM << dec << byteCodesFused << " of " << (nDispatched + byteCodesFused) << " dispatches saved by superinstructions" << endl;
+	TRACESTREAM << "-----------------------------" << endl << endl;
+}
+
+#ifdef CPP_BYTECODELOOP
+// The sequences of three or four instructions that would save the most dispatches if each were
+// fused into a single superinstruction, i.e. those with the greatest count * (length-1). The
+// estimates overlap (a hot 4-gram contains two 3-grams), so they cannot simply be summed.
+// Jumps already fused into a compare and branch are not dispatched, so do not appear.
+static void DumpHottestBytecodeSequences(bool bClear)
+{
+	const int NumHottestSequences = 20;
+	const ByteCodeSequence* hottest[NumHottestSequences];
+	int nHottest = 0;
+	for (unsigned n=0;n<ByteCodeSequenceTableSize;n++)
+	{
+		const ByteCodeSequence* sequence = &byteCodeSequences[n];
+		if (sequence->m_count == 0)
+			continue;
+		const unsigned __int64 saving = unsigned __int64(sequence->m_count) * (sequence->m_length - 1);
+		// Insertion sort into the small table of the hottest sequences seen so far
+		int i = nHottest < NumHottestSequences ? nHottest++ : NumHottestSequences;
+		while (i > 0 && unsigned __int64(hottest[i-1]->m_count) * (hottest[i-1]->m_length - 1) < saving)
+		{
+			if (i < NumHottestSequences)
+				hottest[i] = hottest[i-1];
+			i--;
+		}
+		if (i < NumHottestSequences)
+			hottest[i] = sequence;
+	}
+
+	unsigned __int64 nDispatched = 0;
+	for (int i=0;i<256;i++)
+		nDispatched += byteCodeCounters[i];
+
+	TRACESTREAM << endl << "Hottest bytecode sequences" << endl << "-----------------------------" << endl;
+	for (int i=0;i<nHottest;i++)
+	{
+		const ByteCodeSequence& sequence = *hottest[i];
+		for (int j=sequence.m_length-1;j>=0;j--)
+			TRACESTREAM << dec << ((sequence.m_opcodes >> (j*8)) & 0xFF) << (j ? ", " : ": ");
+		const unsigned __int64 saving = unsigned __int64(sequence.m_count) * (sequence.m_length - 1);
+		TRACESTREAM << sequence.m_count << ", fusing would save " << saving << " dispatches ("
+			<< (nDispatched ? saving * 100.0 / nDispatched : 0.0) << "%)" << endl;
+	}
+	if (byteCodeSequencesDropped != 0)
+		TRACESTREAM << dec << byteCodeSequencesDropped << " sequences not counted as the table was full" << endl;
+	TRACESTREAM << "-----------------------------" << endl << endl;
+
+	if (bClear)
+	{
+		memset(byteCodeSequences, 0, sizeof(byteCodeSequences));
+		byteCodeSequencesDropped = 0;
+	}
+}
+#endif
 
 void DumpBytecodeCounts(bool bClear)
 {
+	DumpHottestBytecodePairs();
+#ifdef CPP_BYTECODELOOP
+	DumpHottestBytecodeSequences(bClear);
+#endif
+	if (bClear) byteCodesFused = 0;
 
 	TRACESTREAM << endl << "Bytecode invocation counts" << endl << "-----------------------------" << endl;
 	for (int i=0;i<256;i++)
@@ -1676,7 +1774,6 @@ void DumpBytecodeCounts(bool bClear)
 		TRACESTREAM << endl;
 	}
 	TRACESTREAM << "-----------------------------" << endl << endl;
-
 }
 
 extern "C" unsigned primitiveCounters[];
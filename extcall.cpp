@@ -188,6 +188,296 @@ BytesOTE* __fastcall NewGUID(GUID* rguid)
 	return oteGUID;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Callback argument marshaling. Each argument type has a routine to push an object for
+// an argument of that type from the parameters of the callback, which answers the
+// number of bytes of parameters consumed. The routines are dispatched through a table
+// indexed by the type code, similar to pushOopTable in ExternalCall.asm. The 32-bit
+// integer and boolean types are pushed inline by pushArgsAt() as long as only they occur.
+
+typedef unsigned (__fastcall *CallbackArgPusher)(BYTE* lpParm, const ExternalDescriptor* descriptor, BYTE literal);
+
+struct CallbackArgMarshaler
+{
+	CallbackArgPusher	m_pfnPush;
+	bool				m_bHasLiteral;		// The next descriptor byte is the index of a literal (e.g. a struct class)
+};
+
+static unsigned __fastcall pushInvalidArg(BYTE*, const ExternalDescriptor*, BYTE)
+{
+	// Not a valid argument, e.g. VOID
+	HARDASSERT(FALSE);
+	Interpreter::pushNil();
+	return sizeof(MWORD);
+}
+
+static unsigned __fastcall pushUnknownArg(BYTE*, const ExternalDescriptor*, BYTE)
+{
+	ASSERT(false);
+	return 0;
+}
+
+static unsigned __fastcall pushLPVOIDArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushNewObject(ExternalAddress::New(*(BYTE**)lpParm));
+	return sizeof(BYTE*);
+}
+
+static unsigned __fastcall pushCHARArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushObject(Character::New(char(*lpParm)));
+	return sizeof(MWORD);
+}
+
+static unsigned __fastcall pushBYTEArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushSmallInteger(*lpParm);
+	return sizeof(MWORD);
+}
+
+static unsigned __fastcall pushSBYTEArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushSmallInteger(*reinterpret_cast<char*>(lpParm));
+	return sizeof(MWORD);
+}
+
+static unsigned __fastcall pushWORDArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushSmallInteger(*reinterpret_cast<WORD*>(lpParm));
+	return sizeof(MWORD);
+}
+
+static unsigned __fastcall pushSWORDArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushSmallInteger(*reinterpret_cast<SWORD*>(lpParm));
+	return sizeof(MWORD);
+}
+
+static unsigned __fastcall pushDWORDArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushUnsigned32(*reinterpret_cast<DWORD*>(lpParm));
+	return sizeof(DWORD);
+}
+
+static unsigned __fastcall pushSDWORDArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushSigned32(*reinterpret_cast<SDWORD*>(lpParm));
+	return sizeof(SDWORD);
+}
+
+static unsigned __fastcall pushBOOLArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushBool(*reinterpret_cast<BOOL*>(lpParm));
+	return sizeof(MWORD);
+}
+
+static unsigned __fastcall pushHANDLEArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushHandle(*reinterpret_cast<HANDLE*>(lpParm));
+	return sizeof(HANDLE);
+}
+
+static unsigned __fastcall pushDOUBLEArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::push(*reinterpret_cast<double*>(lpParm));
+	// Yup, even doubles passed on main stack
+	return sizeof(DOUBLE);
+}
+
+static unsigned __fastcall pushLPSTRArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::push(*reinterpret_cast<LPCSTR*>(lpParm));
+	return sizeof(LPCSTR);
+}
+
+static unsigned __fastcall pushOOPArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::push(*reinterpret_cast<Oop*>(lpParm));
+	return sizeof(Oop);
+}
+
+static unsigned __fastcall pushFLOATArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::push(static_cast<double>(*reinterpret_cast<float*>(lpParm)));
+	return sizeof(FLOAT);
+}
+
+static unsigned __fastcall pushLPPVOIDArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	// Push an LPVOID* instance onto the stack
+	Interpreter::pushNewObject(ExternalStructure::NewPointer(Pointers.ClassLPVOID, *(BYTE**)lpParm));
+	return sizeof(BYTE*);
+}
+
+static unsigned __fastcall pushHRESULTArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushSigned32(*reinterpret_cast<SDWORD*>(lpParm));
+	return sizeof(HRESULT);
+}
+
+static unsigned __fastcall pushLPWSTRArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::push(*reinterpret_cast<LPWSTR*>(lpParm));
+	return sizeof(LPWSTR);
+}
+
+static unsigned __fastcall pushQWORDArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::push(Integer::NewUnsigned64(*reinterpret_cast<ULONGLONG*>(lpParm)));
+	return sizeof(ULARGE_INTEGER);
+}
+
+static unsigned __fastcall pushSQWORDArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::push(Integer::NewSigned64(*reinterpret_cast<LONGLONG*>(lpParm)));
+	return sizeof(LONGLONG);
+}
+
+static unsigned __fastcall pushOTEArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::push(*reinterpret_cast<Oop*>(lpParm));
+	return sizeof(POTE);
+}
+
+static unsigned __fastcall pushBSTRArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::push(*reinterpret_cast<LPWSTR*>(lpParm));
+	return sizeof(BSTR);
+}
+
+static unsigned __fastcall pushVARIANTArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushNewObject(ExternalStructure::New(Pointers.ClassVARIANT, lpParm));
+	return sizeof(VARIANT);
+}
+
+static unsigned __fastcall pushDATEArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushNewObject(ExternalStructure::New(Pointers.ClassDATE, lpParm));
+	return sizeof(DATE);
+}
+
+static unsigned __fastcall pushVARBOOLArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushBool(*reinterpret_cast<VARIANT_BOOL*>(lpParm));
+	return sizeof(MWORD);				// Note passes as 32-bit
+}
+
+static unsigned __fastcall pushGUIDArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushNewObject(NewGUID(reinterpret_cast<GUID*>(lpParm)));
+	return sizeof(GUID);
+}
+
+static unsigned __fastcall pushUINTPTRArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushUIntPtr(*reinterpret_cast<UINT_PTR*>(lpParm));
+	return sizeof(UINT_PTR);
+}
+
+static unsigned __fastcall pushINTPTRArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushIntPtr(*reinterpret_cast<INT_PTR*>(lpParm));
+	return sizeof(INT_PTR);
+}
+
+static unsigned __fastcall pushSTRUCTArg(BYTE* lpParm, const ExternalDescriptor* descriptor, BYTE literal)
+{
+	BehaviorOTE* behaviorPointer = reinterpret_cast<BehaviorOTE*>(descriptor->m_literals[literal]);
+	Interpreter::pushNewObject(ExternalStructure::New(behaviorPointer, lpParm));
+	return behaviorPointer->m_location->extraSpec();
+}
+
+static unsigned __fastcall pushSTRUCT4Arg(BYTE* lpParm, const ExternalDescriptor* descriptor, BYTE literal)
+{
+	BehaviorOTE* behaviorPointer = reinterpret_cast<BehaviorOTE*>(descriptor->m_literals[literal]);
+	Interpreter::pushNewObject(ExternalStructure::New(behaviorPointer, lpParm));
+	return 4;
+}
+
+static unsigned __fastcall pushSTRUCT8Arg(BYTE* lpParm, const ExternalDescriptor* descriptor, BYTE literal)
+{
+	BehaviorOTE* behaviorPointer = reinterpret_cast<BehaviorOTE*>(descriptor->m_literals[literal]);
+	Interpreter::pushNewObject(ExternalStructure::New(behaviorPointer, lpParm));
+	return 8;
+}
+
+static unsigned __fastcall pushLPArg(BYTE* lpParm, const ExternalDescriptor* descriptor, BYTE literal)
+{
+	BehaviorOTE* behaviorPointer = reinterpret_cast<BehaviorOTE*>(descriptor->m_literals[literal]);
+	Interpreter::pushNewObject(ExternalStructure::NewPointer(behaviorPointer, *(BYTE**)lpParm));
+	return sizeof(BYTE*);
+}
+
+static unsigned __fastcall pushLPPArg(BYTE* lpParm, const ExternalDescriptor*, BYTE)
+{
+	Interpreter::pushNewObject(ExternalStructure::NewPointer(Pointers.ClassLPVOID, *(BYTE**)lpParm));
+	return sizeof(BYTE*);
+}
+
+static unsigned __fastcall pushCOMPTRArg(BYTE* lpParm, const ExternalDescriptor* descriptor, BYTE literal)
+{
+	IUnknown* punk = *(IUnknown**)lpParm;
+	BehaviorOTE* behaviorPointer = reinterpret_cast<BehaviorOTE*>(descriptor->m_literals[literal]);
+	StructureOTE* oteUnknown = ExternalStructure::NewRefStruct(behaviorPointer, punk);
+	if (punk != NULL)
+	{
+		punk->AddRef();
+		oteUnknown->beFinalizable();
+	}
+	Interpreter::pushNewObject(oteUnknown);
+	return sizeof(IUnknown*);
+}
+
+#define UNKNOWNARG	{ pushUnknownArg, false }
+
+static const CallbackArgMarshaler callbackArgMarshalers[ExtCallArgMax+1] =
+{
+	{ pushInvalidArg, false },			// 0	VOID
+	{ pushLPVOIDArg, false },			// 1
+	{ pushCHARArg, false },				// 2
+	{ pushBYTEArg, false },				// 3
+	{ pushSBYTEArg, false },			// 4
+	{ pushWORDArg, false },				// 5
+	{ pushSWORDArg, false },			// 6
+	{ pushDWORDArg, false },			// 7
+	{ pushSDWORDArg, false },			// 8
+	{ pushBOOLArg, false },				// 9
+	{ pushHANDLEArg, false },			// 10
+	{ pushDOUBLEArg, false },			// 11
+	{ pushLPSTRArg, false },			// 12
+	{ pushOOPArg, false },				// 13
+	{ pushFLOATArg, false },			// 14
+	{ pushLPPVOIDArg, false },			// 15
+	{ pushHRESULTArg, false },			// 16
+	{ pushLPWSTRArg, false },			// 17
+	{ pushQWORDArg, false },			// 18
+	{ pushSQWORDArg, false },			// 19
+	{ pushOTEArg, false },				// 20
+	{ pushBSTRArg, false },				// 21
+	{ pushVARIANTArg, false },			// 22
+	{ pushDATEArg, false },				// 23
+	{ pushVARBOOLArg, false },			// 24
+	{ pushGUIDArg, false },				// 25
+	{ pushUINTPTRArg, false },			// 26
+	{ pushINTPTRArg, false },			// 27
+	UNKNOWNARG, UNKNOWNARG,				// 28..29
+	UNKNOWNARG, UNKNOWNARG, UNKNOWNARG, UNKNOWNARG, UNKNOWNARG,		// 30..34
+	UNKNOWNARG, UNKNOWNARG, UNKNOWNARG, UNKNOWNARG, UNKNOWNARG,		// 35..39
+	UNKNOWNARG, UNKNOWNARG, UNKNOWNARG, UNKNOWNARG, UNKNOWNARG,		// 40..44
+	UNKNOWNARG, UNKNOWNARG, UNKNOWNARG, UNKNOWNARG, UNKNOWNARG,		// 45..49
+	{ pushSTRUCTArg, true },			// 50
+	{ pushSTRUCT4Arg, true },			// 51
+	{ pushSTRUCT8Arg, true },			// 52
+	{ pushLPArg, true },				// 53
+	{ pushLPPArg, true },				// 54	Literal is ignored
+	{ pushCOMPTRArg, true },			// 55
+	UNKNOWNARG, UNKNOWNARG, UNKNOWNARG, UNKNOWNARG,					// 56..59
+	UNKNOWNARG, UNKNOWNARG, UNKNOWNARG, UNKNOWNARG					// 60..63
+};
+
+#undef UNKNOWNARG
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 unsigned Interpreter::pushArgsAt(const ExternalDescriptor* descriptor, BYTE* lpParms)
@@ -196,217 +486,45 @@ unsigned Interpreter::pushArgsAt(const ExternalDescriptor* descriptor, BYTE* lpP
 	const DescriptorBytes* types = oteTypes->m_location;
 	const unsigned argsLen = types->argsLen(oteTypes);
 	unsigned i=0;
-	while (i<argsLen)
+
+	// Integer and boolean arguments, of which common signatures such as those of comparators and
+	// enumeration callbacks consist entirely, are pushed inline while they last
+	for (;i<argsLen;i++)
 	{
-		BYTE arg = types->m_args[i++];
-		// Similar to primitiveDLL32Call return values, but VOID is not supported as a parameter type
-		switch(ExtCallArgTypes(arg))
+		const DWORD value = *reinterpret_cast<DWORD*>(lpParms);
+		switch (types->m_args[i])
 		{
-			case ExtCallArgVOID:					// Not a valid argument
-				HARDASSERT(FALSE);
-				pushNil();
-				lpParms += sizeof(MWORD);
-				break;
-
-			case ExtCallArgLPVOID:
-				pushNewObject(ExternalAddress::New(*(BYTE**)lpParms));
-				lpParms += sizeof(BYTE*);
-				break;
-
-			case ExtCallArgCHAR:
-				pushObject(Character::New(char(*lpParms)));
-				lpParms += sizeof(MWORD);
-				break;
-
-			case ExtCallArgBYTE:
-				pushSmallInteger(*lpParms);
-				lpParms += sizeof(MWORD);
-				break;
-
-			case ExtCallArgSBYTE:
-				pushSmallInteger(*reinterpret_cast<char*>(lpParms));
-				lpParms += sizeof(MWORD);
-				break;
-			
-			case ExtCallArgWORD:
-				pushSmallInteger(*reinterpret_cast<WORD*>(lpParms));
-				lpParms += sizeof(MWORD);
-				break;
-
-			case ExtCallArgSWORD:
-				pushSmallInteger(*reinterpret_cast<SWORD*>(lpParms));
-				lpParms += sizeof(MWORD);
-				break;
-
-			case ExtCallArgDWORD:
-				pushUnsigned32(*reinterpret_cast<DWORD*>(lpParms));
-				lpParms += sizeof(DWORD);
-				break;
-
-			case ExtCallArgSDWORD:
-				pushSigned32(*reinterpret_cast<SDWORD*>(lpParms));
-				lpParms += sizeof(SDWORD);
-				break;
-
-			case ExtCallArgBOOL:
-				pushBool(*reinterpret_cast<BOOL*>(lpParms));
-				lpParms += sizeof(MWORD);
-				break;
-
-			case ExtCallArgHANDLE:
-				pushHandle(*reinterpret_cast<HANDLE*>(lpParms));
-				lpParms += sizeof(HANDLE);
-				break;
-
-			case ExtCallArgDOUBLE:
-				push(*reinterpret_cast<double*>(lpParms));
-				// Yup, even doubles passed on main stack
-				lpParms += sizeof(DOUBLE);
-				break;
-
-			case ExtCallArgLPSTR:
-				push(*reinterpret_cast<LPCSTR*>(lpParms));
-				lpParms += sizeof(LPCSTR);
-				break;
-
-			case ExtCallArgOOP:
-				push(*reinterpret_cast<Oop*>(lpParms));
-				lpParms += sizeof(Oop);
-				break;
-
-			case ExtCallArgFLOAT:
-				push(static_cast<double>(*reinterpret_cast<float*>(lpParms)));
-				// Yup, even doubles passed on main stack
-				lpParms += sizeof(FLOAT);
-				break;
-
-			case ExtCallArgLPPVOID:
-				// Push an LPVOID* instance onto the stack
-				pushNewObject(ExternalStructure::NewPointer(Pointers.ClassLPVOID, *(BYTE**)lpParms));
-				lpParms += sizeof(BYTE*);
-				break;
-
-			case ExtCallArgHRESULT:
-				pushSigned32(*reinterpret_cast<SDWORD*>(lpParms));
-				lpParms += sizeof(HRESULT);
-				break;
-
-			case ExtCallArgLPWSTR:
-				push(*reinterpret_cast<LPWSTR*>(lpParms));
-				lpParms += sizeof(LPWSTR);
-				break;
-				
-			case ExtCallArgQWORD:
-				push(Integer::NewUnsigned64(*reinterpret_cast<ULONGLONG*>(lpParms)));
-				lpParms += sizeof(ULARGE_INTEGER);
-				break;
-				
-			case ExtCallArgSQWORD:
-				push(Integer::NewSigned64(*reinterpret_cast<LONGLONG*>(lpParms)));
-				lpParms += sizeof(LONGLONG);
-				break;
-			
-			case ExtCallArgOTE:
-				push(*reinterpret_cast<Oop*>(lpParms));
-				lpParms += sizeof(POTE);
-				break;
-
-			case ExtCallArgBSTR:
-				push(*reinterpret_cast<LPWSTR*>(lpParms));
-				lpParms += sizeof(BSTR);
-				break;
-				
-			case ExtCallArgVARIANT:
-				pushNewObject(ExternalStructure::New(Pointers.ClassVARIANT, lpParms));
-				lpParms += sizeof(VARIANT);
-				break;
-
-			case ExtCallArgDATE:
-				pushNewObject(ExternalStructure::New(Pointers.ClassDATE, lpParms));
-				lpParms += sizeof(DATE);
-				break;
-
-			case ExtCallArgVARBOOL:
-				pushBool(*reinterpret_cast<VARIANT_BOOL*>(lpParms));
-				lpParms += sizeof(MWORD);				// Note passes as 32-bit
-				break;
-
-			case ExtCallArgGUID:
-				pushNewObject(NewGUID(reinterpret_cast<GUID*>(lpParms)));
-				lpParms += sizeof(GUID);
-				break;
-
-			case ExtCallArgUINTPTR:
-				pushUIntPtr(*reinterpret_cast<UINT_PTR*>(lpParms));
-				lpParms += sizeof(UINT_PTR);
-				break;
-
-			case ExtCallArgINTPTR:
-				pushIntPtr(*reinterpret_cast<INT_PTR*>(lpParms));
-				lpParms += sizeof(INT_PTR);
-				break;
-
-			case ExtCallArgSTRUCT:
-				{
-					arg = types->m_args[i++];
-					BehaviorOTE* behaviorPointer = reinterpret_cast<BehaviorOTE*>(descriptor->m_literals[arg]);
-					pushNewObject(ExternalStructure::New(behaviorPointer, lpParms));
-					lpParms += behaviorPointer->m_location->extraSpec();
-				}
-				break;
-
-			case ExtCallArgSTRUCT4:
-				{
-					arg = types->m_args[i++];
-					BehaviorOTE* behaviorPointer = reinterpret_cast<BehaviorOTE*>(descriptor->m_literals[arg]);
-					pushNewObject(ExternalStructure::New(behaviorPointer, lpParms));
-					lpParms += 4;
-				}
-				break;
-
-			case ExtCallArgSTRUCT8:
-				{
-					arg = types->m_args[i++];
-					BehaviorOTE* behaviorPointer = reinterpret_cast<BehaviorOTE*>(descriptor->m_literals[arg]);
-					pushNewObject(ExternalStructure::New(behaviorPointer, lpParms));
-					lpParms += 8;
-				}
-				break;
-
-			case ExtCallArgLP:
-				{
-					arg = types->m_args[i++];
-					BehaviorOTE* behaviorPointer = reinterpret_cast<BehaviorOTE*>(descriptor->m_literals[arg]);
-					pushNewObject(ExternalStructure::NewPointer(behaviorPointer, *(BYTE**)lpParms));
-					lpParms += sizeof(BYTE*);
-				}
-				break;
-
-			case ExtCallArgLPP:							// Not a valid argument
-				arg = types->m_args[i++];
-				pushNewObject(ExternalStructure::NewPointer(Pointers.ClassLPVOID, *(BYTE**)lpParms));
-				lpParms += sizeof(BYTE*);
-				break;
-
-			case ExtCallArgCOMPTR:
-				{
-					arg = types->m_args[i++];
-					IUnknown* punk = *(IUnknown**)lpParms;
-					BehaviorOTE* behaviorPointer = reinterpret_cast<BehaviorOTE*>(descriptor->m_literals[arg]);
-					StructureOTE* oteUnknown = ExternalStructure::NewRefStruct(behaviorPointer, punk);
-					if (punk != NULL)
-					{
-						punk->AddRef();
-						oteUnknown->beFinalizable();
-					}
-					pushNewObject(oteUnknown);
-					lpParms += sizeof(IUnknown*);
-				}
-				break;
-
-			default:
-				ASSERT(false);
+		case ExtCallArgDWORD:
+		case ExtCallArgUINTPTR:
+			pushUnsigned32(value);
+			break;
+
+		case ExtCallArgSDWORD:
+		case ExtCallArgINTPTR:
+		case ExtCallArgHRESULT:
+			pushSigned32(value);
+			break;
+
+		case ExtCallArgBOOL:
+			pushBool(value);
+			break;
+
+		default:
+			goto marshalRemainder;
 		}
+		lpParms += sizeof(DWORD);
+	}
+	return types->m_argumentCount;
+
+marshalRemainder:
+	while (i<argsLen)
+	{
+		// Codes beyond the table are unknown, as is the last entry
+		const CallbackArgMarshaler& marshaler = callbackArgMarshalers[min(types->m_args[i++], ExtCallArgMax)];
+		BYTE literal = 0;
+		if (marshaler.m_bHasLiteral)
+			literal = types->m_args[i++];
+		lpParms += marshaler.m_pfnPush(lpParms, descriptor, literal);
 	}
 	return types->m_argumentCount;
 }
@@ -478,6 +478,8 @@ void Interpreter::MarkRoots()
 		i++;
 	}
 
+	MarkTimerWheel();
+	MarkAsyncIo();
 	OverlappedCall::MarkRoots();
 }
 
@@ -504,7 +506,10 @@ void Interpreter::OnCompact()
 	ObjectMemory::compactOop(m_registers.m_oteActiveProcess);
 	ASSERT(ObjectMemory::isKindOf(m_registers.m_oteActiveProcess, Pointers.ClassProcess));
 
-	flushCaches();
+	// Update the cached Oops, rather than discarding the entries
+	compactCaches();
+	CompactTimerWheel();
+	CompactAsyncIo();
 
 	OverlappedCall::OnCompact();
 	//compiler->onCompact();
@@ -709,7 +714,7 @@ DWORD __stdcall Interpreter::GenericCallback(SMALLINTEGER id, BYTE* lpArgs)
 	DWORD dwResult;
 	// We must perform this all inside our standard SEH catcher to handle the stack/OT overflows etc 
 	// As we have entered from an external function
-	if (GetCurrentThreadId() != MainThreadId())
+	if (Isolate::Current() != m_pIsolate)
 	{
 		dwResult = SendMessage(m_hWndVM, WM_USER+1, id, (LONG)lpArgs);
 	}
@@ -79,16 +79,28 @@ POTE* Interpreter::m_roots[] = {
 	0
 };
 
+// The method cache is initially of the minimum size, and is reallocated on startup once the size of 
+// the image is known
 __declspec(align(16))
-Interpreter::MethodCacheEntry Interpreter::methodCache[MethodCacheSize];
+static Interpreter::MethodCacheEntry s_defaultMethodCache[Interpreter::MinMethodCacheSize];
+Interpreter::MethodCacheEntry* Interpreter::methodCache = s_defaultMethodCache;
+unsigned Interpreter::methodCacheSize = MinMethodCacheSize;
+DWORD Interpreter::methodCacheMask = (MinMethodCacheSize/MethodCacheWays - 1) * sizeof(OTE);
+unsigned __int64 Interpreter::m_nMethodCacheHits;
+unsigned __int64 Interpreter::m_nMethodCacheMisses;
+unsigned __int64 Interpreter::m_nMethodCacheEvictions;
 
 __declspec(align(16))
 Interpreter::AtCacheEntry Interpreter::AtCache[AtCacheEntries];
 __declspec(align(16))
 Interpreter::AtCacheEntry Interpreter::AtPutCache[AtCacheEntries];
 
-DWORD Interpreter::m_dwThreadId;
-HANDLE Interpreter::m_hThread;
+Interpreter::SendSiteCache Interpreter::sendSiteCache[SendSiteCacheSize];
+DWORD Interpreter::m_nSendSiteHits;
+DWORD Interpreter::m_nSendSiteMisses;
+DWORD Interpreter::m_nMegamorphicMisses;
+
+Isolate* Interpreter::m_pIsolate;
 
 BOOL Interpreter::m_bStepping;
 
@@ -107,13 +119,27 @@ HWND Interpreter::m_hWndVM;
 	#pragma auto_inline(off)
 #endif
 
+#pragma code_seg(INIT_SEG)
+// The VM is not shut down if it fails to start, so the isolate must be destroyed here. Otherwise it
+// would remain registered as running, and any later attempt to start the VM in the process would fail.
+static HRESULT AbandonIsolate(Isolate*& pIsolate, HRESULT hr)
+{
+	pIsolate->Destroy();
+	pIsolate = NULL;
+	return hr;
+}
+
 #pragma code_seg(INIT_SEG)
 HRESULT Interpreter::initialize(const char* szFileName, LPVOID imageData, UINT imageSize, bool isDevSys)
 {
-	HRESULT hr = initializeBeforeLoad();
+	HRESULT hr = Isolate::Create(szFileName, m_pIsolate);
 	if (FAILED(hr))
 		return hr;
 
+	hr = initializeBeforeLoad();
+	if (FAILED(hr))
+		return AbandonIsolate(m_pIsolate, hr);
+
 	// Load in the basic image. We do this here to avoid allocating memory
 	// in the static constructor of the ObjectMemory class.
 	//
@@ -123,14 +149,20 @@ HRESULT Interpreter::initialize(const char* szFileName, LPVOID imageData, UINT i
 #endif
 	hr = ObjectMemory::LoadImage(szFileName, imageData, imageSize, isDevSys);
 	if (FAILED(hr))
-		return hr;
+		return AbandonIsolate(m_pIsolate, hr);
 #ifdef OAD
 	DWORD timeEnd = timeGetTime();
 	TRACESTREAM << "Time to load image: " << (timeEnd - timeStart) << " mS" << endl;
 #endif
 
 	ObjectMemory::HeapCompact();
-	return initializeAfterLoad();
+	hr = initializeAfterLoad();
+	if (FAILED(hr))
+		return AbandonIsolate(m_pIsolate, hr);
+
+	// Avoid the cold start cost of method lookups for the sends recorded in the last run, if profiled
+	WarmMethodCache(szFileName);
+	return S_OK;
 }
 
 #pragma code_seg(INIT_SEG)
@@ -140,9 +172,6 @@ HRESULT Interpreter::initializeBeforeLoad()
 	m_nOTOverflows = 0;
 
 	InitializeCriticalSection(&m_csAsyncProtect);
-	m_dwThreadId = ::GetCurrentThreadId();
-	HANDLE hProc = GetCurrentProcess();
-	VERIFY(::DuplicateHandle(hProc, GetCurrentThread(), hProc, &m_hThread, 0, FALSE, DUPLICATE_SAME_ACCESS));
 
 	WNDCLASS wndClass;
 	wndClass.style = 0;
@@ -183,6 +212,7 @@ HRESULT Interpreter::initializeAfterLoad()
 	HRESULT hr = initializeTimer();
 	if (FAILED(hr))
 		return hr;
+	initializeAsyncIo();
 
 	m_oteNewProcess = reinterpret_cast<ProcessOTE*>(Pointers.Nil);
     m_oteUnderConstruction = Pointers.Nil;
@@ -238,7 +268,7 @@ void Interpreter::ShutDown()
 	_ASSERTE(!m_bShutDown);
 	m_bShutDown = true;
 	// Nulling out the handle means that any further attempts to queue APCs, etc, will fail
-	HANDLE hThread = LPVOID(::OAInterlockedExchange(LPLONG(&m_hThread), 0));
+	HANDLE hThread = m_pIsolate->ReleaseThreadHandle();
 
 #ifndef _AFX
 	TerminateSampler();
@@ -258,6 +288,7 @@ void Interpreter::ShutDown()
 	}
 	
 	terminateTimer();
+	terminateAsyncIo();
 	#ifndef _AFX
 		OverlappedCall::Uninitialize();
 	#endif
@@ -266,23 +297,68 @@ void Interpreter::ShutDown()
 	::DeleteCriticalSection(&m_csAsyncProtect);
 
 	ObjectMemory::Terminate();
+
+	m_pIsolate->Destroy();
+	m_pIsolate = NULL;
 }
 
 #pragma code_seg(INIT_SEG)
 inline void Interpreter::initializeCaches()
 {
-	// If either of these two assertions fails, update the method cache size
-	// in ISTASM.INC (METHODCACHEDWORDS), change the constants, and rebuild
-	// You may also need to change
+	// If either of these two assertions fails, the method cache hash (cacheHash in bytecde.cpp,
+	// and execMethodOfClass in byteasm.asm) will need to be changed, and the VM rebuilt
 	ASSERT(sizeof(OTE) == 16);
 	ASSERT(sizeof(MethodCacheEntry) == sizeof(OTE));
-	ASSERT(MethodCacheSize == 1024);
+	ASSERT(MethodCacheWays == 2);
 
 	ASSERT(sizeof(AtCacheEntry) == sizeof(OTE));
 
+	// The method cache size may be set in the registry, but otherwise is chosen to suit the 
+	// number of methods in the image. Only a fraction of those are in use at any one time.
+	DWORD dwSize = 0;
+	CRegKey rkMethodCache;
+	if (OpenDolphinKey(rkMethodCache, "MethodCache", KEY_READ) == ERROR_SUCCESS)
+		rkMethodCache.QueryDWORDValue("Size", dwSize);
+	if (dwSize == 0)
+	{
+		const OTE* pOT = ObjectMemory::m_pOT;
+		const unsigned otSize = ObjectMemory::GetOTSize();
+		for (unsigned i=0;i<otSize;i++)
+		{
+			if (!pOT[i].isFree() && pOT[i].m_oteClass == Pointers.ClassCompiledMethod)
+				dwSize++;
+		}
+		dwSize /= 8;
+	}
+
+	unsigned nEntries = MinMethodCacheSize;
+	while (nEntries < dwSize && nEntries < MaxMethodCacheSize)
+		nEntries <<= 1;
+	allocateMethodCache(nEntries);
+
 	flushCaches();
 }
 
+// Replace the method cache with one of the specified number of entries, which must be a power of 2.
+// The existing cache is retained if the memory cannot be allocated.
+void Interpreter::allocateMethodCache(unsigned nEntries)
+{
+	ASSERT(nEntries >= MinMethodCacheSize && nEntries <= MaxMethodCacheSize && (nEntries & (nEntries-1)) == 0);
+	if (nEntries == methodCacheSize)
+		return;
+
+	MethodCacheEntry* pCache = static_cast<MethodCacheEntry*>(::VirtualAlloc(NULL, nEntries*sizeof(MethodCacheEntry), MEM_COMMIT, PAGE_READWRITE));
+	if (pCache == NULL)
+		return;
+
+	if (methodCache != s_defaultMethodCache)
+		::VirtualFree(methodCache, 0, MEM_RELEASE);
+	methodCache = pCache;
+	methodCacheSize = nEntries;
+	methodCacheMask = (nEntries/MethodCacheWays - 1) * sizeof(OTE);
+	m_nMethodCacheHits = m_nMethodCacheMisses = m_nMethodCacheEvictions = 0;
+}
+
 #ifdef _AFX
 	// Clear down any contexts back to the one which returns to Nil
 	// While we have C callback mechanism, its easier to just remove
@@ -390,7 +466,11 @@ void Interpreter::interpret()
 		DWORD dwCode;
 		__try 
 		{ 
+#ifdef CPP_BYTECODELOOP
+			interpretByteCodes();
+#else
 			_asm jmp byteCodeLoop
+#endif
 		}
 		// I'd like to just test for IS_ERROR() here, but due to some macro nastiness
 		// it GPFs in a release build
@@ -424,6 +504,11 @@ void Interpreter::interpret()
 #pragma code_seg(INTERPMISC_SEG)
 void Interpreter::saveContextAfterFault(LPEXCEPTION_POINTERS info)
 {
+#ifdef CPP_BYTECODELOOP
+	// The C++ byte code loop keeps IP/SP in locals that the compiler may assign to any register,
+	// so instead it saves them down as each instruction is dispatched, and they are already correct
+	UNREFERENCED_PARAMETER(info);
+#else
 	BYTE* ip = reinterpret_cast<BYTE*>(info->ContextRecord->Edi);
 	Oop byteCodes = m_registers.m_pMethod->m_byteCodes;
 	BYTE* pBytes = ObjectMemory::ByteAddressOfObjectContents(byteCodes);
@@ -442,6 +527,7 @@ void Interpreter::saveContextAfterFault(LPEXCEPTION_POINTERS info)
 		if (sp < reinterpret_cast<Oop*>(reinterpret_cast<BYTE*>(pBase) + cbCurrent))
 			m_registers.m_stackPointer = sp;
 	}
+#endif
 }
 
 #pragma code_seg(INTERPMISC_SEG)
@@ -0,0 +1,238 @@
+/* lz4.c -- compact LZ4 block format codec for Dolphin image files
+ * See lz4.h for a description.
+ */
+
+#include <string.h>
+#include "lz4.h"
+
+typedef unsigned char	BYTE;
+typedef unsigned short	U16;
+typedef unsigned int	U32;
+
+#define MINMATCH		4
+#define LASTLITERALS	5		/* The last 5 bytes of a block are always literals */
+#define MFLIMIT			12		/* and the last match must start at least 12 bytes before the end */
+#define MAXDISTANCE		65535
+#define HASHLOG			12
+#define SKIPSTRENGTH	6		/* Step further on after repeated failed matches */
+#define ML_MASK			15
+#define RUN_MASK		15
+
+static U32 read32(const BYTE* p)
+{
+	U32 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static U32 hashSequence(U32 sequence)
+{
+	return (sequence * 2654435761U) >> (32 - HASHLOG);
+}
+
+/* Write the variable length extension of a literal or match length */
+static BYTE* writeLength(BYTE* op, unsigned len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (BYTE)len;
+	return op;
+}
+
+int LZ4_compressBound(int isize)
+{
+	return LZ4_COMPRESSBOUND(isize);
+}
+
+int LZ4_compress_default(const char* source, char* dest, int srcSize, int dstCapacity)
+{
+	U32 table[1 << HASHLOG];
+	const BYTE* const src = (const BYTE*)source;
+	const BYTE* ip = src;
+	const BYTE* anchor = src;
+	const BYTE* const iend = src + srcSize;
+	const BYTE* const mflimit = iend - MFLIMIT;
+	const BYTE* const matchlimit = iend - LASTLITERALS;
+	BYTE* op = (BYTE*)dest;
+	BYTE* const oend = op + dstCapacity;
+	unsigned litLen;
+
+	if (srcSize < 0 || srcSize > LZ4_MAX_INPUT_SIZE)
+		return 0;
+
+	memset(table, 0, sizeof(table));
+
+	if (srcSize >= MFLIMIT + 1)
+	{
+		unsigned searchCount = 1 << SKIPSTRENGTH;
+		ip++;
+		while (ip < mflimit)
+		{
+			const U32 sequence = read32(ip);
+			const U32 h = hashSequence(sequence);
+			const BYTE* ref = src + table[h];
+			table[h] = (U32)(ip - src);
+
+			if (ref >= ip || ip - ref > MAXDISTANCE || read32(ref) != sequence)
+			{
+				ip += searchCount++ >> SKIPSTRENGTH;
+				continue;
+			}
+			searchCount = 1 << SKIPSTRENGTH;
+
+			/* Extend the match backwards over any pending literals, then forwards */
+			while (ip > anchor && ref > src && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+			{
+				const BYTE* mp = ip + MINMATCH;
+				const BYTE* rp = ref + MINMATCH;
+				unsigned matchLen;
+				BYTE* token;
+
+				while (mp < matchlimit && *mp == *rp)
+				{
+					mp++;
+					rp++;
+				}
+
+				litLen = (unsigned)(ip - anchor);
+				matchLen = (unsigned)(mp - ip) - MINMATCH;
+
+				/* token + literal length bytes + literals + offset + match length bytes */
+				if (op + 1 + litLen/255 + 1 + litLen + 2 + matchLen/255 + 1 > oend)
+					return 0;
+
+				token = op++;
+				if (litLen >= RUN_MASK)
+				{
+					*token = RUN_MASK << 4;
+					op = writeLength(op, litLen - RUN_MASK);
+				}
+				else
+					*token = (BYTE)(litLen << 4);
+				memcpy(op, anchor, litLen);
+				op += litLen;
+
+				*op++ = (BYTE)(ip - ref);
+				*op++ = (BYTE)((ip - ref) >> 8);
+
+				if (matchLen >= ML_MASK)
+				{
+					*token |= ML_MASK;
+					op = writeLength(op, matchLen - ML_MASK);
+				}
+				else
+					*token |= (BYTE)matchLen;
+
+				ip = anchor = mp;
+
+				/* Prime the table with the position just before the end of the match */
+				if (ip < mflimit)
+					table[hashSequence(read32(ip - 2))] = (U32)(ip - 2 - src);
+			}
+		}
+	}
+
+	/* Final sequence of literals only */
+	litLen = (unsigned)(iend - anchor);
+	if (op + 1 + litLen/255 + 1 + litLen > oend)
+		return 0;
+	if (litLen >= RUN_MASK)
+	{
+		*op++ = RUN_MASK << 4;
+		op = writeLength(op, litLen - RUN_MASK);
+	}
+	else
+		*op++ = (BYTE)(litLen << 4);
+	memcpy(op, anchor, litLen);
+	op += litLen;
+
+	return (int)(op - (BYTE*)dest);
+}
+
+int LZ4_decompress_safe(const char* source, char* dest, int compressedSize, int dstCapacity)
+{
+	const BYTE* ip = (const BYTE*)source;
+	const BYTE* const iend = ip + compressedSize;
+	BYTE* op = (BYTE*)dest;
+	BYTE* const oend = op + dstCapacity;
+
+	if (compressedSize <= 0 || dstCapacity < 0)
+		return -1;
+
+	for (;;)
+	{
+		const unsigned token = *ip++;
+		unsigned length = token >> 4;
+		unsigned offset;
+		const BYTE* match;
+
+		if (length == RUN_MASK)
+		{
+			unsigned s;
+			do
+			{
+				if (ip >= iend)
+					return -1;
+				s = *ip++;
+				length += s;
+			}
+			while (s == 255);
+		}
+
+		if (length > (unsigned)(iend - ip) || length > (unsigned)(oend - op))
+			return -1;
+		memcpy(op, ip, length);
+		op += length;
+		ip += length;
+
+		/* The last sequence has no match part */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (unsigned)(op - (BYTE*)dest))
+			return -1;
+
+		length = token & ML_MASK;
+		if (length == ML_MASK)
+		{
+			unsigned s;
+			do
+			{
+				if (ip >= iend)
+					return -1;
+				s = *ip++;
+				length += s;
+			}
+			while (s == 255);
+		}
+		length += MINMATCH;
+
+		if (length > (unsigned)(oend - op))
+			return -1;
+		match = op - offset;
+		if (offset >= length)
+		{
+			memcpy(op, match, length);
+			op += length;
+		}
+		else
+		{
+			/* Overlapping copy, e.g. a run */
+			while (length--)
+				*op++ = *match++;
+		}
+
+		if (ip >= iend)
+			return -1;
+	}
+
+	return (int)(op - (BYTE*)dest);
+}
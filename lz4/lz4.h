@@ -0,0 +1,41 @@
+/* lz4.h -- compact LZ4 block format codec for Dolphin image files
+ *
+ * This is a small, self-contained implementation of the LZ4 block format
+ * (as produced by LZ4_compress_default and consumed by LZ4_decompress_safe
+ * in the reference library). It is not the reference library itself: there
+ * is no frame format, dictionary or streaming support, and the compressor
+ * is a simple single-probe greedy matcher. Blocks it writes can be read by
+ * any conforming LZ4 block decoder, and vice versa.
+ *
+ * Both functions are reentrant and allocate no memory, so may be called
+ * concurrently from any number of threads.
+ */
+
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LZ4_MAX_INPUT_SIZE	0x7E000000
+
+/* Maximum size of the compressed form of isize bytes of input */
+#define LZ4_COMPRESSBOUND(isize)	((unsigned)(isize) > (unsigned)LZ4_MAX_INPUT_SIZE ? 0 : (isize) + ((isize)/255) + 16)
+
+int LZ4_compressBound(int isize);
+
+/* Compress srcSize bytes from src into dst, which has room for dstCapacity bytes.
+ * Answers the number of bytes written, or 0 if dst is too small. */
+int LZ4_compress_default(const char* src, char* dst, int srcSize, int dstCapacity);
+
+/* Decompress compressedSize bytes from src into dst, which has room for dstCapacity
+ * bytes. Answers the number of bytes decompressed, or a negative value if the input
+ * is malformed. Never reads or writes outside the buffers. */
+int LZ4_decompress_safe(const char* src, char* dst, int compressedSize, int dstCapacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
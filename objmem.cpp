@@ -120,7 +120,9 @@ void __fastcall ObjectMemory::oneWayBecome(OTE* ote1, OTE* ote2)
 	// that are in the stack but are otherwise unreferenced)
 	ote1->m_flags.m_count = 1;
 	ote1->countDown();
-	Interpreter::flushAtCaches();
+	// Only the entries for the two objects can be affected, as no object bodies are moved
+	Interpreter::purgeObjectFromAtCaches(ote1);
+	Interpreter::purgeObjectFromAtCaches(ote2);
 
 	CHECKREFERENCES
 }
@@ -713,6 +715,18 @@ void ObjectMemory::Terminate()
 //	_crtheap = 0;
 	
 
+#ifdef DELTAIMAGES
+	delete[] m_pDeltaDigests;
+	m_pDeltaDigests = NULL;
+	m_nDeltaDigests = 0;
+#endif
+
+#ifdef LAZYLOADING
+	TerminateLazyLoad();
+#endif
+
+	TerminateBorrowedViews();
+
 	if (m_pOT)
 	{
 		// Delete the OT itself
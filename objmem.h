@@ -29,6 +29,16 @@ typedef TOTE<Array> ArrayOTE;
 	#define MEMSTATS
 #endif
 
+// Incremental (delta) images are not supported by To Go VMs (which cannot save) or the boot VM
+#if !defined(TO_GO) && !defined(_AFX)
+	#define DELTAIMAGES
+#endif
+
+// Demand loading of cold objects from the image file is not supported by the boot VM
+#if !defined(_AFX)
+	#define LAZYLOADING
+#endif
+
 // We don't want inline expansion of recursive functions thankyou
 //#pragma inline_depth(32)
 //#pragma inline_recursion(off)
@@ -58,6 +68,7 @@ struct ImageStamp
 };
 
 class ibinstream;
+class imbinstream;
 class obinstream;
 
 #define pointerFromIndex(index)	(m_pOT+int(index))
@@ -120,6 +131,7 @@ public:
 	enum { MaxPools = (PoolObjectSizeLimit-MinObjectSize)/PoolGranularity + 1 };
 
 	static VirtualOTE* __fastcall newVirtualObject(BehaviorOTE* classPointer, MWORD initialSize, MWORD maxSize);
+	static BytesOTE* __fastcall newBorrowedView(BehaviorOTE* classPointer, void* pBytes, MWORD byteSize, OTE* oteOwner);
 	static PointersOTE* __fastcall newPointerObject(BehaviorOTE* classPointer);
 	static PointersOTE* __fastcall newPointerObject(BehaviorOTE* classPointer, MWORD instanceSize);
 	static PointersOTE* __fastcall newUninitializedPointerObject(BehaviorOTE* classPointer, MWORD instanceSize);
@@ -215,6 +227,8 @@ public:
 
 	static void markObject(OTE* ote);
 	static void MarkObjectsAccessibleFromRoot(OTE* ote);
+	static void MarkBorrowedViews();
+	static void CompactBorrowedViews();
 
 	static void finalize(OTE* ote);
 
@@ -224,6 +238,7 @@ public:
 	// Recalc and consistency check
 	static void checkReferences();
 	static void addRefsFrom(OTE* ote);
+	static void addBorrowedViewRefs();
 	static void checkPools();
 	static void checkStackRefs();
 #endif
@@ -233,8 +248,11 @@ public:
 	static void CheckPoint();
 #endif
 
-	static int __stdcall SaveImageFile(const char* fileName, bool bBackup, int nCompressionLevel);
+	static int __stdcall SaveImageFile(const char* fileName, bool bBackup, int nCompressionLevel, bool bDelta=false);
 	static HRESULT __stdcall LoadImage(const char* szImageName, LPVOID imageData, UINT imageSize, bool bIsDevSys);
+#ifdef DELTAIMAGES
+	static HRESULT __stdcall FoldImageChain(const char* szImageName, const char* szOutputName);
+#endif
 
 	static void InitializeImageStamp(void);
 	static WORD __stdcall todayAsDATEWORD();
@@ -448,6 +466,11 @@ private:
 
 	static void releasePointer(OTE* ote);
 
+	// Borrowed views over external memory, see BorrowedView.cpp
+	static bool __fastcall isBorrowedView(const OTE* ote);
+	static void __fastcall releaseBorrowedView(OTE* ote);
+	static void TerminateBorrowedViews();
+
 	// Garbage collection/Ref count checking
 	static void reclaimInaccessibleObjects(DWORD flags);
 	static void markObjectsAccessibleFrom(OTE* ote);
@@ -481,7 +504,8 @@ private:
 	static bool __stdcall SavePointers(obinstream& imageFile, const ImageHeader*);
 	static bool __stdcall SaveObjectTable(obinstream& imageFile, const ImageHeader*);
 	static bool __stdcall SaveObjects(obinstream& imageFile, const ImageHeader*);
-	static bool __stdcall SaveImage(obinstream& imageFile, const ImageHeader*, int);
+	typedef unsigned __int64 DeltaDigest;		// See ObjectDigest
+	static bool __stdcall SaveImage(obinstream& imageFile, const ImageHeader*, int, DeltaDigest** ppDigests);
 
 	static void ShowExpiryDialog();
 
@@ -496,6 +520,44 @@ private:
 	static void __stdcall FixupObject(OTE* ote, MWORD* oldLocation, const ImageHeader*);
 	static void __stdcall PostLoadFix();
 
+#ifdef DELTAIMAGES
+	// Incremental (delta) images, see DeltaImage.cpp
+	enum { DeltaFreedDigest = 1 };
+	static DeltaDigest __fastcall ObjectDigest(const OTE* ote);
+	static bool IsTrackingDeltas() { return m_pDeltaDigests != NULL; }
+	static void __stdcall BeginDeltaBaseline(unsigned nTableSize);
+	static void __stdcall EndDeltaBaseline(const char* szImageName, const BYTE* pImageBytes, UINT imageSize);
+	static DeltaDigest* __stdcall NewDeltaDigests(unsigned nTableSize, DeltaImageHeader* pDeltaHeader);
+	static void __stdcall AcceptDeltaDigests(DeltaDigest* pDigests, unsigned nTableSize, const char* szImageName);
+	static bool __stdcall SaveDeltaObjects(obinstream& imageFile, const ImageHeader*, const DeltaDigest* pDigests);
+	static HRESULT __stdcall LoadDeltaImage(const char* szImageName, BYTE* pImageBytes, UINT imageSize);
+
+	static DeltaDigest*	m_pDeltaDigests;			// Digest of each object as last saved/loaded, 0 if absent
+	static unsigned	m_nDeltaDigests;				// Table size of the last saved/loaded image
+	static DWORD	m_dwDeltaBaseChecksum;			// Adler-32 of the last saved/loaded image file
+	static char		m_szDeltaBase[_MAX_PATH];		// Full path of the last saved/loaded image file
+#endif
+
+#ifdef LAZYLOADING
+	// Demand loading of cold objects, see LazyLoad.cpp
+	static void __stdcall PrepareLazyLoad(const char* szImageName, const BYTE* pImageBytes, UINT imageSize, const imbinstream& imageFile);
+	static bool __stdcall IsLazyCandidate(const OTE* ote, const ImageHeader*);
+	static void __stdcall BeginLazyLoad(const ImageHeader*);
+	static bool __stdcall LoadLazyObject(OTE* ote, ibinstream& imageFile, const ImageHeader*);
+	static void __stdcall EndLazyLoad();
+	static bool __stdcall ReleaseLazyImage(const char* szFileName);
+	static void __stdcall TerminateLazyLoad();
+
+public:
+	// Load demand loaded objects before their addresses are passed to external code
+	static void __stdcall MaterializeLazyReferences(const DWORD* pValues, const DWORD* pEnd);
+	static void __stdcall MaterializeLazyBytes(const void* pBytes, MWORD cb);
+
+	static unsigned	m_nLazyPagesUnloaded;			// Pages of demand loaded objects yet to be loaded
+
+private:
+#endif
+
 	// Error handling (neater with exceptions, but ...)
 
 	#ifdef _AFX
@@ -29,6 +29,8 @@ typedef WORD hash_t;						// Identity hash value, assigned on object creation
 struct OTEFlags
 {
 	// Object Creation
+	// N.B. HeapSpace is used for byte objects whose bodies are not allocated by the object memory, i.e. those demand
+	// loaded from the image file (see LazyLoad.cpp), and borrowed views over external memory (see BorrowedView.cpp)
 	enum Spaces { NormalSpace, VirtualSpace, BlockSpace, ContextSpace, DWORDSpace, HeapSpace, FloatSpace, PoolSpace, NumSpaces };
 
 	BYTE	m_free		: 1;			// Is the object in use?
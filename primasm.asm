@@ -246,6 +246,7 @@ extern ?primitiveSuspend@Interpreter@@CIHXZ	:near32
 extern ?primitiveTerminateProcess@Interpreter@@CIHXZ	:near32
 extern ?primitiveProcessPriority@Interpreter@@CIHXZ:near32
 extern ?primitiveNewVirtual@Interpreter@@CIHXZ:near32
+extern ?primitiveNewBorrowedView@Interpreter@@CIHXZ:near32
 PRIMSNAPSHOT EQU ?primitiveSnapshot@Interpreter@@CIHAAVCompiledMethod@@I@Z
 extern PRIMSNAPSHOT:near32
 extern ?primitiveReplaceBytes@Interpreter@@CIHXZ:near32
@@ -265,6 +266,18 @@ extern ?primitiveNextIndexOfFromTo@Interpreter@@CIHXZ:near32
 extern ?primitiveDeQBereavement@Interpreter@@CIHXZ:near32
 extern ?primitiveHookWindowCreate@Interpreter@@CIHXZ:near32
 extern ?primitiveSmallIntegerPrintString@Interpreter@@CIHXZ:near32
+extern ?primitiveMethodCacheStatistics@Interpreter@@CIHXZ:near32
+extern ?primitiveSampleMethods@Interpreter@@CIHXZ:near32
+extern ?primitiveMethodCounts@Interpreter@@CIHXZ:near32
+extern ?primitiveReplacePointers@Interpreter@@CIHXZ:near32
+PRIMFILL EQU ?primitiveFill@Interpreter@@CIHAAVCompiledMethod@@I@Z
+extern PRIMFILL:near32
+PRIMSIGNALAFTER EQU ?primitiveSignalAfter@Interpreter@@CIHAAVCompiledMethod@@I@Z
+extern PRIMSIGNALAFTER:near32
+extern ?primitiveCancelTimer@Interpreter@@CIHXZ:near32
+PRIMASYNCIOSUBMIT EQU ?primitiveAsyncIoSubmit@Interpreter@@CIHAAVCompiledMethod@@I@Z
+extern PRIMASYNCIOSUBMIT:near32
+extern ?primitiveAsyncIoRequest@Interpreter@@CIHXZ:near32
 
 PRIMMAKEPOINT EQU ?primitiveMakePoint@Interpreter@@CIHAAVCompiledMethod@@I@Z
 extern PRIMMAKEPOINT:near32
@@ -328,6 +341,8 @@ QUEUEINTERRUPT EQU ?queueInterrupt@Interpreter@@SGXPAV?$TOTE@VProcess@@@@II@Z
 extern QUEUEINTERRUPT:near32
 ONEWAYBECOME EQU ?oneWayBecome@ObjectMemory@@SIXPAV?$TOTE@X@@0@Z
 extern ONEWAYBECOME:near32
+ISBORROWEDVIEW EQU ?isBorrowedView@ObjectMemory@@CI_NPBV?$TOTE@X@@@Z
+extern ISBORROWEDVIEW:near32
 SHALLOWCOPY EQU ?shallowCopy@ObjectMemory@@SIPAV?$TOTE@X@@PAV2@@Z
 extern SHALLOWCOPY:near32
 
@@ -559,17 +574,17 @@ DWORD		primitiveIndirectDWORDAt					; case 184  Will be primitiveIndirectUIntPtr
 DWORD		primitiveIndirectDWORDAtPut					; case 185  Will be primitiveIndirectUIntPtrAtPut
 DWORD		primitiveIndirectSDWORDAt					; case 186  Will be primitiveIndirectIntPtrAt
 DWORD		primitiveIndirectSDWORDAtPut				; case 187  Will be primitiveIndirectIntPtrAtPut
-DWORD		unusedPrimitive								; case 188
-DWORD		unusedPrimitive								; case 189
-DWORD		unusedPrimitive								; case 190
-DWORD		unusedPrimitive								; case 191
-DWORD		unusedPrimitive								; case 192
+DWORD		primitiveMethodCacheStatistics				; case 188
+DWORD		primitiveSampleMethods						; case 189
+DWORD		primitiveMethodCounts						; case 190
+DWORD		primitiveReplacePointers					; case 191
+DWORD		primitiveFill								; case 192
+DWORD		primitiveSignalAfter						; case 193
+DWORD		primitiveCancelTimer						; case 194
+DWORD		primitiveAsyncIoSubmit						; case 195
+DWORD		primitiveAsyncIoRequest						; case 196
+DWORD		primitiveNewBorrowedView					; case 197
 IFDEF _AFX
-DWORD		unusedPrimitive								; case 193
-DWORD		unusedPrimitive								; case 194
-DWORD		unusedPrimitive								; case 195
-DWORD		unusedPrimitive								; case 196
-DWORD		unusedPrimitive								; case 197
 DWORD		unusedPrimitive								; case 198
 DWORD		unusedPrimitive								; case 199
 DWORD		unusedPrimitive								; case 200
@@ -2703,6 +2718,20 @@ BEGINPRIMITIVE primitiveBecome
 	cmp		edx, eax
 	jl		localPrimitiveFailure0
 
+	; The owner of a borrowed view is found through the view's OTE (see BorrowedView.cpp), so a view
+	; cannot exchange bodies with another object
+	push	edx
+	push	ecx
+	call	ISBORROWEDVIEW						; Argument in ECX
+	test	al, al
+	jnz		borrowedView
+	mov		ecx, [esp+4]						; Receiver
+	call	ISBORROWEDVIEW
+	test	al, al
+	jnz		borrowedView
+	pop		ecx
+	pop		edx
+
 	; THIS MUST BE CHANGED IF OTE LAYOUT CHANGED.
 	; Note that we swap the location pointer (obviously), the class pointer (as we
 	; aren't swapping the class), and flags. All belong with the object.
@@ -2750,6 +2779,10 @@ BEGINPRIMITIVE primitiveBecome
 	sub		_SP, OOPSIZE					; POPARG
 	ret
 
+borrowedView:
+	add		esp, 8
+	jmp primitiveFailure1
+
 localPrimitiveFailure0:
 	jmp primitiveFailure0
 
@@ -3507,4 +3540,44 @@ BEGINPRIMITIVE primitiveSmallIntegerPrintString
 	CallSimplePrim <?primitiveSmallIntegerPrintString@Interpreter@@CIHXZ>
 ENDPRIMITIVE primitiveSmallIntegerPrintString
 
+BEGINPRIMITIVE primitiveMethodCacheStatistics
+	CallSimplePrim <?primitiveMethodCacheStatistics@Interpreter@@CIHXZ>
+ENDPRIMITIVE primitiveMethodCacheStatistics
+
+BEGINPRIMITIVE primitiveSampleMethods
+	CallSimplePrim <?primitiveSampleMethods@Interpreter@@CIHXZ>
+ENDPRIMITIVE primitiveSampleMethods
+
+BEGINPRIMITIVE primitiveMethodCounts
+	CallSimplePrim <?primitiveMethodCounts@Interpreter@@CIHXZ>
+ENDPRIMITIVE primitiveMethodCounts
+
+BEGINPRIMITIVE primitiveReplacePointers
+	CallSimplePrim <?primitiveReplacePointers@Interpreter@@CIHXZ>
+ENDPRIMITIVE primitiveReplacePointers
+
+BEGINPRIMITIVE primitiveFill
+	CallSimplePrim <PRIMFILL>
+ENDPRIMITIVE primitiveFill
+
+BEGINPRIMITIVE primitiveSignalAfter
+	CallSimplePrim <PRIMSIGNALAFTER>
+ENDPRIMITIVE primitiveSignalAfter
+
+BEGINPRIMITIVE primitiveCancelTimer
+	CallSimplePrim <?primitiveCancelTimer@Interpreter@@CIHXZ>
+ENDPRIMITIVE primitiveCancelTimer
+
+BEGINPRIMITIVE primitiveAsyncIoSubmit
+	CallSimplePrim <PRIMASYNCIOSUBMIT>
+ENDPRIMITIVE primitiveAsyncIoSubmit
+
+BEGINPRIMITIVE primitiveAsyncIoRequest
+	CallSimplePrim <?primitiveAsyncIoRequest@Interpreter@@CIHXZ>
+ENDPRIMITIVE primitiveAsyncIoRequest
+
+BEGINPRIMITIVE primitiveNewBorrowedView
+	CallSimplePrim <?primitiveNewBorrowedView@Interpreter@@CIHXZ>
+ENDPRIMITIVE primitiveNewBorrowedView
+
 END
@@ -147,15 +147,13 @@ BOOL __fastcall Interpreter::primitiveDeQBereavement()
 }
 
 ///////////////////////////////////
-// Clearing down the method cache is a very fast operation, so there is nothing
-// to be gained at the moment from doing it more selectively (except that 
-// method lookups must be recached, so every time a method is installed, the
-// system starts from scratch again).
-// A more selective approach would require clearing down all entries that match
-// a certain selector for a specified class and all its subclasses, because of the 
-// caching of inherited methods. Removing all entries for a specific method is
-// not sufficient since this would not cater for the addition of methods when
-// these override 
+// Clearing down the method cache is a very fast operation, but every method lookup
+// must then be recached, so installing a method in a running system causes a burst
+// of slow sends. When a method is installed, or a class changed, it is sufficient
+// to clear down all entries for that class and all its subclasses (because of the 
+// caching of inherited methods), or all entries for the selector. Removing all 
+// entries for a specific method is not sufficient since this would not cater for 
+// the addition of methods when these override inherited methods.
 #pragma code_seg(PRIM_SEG)
 
 void Interpreter::flushCaches()
@@ -164,8 +162,14 @@ void Interpreter::flushCaches()
 	DumpMethodCacheStats();
 #endif
 
-	ZeroMemory(methodCache, sizeof(methodCache));
+	ZeroMemory(methodCache, methodCacheSize*sizeof(MethodCacheEntry));
+	ZeroMemory(sendSiteCache, sizeof(sendSiteCache));
 
+#ifdef BASELINE_JIT
+	flushNativeCode();
+#endif
+
+	flushCallStubs();
 	flushAtCaches();
 }
 
@@ -178,15 +182,276 @@ void Interpreter::flushAtCaches()
 	ZeroMemory(AtPutCache, sizeof(AtPutCache));
 }
 
+// Remove any AtCache entries for the specified object, e.g. because its body has been moved or replaced
+void Interpreter::purgeObjectFromAtCaches(const OTE* ote)
+{
+	const unsigned atCacheOffset = Oop(ote) & AtCacheMask;
+	AtCacheEntry* caches[2] = { AtCache, AtPutCache };
+	for (unsigned c=0;c<2;c++)
+	{
+		AtCacheEntry* ace = ACEAt(caches[c], atCacheOffset);
+		if (ace->oteArray == ote)
+			ZeroMemory(ace, sizeof(AtCacheEntry));
+	}
+}
+
+// Remove all method cache and send site cache entries for the specified selector
+void Interpreter::purgeSelectorFromCaches(const SymbolOTE* selector)
+{
+	for (unsigned i=0;i<methodCacheSize;i+=MethodCacheWays)
+	{
+		MethodCacheEntry* set = &methodCache[i];
+		if (set[1].selector == selector)
+			ZeroMemory(&set[1], sizeof(MethodCacheEntry));
+		if (set[0].selector == selector)
+		{
+			// Keep the MRU entry first
+			set[0] = set[1];
+			ZeroMemory(&set[1], sizeof(MethodCacheEntry));
+		}
+	}
+
+	for (unsigned i=0;i<SendSiteCacheSize;i++)
+	{
+		if (sendSiteCache[i].selector == selector)
+			ZeroMemory(&sendSiteCache[i], sizeof(SendSiteCache));
+	}
+
+	// Native code and call stubs do not depend on the lookups, but the method may be being replaced
+#ifdef BASELINE_JIT
+	flushNativeCode();
+#endif
+	flushCallStubs();
+}
+
+// Answer whether a cache entry for the class, cachedClass, must be purged when classPointer changes.
+// The caches do not hold references, so the cached class may since have been freed, and its OTE
+// even reused for an object that is not a class, in which case it has no superclass chain to follow
+// and the entry is stale anyway.
+static inline bool mustPurgeClass(const BehaviorOTE* cachedClass, const BehaviorOTE* classPointer)
+{
+	return cachedClass->isFree() || !cachedClass->isBehavior() || ObjectMemory::inheritsFrom(cachedClass, classPointer);
+}
+
+// Remove all method cache and send site cache entries for the specified class, and its subclasses
+void Interpreter::purgeClassFromCaches(const BehaviorOTE* classPointer)
+{
+	for (unsigned i=0;i<methodCacheSize;i+=MethodCacheWays)
+	{
+		MethodCacheEntry* set = &methodCache[i];
+		if (set[1].classPointer != NULL && mustPurgeClass(set[1].classPointer, classPointer))
+			ZeroMemory(&set[1], sizeof(MethodCacheEntry));
+		if (set[0].classPointer != NULL && mustPurgeClass(set[0].classPointer, classPointer))
+		{
+			set[0] = set[1];
+			ZeroMemory(&set[1], sizeof(MethodCacheEntry));
+		}
+	}
+
+	for (unsigned i=0;i<SendSiteCacheSize;i++)
+	{
+		SendSiteCache& site = sendSiteCache[i];
+		const unsigned nEntries = min(site.nClasses, unsigned(SendSiteClasses));
+		for (unsigned j=0;j<nEntries;j++)
+		{
+			if (mustPurgeClass(site.entries[j].classPointer, classPointer))
+			{
+				// Start the site again, but keep its statistics
+				site.nClasses = 0;
+				ZeroMemory(site.entries, sizeof(site.entries));
+				break;
+			}
+		}
+	}
+
+	// The shape of the class may have changed, and with it the inst var offsets in native code
+#ifdef BASELINE_JIT
+	flushNativeCode();
+#endif
+	flushCallStubs();
+}
+
+// If the receiver is a class, then only the cached lookups for that class and its subclasses
+// are flushed, and if a Symbol then only those for that selector. Otherwise all the caches are
+// flushed.
 BOOL __fastcall Interpreter::primitiveFlushCache()
 {
 #ifdef _DEBUG
 	DumpCacheStats();
 #endif
+	Oop receiver = stackTop();
+	if (!ObjectMemoryIsIntegerObject(receiver))
+	{
+		const OTE* oteReceiver = reinterpret_cast<const OTE*>(receiver);
+		if (oteReceiver->isBehavior())
+		{
+			purgeClassFromCaches(reinterpret_cast<const BehaviorOTE*>(oteReceiver));
+			return TRUE;
+		}
+		if (oteReceiver->m_oteClass == Pointers.ClassSymbol)
+		{
+			purgeSelectorFromCaches(reinterpret_cast<const SymbolOTE*>(oteReceiver));
+			return TRUE;
+		}
+	}
+
 	flushCaches();
 	return TRUE;	// return success value so can be used directly as primitive
 }
 
+#pragma code_seg(GC_SEG)
+
+// Answer the new location of an OTE that may have been moved by a compacting GC (see 
+// ObjectMemory::compactOop), or NULL if it does not refer to a live object.
+template <class T> static const TOTE<T>* forwardCachedOop(const TOTE<T>* ote)
+{
+	if (ote->isFree())
+		ote = reinterpret_cast<const TOTE<T>*>(ote->m_location);
+	return ote->getIndex() < ObjectMemory::GetOTSize() && !ote->isFree() ? ote : NULL;
+}
+
+// Answer whether the method is a CompiledMethod for the selector, i.e. plausibly the method cached for it
+static bool IsCachedMethodFor(const MethodOTE* oteMethod, const SymbolOTE* selector)
+{
+	return ObjectMemory::isKindOf(Oop(oteMethod), Pointers.ClassCompiledMethod)
+			&& oteMethod->m_location->m_selector == selector;
+}
+
+// A compaction is about to start. The caches hold no references, so may have entries for objects freed
+// since they were cached, whose OTEs the compaction can then fill with unrelated objects moved down
+// from the top of the OT, or whose free list links would be followed as if forwarding pointers. Such
+// entries must be dropped while they can still be recognised.
+void Interpreter::purgeFreeFromCaches()
+{
+	for (unsigned i=0;i<methodCacheSize;i++)
+	{
+		MethodCacheEntry& entry = methodCache[i];
+		if (entry.method != NULL && (entry.classPointer->isFree() || entry.selector->isFree() || entry.method->isFree()))
+			ZeroMemory(&entry, sizeof(entry));
+	}
+
+	for (unsigned i=0;i<SendSiteCacheSize;i++)
+	{
+		SendSiteCache& site = sendSiteCache[i];
+		if (site.ip == NULL)
+			continue;
+		bool bValid = !site.oteMethod->isFree() && !site.selector->isFree();
+		const unsigned nEntries = min(site.nClasses, unsigned(SendSiteClasses));
+		for (unsigned j=0;bValid && j<nEntries;j++)
+			bValid = !site.entries[j].classPointer->isFree() && !site.entries[j].method->isFree();
+		if (!bValid)
+			ZeroMemory(&site, sizeof(site));
+	}
+
+	AtCacheEntry* caches[2] = { AtCache, AtPutCache };
+	for (unsigned c=0;c<2;c++)
+	{
+		for (unsigned i=0;i<AtCacheEntries;i++)
+		{
+			if (caches[c][i].oteArray != NULL && caches[c][i].oteArray->isFree())
+				caches[c][i].oteArray = NULL;
+		}
+	}
+}
+
+// A compacting GC has occurred. The caches are keyed by the addresses of the OTEs, which may
+// have been moved, so rather than flushing the caches the entries are updated through the 
+// forwarding pointers in the old OTEs and rehashed. This must be done before the free list is
+// rebuilt, as that overwrites the forwarding pointers. Entries for objects that were already free
+// were dropped by purgeFreeFromCaches(), and the survivors are checked again before reinsertion.
+void Interpreter::compactCaches()
+{
+	// Native code is found by the method's OTE, and is cheap enough to regenerate, as are the links to call stubs
+#ifdef BASELINE_JIT
+	flushNativeCode();
+#endif
+	flushCallStubs();
+
+	compactMethodCounters();
+
+	// Rehash the method cache. The least recently used way of each set is reinserted first so 
+	// that, where sets collide, the most recently used entries survive.
+	MethodCacheEntry* oldCache = new MethodCacheEntry[methodCacheSize];
+	memcpy(oldCache, methodCache, methodCacheSize*sizeof(MethodCacheEntry));
+	ZeroMemory(methodCache, methodCacheSize*sizeof(MethodCacheEntry));
+	for (unsigned i=methodCacheSize;i>0;i--)
+	{
+		const MethodCacheEntry& entry = oldCache[i-1];
+		if (entry.method == NULL)
+			continue;
+		const BehaviorOTE* classPointer = forwardCachedOop(entry.classPointer);
+		const SymbolOTE* selector = forwardCachedOop(entry.selector);
+		MethodOTE* oteMethod = const_cast<MethodOTE*>(forwardCachedOop(entry.method));
+		if (classPointer != NULL && selector != NULL && oteMethod != NULL && classPointer->isBehavior()
+				&& IsCachedMethodFor(oteMethod, selector))
+			cacheMethod(classPointer, selector, oteMethod);
+	}
+	delete[] oldCache;
+
+	// Send sites are keyed by the IP, and the method bodies are not moved, so only the Oops need updating
+	for (unsigned i=0;i<SendSiteCacheSize;i++)
+	{
+		SendSiteCache& site = sendSiteCache[i];
+		if (site.ip == NULL)
+			continue;
+		bool bValid = (site.oteMethod = forwardCachedOop(site.oteMethod)) != NULL
+						&& (site.selector = forwardCachedOop(site.selector)) != NULL;
+		const unsigned nEntries = min(site.nClasses, unsigned(SendSiteClasses));
+		for (unsigned j=0;bValid && j<nEntries;j++)
+		{
+			bValid = (site.entries[j].classPointer = forwardCachedOop(site.entries[j].classPointer)) != NULL
+						&& site.entries[j].classPointer->isBehavior()
+						&& (site.entries[j].method = const_cast<MethodOTE*>(forwardCachedOop(site.entries[j].method))) != NULL
+						&& IsCachedMethodFor(site.entries[j].method, site.selector);
+		}
+		if (!bValid)
+			ZeroMemory(&site, sizeof(site));
+	}
+
+	// The AtCaches are tiny, so there is no need to preserve entries displaced by rehashing
+	AtCacheEntry* caches[2] = { AtCache, AtPutCache };
+	for (unsigned c=0;c<2;c++)
+	{
+		AtCacheEntry oldAtCache[AtCacheEntries];
+		memcpy(oldAtCache, caches[c], sizeof(oldAtCache));
+		ZeroMemory(caches[c], sizeof(oldAtCache));
+		for (unsigned i=0;i<AtCacheEntries;i++)
+		{
+			if (oldAtCache[i].oteArray == NULL)
+				continue;
+			OTE* oteArray = const_cast<OTE*>(forwardCachedOop(oldAtCache[i].oteArray));
+			if (oteArray == NULL)
+				continue;
+			unsigned atCacheOffset = Oop(oteArray) & AtCacheMask;
+			AtCacheEntry* ace = ACEAt(caches[c], atCacheOffset);
+			*ace = oldAtCache[i];
+			ace->oteArray = oteArray;
+		}
+	}
+}
+
+// Answer an Array of the method cache size (in entries), and the number of hits, misses, and
+// evictions since startup (or since the cache was last resized). These are counted in all builds.
+BOOL __fastcall Interpreter::primitiveMethodCacheStatistics()
+{
+	Oop stats[4];
+	stats[0] = ObjectMemoryIntegerObjectOf(methodCacheSize);
+	stats[1] = Integer::NewUnsigned64(m_nMethodCacheHits);
+	stats[2] = Integer::NewUnsigned64(m_nMethodCacheMisses);
+	stats[3] = Integer::NewUnsigned64(m_nMethodCacheEvictions);
+
+	ArrayOTE* oteStats = Array::NewUninitialized(4);
+	Array* array = oteStats->m_location;
+	for (unsigned i=0;i<4;i++)
+	{
+		array->m_elements[i] = stats[i];
+		ObjectMemory::countUp(stats[i]);
+	}
+
+	replaceStackTopWithNew(oteStats);
+	return primitiveSuccess();
+}
+
 // Separate atPut primitive is needed to write to the stack because the active process
 // stack is not reference counted.
 BOOL __fastcall Interpreter::primitiveStackAtPut(CompiledMethod& , unsigned argCount)
@@ -153,6 +153,11 @@ bool __fastcall Interpreter::disableInterrupts(bool bDisable)
 			// We must clear the async. pending flag, but if currently set we save that
 			if (InterlockedExchange((LPLONG)&m_bAsyncPending, FALSE))
 				InterlockedExchange((LPLONG)&m_bAsyncPendingIOff, TRUE);
+
+			// A safepoint request sets the normal flag regardless, and must not be lost (see 
+			// parkAtSafepoint(), which clears it again when interrupts are disabled)
+			if (m_pIsolate->IsSafepointRequested())
+				InterlockedExchange((LPLONG)&m_bAsyncPending, TRUE);
 			
 			// At this point the buffer should have the same value as the async. pending flag
 			// (unless the latter was false, and some thread has notified of pending async
@@ -709,6 +714,11 @@ BOOL __fastcall Interpreter::FireAsyncEvents()
 	}
 
 	LONG bAsyncPending = ::InterlockedExchange(LPLONG(&m_bAsyncPending), FALSE);
+
+	// The requester of a safepoint sets the state before the flag, so if we have just cleared the
+	// flag for a request that has yet to be parked for, we see it here and set the flag again
+	if (m_pIsolate->IsSafepointRequested())
+		::InterlockedExchange(LPLONG(&m_bAsyncPending), TRUE);
 	
 	// Indicates interrupt was fired
 	BOOL bInterrupted = FALSE;
@@ -730,6 +740,8 @@ BOOL __fastcall Interpreter::FireAsyncEvents()
 				// Queue leaves ref. count raised so object does not go away
 				sem->countDown();
 			}
+			// Release the Semaphores of any timer wheel timers that have now been signalled
+			reapFiredTimers();
 		}
 
 		// Send the first interrupt (if any) to the destination process, which may not be the
@@ -1446,6 +1458,10 @@ BOOL __fastcall Interpreter::primitiveSingleStep(CompiledMethod&, unsigned argum
 	disableInterrupts(true);
 	m_bAsyncPending = true;
 	m_bStepping = true;
+#ifdef BASELINE_JIT
+	// The debugger is attaching, so fall back on the interpreter
+	flushNativeCode();
+#endif
 
 	return primitiveSuccess();
 }
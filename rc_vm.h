@@ -28,6 +28,8 @@
 #define IDP_PERMEXPIRED                 530
 #define IDP_WRONGMACHINE                531
 #define IDP_NEARLYEXPIRED               532
+#define IDP_DELTABASEMISSING            533
+#define IDP_DELTABASEMISMATCH           534
 #define IDS_INVALIDPROGID               768
 #define IDS_CANTCREATECONTROL           769
 #define IDS_CANTCREATEIE                770
@@ -90,6 +90,8 @@ inline MWORD ObjectMemory::sizeOfObjectFor(OTE* ote, MWORD pointersRequested)
 POBJECT ObjectMemory::basicResize(POTE ote, MWORD byteSize, int extra)
 {
 	ASSERT(!isIntegerObject(ote));
+	// The body may move, and the size will change
+	Interpreter::purgeObjectFromAtCaches(ote);
 	POBJECT pObject;
 
 /*	#ifdef _DEBUG
@@ -144,6 +146,33 @@ POBJECT ObjectMemory::basicResize(POTE ote, MWORD byteSize, int extra)
 			break;
 		}
 
+		case OTEFlags::HeapSpace:
+		{
+			// The memory of a borrowed view belongs to its owner
+			if (isBorrowedView(ote))
+				return NULL;
+#ifdef LAZYLOADING
+			// Demand loaded from the image, so move onto the heap (loading it if not already)
+			if ((byteSize+extra) > MaxSmallObjectSize)
+			{
+				pObject = allocChunk(byteSize+extra);
+				ote->m_flags.m_space = OTEFlags::NormalSpace;
+			}
+			else
+			{
+				pObject = allocSmallChunk(byteSize+extra);
+				ote->m_flags.m_space = OTEFlags::PoolSpace;
+			}
+
+			memcpy(pObject, ote->m_location, min(ote->getSize(), byteSize));
+			ote->m_location = pObject;
+			ote->setSize(byteSize);
+			break;
+#else
+			return NULL;
+#endif
+		}
+
 		default:
 			// Not resizeable
 			return NULL;
@@ -48,6 +48,8 @@ HRESULT Interpreter::InitializeSampler()
 #ifdef _DEBUG
 	dwTicksReset = 0;
 #endif
+	InitializeMethodSampler();
+	InitializeMethodCounters();
 	return S_OK;
 }
 
@@ -97,5 +99,7 @@ void Interpreter::CancelSampleTimer()
 
 void Interpreter::TerminateSampler()
 {
+	TerminateMethodSampler();
+	TerminateMethodCounters();
 	CancelSampleTimer();
 }
\ No newline at end of file
@@ -6,12 +6,22 @@
 
 	External threaded calls.
 
+	Overlapped calls are performed on a bounded pool of threads shared by all
+	Processes, rather than on a thread dedicated to each Process. A call is
+	queued when initiated, and bound to whichever pool thread takes it for the
+	duration of the call. Threads are started as needed up to the maximum
+	(registry value Overlapped\MaxThreads), and exit when they have been idle
+	for the idle timeout (Overlapped\IdleTimeout). Calls initiated while all
+	the threads are busy wait in the queue for one to become free.
+
 ******************************************************************************/
 #include "Ist.h"
 #pragma code_seg(FFI_SEG)
 
 #include <process.h>	// For CRT thread routines, such as _beginthreadex()
 #include <wtypes.h>
+#include <deque>
+#include <algorithm>
 #include "Interprt.h"
 #include "InterprtProc.inl"
 #include "STExternal.h"
@@ -43,6 +53,25 @@ OverlappedCallList OverlappedCall::s_activeList;
 static DWORD s_dwTerminateTimeout;
 static bool bIsNT;
 
+// The thread pool. The lock protects the queue and counts, and the binding of calls to threads.
+struct OverlappedCall::Worker
+{
+	HANDLE				m_hThread;
+	DWORD				m_dwThreadId;
+	bool				m_bTerminating;			// A call on this thread has been terminated
+	OverlappedCall*		m_pTerminatedCall;		// That call (with a reference)
+	OverlappedCall*		m_pCall;				// Call being performed, if any
+};
+
+static CRITICAL_SECTION s_csPool;
+static HANDLE s_hWorkAvailable;					// Semaphore released once for each queued call
+static std::deque<OverlappedCall*> s_callQueue;
+static unsigned s_nWorkers;
+static unsigned s_nIdleWorkers;
+static DWORD s_dwMaxWorkers;
+static DWORD s_dwIdleTimeout;
+static volatile bool s_bPoolShutdown;
+
 const DWORD SE_VMTERMINATETHREAD = MAKE_CUST_SCODE(SEVERITY_ERROR, FACILITY_NULL, 0x300);
 
 //bool inPrim = false;
@@ -68,11 +97,10 @@ void OverlappedCall::CallFinished()
 
 OverlappedCall* OverlappedCall::GetActiveProcessOverlappedCall()
 {
-	// We no longer have a pool (for simplicity), so just answer a new thread every time.
-	// The thread will be retained for use for all subseqeunt overlapped calls from the 
-	// associated process.
-	// The new OverlappedCall will have an initial reference of one from its
-	// own thread. At the moment we have no ref. count on it.
+	// The OverlappedCall will be retained for use for all subsequent overlapped calls from the 
+	// associated process, and each call is performed on a thread from the pool.
+	// The new OverlappedCall will have an initial reference of one from the process,
+	// released when the process' call is terminated.
 
 	Process* pActiveProcess = Interpreter::actualActiveProcess();
 	OverlappedCall* pOverlapped = pActiveProcess->GetOverlappedCall();
@@ -111,16 +139,24 @@ void OverlappedCall::Initialize()
 	extern bool isWindowsNT();
 	bIsNT = isWindowsNT();
 
+	s_dwMaxWorkers = 256;
+	s_dwIdleTimeout = 30000;
 	CRegKey rkOverlap;
 	if (OpenDolphinKey(rkOverlap, "Overlapped")==ERROR_SUCCESS)
 	{
 		rkOverlap.QueryDWORDValue("TerminateTimeout", s_dwTerminateTimeout);
 		s_dwTerminateTimeout = max(s_dwTerminateTimeout, 100);
+		rkOverlap.QueryDWORDValue("MaxThreads", s_dwMaxWorkers);
+		s_dwMaxWorkers = max(s_dwMaxWorkers, 1);
+		rkOverlap.QueryDWORDValue("IdleTimeout", s_dwIdleTimeout);
 	}
 	else
 	{
 		s_dwTerminateTimeout = 500;
 	}
+
+	::InitializeCriticalSection(&s_csPool);
+	s_hWorkAvailable = ::CreateSemaphore(NULL, 0, LONG_MAX, NULL);
 }
 
 // Note that this is only called on shutdown
@@ -128,8 +164,20 @@ void OverlappedCall::TerminateThread()
 {
 	HARDASSERT(::GetCurrentThreadId() == Interpreter::MainThreadId());
 
+	// The pool thread closes its handle as it exits, so wait on a duplicate
+	HANDLE hThread = NULL;
+	::EnterCriticalSection(&s_csPool);
+	if (m_hThread != NULL)
+		::DuplicateHandle(::GetCurrentProcess(), m_hThread, ::GetCurrentProcess(), &hThread, SYNCHRONIZE, FALSE, 0);
+	::LeaveCriticalSection(&s_csPool);
+
 	QueueTerminate();
-	DWORD dwWaitRet = ::WaitForSingleObject(m_hThread, s_dwTerminateTimeout); dwWaitRet;
+	DWORD dwWaitRet = WAIT_OBJECT_0;
+	if (hThread != NULL)
+	{
+		dwWaitRet = ::WaitForSingleObject(hThread, s_dwTerminateTimeout);
+		::CloseHandle(hThread);
+	}
 	
 	#if TRACING == 1
 	{
@@ -156,13 +204,21 @@ void OverlappedCall::Uninitialize()
 	// monitor, so we have to be careful to avoid a deadlock here by not
 	// holding that monitor while enumerating
 
-	// Terminate all overlapped call threads associated with processes
+	// Terminate all overlapped calls associated with processes
+	s_bPoolShutdown = true;
 	OverlappedCallPtr next = RemoveFirstFromList(s_activeList);
 	while (next)
 	{
 		next->TerminateThread();
 		next = RemoveFirstFromList(s_activeList);
 	}
+
+	// Wake the idle pool threads so that they exit
+	::EnterCriticalSection(&s_csPool);
+	const unsigned nWorkers = s_nWorkers;
+	::LeaveCriticalSection(&s_csPool);
+	if (nWorkers > 0)
+		::ReleaseSemaphore(s_hWorkAvailable, nWorkers, NULL);
 }
 
 
@@ -324,13 +380,13 @@ ostream& operator<<(ostream& stream, const OverlappedCall& oc)
 // Construction
 
 OverlappedCall::OverlappedCall(ProcessOTE* oteProcess) : 
-			// Initial ref of 1 for the associated thread, released by smart pointer in ThreadMain
+			// Initial ref of 1 for the associated process, released when the call is terminated
 			m_dwRefs(1),
-			m_hThread(0), m_dwThreadId(0),
+			m_pWorker(0), m_hThread(0), m_dwThreadId(0),
 			m_hEvtGo(0), m_hEvtCompleted(0),
 			m_oteProcess(oteProcess),
 			m_nSuspendCount(0), m_nCallDepth(0), 
-			m_state(OverlappedCall::Starting),
+			m_state(OverlappedCall::Running),
 			m_bCompletionRequestPending(false)
 {
 	HARDASSERT(::GetCurrentThreadId() == Interpreter::MainThreadId());
@@ -362,6 +418,8 @@ OverlappedCall::~OverlappedCall()
 	#endif
 
 	//HARDASSERT(m_oteProcess->isNil());
+	::CloseHandle(m_hEvtGo);
+	::CloseHandle(m_hEvtCompleted);
 }
 
 
@@ -369,56 +427,17 @@ OverlappedCall::~OverlappedCall()
 // Initialization helpers
 
 
-// Start off the thread, answering whether it worked or not
-bool OverlappedCall::BeginThread()
-{
-	HARDASSERT(::GetCurrentThreadId() == Interpreter::MainThreadId());
-
-	HARDASSERT(m_hThread == 0);
-	// N.B. Start it suspended
-	m_hThread = (HANDLE)_beginthreadex(
-							/*security=*/		NULL, 
-							/*stack_size=*/		0,
-							/*start_address*/	ThreadMain,
-							/*arglist=*/		this,
-							/*initflag=*/		0, //CREATE_SUSPENDED,
-							/*thrdaddr=*/		reinterpret_cast<UINT*>(&m_dwThreadId));
-	return m_hThread != 0;
-}
-
 void OverlappedCall::Init()
 {
 	HARDASSERT(::GetCurrentThreadId() == Interpreter::MainThreadId());
 
 	m_hEvtGo = NewAutoResetEvent();
 	m_hEvtCompleted = NewAutoResetEvent();
-	BeginThread();
-}
-
-void OverlappedCall::Term()
-{
-	HARDASSERT(::GetCurrentThreadId() == m_dwThreadId);
-
-	if (m_hThread)
-	{
-		::CloseHandle(m_hThread);
-		m_hThread = NULL;
-		::CloseHandle(m_hEvtGo);
-		m_hEvtGo = NULL;
-		::CloseHandle(m_hEvtCompleted);
-		m_hEvtCompleted = NULL;
-	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // States changes (answers if successful)
 
-bool OverlappedCall::beStarted()
-{
-	// Can only transition to Resting state on startup if not terminated in the meantime
-	return InterlockedCompareExchange((PVOID*)&m_state, PVOID(Running), PVOID(Starting)) == PVOID(Starting);
-}
-
 //bool OverlappedCall::beResting()
 //{
 //	// Only transition to Resting state if thread still active
@@ -436,58 +455,201 @@ OverlappedCall::States OverlappedCall::beTerminated()
 
 extern "C" BOOL __fastcall asyncDLL32Call(CompiledMethod* pMethod, unsigned argCount, OverlappedCall* pThis, InterpreterRegisters* pContext);
 
-DWORD OverlappedCall::WaitForRequest()
+///////////////////////////////////////////////////////////////////////////////
+// Thread pool
+
+// Save down contextual information for the call, which is about to be queued
+void OverlappedCall::SaveInterpreterContext()
 {
-	DWORD dwRet;
-	while ((dwRet = ::WaitForSingleObjectEx(m_hEvtGo, INFINITE, TRUE)) == WAIT_IO_COMPLETION)
+	ASSERT(m_oteProcess == Interpreter::actualActiveProcessPointer());
+	// Copy context from Interpreter
+	// ?? Not sure we'll need all this
+	m_interpContext = Interpreter::GetRegisters();
+
+	// As we are about to suspend the process, we must also store down the active frame into
+	// the suspended frame, and update the active frame with the current IP/SP.
+	m_interpContext.PrepareToSuspendProcess();
+}
+
+// Queue the call to be performed by a pool thread, starting a new thread if none is idle and the pool is not
+// at its maximum size. Answers false if there are no threads to perform the call, in which case the
+// interpreter context has not been saved. The context is saved inside the pool lock, so no thread can
+// start the call before it is complete.
+bool OverlappedCall::QueueForWorker()
+{
+	HARDASSERT(::GetCurrentThreadId() == Interpreter::MainThreadId());
+
+	::EnterCriticalSection(&s_csPool);
+	if (s_nIdleWorkers <= s_callQueue.size() && s_nWorkers < s_dwMaxWorkers)
+		StartWorker();
+	const bool bQueued = s_nWorkers > 0;
+	if (bQueued)
 	{
-		#if TRACING == 1
-		{
-			TRACELOCK();
-			TRACESTREAM << m_dwThreadId << ": " << *this << "::Run() processed APCs while waiting" << endl;
-		}
-		#endif
+		SaveInterpreterContext();
+		s_callQueue.push_back(this);
 	}
+	::LeaveCriticalSection(&s_csPool);
 
-	return dwRet;
+	if (bQueued)
+		::ReleaseSemaphore(s_hWorkAvailable, 1, NULL);
+	return bQueued;
 }
 
-int OverlappedCall::ProcessRequests()
+// Start a new pool thread. Must be called inside the pool lock.
+bool OverlappedCall::StartWorker()
 {
-	HARDASSERT(::GetCurrentThreadId() == m_dwThreadId);
+	Worker* pWorker = new Worker;
+	pWorker->m_bTerminating = false;
+	pWorker->m_pTerminatedCall = NULL;
+	pWorker->m_pCall = NULL;
+	pWorker->m_hThread = (HANDLE)_beginthreadex(
+							/*security=*/		NULL, 
+							/*stack_size=*/		0,
+							/*start_address*/	WorkerMain,
+							/*arglist=*/		pWorker,
+							/*initflag=*/		0,
+							/*thrdaddr=*/		reinterpret_cast<UINT*>(&pWorker->m_dwThreadId));
+	if (pWorker->m_hThread == 0)
+	{
+		delete pWorker;
+		return false;
+	}
+	s_nWorkers++;
+	return true;
+}
 
-	DWORD dwRet;
-	// Wait until either there is work to do - a terminate exception could be delivered in an APC, 
-	// so the wait is interruptable.
-	while ((dwRet = WaitForRequest()) == WAIT_OBJECT_0)
+// Remove an exiting pool thread from the pool
+void OverlappedCall::ExitWorker(Worker* pWorker)
+{
+	::EnterCriticalSection(&s_csPool);
+	s_nWorkers--;
+	::CloseHandle(pWorker->m_hThread);
+	delete pWorker;
+	::LeaveCriticalSection(&s_csPool);
+}
+
+// Bind the call to the pool thread that is about to perform it. Must be called inside the pool lock.
+void OverlappedCall::BindWorker(Worker* pWorker)
+{
+	m_pWorker = pWorker;
+	pWorker->m_pCall = this;
+	m_hThread = pWorker->m_hThread;
+	m_dwThreadId = pWorker->m_dwThreadId;
+}
+
+// Return the pool thread performing the call to the pool
+void OverlappedCall::ReleaseWorker()
+{
+	::EnterCriticalSection(&s_csPool);
+	if (m_pWorker != NULL)
+		m_pWorker->m_pCall = NULL;
+	m_pWorker = NULL;
+	m_hThread = NULL;
+	m_dwThreadId = 0;
+	::LeaveCriticalSection(&s_csPool);
+}
+
+// Answer the next call for the pool thread to perform, waiting until one is queued. 
+// Answers NULL if the thread should exit because it has been idle too long, or on shutdown.
+OverlappedCall* OverlappedCall::NextCall(Worker* pWorker)
+{
+	for (;;)
 	{
-		#if TRACING == 1
+		::EnterCriticalSection(&s_csPool);
+		if (pWorker->m_bTerminating)
 		{
-			TRACELOCK();
-			TRACESTREAM << m_dwThreadId << ": Calling " << *this << " to " << *m_pMethod << 
-				endl << "	for " << m_oteProcess << endl;
+			// A call this thread was performing has been terminated, and the terminate exception
+			// is on its way, so wait for it rather than accepting more work
+			::LeaveCriticalSection(&s_csPool);
+			::SleepEx(INFINITE, TRUE);
+			continue;
 		}
-		#endif
-
-		PerformCall();
+		if (!s_callQueue.empty())
+		{
+			OverlappedCall* pCall = s_callQueue.front();
+			s_callQueue.pop_front();
+			pCall->BindWorker(pWorker);
+			::LeaveCriticalSection(&s_csPool);
+			return pCall;
+		}
+		if (s_bPoolShutdown)
+		{
+			::LeaveCriticalSection(&s_csPool);
+			return NULL;
+		}
+		s_nIdleWorkers++;
+		::LeaveCriticalSection(&s_csPool);
+
+		// The wait is alertable, as a terminate exception for the last call could be delivered in an APC
+		DWORD dwRet = ::WaitForSingleObjectEx(s_hWorkAvailable, s_dwIdleTimeout, TRUE);
+
+		::EnterCriticalSection(&s_csPool);
+		s_nIdleWorkers--;
+		const bool bShrink = dwRet == WAIT_TIMEOUT && s_callQueue.empty();
+		::LeaveCriticalSection(&s_csPool);
+		if (bShrink)
+			return NULL;
+	}
+}
 
+void OverlappedCall::WorkerLoop(Worker* pWorker)
+{
+	OverlappedCall* pCall;
+	while ((pCall = NextCall(pWorker)) != NULL)
+	{
 		#if TRACING == 1
 		{
 			TRACELOCK();
-			TRACESTREAM << hex << m_dwThreadId << ": Resting..." << endl;
+			TRACESTREAM << pWorker->m_dwThreadId << ": Calling " << *pCall << " to " << *pCall->m_pMethod << 
+				endl << "	for " << pCall->m_oteProcess << endl;
 		}
 		#endif
+
+		// Returns the thread to the pool before letting the main thread continue
+		pCall->PerformCall();
 	}
+}
 
-	#if TRACING == 1
+// Static entry point of pool threads, required by _beginthreadex()
+unsigned __stdcall OverlappedCall::WorkerMain(void* pvWorker)
+{
+	HARDASSERT(::GetCurrentThreadId() != Interpreter::MainThreadId());
+
+	Worker* pWorker = static_cast<Worker*>(pvWorker);
+	__try
 	{
-		TRACELOCK();
-		TRACESTREAM << hex << *this << " exiting on " << dwRet << endl;
+		WorkerLoop(pWorker);
+	}
+	__except(GetExceptionCode() == SE_VMTERMINATETHREAD ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+	{
+		// A call on this thread was terminated. The call was abandoned at an unknown point, so the thread
+		// is not returned to the pool. The exception is either queued by QueueTerminate(), or raised by
+		// the call itself (e.g. from OnCallReturned()), in which case it is the call bound to the thread.
+		OverlappedCall* pCall = pWorker->m_pTerminatedCall;
+		const bool bQueued = pCall != NULL;
+		if (!bQueued)
+			pCall = pWorker->m_pCall;
+
+		if (pCall != NULL)
+		{
+			#if TRACING == 1
+			{
+				TRACELOCK();
+				TRACESTREAM << hex << GetCurrentThreadId() << ": " << *pCall << " received terminate exception" << endl;
+			}
+			#endif
+
+			if (pCall->m_pWorker == pWorker)
+				pCall->ReleaseWorker();
+			pCall->NotifyInterpreterOfTermination();
+			// Remove the reference taken by QueueTerminate()
+			if (bQueued)
+				pCall->Release();
+		}
 	}
-	#endif
 
-	// Allow it to terminate
-	return dwRet;
+	ExitWorker(pWorker);
+	return 0;
 }
 
 void OverlappedCall::PerformCall()
@@ -530,8 +692,9 @@ void OverlappedCall::PerformCall()
 
 	CallFinished();
 
-	// We don't use any of the old context after here, so even if this thread is immediately
-	// reused before it gets a chance to suspend itself, it wont matter
+	// We don't use any of the old context after here, so the thread can be returned to the pool
+	// before the main thread is released, as that may immediately initiate another call
+	ReleaseWorker();
 	VERIFY(::SetEvent(m_hEvtCompleted));
 }
 
@@ -553,19 +716,16 @@ bool OverlappedCall::Initiate(CompiledMethod* pMethod, unsigned argCount)
 		// Nested overlapped calls are not currently supported
 		return false;
 
-	m_nCallDepth++;
-
-	// Now save down contextual information
 	m_pMethod = pMethod;
 	m_nArgCount = argCount;
-	ASSERT(m_oteProcess == Interpreter::actualActiveProcessPointer());
-	// Copy context from Interpreter
-	// ?? Not sure we'll need all this
-	m_interpContext = Interpreter::GetRegisters();
 
-	// As we are about to suspend the process, we must also store down the active frame into
-	// the suspended frame, and update the active frame with the current IP/SP.
-	m_interpContext.PrepareToSuspendProcess();
+	// OK to start the async. operation now. It will be performed by the first free pool thread.
+	m_nCallDepth++;
+	if (!QueueForWorker())
+	{
+		m_nCallDepth--;
+		return false;
+	}
 
 	Process* proc = m_oteProcess->m_location;
 
@@ -577,12 +737,6 @@ bool OverlappedCall::Initiate(CompiledMethod* pMethod, unsigned argCount)
 	// the process is probably the only ref. to the Semaphore.
 	Interpreter::QueueProcessOn(m_oteProcess, reinterpret_cast<ProcessListOTE*>(proc->OverlapSemaphore()));
 
-	// OK to start the async. operation now
-	// We don't use Suspend/Resume because if thread is not suspended yet 
-	// (i.e. it hasn't reached its SuspendThread() call), then calling Resume() here
-	// will do nothing, and the thread will suspend itself for ever!
-	::SetEvent(m_hEvtGo);
-
 	TODO("Try a deliberate SwitchToThread here to see effect of call completing before we reschedule")
 
 	// Reschedule as we probably need another process to run
@@ -632,25 +786,23 @@ void OverlappedCall::OnActivateProcess()
 	}
 }
 
-// Fire off an exception from the main thread into the overlapped thread to cause it
-// to terminate the next time it enters an alertable wait state. This may not happen
-// immediately.
+// Fire off an exception from the main thread into the pool thread performing the call to cause 
+// it to terminate the next time it enters an alertable wait state. This may not happen
+// immediately. If no thread is performing the call, it is terminated immediately.
 bool OverlappedCall::QueueTerminate()
 {
 	HARDASSERT(::GetCurrentThreadId() == Interpreter::MainThreadId());
 	
-	// Although there is a race condition here, in that the thread may terminate after this
-	// test, we don't care because the thread handle will be nulled, and the operations against
-	// a NULL thread handle are benign.
+	::EnterCriticalSection(&s_csPool);
 	States previousState = beTerminated();
-	if (previousState == Terminated || m_hThread == NULL)
+	if (previousState == Terminated)
+	{
 		// Already terminated/terminating
+		::LeaveCriticalSection(&s_csPool);
 		return false;
+	}
 
-	// If the thread has entered its base try/catch block then we must use an exception
-	// to terminate it. If it hasn't then when it does it will not be able to transition to
-	// the running state, and will recognise that as a termination request and drop out.
-	if (previousState != Starting)
+	if (m_pWorker != NULL)
 	{
 		#if TRACING == 1
 		{
@@ -660,17 +812,30 @@ bool OverlappedCall::QueueTerminate()
 		#endif
 
 		// Terminate the thread by queueing an APC to it which will raise the terminate exception
-		// This will be trapped in the entry point routine, which is static and will not access
-		// any of the state herein
+		// This will be trapped in the pool thread's entry point routine, which notifies us when
+		// the call has terminated, and the thread then exits rather than returning to the pool.
+		m_pWorker->m_bTerminating = true;
+		m_pWorker->m_pTerminatedCall = this;
+		AddRef();
 		DWORD adwArgs[1];
 		adwArgs[0] = (DWORD)this;
 		RaiseThreadException(m_hThread, SE_VMTERMINATETHREAD, EXCEPTION_NONCONTINUABLE, 1, adwArgs);
-	}
 
-	// Ensure running and therefore able to receive termination request
-	InterlockedExchange(LPLONG(&m_nSuspendCount), 0);
-	while (long(::ResumeThread(m_hThread)) > 0)
-		continue;
+		// Ensure running and therefore able to receive termination request
+		InterlockedExchange(LPLONG(&m_nSuspendCount), 0);
+		while (long(::ResumeThread(m_hThread)) > 0)
+			continue;
+	}
+	else
+	{
+		// The call is not in progress, though it may be waiting for a pool thread, so just let the 
+		// interpreter know that it has terminated as the thread would
+		std::deque<OverlappedCall*>::iterator it = std::find(s_callQueue.begin(), s_callQueue.end(), this);
+		if (it != s_callQueue.end())
+			s_callQueue.erase(it);
+		QueueForInterpreter(TerminatedAPC);
+	}
+	::LeaveCriticalSection(&s_csPool);
 
 	return true;
 }
@@ -737,12 +902,10 @@ DWORD OverlappedCall::Resume()
 // Used by an overlapped thread to suspend itself
 void OverlappedCall::SuspendThread()
 {
-	// Should only be called from the overlapped call thread itself for safety
-	HARDASSERT(::GetCurrentThreadId() == m_dwThreadId);
-
 	// Only really suspend if there is at least one suspend still pending (an intervening
-	// resume may revoke the pending suspend)
-	if (m_nSuspendCount > 0)
+	// resume may revoke the pending suspend), and the call is still being performed on this 
+	// pool thread - if not the APC has arrived after the call completed
+	if (m_nSuspendCount > 0 && m_dwThreadId == ::GetCurrentThreadId())
 	{
 		DWORD dwRet = ::SuspendThread(GetCurrentThread());
 		dwRet;
@@ -763,73 +926,10 @@ DWORD OverlappedCall::ResumeThread()
 	return ::ResumeThread(m_hThread);
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Thread main function
-
-int OverlappedCall::TryMain()
-{
-	int ret;
-	__try
-	{
-		ret = Main();
-	}
-	__except(GetExceptionCode() == SE_VMTERMINATETHREAD ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
-	{
-		#if TRACING == 1
-		{
-			TRACELOCK();
-			TRACESTREAM << hex << GetCurrentThreadId() << ": " << *this << " received terminate exception" << endl;
-		}
-		#endif
-		
-		NotifyInterpreterOfTermination();
-		ret = 0;
-	}
-
-	Term();	// Thread is terminating, so don't want handles (also lets Complete() know we have terminated)
-
-	return ret;
-}
-
-// Static entry point required by _beginthreadex()
-unsigned __stdcall OverlappedCall::ThreadMain(void* pvClosure)
-{
-	HARDASSERT(::GetCurrentThreadId() != Interpreter::MainThreadId());
-
-	// Take over the initial reference (while thread is running, 
-	// this keeps a reference on the OverlappedCall object which will then
-	// be released when the smart pointer goes out of scope at the end of
-	// this function, at which point the call will normally be deleted,
-	// unless that is something else is holding a reference to it.)
-	OverlappedCallPtr pThis(static_cast<OverlappedCall*>(pvClosure), false);
-
-	// N.B. OC may not actually deleted as may still be ref'd from APC queue, etc
-	return pThis->TryMain();
-}
-
-int OverlappedCall::Main()
-{
-	int ret;
-
-	if (beStarted())
-		ret = ProcessRequests();
-	else
-	{
-		// Terminated even before the try block could be entered. This will happen if the beStarted() call
-		// found that the state had already transitioned away from the Starting state, probably to the
-		// Terminated state.
-		NotifyInterpreterOfTermination();
-		ret = -1;
-	}
-
-	return ret;
-}
-
 // Queue an APC to let the main thread know that the overlapped thread has terminated
 // this allows it to update its pending terminations list
 bool OverlappedCall::NotifyInterpreterOfTermination()
 {
-	HARDASSERT(::GetCurrentThreadId() == m_dwThreadId);
 	return QueueForInterpreter(TerminatedAPC);
 }
 
@@ -882,6 +982,9 @@ void OverlappedCall::RemoveFromPendingTerminations()
 		//CMonitorLock lock(s_listMonitor);
 		Unlink();
 	}
+
+	// Remove the process' reference (the APC still holds one)
+	Release();
 }
 
 // Let the interpreter know that this thread has completed the call, and is ready to finish
@@ -1030,7 +1133,7 @@ BOOL __fastcall Interpreter::primitiveAsyncDLL32Call(CompiledMethod& method, uns
 
 	OverlappedCall* pCall = OverlappedCall::Do(&method, argCount);
 	if (pCall == NULL)
-		// Nested overlapped calls are not supported
+		// Nested overlapped calls are not supported, or no pool thread could be started
 		return primitiveFailure(0);
 
 	HARDASSERT(newProcessWaiting());
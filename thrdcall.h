@@ -182,11 +182,13 @@ public:
 
 	enum States { Starting, Resting, Running, Terminated };
 
-	bool beStarted();
 	States beTerminated();
 	bool beResting();
 
 private:
+	// A thread of the pool on which overlapped calls are performed
+	struct Worker;
+
 	///////////////////////////////////////////////////////////////////////////
 	// Private member functions
 
@@ -195,22 +197,19 @@ private:
 
 	Process* GetProcess() { return m_oteProcess->m_location; }
 
-	// Start corresponding OS thread
-	bool BeginThread();
-
 	void Init();
-	void Term();
 
 	void TerminateThread();
 
 	bool Initiate(CompiledMethod* pMethod, unsigned nArgCount);
-	DWORD WaitForRequest();
-	int ProcessRequests();
 	void PerformCall();
 	void CallFinished();
 
-	int Main();
-	int TryMain();
+	// Pool management
+	void SaveInterpreterContext();
+	bool QueueForWorker();
+	void BindWorker(Worker* pWorker);
+	void ReleaseWorker();
 
 	// Called from assembler
 	void /*thiscall*/ OnCallReturned();
@@ -260,8 +259,12 @@ private:
 	static OverlappedCall* New(ProcessOTE*);
 	static OverlappedCallPtr RemoveFirstFromList(OverlappedCallList&);
 
-	// Thread entry point function
-	static unsigned __stdcall ThreadMain(void* pThis);
+	// Pool thread entry point function, and its helpers
+	static unsigned __stdcall WorkerMain(void* pWorker);
+	static void WorkerLoop(Worker* pWorker);
+	static OverlappedCall* NextCall(Worker* pWorker);
+	static bool StartWorker();
+	static void ExitWorker(Worker* pWorker);
 
 	// APC functions (APCs are used to queue messages between threads)
 	static void __stdcall SuspendAPC(DWORD dwParam);
@@ -296,8 +299,9 @@ private:
 	ProcessOTE*				m_oteProcess;
 	long					m_dwRefs;
 
-	HANDLE					m_hThread;		// thread handle (returned by _beginthread(ex))
-	DWORD					m_dwThreadId;	// thread's ID
+	Worker*					m_pWorker;		// Pool thread performing the call, if any
+	HANDLE					m_hThread;		// handle of that thread
+	DWORD					m_dwThreadId;	// and its ID
 	HANDLE					m_hEvtGo;		// Set when ready to initiate a call (auto-reset)
 	HANDLE					m_hEvtCompleted;// Set when call has completed (auto-reset)
 
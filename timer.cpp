@@ -38,6 +38,11 @@ static volatile UINT timerID;
 
 SemaphoreOTE* Interpreter::m_oteTimerSem;
 
+#ifdef _DEBUG
+	// Maximum time the timer thread will wait for the interpreter to park to check the Semaphore
+	static const DWORD TIMERSAFEPOINTTIMEOUT = 50;
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Smalltalk Alarm/Delay/Timers
 //
@@ -82,16 +87,17 @@ void CALLBACK Interpreter::TimeProc(UINT uID, UINT /*uMsg*/, DWORD /*dwUser*/, D
 		// circumstances where the timer is killed at the exact moment it is about to fire)
 		// then go ahead and signal the semaphore and the wakeup event
 
+		#ifdef _DEBUG
+			// Before taking the lock, as the interpreter may need it to reach a safepoint
+			checkTimerSemaphore();
+		#endif
+
 		// We mustn't access Pointers from an async thread when object memory is compacting
 		// as the Pointer will be wrong
 		GrabAsyncProtect();
 		SemaphoreOTE* timerSemaphore = m_oteTimerSem;
 		if (!timerSemaphore->isNil())
 		{
-			HARDASSERT(!ObjectMemoryIsIntegerObject(timerSemaphore));
-			HARDASSERT(!timerSemaphore->isFree());
-			HARDASSERT(timerSemaphore->m_oteClass == Pointers.ClassSemaphore);
-
 			// Asynchronously signal the required semaphore asynchronously, which will be detected
 			// in sync. with the dispatching of byte codes, and properly signalled
 			asynchronousSignalNoProtect(timerSemaphore);
@@ -105,6 +111,29 @@ void CALLBACK Interpreter::TimeProc(UINT uID, UINT /*uMsg*/, DWORD /*dwUser*/, D
 		trace("Old timer %d fired, current %d\n", uID, timerID);
 }
 
+#ifdef _DEBUG
+// Check that the timer Semaphore is valid. The object table and the Semaphore's header can only
+// be read on this thread while the interpreter is parked at a safepoint (see Isolate.h). The timer
+// callback must not block for long, so the check is skipped if the interpreter does not park
+// promptly, e.g. because it is in a long running external call.
+void Interpreter::checkTimerSemaphore()
+{
+	Isolate* pIsolate = m_pIsolate;
+	if (pIsolate == NULL || FAILED(pIsolate->RequestSafepoint(TIMERSAFEPOINTTIMEOUT)))
+		return;
+
+	SemaphoreOTE* timerSemaphore = m_oteTimerSem;
+	if (!timerSemaphore->isNil())
+	{
+		HARDASSERT(!ObjectMemoryIsIntegerObject(timerSemaphore));
+		HARDASSERT(!timerSemaphore->isFree());
+		HARDASSERT(timerSemaphore->m_oteClass == Pointers.ClassSemaphore);
+	}
+
+	pIsolate->ReleaseSafepoint();
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Timer/Idling Primitives
 
@@ -252,6 +281,8 @@ HRESULT Interpreter::initializeTimer()
 			return ReportError(IDP_BADTIMERRES, MAXTIMERRES);
 	} while (::timeBeginPeriod(wTimerRes) != TIMERR_NOERROR);
 
+	initializeTimerWheel();
+
 #ifdef _DEBUG
 	trace("Established timer resolution of %u mS\n", wTimerRes);
 #endif
@@ -264,6 +295,8 @@ void Interpreter::terminateTimer()
 {
 	static const char* szFmt = "Shutdown Error %u calling %s(%u)\n";
 	MMRESULT err;
+	terminateTimerWheel();
+
 	if (timerID != 0)
 	{
 		err = ::timeKillEvent(timerID);